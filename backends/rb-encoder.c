@@ -31,6 +31,7 @@
 #include "rb-encoder.h"
 #include "rb-encoder-gst.h"
 #include "rb-marshal.h"
+#include "rb-util.h"
 
 /**
  * SECTION:rb-encoder
@@ -258,6 +259,68 @@ rb_encoder_get_preferred_mimetype (RBEncoder *encoder,
 	return iface->get_preferred_mimetype (encoder, mime_types, mime, extension);
 }
 
+/**
+ * rb_encoder_get_media_type:
+ * @entry: the #RhythmDBEntry to examine
+ *
+ * Maps the media type stored for the entry to the MIME type used to
+ * decide whether it can be copied to a destination as is.  This deals
+ * with the differences between GStreamer media types and MIME types,
+ * such as ID3 tagged MP3 files.
+ *
+ * Return value: the MIME type of the entry
+ */
+const char *
+rb_encoder_get_media_type (RhythmDBEntry *entry)
+{
+	const char *entry_mime;
+
+	entry_mime = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_MIMETYPE);
+
+	/* hackish mapping of gstreamer media types to mime types; this
+	 * should be easier when we do proper (deep) typefinding.
+	 */
+	if (rb_safe_strcmp (entry_mime, "audio/x-wav") == 0) {
+		/* if it has a bitrate, assume it's mp3-in-wav */
+		if (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_BITRATE) != 0)
+			entry_mime = "audio/mpeg";
+	} else if (rb_safe_strcmp (entry_mime, "audio/x-m4a") == 0) {
+		entry_mime = "audio/aac";
+	} else if (rb_safe_strcmp (entry_mime, "application/x-id3") == 0) {
+		entry_mime = "audio/mpeg";
+	} else if (rb_safe_strcmp (entry_mime, "audio/x-flac") == 0) {
+		entry_mime = "audio/flac";
+	}
+
+	return entry_mime;
+}
+
+/**
+ * rb_encoder_needs_transcode:
+ * @entry: the #RhythmDBEntry to transfer
+ * @mime_types: a #GList of acceptable output MIME types, or NULL
+ *
+ * Determines whether transferring the entry to a destination accepting
+ * the given MIME types requires transcoding, or whether the file can
+ * simply be copied.
+ *
+ * Return value: TRUE if the entry will be transcoded
+ */
+gboolean
+rb_encoder_needs_transcode (RhythmDBEntry *entry, GList *mime_types)
+{
+	const char *entry_mime;
+
+	if (mime_types == NULL) {
+		/* don't copy raw audio */
+		entry_mime = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_MIMETYPE);
+		return g_str_has_prefix (entry_mime, "audio/x-raw");
+	}
+
+	entry_mime = rb_encoder_get_media_type (entry);
+	return (rb_string_list_contains (mime_types, entry_mime) == FALSE);
+}
+
 /**
  * rb_encoder_new:
  *
@@ -117,6 +117,10 @@ gboolean	rb_encoder_get_preferred_mimetype (RBEncoder *encoder,
 						   char **mime,
 						   char **extension);
 
+const char *	rb_encoder_get_media_type (RhythmDBEntry *entry);
+gboolean	rb_encoder_needs_transcode (RhythmDBEntry *entry,
+					    GList *mime_types);
+
 /* only to be used by subclasses */
 void	_rb_encoder_emit_progress (RBEncoder *encoder, double fraction);
 void	_rb_encoder_emit_completed (RBEncoder *encoder, guint64 dest_size);
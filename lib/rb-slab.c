@@ -0,0 +1,187 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/**
+ * SECTION:rb-slab
+ * @short_description: allocator for large numbers of same-sized objects
+ *
+ * Allocates objects of a single size from large blocks, so they're packed
+ * together in memory rather than scattered around the heap.  Released
+ * objects are kept on a free list and reused by later allocations.
+ * Blocks are only returned to the system when the slab is destroyed.
+ *
+ * All operations are thread-safe.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "rb-slab.h"
+
+#define SLAB_ALIGNMENT		(2 * sizeof (gsize))
+#define SLAB_ALIGN(size)	(((size) + (SLAB_ALIGNMENT - 1)) & ~(SLAB_ALIGNMENT - 1))
+
+struct _RBSlab
+{
+	GMutex *lock;
+	gsize object_size;
+	gsize block_size;
+
+	GSList *blocks;
+	char *next;		/* next unused object in the newest block */
+	char *block_end;
+	gpointer free_list;	/* released objects, linked through their first word */
+
+	guint n_objects;
+	guint n_free;
+};
+
+/**
+ * rb_slab_new:
+ * @object_size: size of the objects to allocate
+ * @objects_per_block: number of objects to allocate space for at a time
+ *
+ * Creates a new slab allocator.
+ *
+ * Return value: the new #RBSlab
+ */
+RBSlab *
+rb_slab_new (gsize object_size, guint objects_per_block)
+{
+	RBSlab *slab;
+
+	g_return_val_if_fail (object_size > 0, NULL);
+	g_return_val_if_fail (objects_per_block > 0, NULL);
+
+	slab = g_new0 (RBSlab, 1);
+	slab->lock = g_mutex_new ();
+	slab->object_size = SLAB_ALIGN (MAX (object_size, sizeof (gpointer)));
+	slab->block_size = slab->object_size * objects_per_block;
+	return slab;
+}
+
+/**
+ * rb_slab_destroy:
+ * @slab: a #RBSlab
+ *
+ * Frees the slab and all the memory allocated from it.
+ */
+void
+rb_slab_destroy (RBSlab *slab)
+{
+	g_slist_foreach (slab->blocks, (GFunc) g_free, NULL);
+	g_slist_free (slab->blocks);
+	g_mutex_free (slab->lock);
+	g_free (slab);
+}
+
+/**
+ * rb_slab_alloc0:
+ * @slab: a #RBSlab
+ *
+ * Allocates an object from the slab.  The object's memory is cleared.
+ *
+ * Return value: the new object
+ */
+gpointer
+rb_slab_alloc0 (RBSlab *slab)
+{
+	gpointer object;
+
+	g_mutex_lock (slab->lock);
+	if (slab->free_list != NULL) {
+		object = slab->free_list;
+		slab->free_list = *(gpointer *) object;
+		slab->n_free--;
+	} else {
+		if (slab->next == slab->block_end) {
+			slab->next = g_malloc (slab->block_size);
+			slab->block_end = slab->next + slab->block_size;
+			slab->blocks = g_slist_prepend (slab->blocks, slab->next);
+		}
+		object = slab->next;
+		slab->next += slab->object_size;
+	}
+	slab->n_objects++;
+	g_mutex_unlock (slab->lock);
+
+	memset (object, 0, slab->object_size);
+	return object;
+}
+
+/**
+ * rb_slab_release:
+ * @slab: a #RBSlab
+ * @object: an object allocated from @slab
+ *
+ * Returns an object to the slab, to be reused by later allocations.
+ */
+void
+rb_slab_release (RBSlab *slab, gpointer object)
+{
+	g_mutex_lock (slab->lock);
+	*(gpointer *) object = slab->free_list;
+	slab->free_list = object;
+	slab->n_free++;
+	slab->n_objects--;
+	g_mutex_unlock (slab->lock);
+}
+
+/**
+ * rb_slab_get_object_size:
+ * @slab: a #RBSlab
+ *
+ * Return value: the size of the objects allocated from @slab, including padding
+ */
+gsize
+rb_slab_get_object_size (RBSlab *slab)
+{
+	return slab->object_size;
+}
+
+/**
+ * rb_slab_get_usage:
+ * @slab: a #RBSlab
+ * @n_objects: returns the number of objects currently allocated
+ * @n_free: returns the number of released objects waiting to be reused
+ * @n_bytes: returns the total size of the blocks allocated by the slab
+ *
+ * Reports how much memory the slab is using.
+ */
+void
+rb_slab_get_usage (RBSlab *slab, guint *n_objects, guint *n_free, gsize *n_bytes)
+{
+	g_mutex_lock (slab->lock);
+	if (n_objects)
+		*n_objects = slab->n_objects;
+	if (n_free)
+		*n_free = slab->n_free;
+	if (n_bytes)
+		*n_bytes = g_slist_length (slab->blocks) * slab->block_size;
+	g_mutex_unlock (slab->lock);
+}
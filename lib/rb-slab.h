@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_SLAB_H
+#define RB_SLAB_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RBSlab RBSlab;
+
+RBSlab *	rb_slab_new		(gsize object_size,
+					 guint objects_per_block);
+void		rb_slab_destroy		(RBSlab *slab);
+
+gpointer	rb_slab_alloc0		(RBSlab *slab);
+void		rb_slab_release		(RBSlab *slab,
+					 gpointer object);
+
+gsize		rb_slab_get_object_size	(RBSlab *slab);
+void		rb_slab_get_usage	(RBSlab *slab,
+					 guint *n_objects,
+					 guint *n_free,
+					 gsize *n_bytes);
+
+G_END_DECLS
+
+#endif /* RB_SLAB_H */
@@ -0,0 +1,363 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/**
+ * SECTION:rb-weighted-index
+ * @short_description: set of weighted items supporting fast random selection
+ *
+ * Holds a set of items, each with a non-negative weight, and picks an item
+ * at random with probability proportional to its weight.  The weights are
+ * stored in a Fenwick (binary indexed) tree, so adding, removing or
+ * reweighting an item and picking an item are all O(log N).
+ *
+ * Items are kept in a dense array of slots.  Removing an item moves the item
+ * in the last slot into the hole, so slot numbers are not stable and are not
+ * exposed.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "rb-weighted-index.h"
+
+/* Rebuild the tree from the plain weights after this many incremental
+ * updates per slot, so floating point error can't accumulate in the
+ * partial sums.
+ */
+#define REBUILD_UPDATE_FACTOR	4
+#define MIN_TREE_SIZE		64
+
+struct _RBWeightedIndex
+{
+	GPtrArray *items;
+	GArray *weights;
+	GHashTable *slots;
+	GDestroyNotify item_destroy;
+
+	double *tree;
+	guint tree_size;
+	guint updates;
+};
+
+static void
+tree_add (RBWeightedIndex *index, guint slot, double delta)
+{
+	guint i;
+
+	for (i = slot + 1; i <= index->tree_size; i += (i & -i)) {
+		index->tree[i] += delta;
+	}
+}
+
+static void
+tree_rebuild (RBWeightedIndex *index, guint size)
+{
+	guint i;
+
+	if (size != index->tree_size) {
+		g_free (index->tree);
+		index->tree = g_new (double, size + 1);
+		index->tree_size = size;
+	}
+
+	/* O(N) construction: each node pushes its partial sum to its parent */
+	memset (index->tree, 0, (size + 1) * sizeof (double));
+	for (i = 0; i < index->weights->len; i++) {
+		index->tree[i + 1] = g_array_index (index->weights, double, i);
+	}
+	for (i = 1; i <= size; i++) {
+		guint parent = i + (i & -i);
+		if (parent <= size)
+			index->tree[parent] += index->tree[i];
+	}
+
+	index->updates = 0;
+}
+
+static void
+set_slot_weight (RBWeightedIndex *index, guint slot, double weight)
+{
+	double *old;
+
+	old = &g_array_index (index->weights, double, slot);
+	if (*old == weight)
+		return;
+
+	tree_add (index, slot, weight - *old);
+	*old = weight;
+
+	if (++index->updates > index->tree_size * REBUILD_UPDATE_FACTOR)
+		tree_rebuild (index, index->tree_size);
+}
+
+/**
+ * rb_weighted_index_new:
+ * @item_destroy: function to call on items when they are removed, or NULL
+ *
+ * Creates a new, empty weighted index.  Items are compared by address.
+ *
+ * Return value: new #RBWeightedIndex
+ */
+RBWeightedIndex *
+rb_weighted_index_new (GDestroyNotify item_destroy)
+{
+	RBWeightedIndex *index;
+
+	index = g_new0 (RBWeightedIndex, 1);
+	index->items = g_ptr_array_new ();
+	index->weights = g_array_new (FALSE, FALSE, sizeof (double));
+	index->slots = g_hash_table_new (g_direct_hash, g_direct_equal);
+	index->item_destroy = item_destroy;
+
+	tree_rebuild (index, MIN_TREE_SIZE);
+	return index;
+}
+
+/**
+ * rb_weighted_index_clear:
+ * @index: a #RBWeightedIndex
+ *
+ * Removes all items from the index.
+ */
+void
+rb_weighted_index_clear (RBWeightedIndex *index)
+{
+	guint i;
+
+	if (index->item_destroy != NULL) {
+		for (i = 0; i < index->items->len; i++) {
+			index->item_destroy (g_ptr_array_index (index->items, i));
+		}
+	}
+
+	g_ptr_array_set_size (index->items, 0);
+	g_array_set_size (index->weights, 0);
+	g_hash_table_remove_all (index->slots);
+	tree_rebuild (index, MIN_TREE_SIZE);
+}
+
+/**
+ * rb_weighted_index_free:
+ * @index: a #RBWeightedIndex
+ *
+ * Frees the index, calling the item destroy function for each item.
+ */
+void
+rb_weighted_index_free (RBWeightedIndex *index)
+{
+	rb_weighted_index_clear (index);
+
+	g_ptr_array_free (index->items, TRUE);
+	g_array_free (index->weights, TRUE);
+	g_hash_table_destroy (index->slots);
+	g_free (index->tree);
+	g_free (index);
+}
+
+/**
+ * rb_weighted_index_set:
+ * @index: a #RBWeightedIndex
+ * @item: item to add or update
+ * @weight: weight of the item; negative weights are treated as 0
+ *
+ * Adds @item to the index, or updates its weight if it is already present.
+ * When an item is added, the index takes ownership of it.
+ */
+void
+rb_weighted_index_set (RBWeightedIndex *index, gpointer item, double weight)
+{
+	gpointer slot_ptr;
+	guint slot;
+
+	if (weight < 0.0)
+		weight = 0.0;
+
+	if (g_hash_table_lookup_extended (index->slots, item, NULL, &slot_ptr)) {
+		set_slot_weight (index, GPOINTER_TO_UINT (slot_ptr), weight);
+		return;
+	}
+
+	slot = index->items->len;
+	g_ptr_array_add (index->items, item);
+	g_array_append_val (index->weights, weight);
+	g_hash_table_insert (index->slots, item, GUINT_TO_POINTER (slot));
+
+	if (index->items->len > index->tree_size) {
+		/* grows geometrically, so the rebuild is amortised O(1) */
+		tree_rebuild (index, index->tree_size * 2);
+	} else {
+		tree_add (index, slot, weight);
+	}
+}
+
+/**
+ * rb_weighted_index_remove:
+ * @index: a #RBWeightedIndex
+ * @item: item to remove
+ *
+ * Removes @item from the index, calling the item destroy function on it.
+ *
+ * Return value: TRUE if the item was present
+ */
+gboolean
+rb_weighted_index_remove (RBWeightedIndex *index, gpointer item)
+{
+	gpointer slot_ptr;
+	guint slot;
+	guint last;
+
+	if (!g_hash_table_lookup_extended (index->slots, item, NULL, &slot_ptr))
+		return FALSE;
+
+	slot = GPOINTER_TO_UINT (slot_ptr);
+	last = index->items->len - 1;
+	g_hash_table_remove (index->slots, item);
+
+	if (slot != last) {
+		gpointer moved;
+
+		/* fill the hole with the item from the last slot */
+		moved = g_ptr_array_index (index->items, last);
+		g_ptr_array_index (index->items, slot) = moved;
+		g_hash_table_insert (index->slots, moved, GUINT_TO_POINTER (slot));
+		set_slot_weight (index, slot, g_array_index (index->weights, double, last));
+	}
+
+	set_slot_weight (index, last, 0.0);
+	g_ptr_array_set_size (index->items, last);
+	g_array_set_size (index->weights, last);
+
+	if (index->item_destroy != NULL)
+		index->item_destroy (item);
+
+	return TRUE;
+}
+
+/**
+ * rb_weighted_index_contains:
+ * @index: a #RBWeightedIndex
+ * @item: item to look for
+ *
+ * Return value: TRUE if @item is in the index
+ */
+gboolean
+rb_weighted_index_contains (RBWeightedIndex *index, gpointer item)
+{
+	return g_hash_table_lookup_extended (index->slots, item, NULL, NULL);
+}
+
+/**
+ * rb_weighted_index_size:
+ * @index: a #RBWeightedIndex
+ *
+ * Return value: number of items in the index
+ */
+guint
+rb_weighted_index_size (RBWeightedIndex *index)
+{
+	return index->items->len;
+}
+
+/**
+ * rb_weighted_index_total_weight:
+ * @index: a #RBWeightedIndex
+ *
+ * Return value: sum of the weights of all items in the index
+ */
+double
+rb_weighted_index_total_weight (RBWeightedIndex *index)
+{
+	double total = 0.0;
+	guint i;
+
+	for (i = index->items->len; i > 0; i -= (i & -i)) {
+		total += index->tree[i];
+	}
+	return total;
+}
+
+/**
+ * rb_weighted_index_lookup:
+ * @index: a #RBWeightedIndex
+ * @point: a value between 0 and the total weight of the index
+ *
+ * Lays the items out along a line segment, each taking up a length equal
+ * to its weight, and returns the item @point falls in.
+ *
+ * Return value: the item (not referenced), or NULL if the index is empty
+ */
+gpointer
+rb_weighted_index_lookup (RBWeightedIndex *index, double point)
+{
+	guint pos;
+	guint step;
+
+	if (index->items->len == 0)
+		return NULL;
+
+	/* find the last slot whose cumulative weight is <= point */
+	pos = 0;
+	for (step = index->tree_size; step > 0; step >>= 1) {
+		if (pos + step <= index->tree_size && index->tree[pos + step] <= point) {
+			pos += step;
+			point -= index->tree[pos];
+		}
+	}
+
+	/* rounding errors could take us past the end */
+	if (pos >= index->items->len)
+		pos = index->items->len - 1;
+
+	return g_ptr_array_index (index->items, pos);
+}
+
+/**
+ * rb_weighted_index_pick:
+ * @index: a #RBWeightedIndex
+ *
+ * Picks an item at random, with probability proportional to its weight.
+ * If all weights are 0, every item is equally likely.
+ *
+ * Return value: the item (not referenced), or NULL if the index is empty
+ */
+gpointer
+rb_weighted_index_pick (RBWeightedIndex *index)
+{
+	double total;
+
+	if (index->items->len == 0)
+		return NULL;
+
+	total = rb_weighted_index_total_weight (index);
+	if (total <= 0.0) {
+		return g_ptr_array_index (index->items,
+					  g_random_int_range (0, index->items->len));
+	}
+
+	return rb_weighted_index_lookup (index, g_random_double_range (0, total));
+}
@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_WEIGHTED_INDEX_H
+#define RB_WEIGHTED_INDEX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RBWeightedIndex RBWeightedIndex;
+
+RBWeightedIndex *	rb_weighted_index_new		(GDestroyNotify item_destroy);
+void			rb_weighted_index_free		(RBWeightedIndex *index);
+void			rb_weighted_index_clear		(RBWeightedIndex *index);
+
+void			rb_weighted_index_set		(RBWeightedIndex *index,
+							 gpointer item,
+							 double weight);
+gboolean		rb_weighted_index_remove	(RBWeightedIndex *index,
+							 gpointer item);
+gboolean		rb_weighted_index_contains	(RBWeightedIndex *index,
+							 gpointer item);
+
+guint			rb_weighted_index_size		(RBWeightedIndex *index);
+double			rb_weighted_index_total_weight	(RBWeightedIndex *index);
+
+gpointer		rb_weighted_index_lookup	(RBWeightedIndex *index,
+							 double point);
+gpointer		rb_weighted_index_pick		(RBWeightedIndex *index);
+
+G_END_DECLS
+
+#endif /* RB_WEIGHTED_INDEX_H */
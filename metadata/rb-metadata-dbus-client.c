@@ -44,6 +44,12 @@
  * child is still capable of handling messages, and it ensures the child
  * doesn't time out between when we check the child is still running and when
  * we actually send it the request.
+ *
+ * Several helper processes can be running at once, each with its own
+ * connection.  Each request is handed to an idle helper, so requests made
+ * from different threads don't have to wait for each other.  The number
+ * of helpers defaults to the number of processors (up to 8), and can be
+ * set using the RB_METADATA_HELPERS environment variable.
  */
 
 /**
@@ -77,12 +83,32 @@ static void rb_metadata_class_init (RBMetaDataClass *klass);
 static void rb_metadata_init (RBMetaData *md);
 static void rb_metadata_finalize (GObject *object);
 
+#define RB_METADATA_MAX_HELPERS		8
+#define RB_METADATA_STATS_INTERVAL	100
+
+typedef struct
+{
+	guint index;
+	gboolean busy;
+
+	DBusConnection *connection;
+	GPid child;
+	int child_stdout;
+
+	/* statistics */
+	guint n_starts;
+	guint n_requests;
+	gdouble busy_time;
+	GTimer *timer;
+} RBMetaDataHelper;
+
 static gboolean tried_env_address = FALSE;
-static DBusConnection *dbus_connection = NULL;
-static GPid metadata_child = 0;
-static int metadata_stdout = -1;
 static GMainContext *main_context = NULL;
-static GStaticMutex conn_mutex = G_STATIC_MUTEX_INIT;
+static GStaticMutex pool_mutex = G_STATIC_MUTEX_INIT;
+static GCond *pool_cond = NULL;
+static GPtrArray *helpers = NULL;
+static guint max_helpers = 0;
+G_LOCK_DEFINE_STATIC (saveable_types);
 static char **saveable_types = NULL;
 
 struct RBMetaDataPrivate
@@ -143,41 +169,138 @@ rb_metadata_new (void)
 	return RB_METADATA (g_object_new (RB_TYPE_METADATA, NULL));
 }
 
+static guint
+get_max_helpers (void)
+{
+	const char *env;
+	long n;
+
+	env = g_getenv ("RB_METADATA_HELPERS");
+	if (env != NULL) {
+		n = strtol (env, NULL, 10);
+		if (n > 0)
+			return n;
+	}
+
+	/* if the helper was started elsewhere, there's only one of it */
+	if (g_getenv ("RB_DBUS_METADATA_ADDRESS") != NULL)
+		return 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n > 1)
+		return MIN (n, RB_METADATA_MAX_HELPERS);
+#endif
+	return 1;
+}
+
+/*
+ * Finds an idle metadata helper for the caller to use, waiting for one
+ * to finish its current request if they're all busy.  Helpers that are
+ * already running are preferred, so callers only end up with a new
+ * process when there are more concurrent requests than running helpers.
+ */
+static RBMetaDataHelper *
+acquire_helper (void)
+{
+	RBMetaDataHelper *helper = NULL;
+	guint i;
+
+	g_static_mutex_lock (&pool_mutex);
+	if (helpers == NULL) {
+		helpers = g_ptr_array_new ();
+		pool_cond = g_cond_new ();
+		max_helpers = get_max_helpers ();
+		rb_debug ("using up to %u metadata helper processes", max_helpers);
+	}
+
+	while (helper == NULL) {
+		for (i = 0; i < helpers->len; i++) {
+			RBMetaDataHelper *h = g_ptr_array_index (helpers, i);
+			if (h->busy)
+				continue;
+
+			if (h->connection != NULL) {
+				helper = h;
+				break;
+			} else if (helper == NULL) {
+				helper = h;
+			}
+		}
+
+		if (helper == NULL && helpers->len < max_helpers) {
+			helper = g_new0 (RBMetaDataHelper, 1);
+			helper->index = helpers->len;
+			helper->child_stdout = -1;
+			helper->timer = g_timer_new ();
+			g_ptr_array_add (helpers, helper);
+		}
+
+		if (helper == NULL)
+			g_cond_wait (pool_cond, g_static_mutex_get_mutex (&pool_mutex));
+	}
+
+	helper->busy = TRUE;
+	g_static_mutex_unlock (&pool_mutex);
+
+	g_timer_start (helper->timer);
+	return helper;
+}
+
+static void
+release_helper (RBMetaDataHelper *helper)
+{
+	helper->busy_time += g_timer_elapsed (helper->timer, NULL);
+	helper->n_requests++;
+	if (helper->n_requests % RB_METADATA_STATS_INTERVAL == 0) {
+		rb_debug ("metadata helper %u: %u requests, %.1f requests/s, %u restarts",
+			  helper->index,
+			  helper->n_requests,
+			  helper->n_requests / MAX (helper->busy_time, 0.001),
+			  helper->n_starts > 0 ? helper->n_starts - 1 : 0);
+	}
+
+	g_static_mutex_lock (&pool_mutex);
+	helper->busy = FALSE;
+	g_cond_signal (pool_cond);
+	g_static_mutex_unlock (&pool_mutex);
+}
+
 static void
-kill_metadata_service (void)
+kill_metadata_service (RBMetaDataHelper *helper)
 {
-	if (dbus_connection) {
-		if (dbus_connection_get_is_connected (dbus_connection)) {
-			rb_debug ("closing dbus connection");
-			dbus_connection_close (dbus_connection);
+	if (helper->connection) {
+		if (dbus_connection_get_is_connected (helper->connection)) {
+			rb_debug ("closing dbus connection to metadata helper %u", helper->index);
+			dbus_connection_close (helper->connection);
 		} else {
-			rb_debug ("dbus connection already closed");
+			rb_debug ("dbus connection to metadata helper %u already closed", helper->index);
 		}
-		dbus_connection_unref (dbus_connection);
-		dbus_connection = NULL;
+		dbus_connection_unref (helper->connection);
+		helper->connection = NULL;
 	}
 
-	if (metadata_child) {
+	if (helper->child) {
 		rb_debug ("killing child process");
-		kill (metadata_child, SIGINT);
-		g_spawn_close_pid (metadata_child);
-		metadata_child = 0;
+		kill (helper->child, SIGINT);
+		g_spawn_close_pid (helper->child);
+		helper->child = 0;
 	}
 
-	if (metadata_stdout != -1) {
+	if (helper->child_stdout != -1) {
 		rb_debug ("closing metadata child process stdout pipe");
-		close (metadata_stdout);
-		metadata_stdout = -1;
+		close (helper->child_stdout);
+		helper->child_stdout = -1;
 	}
 }
 
 static gboolean
-ping_metadata_service (GError **error)
+ping_metadata_service (RBMetaDataHelper *helper, GError **error)
 {
 	DBusMessage *message, *response;
 	DBusError dbus_error = {0,};
 
-	if (!dbus_connection_get_is_connected (dbus_connection))
+	if (!dbus_connection_get_is_connected (helper->connection))
 		return FALSE;
 
 	message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
@@ -187,7 +310,7 @@ ping_metadata_service (GError **error)
 	if (!message) {
 		return FALSE;
 	}
-	response = dbus_connection_send_with_reply_and_block (dbus_connection,
+	response = dbus_connection_send_with_reply_and_block (helper->connection,
 							      message,
 							      RB_METADATA_DBUS_TIMEOUT,
 							      &dbus_error);
@@ -205,7 +328,7 @@ ping_metadata_service (GError **error)
 }
 
 static gboolean
-start_metadata_service (GError **error)
+start_metadata_service (RBMetaDataHelper *helper, GError **error)
 {
 	DBusError dbus_error = {0,};
 	DBusMessage *message;
@@ -214,30 +337,33 @@ start_metadata_service (GError **error)
 	GIOChannel *stdout_channel;
 	GIOStatus status;
 	gchar *dbus_address = NULL;
+	char **types;
 	char *saveable_type_list;
 
-	if (dbus_connection) {
-		if (ping_metadata_service (error))
+	if (helper->connection) {
+		if (ping_metadata_service (helper, error))
 			return TRUE;
 
 		/* Metadata service is broken.  Kill it, and if we haven't run
 		 * into any errors yet, we can try to restart it.
 		 */
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 
 		if (*error)
 			return FALSE;
 	}
 
+	g_static_mutex_lock (&pool_mutex);
 	if (!tried_env_address) {
 		const char *addr = g_getenv ("RB_DBUS_METADATA_ADDRESS");
 		tried_env_address = TRUE;
 		if (addr) {
 			rb_debug ("trying metadata service address %s (from environment)", addr);
 			dbus_address = g_strdup (addr);
-			metadata_child = 0;
+			helper->child = 0;
 		}
 	}
+	g_static_mutex_unlock (&pool_mutex);
 
 	if (dbus_address == NULL) {
 		GPtrArray *argv;
@@ -273,9 +399,9 @@ start_metadata_service (GError **error)
 						NULL,
 						0,
 						NULL, NULL,
-						&metadata_child,
+						&helper->child,
 						NULL,
-						&metadata_stdout,
+						&helper->child_stdout,
 						NULL,
 						&local_error);
 		g_ptr_array_free (argv, TRUE);
@@ -286,11 +412,11 @@ start_metadata_service (GError **error)
 			return FALSE;
 		}
 
-		stdout_channel = g_io_channel_unix_new (metadata_stdout);
+		stdout_channel = g_io_channel_unix_new (helper->child_stdout);
 		status = g_io_channel_read_line (stdout_channel, &dbus_address, NULL, NULL, error);
 		g_io_channel_unref (stdout_channel);
 		if (status != G_IO_STATUS_NORMAL) {
-			kill_metadata_service ();
+			kill_metadata_service (helper);
 			return FALSE;
 		}
 
@@ -298,26 +424,28 @@ start_metadata_service (GError **error)
 		rb_debug ("Got metadata helper D-BUS address %s", dbus_address);
 	}
 
-	dbus_connection = dbus_connection_open_private (dbus_address, &dbus_error);
+	helper->connection = dbus_connection_open_private (dbus_address, &dbus_error);
 	g_free (dbus_address);
-	if (!dbus_connection) {
-		kill_metadata_service ();
+	if (!helper->connection) {
+		kill_metadata_service (helper);
 
 		dbus_set_g_error (error, &dbus_error);
 		dbus_error_free (&dbus_error);
 		return FALSE;
 	}
-	dbus_connection_set_exit_on_disconnect (dbus_connection, FALSE);
+	dbus_connection_set_exit_on_disconnect (helper->connection, FALSE);
 
-	dbus_connection_setup_with_g_main (dbus_connection, main_context);
+	dbus_connection_setup_with_g_main (helper->connection, main_context);
 
-	rb_debug ("Metadata process %d started", metadata_child);
-
-	/* now ask it what types it can re-tag */
-	if (saveable_types != NULL) {
-		g_strfreev (saveable_types);
+	helper->n_starts++;
+	if (helper->n_starts > 1) {
+		rb_debug ("Metadata helper %u restarted as process %d (%u restarts, %u requests)",
+			  helper->index, helper->child, helper->n_starts - 1, helper->n_requests);
+	} else {
+		rb_debug ("Metadata helper %u started as process %d", helper->index, helper->child);
 	}
 
+	/* now ask it what types it can re-tag */
 	message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
 						RB_METADATA_DBUS_OBJECT_PATH,
 						RB_METADATA_DBUS_INTERFACE,
@@ -329,7 +457,7 @@ start_metadata_service (GError **error)
 	}
 
 	rb_debug ("sending metadata saveable types query");
-	response = dbus_connection_send_with_reply_and_block (dbus_connection,
+	response = dbus_connection_send_with_reply_and_block (helper->connection,
 							      message,
 							      RB_METADATA_DBUS_TIMEOUT,
 							      &dbus_error);
@@ -344,19 +472,24 @@ start_metadata_service (GError **error)
 		return FALSE;
 	}
 
-	if (!rb_metadata_dbus_get_strv (&iter, &saveable_types)) {
+	if (!rb_metadata_dbus_get_strv (&iter, &types)) {
 		rb_debug ("couldn't get saveable type data from response message");
 		return FALSE;
 	}
 
-	if (saveable_types != NULL) {
-		saveable_type_list = g_strjoinv (", ", saveable_types);
+	if (types != NULL) {
+		saveable_type_list = g_strjoinv (", ", types);
 		rb_debug ("saveable types from metadata helper: %s", saveable_type_list);
 		g_free (saveable_type_list);
 	} else {
 		rb_debug ("unable to save metadata for any file types");
 	}
 
+	G_LOCK (saveable_types);
+	g_strfreev (saveable_types);
+	saveable_types = types;
+	G_UNLOCK (saveable_types);
+
 	if (message)
 		dbus_message_unref (message);
 	if (response)
@@ -365,7 +498,7 @@ start_metadata_service (GError **error)
 }
 
 static void
-handle_dbus_error (RBMetaData *md, DBusError *dbus_error, GError **error)
+handle_dbus_error (RBMetaDataHelper *helper, DBusError *dbus_error, GError **error)
 {
 	/*
 	 * If the error is 'no reply within the specified time',
@@ -373,7 +506,7 @@ handle_dbus_error (RBMetaData *md, DBusError *dbus_error, GError **error)
 	 * it's stuck in a loop and needs to be killed.
 	 */
 	if (strcmp (dbus_error->name, DBUS_ERROR_NO_REPLY) == 0) {
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 
 		g_set_error (error,
 			     RB_METADATA_ERROR,
@@ -406,6 +539,94 @@ read_error_from_message (RBMetaData *md, DBusMessageIter *iter, GError **error)
 	g_free (error_message);
 }
 
+static void
+set_communication_error (GError **error)
+{
+	g_set_error (error,
+		     RB_METADATA_ERROR,
+		     RB_METADATA_ERROR_INTERNAL,
+		     _("D-BUS communication error"));
+}
+
+static void
+reset_metadata (RBMetaData *md, const char *uri)
+{
+	g_free (md->priv->mimetype);
+	md->priv->mimetype = NULL;
+
+	g_strfreev (md->priv->missing_plugins);
+	md->priv->missing_plugins = NULL;
+	g_strfreev (md->priv->plugin_descriptions);
+	md->priv->plugin_descriptions = NULL;
+
+	g_free (md->priv->uri);
+	md->priv->uri = g_strdup (uri);
+
+	if (md->priv->metadata)
+		g_hash_table_destroy (md->priv->metadata);
+	md->priv->metadata = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)rb_value_free);
+}
+
+/*
+ * Reads the results of loading a file, as sent by the metadata helper
+ * in reply to a load request or as part of a batch.
+ */
+static void
+read_load_result (RBMetaData *md, DBusMessageIter *iter, GError **error)
+{
+	gboolean ok;
+
+	if (!rb_metadata_dbus_get_strv (iter, &md->priv->missing_plugins)) {
+		rb_debug ("couldn't get missing plugin data from response message");
+		set_communication_error (error);
+		return;
+	}
+
+	if (!rb_metadata_dbus_get_strv (iter, &md->priv->plugin_descriptions)) {
+		rb_debug ("couldn't get missing plugin descriptions from response message");
+		set_communication_error (error);
+		return;
+	}
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_audio)) {
+		rb_debug ("couldn't get has-audio flag from response message");
+		set_communication_error (error);
+		return;
+	}
+	rb_debug ("has audio: %d", md->priv->has_audio);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_video)) {
+		rb_debug ("couldn't get has-video flag from response message");
+		set_communication_error (error);
+		return;
+	}
+	rb_debug ("has video: %d", md->priv->has_video);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_other_data)) {
+		rb_debug ("couldn't get has-other-data flag from response message");
+		set_communication_error (error);
+		return;
+	}
+	rb_debug ("has other data: %d", md->priv->has_other_data);
+
+	if (!rb_metadata_dbus_get_string (iter, &md->priv->mimetype)) {
+		set_communication_error (error);
+		return;
+	}
+	rb_debug ("got mimetype: %s", md->priv->mimetype);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &ok)) {
+		rb_debug ("couldn't get success flag from response message");
+		set_communication_error (error);
+		return;
+	} else if (ok == FALSE) {
+		read_error_from_message (md, iter, error);
+		return;
+	}
+
+	rb_metadata_dbus_read_from_message (md, md->priv->metadata, iter);
+}
+
 /**
  * rb_metadata_load:
  * @md: a #RBMetaData
@@ -426,32 +647,19 @@ rb_metadata_load (RBMetaData *md,
 	DBusMessage *response = NULL;
 	DBusMessageIter iter;
 	DBusError dbus_error = {0,};
-	gboolean ok;
 	GError *fake_error = NULL;
-	GError *dbus_gerror;
-
-	dbus_gerror = g_error_new (RB_METADATA_ERROR,
-				   RB_METADATA_ERROR_INTERNAL,
-				   _("D-BUS communication error"));
+	RBMetaDataHelper *helper;
 
 	if (error == NULL)
 		error = &fake_error;
 
-	g_free (md->priv->mimetype);
-	md->priv->mimetype = NULL;
-
-	g_free (md->priv->uri);
-	md->priv->uri = g_strdup (uri);
+	reset_metadata (md, uri);
 	if (uri == NULL)
 		return;
 
-	if (md->priv->metadata)
-		g_hash_table_destroy (md->priv->metadata);
-	md->priv->metadata = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)rb_value_free);
-
-	g_static_mutex_lock (&conn_mutex);
+	helper = acquire_helper ();
 
-	start_metadata_service (error);
+	start_metadata_service (helper, error);
 
 	if (*error == NULL) {
 		message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
@@ -459,111 +667,210 @@ rb_metadata_load (RBMetaData *md,
 							RB_METADATA_DBUS_INTERFACE,
 							"load");
 		if (!message) {
-			g_propagate_error (error, dbus_gerror);
+			set_communication_error (error);
 		} else if (!dbus_message_append_args (message, DBUS_TYPE_STRING, &uri, DBUS_TYPE_INVALID)) {
-			g_propagate_error (error, dbus_gerror);
+			set_communication_error (error);
 		}
 	}
 
 	if (*error == NULL) {
-		rb_debug ("sending metadata load request");
-		response = dbus_connection_send_with_reply_and_block (dbus_connection,
+		rb_debug ("sending metadata load request to helper %u", helper->index);
+		response = dbus_connection_send_with_reply_and_block (helper->connection,
 								      message,
 								      RB_METADATA_DBUS_TIMEOUT,
 								      &dbus_error);
 
 		if (!response)
-			handle_dbus_error (md, &dbus_error, error);
+			handle_dbus_error (helper, &dbus_error, error);
 	}
 
 	if (*error == NULL) {
 		if (!dbus_message_iter_init (response, &iter)) {
-			g_propagate_error (error, dbus_gerror);
+			set_communication_error (error);
 			rb_debug ("couldn't read response message");
 		}
 	}
-	
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_strv (&iter, &md->priv->missing_plugins)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get missing plugin data from response message");
-		}
-	}
 
 	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_strv (&iter, &md->priv->plugin_descriptions)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get missing plugin descriptions from response message");
-		}
+		read_load_result (md, &iter, error);
 	}
 
 	/* if we're missing some plugins, we'll need to make sure the
 	 * metadata helper rereads the registry before the next load.
 	 * the easiest way to do this is to kill it.
 	 */
-	if (*error == NULL && md->priv->missing_plugins != NULL) {
+	if (md->priv->missing_plugins != NULL) {
 		rb_debug ("missing plugins; killing metadata service to force registry reload");
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 	}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_audio)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-audio flag from response message");
-		} else {
-			rb_debug ("has audio: %d", md->priv->has_audio);
-		}
-	}
+	if (message)
+		dbus_message_unref (message);
+	if (response)
+		dbus_message_unref (response);
+	if (fake_error)
+		g_error_free (fake_error);
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_video)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-video flag from response message");
+	release_helper (helper);
+}
+
+/**
+ * rb_metadata_load_batch:
+ * @md: a #RBMetaData
+ * @uris: NULL-terminated array of URIs from which to load metadata
+ * @func: function to call with the results for each URI
+ * @data: data to pass to @func
+ *
+ * Reads metadata information from each of the specified URIs, using
+ * a single request to the metadata helper.  The helper sends back the
+ * results for each file as soon as it has read it.  @func is called
+ * once for each URI, in order, with @md holding the metadata for that
+ * URI and @error set if it could not be read.
+ *
+ * If @md is NULL, the results for each URI are read into a new #RBMetaData,
+ * which @func can keep a reference to.
+ */
+void
+rb_metadata_load_batch (RBMetaData *md,
+			char **uris,
+			RBMetaDataBatchFunc func,
+			gpointer data)
+{
+	DBusMessage *message = NULL;
+	DBusMessageIter iter;
+	dbus_uint32_t serial = 0;
+	GError *error = NULL;
+	RBMetaDataHelper *helper;
+	gboolean missing_plugins = FALSE;
+	gboolean done = FALSE;
+	GTimer *timer;
+	guint n_results = 0;
+
+	if (uris == NULL || uris[0] == NULL)
+		return;
+
+	helper = acquire_helper ();
+
+	start_metadata_service (helper, &error);
+
+	if (error == NULL) {
+		message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
+							RB_METADATA_DBUS_OBJECT_PATH,
+							RB_METADATA_DBUS_INTERFACE,
+							"loadBatch");
+		if (!message) {
+			set_communication_error (&error);
 		} else {
-			rb_debug ("has video: %d", md->priv->has_video);
+			dbus_message_iter_init_append (message, &iter);
+			if (!rb_metadata_dbus_add_strv (&iter, uris))
+				set_communication_error (&error);
 		}
 	}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_other_data)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-other-data flag from response message");
-		} else {
-			rb_debug ("has other data: %d", md->priv->has_other_data);
-		}
+	if (error == NULL) {
+		rb_debug ("sending batch load request for %u files to helper %u",
+			  g_strv_length (uris), helper->index);
+		if (!dbus_connection_send (helper->connection, message, &serial))
+			set_communication_error (&error);
 	}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_string (&iter, &md->priv->mimetype)) {
-			g_propagate_error (error, dbus_gerror);
-		} else {
-			rb_debug ("got mimetype: %s", md->priv->mimetype);
+	/* process results as they arrive, until we get the reply to the
+	 * batch request itself.  the helper has the same amount of time to
+	 * read each file as it would for a single load request.
+	 */
+	timer = g_timer_new ();
+	while (error == NULL && !done) {
+		DBusMessage *response;
+
+		response = dbus_connection_pop_message (helper->connection);
+		if (response == NULL) {
+			if (g_timer_elapsed (timer, NULL) * 1000 > RB_METADATA_DBUS_TIMEOUT) {
+				rb_debug ("timed out waiting for batch load results");
+				kill_metadata_service (helper);
+				g_set_error (&error,
+					     RB_METADATA_ERROR,
+					     RB_METADATA_ERROR_INTERNAL,
+					     _("Internal GStreamer problem; file a bug"));
+			} else if (!dbus_connection_read_write (helper->connection, RB_METADATA_DBUS_TIMEOUT)) {
+				rb_debug ("metadata helper disconnected during batch load");
+				kill_metadata_service (helper);
+				set_communication_error (&error);
+			}
+			continue;
 		}
-	}
+		g_timer_start (timer);
+
+		if (dbus_message_is_signal (response, RB_METADATA_DBUS_INTERFACE, "loadResult")) {
+			GError *load_error = NULL;
+			char *uri;
+
+			if (!dbus_message_iter_init (response, &iter) ||
+			    !rb_metadata_dbus_get_string (&iter, &uri)) {
+				rb_debug ("couldn't read batch load result");
+				set_communication_error (&error);
+			} else if (uris[n_results] == NULL || strcmp (uri, uris[n_results]) != 0) {
+				rb_debug ("got unexpected batch load result for %s", uri);
+				set_communication_error (&error);
+				g_free (uri);
+			} else {
+				RBMetaData *result;
+
+				result = (md != NULL) ? md : rb_metadata_new ();
+				reset_metadata (result, uri);
+				read_load_result (result, &iter, &load_error);
+				if (result->priv->missing_plugins != NULL)
+					missing_plugins = TRUE;
+
+				func (result, uri, load_error, data);
+				n_results++;
+
+				if (result != md)
+					g_object_unref (result);
+				g_clear_error (&load_error);
+				g_free (uri);
+			}
+		} else if (dbus_message_get_reply_serial (response) == serial) {
+			DBusError dbus_error = {0,};
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &ok)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get success flag from response message");
-		} else if (ok == FALSE) {
-			read_error_from_message (md, &iter, error);
+			if (dbus_set_error_from_message (&dbus_error, response)) {
+				dbus_set_g_error (&error, &dbus_error);
+				dbus_error_free (&dbus_error);
+			}
+			done = TRUE;
+		} else if (dbus_message_is_signal (response, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+			rb_debug ("metadata helper disconnected during batch load");
+			kill_metadata_service (helper);
+			set_communication_error (&error);
 		}
+
+		dbus_message_unref (response);
+	}
+	g_timer_destroy (timer);
+
+	/* anything we didn't get results for failed */
+	if (error == NULL && uris[n_results] != NULL)
+		set_communication_error (&error);
+	for (; uris[n_results] != NULL; n_results++) {
+		RBMetaData *result;
+
+		result = (md != NULL) ? md : rb_metadata_new ();
+		reset_metadata (result, uris[n_results]);
+		func (result, uris[n_results], error, data);
+		if (result != md)
+			g_object_unref (result);
 	}
 
-	if (*error == NULL) {
-		rb_metadata_dbus_read_from_message (md, md->priv->metadata, &iter);
+	if (missing_plugins) {
+		rb_debug ("missing plugins; killing metadata service to force registry reload");
+		kill_metadata_service (helper);
 	}
 
 	if (message)
 		dbus_message_unref (message);
-	if (response)
-		dbus_message_unref (response);
-	if (*error != dbus_gerror)
-		g_error_free (dbus_gerror);
-	if (fake_error)
-		g_error_free (fake_error);
+	if (error)
+		g_error_free (error);
 
-	g_static_mutex_unlock (&conn_mutex);
+	release_helper (helper);
 }
 
 /**
@@ -697,18 +1004,24 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 {
 	GError *error = NULL;
 	gboolean result = FALSE;
+	gboolean started = TRUE;
 	int i = 0;
 
-	g_static_mutex_lock (&conn_mutex);
-
+	G_LOCK (saveable_types);
 	if (saveable_types == NULL) {
-		if (start_metadata_service (&error) == FALSE) {
-			g_error_free (error);
-			return FALSE;
-		}
+		RBMetaDataHelper *helper;
+
+		G_UNLOCK (saveable_types);
+		helper = acquire_helper ();
+		started = start_metadata_service (helper, &error);
+		release_helper (helper);
+		G_LOCK (saveable_types);
 	}
 
-	if (saveable_types != NULL) {
+	if (started == FALSE) {
+		if (error)
+			g_error_free (error);
+	} else if (saveable_types != NULL) {
 		for (i = 0; saveable_types[i] != NULL; i++) {
 			if (g_str_equal (mimetype, saveable_types[i])) {
 				result = TRUE;
@@ -717,7 +1030,7 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 		}
 	}
 
-	g_static_mutex_unlock (&conn_mutex);
+	G_UNLOCK (saveable_types);
 	return result;
 }
 
@@ -734,7 +1047,12 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 char **
 rb_metadata_get_saveable_types (RBMetaData *md)
 {
-	return g_strdupv (saveable_types);
+	char **types;
+
+	G_LOCK (saveable_types);
+	types = g_strdupv (saveable_types);
+	G_UNLOCK (saveable_types);
+	return types;
 }
 
 /**
@@ -753,13 +1071,14 @@ rb_metadata_save (RBMetaData *md, GError **error)
 	DBusMessage *response = NULL;
 	DBusError dbus_error = {0,};
 	DBusMessageIter iter;
+	RBMetaDataHelper *helper;
 
 	if (error == NULL)
 		error = &fake_error;
 
-	g_static_mutex_lock (&conn_mutex);
+	helper = acquire_helper ();
 
-	start_metadata_service (error);
+	start_metadata_service (helper, error);
 
 	if (*error == NULL) {
 		message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
@@ -785,12 +1104,12 @@ rb_metadata_save (RBMetaData *md, GError **error)
 	}
 
 	if (*error == NULL) {
-		response = dbus_connection_send_with_reply_and_block (dbus_connection,
+		response = dbus_connection_send_with_reply_and_block (helper->connection,
 								      message,
 								      RB_METADATA_SAVE_DBUS_TIMEOUT,
 								      &dbus_error);
 		if (!response) {
-			handle_dbus_error (md, &dbus_error, error);
+			handle_dbus_error (helper, &dbus_error, error);
 		} else if (dbus_message_iter_init (response, &iter)) {
 			/* if there's any return data at all, it'll be an error */
 			read_error_from_message (md, &iter, error);
@@ -804,7 +1123,7 @@ rb_metadata_save (RBMetaData *md, GError **error)
 	if (fake_error)
 		g_error_free (fake_error);
 
-	g_static_mutex_unlock (&conn_mutex);
+	release_helper (helper);
 }
 
 gboolean
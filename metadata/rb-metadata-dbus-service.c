@@ -98,6 +98,65 @@ send_error (DBusConnection *connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+static gboolean
+add_load_result (RBMetaData *md, const GError *error, DBusMessageIter *iter)
+{
+	gboolean ok;
+	const char *mimetype = NULL;
+	char **missing_plugins = NULL;
+	char **plugin_descriptions = NULL;
+	gboolean has_audio;
+	gboolean has_video;
+	gboolean has_other_data;
+
+	rb_metadata_get_missing_plugins (md, &missing_plugins, &plugin_descriptions);
+	ok = rb_metadata_dbus_add_strv (iter, missing_plugins) &&
+	     rb_metadata_dbus_add_strv (iter, plugin_descriptions);
+	g_strfreev (missing_plugins);
+	g_strfreev (plugin_descriptions);
+	if (!ok) {
+		rb_debug ("out of memory adding data to return message");
+		return FALSE;
+	}
+
+	mimetype = rb_metadata_get_mime (md);
+	if (mimetype == NULL) {
+		mimetype = "";
+	}
+	has_audio = rb_metadata_has_audio (md);
+	has_video = rb_metadata_has_video (md);
+	has_other_data = rb_metadata_has_other_data (md);
+
+	if (!dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_audio) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_video) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_other_data) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &mimetype)) {
+		rb_debug ("out of memory adding data to return message");
+		return FALSE;
+	}
+
+	ok = (error == NULL);
+	if (!dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &ok)) {
+		rb_debug ("out of memory adding error flag to return message");
+		return FALSE;
+	}
+
+	if (error != NULL) {
+		rb_debug ("metadata error: %s", error->message);
+		if (append_error (iter, error->code, error->message) == FALSE) {
+			rb_debug ("out of memory adding error details to return message");
+			return FALSE;
+		}
+	}
+
+	if (!rb_metadata_dbus_add_to_message (md, iter)) {
+		rb_debug ("unable to add metadata to return message");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static DBusHandlerResult
 rb_metadata_dbus_load (DBusConnection *connection,
 		       DBusMessage *message,
@@ -108,12 +167,6 @@ rb_metadata_dbus_load (DBusConnection *connection,
 	DBusMessage *reply;
 	GError *error = NULL;
 	gboolean ok;
-	const char *mimetype = NULL;
-	char **missing_plugins = NULL;
-	char **plugin_descriptions = NULL;
-	gboolean has_audio;
-	gboolean has_video;
-	gboolean has_other_data;
 
 	if (!dbus_message_iter_init (message, &iter)) {
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
@@ -136,49 +189,93 @@ rb_metadata_dbus_load (DBusConnection *connection,
 	}
 	
 	dbus_message_iter_init_append (reply, &iter);
-
-	rb_metadata_get_missing_plugins (svc->metadata, &missing_plugins, &plugin_descriptions);
-	if (!rb_metadata_dbus_add_strv (&iter, missing_plugins)) {
-		rb_debug ("out of memory adding data to return message");
+	ok = add_load_result (svc->metadata, error, &iter);
+	g_clear_error (&error);
+	if (!ok) {
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
-	if (!rb_metadata_dbus_add_strv (&iter, plugin_descriptions)) {
-		rb_debug ("out of memory adding data to return message");
+
+	if (!dbus_connection_send (connection, reply, NULL)) {
+		rb_debug ("failed to send return message");
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	mimetype = rb_metadata_get_mime (svc->metadata);
-	if (mimetype == NULL) {
-		mimetype = "";
+	dbus_message_unref (reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+typedef struct {
+	DBusConnection *connection;
+	ServiceData *svc;
+	gboolean failed;
+} LoadBatchData;
+
+static void
+send_load_batch_result (RBMetaData *md, const char *uri, const GError *error, LoadBatchData *batch)
+{
+	DBusMessage *result;
+	DBusMessageIter iter;
+
+	if (batch->failed)
+		return;
+
+	/* each result is sent as a signal as soon as it's ready,
+	 * so the client can start processing it while we load the next file.
+	 */
+	result = dbus_message_new_signal (RB_METADATA_DBUS_OBJECT_PATH,
+					  RB_METADATA_DBUS_INTERFACE,
+					  "loadResult");
+	if (!result) {
+		rb_debug ("out of memory creating load result message");
+		batch->failed = TRUE;
+		return;
 	}
-	has_audio = rb_metadata_has_audio (svc->metadata);
-	has_video = rb_metadata_has_video (svc->metadata);
-	has_other_data = rb_metadata_has_other_data (svc->metadata);
 
-	if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_audio) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_video) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_other_data) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &mimetype)) {
-		rb_debug ("out of memory adding data to return message");
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	dbus_message_iter_init_append (result, &iter);
+	if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &uri) ||
+	    !add_load_result (md, error, &iter) ||
+	    !dbus_connection_send (batch->connection, result, NULL)) {
+		rb_debug ("failed to send load result for %s", uri);
+		batch->failed = TRUE;
+	} else {
+		dbus_connection_flush (batch->connection);
 	}
 
-	ok = (error == NULL);
-	if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &ok)) {
-		rb_debug ("out of memory adding error flag to return message");
+	dbus_message_unref (result);
+	batch->svc->last_active = time (NULL);
+}
+
+static DBusHandlerResult
+rb_metadata_dbus_load_batch (DBusConnection *connection,
+			     DBusMessage *message,
+			     ServiceData *svc)
+{
+	DBusMessageIter iter;
+	DBusMessage *reply;
+	LoadBatchData batch;
+	char **uris;
+
+	if (!dbus_message_iter_init (message, &iter)) {
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	if (!rb_metadata_dbus_get_strv (&iter, &uris)) {
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	if (error != NULL) {
-		rb_debug ("metadata error: %s", error->message);
-		if (append_error (&iter, error->code, error->message) == FALSE) {
-			rb_debug ("out of memory adding error details to return message");
-			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-		}
+	batch.connection = connection;
+	batch.svc = svc;
+	batch.failed = FALSE;
+	if (uris != NULL) {
+		rb_debug ("loading metadata for %u files", g_strv_length (uris));
+		rb_metadata_load_batch (svc->metadata, uris, (RBMetaDataBatchFunc) send_load_batch_result, &batch);
+		g_strfreev (uris);
 	}
 
-	if (!rb_metadata_dbus_add_to_message (svc->metadata, &iter)) {
-		rb_debug ("unable to add metadata to return message");
+	/* the reply just marks the end of the batch */
+	reply = dbus_message_new_method_return (message);
+	if (!reply) {
+		rb_debug ("out of memory creating return message");
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
@@ -346,6 +443,8 @@ _handle_message (DBusConnection *connection, DBusMessage *message, void *data)
 
 	if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "load")) {
 		result = rb_metadata_dbus_load (connection, message, svc);
+	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "loadBatch")) {
+		result = rb_metadata_dbus_load_batch (connection, message, svc);
 	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "getSaveableTypes")) {
 		result = rb_metadata_dbus_get_saveable_types (connection, message, svc);
 	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "save")) {
@@ -41,6 +41,7 @@
 
 #include "rb-metadata.h"
 #include "rb-metadata-gst-common.h"
+#include "rb-metadata-native.h"
 #include "rb-debug.h"
 #include "rb-util.h"
 #include "rb-file-helpers.h"
@@ -60,6 +61,9 @@ struct RBMetaDataPrivate
 	GstElement *pipeline;
 	GstElement *sink;
 	gulong typefind_cb_id;
+
+	/* load pipeline kept for reuse by the next load */
+	GstElement *load_pipeline;
 	GstTagList *tags;
 
 	GHashTable *taggers;
@@ -321,6 +325,8 @@ rb_metadata_finalize (GObject *object)
 
 	if (md->priv->pipeline)
 		gst_object_unref (GST_OBJECT (md->priv->pipeline));
+	if (md->priv->load_pipeline)
+		gst_object_unref (GST_OBJECT (md->priv->load_pipeline));
 
 	if (md->priv->taggers)
 		g_hash_table_destroy (md->priv->taggers);
@@ -457,6 +463,7 @@ rb_metadata_gst_typefind_cb (GstElement *typefind, guint probability, GstCaps *c
 	}
 
 	g_signal_handler_disconnect (typefind, md->priv->typefind_cb_id);
+	md->priv->typefind_cb_id = 0;
 }
 
 static void
@@ -689,6 +696,8 @@ rb_metadata_load (RBMetaData *md,
 	GstFormat file_size_format = GST_FORMAT_BYTES;
 	GstStateChangeReturn state_ret;
 	int change_timeout;
+	gboolean reusable = FALSE;
+	RBMetaDataNativeResult native;
 	GstBus *bus;
 
 	g_free (md->priv->uri);
@@ -718,34 +727,87 @@ rb_metadata_load (RBMetaData *md,
 	md->priv->metadata = g_hash_table_new_full (g_direct_hash, g_direct_equal,
 						    NULL, (GDestroyNotify) rb_value_free);
 
+	/* Try reading the file directly first, which is much quicker than
+	 * building a pipeline when the file is in a format we can handle.
+	 */
+	if (rb_metadata_native_load (uri, &native)) {
+		md->priv->type = native.type;
+		native.type = NULL;
+		md->priv->has_audio = TRUE;
+		gst_tag_list_foreach (native.tags, (GstTagForeachFunc) rb_metadata_gst_load_tag, md);
+
+		if (native.duration > 0) {
+			GValue *newval;
+
+			newval = g_slice_new0 (GValue);
+			g_value_init (newval, G_TYPE_ULONG);
+			g_value_set_ulong (newval, (long) (native.duration / GST_SECOND));
+			g_hash_table_insert (md->priv->metadata, GINT_TO_POINTER (RB_METADATA_FIELD_DURATION),
+					     newval);
+		}
+
+		rb_metadata_native_result_clear (&native);
+		rb_debug ("successfully read metadata for %s", uri);
+		return;
+	}
+
 	/* The main tagfinding pipeline looks like this:
  	 * <src> ! decodebin ! fakesink
  	 *
  	 * but we can only link the fakesink in when the decodebin
  	 * creates an audio source pad.  we do this in the 'new-decoded-pad'
  	 * signal handler.
+ 	 *
+ 	 * decodebin discards everything it has plugged when it returns
+ 	 * to NULL state, so if the previous load succeeded, its pipeline
+ 	 * can be used again as long as the source element accepts the
+ 	 * new uri.  this saves building a new pipeline for each file.
  	 */
-	pipeline = gst_pipeline_new ("pipeline");
-
-	urisrc = gst_element_make_from_uri (GST_URI_SRC, uri, "urisrc");
-	if (urisrc == NULL) {
-		g_set_error (error,
-			     RB_METADATA_ERROR,
-			     RB_METADATA_ERROR_MISSING_PLUGIN,
-			     _("Failed to create a source element; check your installation"));
-		rb_debug ("missing an element to load the uri, sadly");
-		goto out;
+	if (md->priv->load_pipeline != NULL) {
+		pipeline = md->priv->load_pipeline;
+		md->priv->load_pipeline = NULL;
+
+		urisrc = gst_bin_get_by_name (GST_BIN (pipeline), "urisrc");
+		gst_object_unref (GST_OBJECT (urisrc));
+		if (gst_uri_handler_set_uri (GST_URI_HANDLER (urisrc), uri)) {
+			rb_debug ("reusing metadata pipeline");
+			decodebin = gst_bin_get_by_name (GST_BIN (pipeline), "decodebin");
+			gst_object_unref (GST_OBJECT (decodebin));
+			md->priv->sink = gst_bin_get_by_name (GST_BIN (pipeline), "fakesink");
+			gst_object_unref (GST_OBJECT (md->priv->sink));
+		} else {
+			rb_debug ("can't reuse metadata pipeline for %s", uri);
+			gst_object_unref (GST_OBJECT (pipeline));
+			pipeline = NULL;
+			urisrc = NULL;
+		}
 	}
-	gst_bin_add (GST_BIN (pipeline), urisrc);
 
- 	decodebin = make_pipeline_element (pipeline, "decodebin", error);
- 	md->priv->sink = make_pipeline_element (pipeline, "fakesink", error);
- 	if (!(urisrc && decodebin && md->priv->sink)) {
- 		rb_debug ("missing an element, sadly");
- 		goto out;
- 	}
+	if (pipeline == NULL) {
+		pipeline = gst_pipeline_new ("pipeline");
 
- 	g_signal_connect_object (decodebin, "new-decoded-pad", G_CALLBACK (rb_metadata_gst_new_decoded_pad_cb), md, 0);
+		urisrc = gst_element_make_from_uri (GST_URI_SRC, uri, "urisrc");
+		if (urisrc == NULL) {
+			g_set_error (error,
+				     RB_METADATA_ERROR,
+				     RB_METADATA_ERROR_MISSING_PLUGIN,
+				     _("Failed to create a source element; check your installation"));
+			rb_debug ("missing an element to load the uri, sadly");
+			goto out;
+		}
+		gst_bin_add (GST_BIN (pipeline), urisrc);
+
+		decodebin = make_pipeline_element (pipeline, "decodebin", error);
+		md->priv->sink = make_pipeline_element (pipeline, "fakesink", error);
+		if (!(urisrc && decodebin && md->priv->sink)) {
+			rb_debug ("missing an element, sadly");
+			goto out;
+		}
+
+		g_signal_connect_object (decodebin, "new-decoded-pad", G_CALLBACK (rb_metadata_gst_new_decoded_pad_cb), md, 0);
+
+		gst_element_link (urisrc, decodebin);
+	}
 
  	/* locate the decodebin's typefind, so we can get the have_type signal too.
  	 * this is kind of nasty, since it relies on an essentially arbitrary string
@@ -761,8 +823,6 @@ rb_metadata_load (RBMetaData *md,
 							    0);
 	gst_object_unref (GST_OBJECT (typefind));
 
- 	gst_element_link (urisrc, decodebin);
-
 	md->priv->pipeline = pipeline;
 	rb_debug ("going to PAUSED for metadata, uri: %s", uri);
 	state_ret = gst_element_set_state (pipeline, GST_STATE_PAUSED);
@@ -835,6 +895,8 @@ rb_metadata_load (RBMetaData *md,
 	state_ret = gst_element_set_state (pipeline, GST_STATE_NULL);
 	if (state_ret == GST_STATE_CHANGE_ASYNC) {
 		g_warning ("Failed to return metadata reader to NULL state");
+	} else if (md->priv->error == NULL && md->priv->type != NULL && !md->priv->has_non_audio) {
+		reusable = TRUE;
 	}
 
 	if (md->priv->error != NULL) {
@@ -852,11 +914,35 @@ rb_metadata_load (RBMetaData *md,
 	}
 
  out:
-	if (pipeline != NULL)
+	if (reusable) {
+		md->priv->load_pipeline = pipeline;
+	} else if (pipeline != NULL) {
 		gst_object_unref (GST_OBJECT (pipeline));
+	}
 	md->priv->pipeline = NULL;
 }
 
+void
+rb_metadata_load_batch (RBMetaData *md,
+			char **uris,
+			RBMetaDataBatchFunc func,
+			gpointer data)
+{
+	int i;
+
+	for (i = 0; uris[i] != NULL; i++) {
+		GError *error = NULL;
+		RBMetaData *result;
+
+		result = (md != NULL) ? md : rb_metadata_new ();
+		rb_metadata_load (result, uris[i], &error);
+		func (result, uris[i], error, data);
+		if (result != md)
+			g_object_unref (result);
+		g_clear_error (&error);
+	}
+}
+
 gboolean
 rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 {
@@ -0,0 +1,1358 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Fast path metadata readers for common audio formats.
+ *
+ * Building a GStreamer pipeline and taking it to PAUSED reads and decodes
+ * a lot more of the file than we need just to get the tags and duration.
+ * For formats where the tags and the information needed to work out the
+ * duration are in a known place near the start (or end) of the file, we
+ * read them directly instead.  Anything unusual about a file causes the
+ * reader to give up, and the file is loaded using GStreamer as usual.
+ *
+ * The readers produce a GstTagList using the same tag mappings as the
+ * GStreamer elements that would otherwise read the file, so the tags
+ * end up in the same metadata fields either way.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+#include "rb-metadata-native.h"
+#include "rb-debug.h"
+
+/* amount of the start of the file read before choosing a reader */
+#define HEAD_SIZE		(64 * 1024)
+/* limit on the size of a tag block we'll read into memory */
+#define MAX_TAG_SIZE		(16 * 1024 * 1024)
+/* amount of the end of an ogg file to search for the last page */
+#define OGG_TAIL_SIZE		(64 * 1024)
+/* amount of data after an ID3v2 tag to search for the first mpeg frame */
+#define MPEG_SEARCH_SIZE	(4 * 1024)
+
+typedef struct {
+	int fd;
+	guint64 size;
+	guchar *head;
+	gsize head_len;
+} NativeFile;
+
+typedef gboolean (*NativeReaderFunc) (NativeFile *file, RBMetaDataNativeResult *result);
+
+typedef struct {
+	const char *name;
+	NativeReaderFunc read;
+} NativeReader;
+
+static guint32
+get_be16 (const guchar *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static guint32
+get_be24 (const guchar *p)
+{
+	return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static guint32
+get_be32 (const guchar *p)
+{
+	return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static guint64
+get_be64 (const guchar *p)
+{
+	return ((guint64) get_be32 (p) << 32) | get_be32 (p + 4);
+}
+
+static guint32
+get_le32 (const guchar *p)
+{
+	return ((guint32) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static guint64
+get_le64 (const guchar *p)
+{
+	return ((guint64) get_le32 (p + 4) << 32) | get_le32 (p);
+}
+
+static guint32
+get_syncsafe (const guchar *p)
+{
+	return (p[0] << 21) | (p[1] << 14) | (p[2] << 7) | p[3];
+}
+
+/* returns a newly allocated copy of part of the file, or NULL if the file
+ * isn't that long.
+ */
+static guchar *
+read_bytes (NativeFile *file, guint64 offset, gsize len)
+{
+	guchar *data;
+	gsize done;
+
+	if (offset > file->size || len > file->size - offset)
+		return NULL;
+
+	if (offset + len <= file->head_len)
+		return g_memdup (file->head + offset, len);
+
+	if (lseek (file->fd, offset, SEEK_SET) == (off_t) -1)
+		return NULL;
+
+	data = g_malloc (len);
+	done = 0;
+	while (done < len) {
+		ssize_t r;
+
+		r = read (file->fd, data + done, len - done);
+		if (r <= 0) {
+			g_free (data);
+			return NULL;
+		}
+		done += r;
+	}
+	return data;
+}
+
+static GstTagList *
+parse_vorbis_comments (const guchar *data, gsize len, const guint8 *id_data, guint id_data_len)
+{
+	GstBuffer *buffer;
+	GstTagList *tags;
+
+	buffer = gst_buffer_new_and_alloc (len);
+	memcpy (GST_BUFFER_DATA (buffer), data, len);
+	tags = gst_tag_list_from_vorbiscomment_buffer (buffer, id_data, id_data_len, NULL);
+	gst_buffer_unref (buffer);
+	return tags;
+}
+
+static void
+add_date_tag (GstTagList *tags, const char *tag, const char *str)
+{
+	GDate *date;
+	int year, month = 0, day = 0;
+
+	year = atoi (str);
+	if (year <= 0 || year > 9999)
+		return;
+
+	if (strlen (str) >= 10 && str[4] == '-' && str[7] == '-') {
+		month = atoi (str + 5);
+		day = atoi (str + 8);
+	}
+
+	if (g_date_valid_dmy (day, month, year)) {
+		date = g_date_new_dmy (day, month, year);
+	} else {
+		date = g_date_new_dmy (1, 1, year);
+	}
+	gst_tag_list_add (tags, GST_TAG_MERGE_KEEP, tag, date, NULL);
+	g_date_free (date);
+}
+
+/*
+ * Adds a tag value read as text, converting it to the tag's type.
+ * Numbers of the form "3/12" also set the corresponding count tag.
+ */
+static void
+add_text_tag (GstTagList *tags, const char *tag, const char *str)
+{
+	GType type;
+	char *end;
+
+	type = gst_tag_get_type (tag);
+	if (type == G_TYPE_STRING) {
+		if (str[0] != '\0')
+			gst_tag_list_add (tags, GST_TAG_MERGE_APPEND, tag, str, NULL);
+	} else if (type == G_TYPE_UINT) {
+		guint n;
+
+		n = strtoul (str, &end, 10);
+		if (end != str && n > 0)
+			gst_tag_list_add (tags, GST_TAG_MERGE_KEEP, tag, n, NULL);
+
+		if (*end == '/') {
+			const char *count_tag = NULL;
+
+			n = strtoul (end + 1, NULL, 10);
+			if (strcmp (tag, GST_TAG_TRACK_NUMBER) == 0)
+				count_tag = GST_TAG_TRACK_COUNT;
+			else if (strcmp (tag, GST_TAG_ALBUM_VOLUME_NUMBER) == 0)
+				count_tag = GST_TAG_ALBUM_VOLUME_COUNT;
+
+			if (count_tag != NULL && n > 0)
+				gst_tag_list_add (tags, GST_TAG_MERGE_KEEP, count_tag, n, NULL);
+		}
+	} else if (type == G_TYPE_DOUBLE) {
+		double d;
+
+		d = g_ascii_strtod (str, &end);
+		if (end != str)
+			gst_tag_list_add (tags, GST_TAG_MERGE_KEEP, tag, d, NULL);
+	} else if (type == GST_TYPE_DATE) {
+		add_date_tag (tags, tag, str);
+	}
+}
+
+/* tags stored as free-form name/value pairs in ID3v2 TXXX frames and
+ * MP4 '----' atoms that don't have a standard mapping.
+ */
+static const char *
+user_tag_to_gst_tag (const char *name)
+{
+	if (g_ascii_strcasecmp (name, "replaygain_track_gain") == 0)
+		return GST_TAG_TRACK_GAIN;
+	else if (g_ascii_strcasecmp (name, "replaygain_track_peak") == 0)
+		return GST_TAG_TRACK_PEAK;
+	else if (g_ascii_strcasecmp (name, "replaygain_album_gain") == 0)
+		return GST_TAG_ALBUM_GAIN;
+	else if (g_ascii_strcasecmp (name, "replaygain_album_peak") == 0)
+		return GST_TAG_ALBUM_PEAK;
+	else if (strcmp (name, "MusicBrainz Track Id") == 0)
+		return GST_TAG_MUSICBRAINZ_TRACKID;
+	else if (strcmp (name, "MusicBrainz Artist Id") == 0)
+		return GST_TAG_MUSICBRAINZ_ARTISTID;
+	else if (strcmp (name, "MusicBrainz Album Id") == 0)
+		return GST_TAG_MUSICBRAINZ_ALBUMID;
+	else if (strcmp (name, "MusicBrainz Album Artist Id") == 0)
+		return GST_TAG_MUSICBRAINZ_ALBUMARTISTID;
+	return NULL;
+}
+
+/* ID3v2 */
+
+static gsize
+id3v2_undo_unsync (guchar *data, gsize len)
+{
+	gsize i, j;
+
+	for (i = 0, j = 0; i < len; i++) {
+		data[j++] = data[i];
+		if (data[i] == 0xff && i + 1 < len && data[i + 1] == 0x00)
+			i++;
+	}
+	return j;
+}
+
+/* reads the next null-terminated string from a frame, converting it to UTF-8 */
+static char *
+id3v2_next_string (guint8 encoding, const guchar **data, gsize *len)
+{
+	const guchar *str = *data;
+	gsize str_len;
+	gsize skip;
+	const char *charset;
+	char *utf8;
+
+	if (encoding == 1 || encoding == 2) {
+		for (str_len = 0; str_len + 1 < *len; str_len += 2) {
+			if (str[str_len] == 0 && str[str_len + 1] == 0)
+				break;
+		}
+		skip = MIN (str_len + 2, *len);
+		str_len = MIN (str_len, *len & ~1);
+
+		charset = "UTF-16BE";
+		if (encoding == 1 && str_len >= 2) {
+			if (str[0] == 0xff && str[1] == 0xfe) {
+				charset = "UTF-16LE";
+				str += 2;
+				str_len -= 2;
+			} else if (str[0] == 0xfe && str[1] == 0xff) {
+				str += 2;
+				str_len -= 2;
+			}
+		}
+	} else {
+		for (str_len = 0; str_len < *len; str_len++) {
+			if (str[str_len] == 0)
+				break;
+		}
+		skip = MIN (str_len + 1, *len);
+		charset = (encoding == 3) ? "UTF-8" : "ISO-8859-1";
+	}
+
+	*data += skip;
+	*len -= skip;
+
+	if (strcmp (charset, "UTF-8") == 0) {
+		utf8 = g_strndup ((const char *) str, str_len);
+		if (!g_utf8_validate (utf8, -1, NULL)) {
+			g_free (utf8);
+			return NULL;
+		}
+		return utf8;
+	}
+	return g_convert ((const char *) str, str_len, "UTF-8", charset, NULL, NULL, NULL);
+}
+
+static void
+id3v2_add_genre (GstTagList *tags, const char *str)
+{
+	const char *genre = str;
+	char *end;
+	guint n;
+
+	/* genres can be given as id3v1 genre numbers, either bare or in brackets */
+	if (str[0] == '(') {
+		n = strtoul (str + 1, &end, 10);
+		if (end != str + 1 && *end == ')') {
+			if (end[1] != '\0')
+				genre = end + 1;
+			else
+				genre = gst_tag_id3_genre_get (n);
+		}
+	} else if (g_ascii_isdigit (str[0])) {
+		n = strtoul (str, &end, 10);
+		if (*end == '\0')
+			genre = gst_tag_id3_genre_get (n);
+	}
+
+	if (genre != NULL && genre[0] != '\0')
+		gst_tag_list_add (tags, GST_TAG_MERGE_APPEND, GST_TAG_GENRE, genre, NULL);
+}
+
+static void
+id3v2_read_frame (const char *id, const guchar *data, gsize len, GstTagList *tags)
+{
+	guint8 encoding;
+
+	if (len < 1)
+		return;
+
+	if (id[0] == 'T' && strcmp (id, "TXXX") != 0) {
+		const char *tag;
+
+		/* v2.3 TYER has the same meaning as the first part of v2.4 TDRC */
+		tag = gst_tag_from_id3_tag (strcmp (id, "TYER") == 0 ? "TDRC" : id);
+		if (tag == NULL)
+			return;
+
+		encoding = data[0];
+		data++;
+		len--;
+
+		/* v2.4 text frames can contain multiple null-separated values */
+		while (len > 0) {
+			char *str;
+
+			str = id3v2_next_string (encoding, &data, &len);
+			if (str == NULL)
+				continue;
+
+			g_strstrip (str);
+			if (strcmp (tag, GST_TAG_GENRE) == 0)
+				id3v2_add_genre (tags, str);
+			else
+				add_text_tag (tags, tag, str);
+			g_free (str);
+		}
+	} else if (strcmp (id, "TXXX") == 0) {
+		char *desc;
+		char *value;
+
+		encoding = data[0];
+		data++;
+		len--;
+
+		desc = id3v2_next_string (encoding, &data, &len);
+		value = id3v2_next_string (encoding, &data, &len);
+		if (desc != NULL && value != NULL) {
+			const char *tag;
+
+			tag = gst_tag_from_id3_user_tag ("TXXX", desc);
+			if (tag == NULL)
+				tag = user_tag_to_gst_tag (desc);
+			if (tag != NULL)
+				add_text_tag (tags, tag, g_strstrip (value));
+		}
+		g_free (desc);
+		g_free (value);
+	} else if (strcmp (id, "COMM") == 0) {
+		char *desc;
+		char *text;
+
+		if (len < 4)
+			return;
+
+		encoding = data[0];
+		data += 4;		/* skip the language code too */
+		len -= 4;
+
+		/* only plain comments, not ones with a description */
+		desc = id3v2_next_string (encoding, &data, &len);
+		text = id3v2_next_string (encoding, &data, &len);
+		if (desc != NULL && desc[0] == '\0' && text != NULL)
+			add_text_tag (tags, GST_TAG_COMMENT, g_strstrip (text));
+		g_free (desc);
+		g_free (text);
+	} else if (strcmp (id, "UFID") == 0) {
+		char *owner;
+		const char *tag;
+
+		owner = id3v2_next_string (0, &data, &len);
+		if (owner != NULL && len > 0) {
+			tag = gst_tag_from_id3_user_tag ("UFID", owner);
+			if (tag != NULL) {
+				char *value = g_strndup ((const char *) data, len);
+				if (g_utf8_validate (value, -1, NULL))
+					add_text_tag (tags, tag, value);
+				g_free (value);
+			}
+		}
+		g_free (owner);
+	}
+}
+
+/*
+ * Reads an ID3v2.3 or v2.4 tag at the start of the file, if there is one,
+ * and returns the offset of the data following it.  Returns FALSE if
+ * there's a tag we can't read.
+ */
+static gboolean
+read_id3v2 (NativeFile *file, GstTagList *tags, guint64 *tag_end)
+{
+	const guchar *head = file->head;
+	guchar *data;
+	guint8 version;
+	guint8 flags;
+	gsize size;
+	gsize pos;
+
+	*tag_end = 0;
+	if (file->head_len < 10 || memcmp (head, "ID3", 3) != 0)
+		return TRUE;
+
+	version = head[3];
+	flags = head[5];
+	if (version < 3 || version > 4) {
+		rb_debug ("can't read ID3v2.%d tags", version);
+		return FALSE;
+	}
+	if ((head[6] | head[7] | head[8] | head[9]) & 0x80)
+		return FALSE;
+
+	size = get_syncsafe (head + 6);
+	*tag_end = 10 + size + ((flags & 0x10) ? 10 : 0);
+	if (size > MAX_TAG_SIZE)
+		return FALSE;
+
+	data = read_bytes (file, 10, size);
+	if (data == NULL)
+		return FALSE;
+
+	if (version == 3 && (flags & 0x80))
+		size = id3v2_undo_unsync (data, size);
+
+	pos = 0;
+	if (flags & 0x40) {
+		/* skip the extended header */
+		if (size < 4) {
+			g_free (data);
+			return FALSE;
+		}
+		if (version == 3)
+			pos = get_be32 (data) + 4;
+		else
+			pos = get_syncsafe (data);
+	}
+
+	while (pos + 10 <= size) {
+		char id[5];
+		const guchar *frame;
+		gsize frame_size;
+		guint16 frame_flags;
+		int i;
+
+		/* padding */
+		if (data[pos] == 0)
+			break;
+
+		for (i = 0; i < 4; i++) {
+			if (!g_ascii_isupper (data[pos + i]) && !g_ascii_isdigit (data[pos + i])) {
+				g_free (data);
+				return FALSE;
+			}
+			id[i] = data[pos + i];
+		}
+		id[4] = '\0';
+
+		if (version == 4)
+			frame_size = get_syncsafe (data + pos + 4);
+		else
+			frame_size = get_be32 (data + pos + 4);
+		frame_flags = get_be16 (data + pos + 8);
+		pos += 10;
+		if (frame_size > size - pos)
+			break;
+
+		frame = data + pos;
+		pos += frame_size;
+
+		if (version == 3) {
+			/* compressed or encrypted */
+			if (frame_flags & 0x00c0)
+				continue;
+			/* grouping identity */
+			if (frame_flags & 0x0020) {
+				if (frame_size < 1)
+					continue;
+				frame++;
+				frame_size--;
+			}
+		} else {
+			/* compressed or encrypted */
+			if (frame_flags & 0x000c)
+				continue;
+			/* grouping identity */
+			if (frame_flags & 0x0040) {
+				if (frame_size < 1)
+					continue;
+				frame++;
+				frame_size--;
+			}
+			/* data length indicator */
+			if (frame_flags & 0x0001) {
+				if (frame_size < 4)
+					continue;
+				frame += 4;
+				frame_size -= 4;
+			}
+			if ((frame_flags & 0x0002) || (flags & 0x80))
+				frame_size = id3v2_undo_unsync ((guchar *) frame, frame_size);
+		}
+
+		id3v2_read_frame (id, frame, frame_size, tags);
+	}
+
+	g_free (data);
+	return TRUE;
+}
+
+static gboolean
+read_id3v1 (NativeFile *file, GstTagList *tags)
+{
+	GstTagList *v1_tags;
+	guchar *data;
+
+	if (file->size < 128)
+		return FALSE;
+
+	data = read_bytes (file, file->size - 128, 128);
+	if (data == NULL || memcmp (data, "TAG", 3) != 0) {
+		g_free (data);
+		return FALSE;
+	}
+
+	/* ID3v2 tags take precedence */
+	v1_tags = gst_tag_list_new_from_id3v1 (data);
+	if (v1_tags != NULL) {
+		gst_tag_list_insert (tags, v1_tags, GST_TAG_MERGE_KEEP);
+		gst_tag_list_free (v1_tags);
+	}
+	g_free (data);
+	return TRUE;
+}
+
+/* MPEG audio */
+
+static const guint mpeg1_l3_bitrates[16] = {
+	0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0
+};
+
+static const guint mpeg2_l3_bitrates[16] = {
+	0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0
+};
+
+static const guint mpeg_sample_rates[3] = { 44100, 48000, 32000 };
+
+/*
+ * Works out the duration and bitrate of an MP3 stream from the Xing, Info
+ * or VBRI header in its first frame.  Without one of those, the duration
+ * can only be found by reading the whole stream, so we leave it to
+ * GStreamer.
+ */
+static gboolean
+read_mpeg_audio (NativeFile *file, guint64 offset, gboolean has_id3v1, RBMetaDataNativeResult *result)
+{
+	guchar *data;
+	gsize len;
+	gsize pos;
+	guint32 header = 0;
+	int version;
+	guint sample_rate;
+	guint bitrate;
+	guint samples_per_frame;
+	gsize side_info;
+	guint32 frames = 0;
+	guint32 bytes = 0;
+	gboolean cbr = FALSE;
+	guint64 stream_size;
+
+	len = MIN (MPEG_SEARCH_SIZE, file->size - MIN (offset, file->size));
+	data = read_bytes (file, offset, len);
+	if (data == NULL)
+		return FALSE;
+
+	/* find the first frame header, skipping any padding after the tag */
+	for (pos = 0; pos + 4 <= len; pos++) {
+		if (data[pos] == 0xff && (data[pos + 1] & 0xe0) == 0xe0)
+			break;
+		if (data[pos] != 0) {
+			pos = len;
+			break;
+		}
+	}
+	if (pos + 4 > len) {
+		g_free (data);
+		return FALSE;
+	}
+	header = get_be32 (data + pos);
+
+	/* layer 3 only */
+	version = (header >> 19) & 3;
+	if (version == 1 || ((header >> 17) & 3) != 1) {
+		g_free (data);
+		return FALSE;
+	}
+	if (((header >> 10) & 3) == 3) {
+		g_free (data);
+		return FALSE;
+	}
+
+	sample_rate = mpeg_sample_rates[(header >> 10) & 3];
+	if (version == 3) {
+		bitrate = mpeg1_l3_bitrates[(header >> 12) & 0xf];
+		samples_per_frame = 1152;
+		side_info = (((header >> 6) & 3) == 3) ? 17 : 32;
+	} else {
+		sample_rate /= (version == 2) ? 2 : 4;
+		bitrate = mpeg2_l3_bitrates[(header >> 12) & 0xf];
+		samples_per_frame = 576;
+		side_info = (((header >> 6) & 3) == 3) ? 9 : 17;
+	}
+	if (bitrate == 0) {
+		g_free (data);
+		return FALSE;
+	}
+
+	if (pos + 4 + side_info + 16 <= len &&
+	    (memcmp (data + pos + 4 + side_info, "Xing", 4) == 0 ||
+	     memcmp (data + pos + 4 + side_info, "Info", 4) == 0)) {
+		const guchar *xing = data + pos + 4 + side_info;
+		guint32 xing_flags = get_be32 (xing + 4);
+		gsize p = 8;
+
+		cbr = (memcmp (xing, "Info", 4) == 0);
+		if (xing_flags & 1) {
+			frames = get_be32 (xing + p);
+			p += 4;
+		}
+		if (xing_flags & 2)
+			bytes = get_be32 (xing + p);
+	} else if (pos + 4 + 32 + 18 <= len &&
+		   memcmp (data + pos + 4 + 32, "VBRI", 4) == 0) {
+		const guchar *vbri = data + pos + 4 + 32;
+
+		bytes = get_be32 (vbri + 10);
+		frames = get_be32 (vbri + 14);
+	}
+	g_free (data);
+
+	if (frames == 0) {
+		rb_debug ("no frame count in mp3 stream");
+		return FALSE;
+	}
+
+	result->duration = gst_util_uint64_scale ((guint64) frames * samples_per_frame, GST_SECOND, sample_rate);
+	if (result->duration == 0)
+		return FALSE;
+
+	if (cbr) {
+		bitrate *= 1000;
+	} else {
+		stream_size = bytes;
+		if (stream_size == 0) {
+			stream_size = file->size - offset - pos;
+			if (has_id3v1)
+				stream_size -= 128;
+		}
+		bitrate = gst_util_uint64_scale (stream_size * 8, GST_SECOND, result->duration);
+	}
+	gst_tag_list_add (result->tags, GST_TAG_MERGE_REPLACE, GST_TAG_BITRATE, bitrate, NULL);
+	return TRUE;
+}
+
+static gboolean
+read_mp3 (NativeFile *file, RBMetaDataNativeResult *result)
+{
+	guint64 audio_start;
+	gboolean has_id3v1;
+
+	if (!read_id3v2 (file, result->tags, &audio_start))
+		return FALSE;
+	if (audio_start >= file->size)
+		return FALSE;
+
+	has_id3v1 = read_id3v1 (file, result->tags);
+
+	if (!read_mpeg_audio (file, audio_start, has_id3v1, result))
+		return FALSE;
+
+	if (audio_start > 0 || has_id3v1)
+		result->type = g_strdup ("application/x-id3");
+	else
+		result->type = g_strdup ("audio/mpeg");
+	return TRUE;
+}
+
+/* FLAC */
+
+static gboolean
+read_flac (NativeFile *file, RBMetaDataNativeResult *result)
+{
+	guint64 pos;
+	gboolean last = FALSE;
+	guint sample_rate = 0;
+	guint64 total_samples = 0;
+
+	if (file->head_len < 4 || memcmp (file->head, "fLaC", 4) != 0)
+		return FALSE;
+
+	pos = 4;
+	while (!last) {
+		guchar *header;
+		guchar *block;
+		guint type;
+		gsize len;
+
+		header = read_bytes (file, pos, 4);
+		if (header == NULL)
+			return FALSE;
+
+		last = (header[0] & 0x80) != 0;
+		type = header[0] & 0x7f;
+		len = get_be24 (header + 1);
+		g_free (header);
+		pos += 4;
+
+		if (type == 0 && len >= 18) {
+			/* STREAMINFO */
+			block = read_bytes (file, pos, len);
+			if (block == NULL)
+				return FALSE;
+
+			sample_rate = (block[10] << 12) | (block[11] << 4) | (block[12] >> 4);
+			total_samples = ((guint64) (block[13] & 0x0f) << 32) | get_be32 (block + 14);
+			g_free (block);
+		} else if (type == 4 && len <= MAX_TAG_SIZE) {
+			/* VORBIS_COMMENT */
+			GstTagList *tags;
+
+			block = read_bytes (file, pos, len);
+			if (block == NULL)
+				return FALSE;
+
+			tags = parse_vorbis_comments (block, len, NULL, 0);
+			g_free (block);
+			if (tags == NULL)
+				return FALSE;
+
+			gst_tag_list_insert (result->tags, tags, GST_TAG_MERGE_KEEP);
+			gst_tag_list_free (tags);
+		}
+
+		pos += len;
+	}
+
+	/* the total number of samples is optional */
+	if (sample_rate == 0 || total_samples == 0)
+		return FALSE;
+
+	result->duration = gst_util_uint64_scale (total_samples, GST_SECOND, sample_rate);
+	result->type = g_strdup ("audio/x-flac");
+	return TRUE;
+}
+
+/* Ogg Vorbis */
+
+static gboolean
+ogg_find_last_granule (NativeFile *file, guint32 serial, guint64 *granule)
+{
+	guchar *tail;
+	gsize len;
+	gssize pos;
+
+	len = MIN (OGG_TAIL_SIZE, file->size);
+	tail = read_bytes (file, file->size - len, len);
+	if (tail == NULL)
+		return FALSE;
+
+	/* a page header is at least 27 bytes long */
+	for (pos = (gssize) len - 27; pos >= 0; pos--) {
+		if (memcmp (tail + pos, "OggS", 4) == 0 &&
+		    tail[pos + 4] == 0 &&
+		    get_le32 (tail + pos + 14) == serial) {
+			*granule = get_le64 (tail + pos + 6);
+			if (*granule != G_MAXUINT64) {
+				g_free (tail);
+				return TRUE;
+			}
+		}
+	}
+
+	g_free (tail);
+	return FALSE;
+}
+
+static gboolean
+read_ogg_vorbis (NativeFile *file, RBMetaDataNativeResult *result)
+{
+	const guchar *head = file->head;
+	GByteArray *packet;
+	guint32 serial;
+	gsize pos = 0;
+	guint n_packets = 0;
+	guint sample_rate = 0;
+	gint32 nominal_bitrate = 0;
+	guint64 granule;
+	gboolean ok = TRUE;
+
+	if (file->head_len < 27 || memcmp (head, "OggS", 4) != 0)
+		return FALSE;
+
+	/* the identification and comment headers are the first two packets */
+	serial = get_le32 (head + 14);
+	packet = g_byte_array_new ();
+	while (ok && n_packets < 2) {
+		guint n_segments;
+		gsize data_pos;
+		gsize page_len;
+		guint i;
+
+		if (pos + 27 > file->head_len || memcmp (head + pos, "OggS", 4) != 0) {
+			ok = FALSE;
+			break;
+		}
+
+		n_segments = head[pos + 26];
+		data_pos = pos + 27 + n_segments;
+		if (data_pos > file->head_len) {
+			ok = FALSE;
+			break;
+		}
+
+		page_len = 0;
+		for (i = 0; i < n_segments; i++)
+			page_len += head[pos + 27 + i];
+		if (data_pos + page_len > file->head_len) {
+			ok = FALSE;
+			break;
+		}
+
+		if (get_le32 (head + pos + 14) != serial) {
+			/* more than one stream, probably audio with video */
+			if (head[pos + 5] & 0x02)
+				ok = FALSE;
+			pos = data_pos + page_len;
+			continue;
+		}
+
+		for (i = 0; i < n_segments && n_packets < 2; i++) {
+			guint seg_len = head[pos + 27 + i];
+
+			g_byte_array_append (packet, head + data_pos, seg_len);
+			data_pos += seg_len;
+			if (seg_len == 255)
+				continue;
+
+			if (n_packets == 0) {
+				if (packet->len < 30 || memcmp (packet->data, "\001vorbis", 7) != 0) {
+					ok = FALSE;
+					break;
+				}
+				sample_rate = get_le32 (packet->data + 12);
+				nominal_bitrate = (gint32) get_le32 (packet->data + 20);
+			} else {
+				GstTagList *tags;
+
+				tags = parse_vorbis_comments (packet->data, packet->len, (const guint8 *) "\003vorbis", 7);
+				if (tags == NULL) {
+					ok = FALSE;
+					break;
+				}
+				gst_tag_list_insert (result->tags, tags, GST_TAG_MERGE_KEEP);
+				gst_tag_list_free (tags);
+			}
+
+			n_packets++;
+			g_byte_array_set_size (packet, 0);
+		}
+
+		pos += 27 + n_segments + page_len;
+	}
+	g_byte_array_free (packet, TRUE);
+
+	if (!ok || sample_rate == 0)
+		return FALSE;
+
+	if (!ogg_find_last_granule (file, serial, &granule))
+		return FALSE;
+
+	result->duration = gst_util_uint64_scale (granule, GST_SECOND, sample_rate);
+	if (nominal_bitrate > 0)
+		gst_tag_list_add (result->tags, GST_TAG_MERGE_REPLACE, GST_TAG_BITRATE, (guint) nominal_bitrate, NULL);
+	result->type = g_strdup ("application/ogg");
+	return TRUE;
+}
+
+/* MP4 */
+
+typedef struct {
+	char type[5];
+	const guchar *data;
+	gsize len;
+} MP4Atom;
+
+static gboolean
+mp4_next_atom (const guchar **data, gsize *len, MP4Atom *atom)
+{
+	guint64 size;
+	gsize header = 8;
+
+	if (*len < 8)
+		return FALSE;
+
+	size = get_be32 (*data);
+	if (size == 1) {
+		if (*len < 16)
+			return FALSE;
+		size = get_be64 (*data + 8);
+		header = 16;
+	} else if (size == 0) {
+		size = *len;
+	}
+	if (size < header || size > *len)
+		return FALSE;
+
+	memcpy (atom->type, *data + 4, 4);
+	atom->type[4] = '\0';
+	atom->data = *data + header;
+	atom->len = size - header;
+
+	*data += size;
+	*len -= size;
+	return TRUE;
+}
+
+static gboolean
+mp4_find_atom (const guchar *data, gsize len, const char *type, MP4Atom *atom)
+{
+	while (mp4_next_atom (&data, &len, atom)) {
+		if (memcmp (atom->type, type, 4) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* returns the value in the 'data' atom of a metadata item */
+static gboolean
+mp4_item_data (const MP4Atom *item, guint32 *data_type, const guchar **value, gsize *value_len)
+{
+	MP4Atom data;
+
+	if (!mp4_find_atom (item->data, item->len, "data", &data) || data.len < 8)
+		return FALSE;
+
+	*data_type = get_be32 (data.data) & 0xffffff;
+	*value = data.data + 8;
+	*value_len = data.len - 8;
+	return TRUE;
+}
+
+static void
+mp4_add_text (GstTagList *tags, const char *tag, const guchar *value, gsize value_len)
+{
+	char *str;
+
+	str = g_strndup ((const char *) value, value_len);
+	if (g_utf8_validate (str, -1, NULL))
+		add_text_tag (tags, tag, g_strstrip (str));
+	g_free (str);
+}
+
+static void
+mp4_read_freeform_item (const MP4Atom *item, GstTagList *tags)
+{
+	MP4Atom name;
+	const guchar *value;
+	gsize value_len;
+	guint32 data_type;
+	const char *tag;
+	char *name_str;
+
+	if (!mp4_find_atom (item->data, item->len, "name", &name) || name.len < 4)
+		return;
+	if (!mp4_item_data (item, &data_type, &value, &value_len))
+		return;
+
+	name_str = g_strndup ((const char *) name.data + 4, name.len - 4);
+	tag = user_tag_to_gst_tag (name_str);
+	g_free (name_str);
+
+	if (tag != NULL)
+		mp4_add_text (tags, tag, value, value_len);
+}
+
+static void
+mp4_read_item (const MP4Atom *item, GstTagList *tags)
+{
+	static const struct {
+		const char *type;
+		const char *tag;
+	} text_items[] = {
+		{ "\251nam", GST_TAG_TITLE },
+		{ "\251ART", GST_TAG_ARTIST },
+		{ "\251alb", GST_TAG_ALBUM },
+		{ "\251day", GST_TAG_DATE },
+		{ "\251gen", GST_TAG_GENRE },
+		{ "\251cmt", GST_TAG_COMMENT },
+		{ "cprt", GST_TAG_COPYRIGHT },
+		{ "soar", GST_TAG_ARTIST_SORTNAME },
+		{ "soal", GST_TAG_ALBUM_SORTNAME },
+	};
+	const guchar *value;
+	gsize value_len;
+	guint32 data_type;
+	guint i;
+
+	if (strcmp (item->type, "----") == 0) {
+		mp4_read_freeform_item (item, tags);
+		return;
+	}
+
+	if (!mp4_item_data (item, &data_type, &value, &value_len))
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (text_items); i++) {
+		if (memcmp (item->type, text_items[i].type, 4) == 0) {
+			mp4_add_text (tags, text_items[i].tag, value, value_len);
+			return;
+		}
+	}
+
+	if (strcmp (item->type, "trkn") == 0 || strcmp (item->type, "disk") == 0) {
+		gboolean track = (strcmp (item->type, "trkn") == 0);
+		guint n, count;
+
+		if (value_len < 6)
+			return;
+		n = get_be16 (value + 2);
+		count = get_be16 (value + 4);
+		if (n > 0)
+			gst_tag_list_add (tags, GST_TAG_MERGE_KEEP,
+					  track ? GST_TAG_TRACK_NUMBER : GST_TAG_ALBUM_VOLUME_NUMBER, n, NULL);
+		if (count > 0)
+			gst_tag_list_add (tags, GST_TAG_MERGE_KEEP,
+					  track ? GST_TAG_TRACK_COUNT : GST_TAG_ALBUM_VOLUME_COUNT, count, NULL);
+	} else if (strcmp (item->type, "gnre") == 0) {
+		const char *genre;
+
+		/* id3v1 genre number plus one */
+		if (value_len < 2)
+			return;
+		genre = gst_tag_id3_genre_get (get_be16 (value) - 1);
+		if (genre != NULL)
+			gst_tag_list_add (tags, GST_TAG_MERGE_KEEP, GST_TAG_GENRE, genre, NULL);
+	}
+}
+
+static gboolean
+read_mp4 (NativeFile *file, RBMetaDataNativeResult *result)
+{
+	const guchar *head = file->head;
+	const guchar *data;
+	gsize len;
+	guchar *moov_data = NULL;
+	gsize moov_len = 0;
+	guint64 pos;
+	MP4Atom atom;
+	MP4Atom mvhd;
+	guint32 timescale;
+	guint64 duration;
+	gboolean has_audio = FALSE;
+
+	if (file->head_len < 12 || memcmp (head + 4, "ftyp", 4) != 0)
+		return FALSE;
+
+	/* only plain audio files; protected files and anything that could
+	 * contain video are left to GStreamer.
+	 */
+	if (memcmp (head + 8, "M4A ", 4) != 0 && memcmp (head + 8, "M4B ", 4) != 0)
+		return FALSE;
+
+	/* find the moov atom, which may be after the media data */
+	pos = 0;
+	while (pos + 8 <= file->size) {
+		guchar *header;
+		guint64 size;
+		gsize header_len = 8;
+		gboolean is_moov;
+
+		header = read_bytes (file, pos, MIN (16, file->size - pos));
+		if (header == NULL)
+			return FALSE;
+
+		size = get_be32 (header);
+		is_moov = (memcmp (header + 4, "moov", 4) == 0);
+		if (size == 1 && file->size - pos >= 16) {
+			size = get_be64 (header + 8);
+			header_len = 16;
+		} else if (size == 0) {
+			size = file->size - pos;
+		}
+		g_free (header);
+
+		if (size < header_len || size > file->size - pos)
+			return FALSE;
+
+		if (is_moov) {
+			if (size - header_len > MAX_TAG_SIZE)
+				return FALSE;
+			moov_len = size - header_len;
+			moov_data = read_bytes (file, pos + header_len, moov_len);
+			break;
+		}
+		pos += size;
+	}
+	if (moov_data == NULL)
+		return FALSE;
+
+	if (!mp4_find_atom (moov_data, moov_len, "mvhd", &mvhd) || mvhd.len < 20) {
+		g_free (moov_data);
+		return FALSE;
+	}
+	if (mvhd.data[0] == 1) {
+		if (mvhd.len < 32) {
+			g_free (moov_data);
+			return FALSE;
+		}
+		timescale = get_be32 (mvhd.data + 20);
+		duration = get_be64 (mvhd.data + 24);
+	} else {
+		timescale = get_be32 (mvhd.data + 12);
+		duration = get_be32 (mvhd.data + 16);
+	}
+
+	/* check the tracks */
+	data = moov_data;
+	len = moov_len;
+	while (mp4_next_atom (&data, &len, &atom)) {
+		MP4Atom mdia;
+		MP4Atom hdlr;
+
+		if (strcmp (atom.type, "trak") != 0)
+			continue;
+
+		if (!mp4_find_atom (atom.data, atom.len, "mdia", &mdia) ||
+		    !mp4_find_atom (mdia.data, mdia.len, "hdlr", &hdlr) ||
+		    hdlr.len < 12)
+			continue;
+
+		if (memcmp (hdlr.data + 8, "soun", 4) == 0) {
+			has_audio = TRUE;
+		} else if (memcmp (hdlr.data + 8, "vide", 4) == 0) {
+			has_audio = FALSE;
+			break;
+		}
+	}
+
+	if (!has_audio || timescale == 0 || duration == 0) {
+		g_free (moov_data);
+		return FALSE;
+	}
+
+	/* moov/udta/meta/ilst holds the metadata items */
+	if (mp4_find_atom (moov_data, moov_len, "udta", &atom) &&
+	    mp4_find_atom (atom.data, atom.len, "meta", &atom) &&
+	    atom.len >= 4 &&
+	    mp4_find_atom (atom.data + 4, atom.len - 4, "ilst", &atom)) {
+		MP4Atom item;
+
+		data = atom.data;
+		len = atom.len;
+		while (mp4_next_atom (&data, &len, &item)) {
+			mp4_read_item (&item, result->tags);
+		}
+	}
+	g_free (moov_data);
+
+	result->duration = gst_util_uint64_scale (duration, GST_SECOND, timescale);
+	result->type = g_strdup ("audio/x-m4a");
+	return TRUE;
+}
+
+static const NativeReader readers[] = {
+	{ "flac", read_flac },
+	{ "ogg vorbis", read_ogg_vorbis },
+	{ "mp4", read_mp4 },
+	{ "mp3", read_mp3 },
+};
+
+static volatile gint native_enabled = TRUE;
+
+static gboolean
+native_readers_enabled (void)
+{
+	static gsize init = 0;
+
+	if (g_once_init_enter (&init)) {
+		const char *env;
+
+		/* the tags the readers produce need to be registered */
+		gst_tag_register_musicbrainz_tags ();
+
+		env = g_getenv ("RB_METADATA_NATIVE");
+		if (env != NULL && strcmp (env, "0") == 0) {
+			rb_debug ("native metadata readers disabled");
+			g_atomic_int_set (&native_enabled, FALSE);
+		}
+		g_once_init_leave (&init, 1);
+	}
+	return g_atomic_int_get (&native_enabled);
+}
+
+/**
+ * rb_metadata_native_set_enabled:
+ * @enabled: whether to use the native readers
+ *
+ * Enables or disables the native readers, overriding the
+ * RB_METADATA_NATIVE environment variable.  This is used to compare
+ * their results against those from GStreamer.
+ */
+void
+rb_metadata_native_set_enabled (gboolean enabled)
+{
+	native_readers_enabled ();
+	g_atomic_int_set (&native_enabled, enabled);
+}
+
+/**
+ * rb_metadata_native_load:
+ * @uri: URI of the file to read
+ * @result: returns the metadata read from the file
+ *
+ * Tries to read metadata from a local file without using GStreamer.
+ * If the file is in a format one of the native readers understands,
+ * the tags, duration and media type are returned in @result.
+ * Clear @result using rb_metadata_native_result_clear afterwards.
+ *
+ * Return value: TRUE if the metadata was read
+ */
+gboolean
+rb_metadata_native_load (const char *uri, RBMetaDataNativeResult *result)
+{
+	NativeFile file;
+	struct stat st;
+	char *filename;
+	gboolean ok = FALSE;
+	ssize_t r;
+	guint i;
+
+	memset (result, 0, sizeof (RBMetaDataNativeResult));
+	if (!native_readers_enabled ())
+		return FALSE;
+
+	filename = g_filename_from_uri (uri, NULL, NULL);
+	if (filename == NULL)
+		return FALSE;
+
+	file.fd = open (filename, O_RDONLY);
+	g_free (filename);
+	if (file.fd == -1)
+		return FALSE;
+
+	if (fstat (file.fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+		close (file.fd);
+		return FALSE;
+	}
+	file.size = st.st_size;
+
+	file.head = g_malloc (HEAD_SIZE);
+	file.head_len = 0;
+	while (file.head_len < HEAD_SIZE) {
+		r = read (file.fd, file.head + file.head_len, HEAD_SIZE - file.head_len);
+		if (r <= 0)
+			break;
+		file.head_len += r;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (readers) && !ok; i++) {
+		result->tags = gst_tag_list_new ();
+		ok = readers[i].read (&file, result);
+		if (ok) {
+			rb_debug ("read metadata for %s using %s reader", uri, readers[i].name);
+		} else {
+			rb_metadata_native_result_clear (result);
+		}
+	}
+
+	g_free (file.head);
+	close (file.fd);
+	return ok;
+}
+
+/**
+ * rb_metadata_native_result_clear:
+ * @result: a #RBMetaDataNativeResult
+ *
+ * Frees the data held in @result.
+ */
+void
+rb_metadata_native_result_clear (RBMetaDataNativeResult *result)
+{
+	g_free (result->type);
+	if (result->tags != NULL)
+		gst_tag_list_free (result->tags);
+	memset (result, 0, sizeof (RBMetaDataNativeResult));
+}
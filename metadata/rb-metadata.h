@@ -126,6 +126,16 @@ void		rb_metadata_load	(RBMetaData *md,
 					 const char *uri,
 					 GError **error);
 
+typedef void	(*RBMetaDataBatchFunc)	(RBMetaData *md,
+					 const char *uri,
+					 const GError *error,
+					 gpointer data);
+
+void		rb_metadata_load_batch	(RBMetaData *md,
+					 char **uris,
+					 RBMetaDataBatchFunc func,
+					 gpointer data);
+
 void		rb_metadata_save	(RBMetaData *md,
 					 GError **error);
 
@@ -44,10 +44,12 @@ static RBMetaData *md = NULL;
 
 static gboolean debug = FALSE;
 static gboolean can_save = FALSE;
+static gboolean no_native = FALSE;
 
 static GOptionEntry entries [] = {
 	{ "debug", 0, 0, G_OPTION_ARG_NONE, &debug, NULL, NULL },
 	{ "can-save", 0, 0, G_OPTION_ARG_NONE, &can_save, NULL, NULL },
+	{ "no-native", 0, 0, G_OPTION_ARG_NONE, &no_native, NULL, NULL },
 	{ NULL }
 };
 
@@ -165,6 +167,10 @@ int main(int argc, char **argv)
 		rb_debug_init (TRUE);
 	}
 
+	/* read everything through GStreamer, for comparing against the native readers */
+	if (no_native) {
+		g_setenv ("RB_METADATA_NATIVE", "0", TRUE);
+	}
 
 	loop = g_main_loop_new (NULL, FALSE);
 	md = rb_metadata_new ();
@@ -55,6 +55,9 @@
 
 #define ITUNES_7_SERVER "iTunes/7"
 
+/* size of the buffer used to decompress streamed responses */
+#define DAAP_STREAM_INFLATE_SIZE 16384
+
 static void      rb_daap_connection_dispose      (GObject *obj);
 static void      rb_daap_connection_set_property (GObject *object,
 						  guint prop_id,
@@ -113,6 +116,16 @@ struct RBDAAPConnectionPrivate {
 	gboolean use_response_handler_thread;
 	float progress;
 
+	/* streamed responses */
+	RBDAAPStructureParser *parser;
+	gboolean stream_failed;
+#ifdef HAVE_LIBZ
+	gboolean inflating;
+	z_stream stream;
+#endif
+	gint returned_count;
+	gint items_received;
+
 	guint emit_progress_id;
 	guint do_something_id;
 
@@ -428,6 +441,104 @@ typedef struct {
 	RBDAAPConnection *connection;
 } DAAPResponseData;
 
+static GNode *
+connection_stream_finish (RBDAAPConnection *connection)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+	GNode *structure;
+
+	structure = rb_daap_structure_parser_finish (priv->parser);
+	priv->parser = NULL;
+#ifdef HAVE_LIBZ
+	if (priv->inflating) {
+		inflateEnd (&priv->stream);
+		priv->inflating = FALSE;
+	}
+#endif
+	if (priv->stream_failed) {
+		rb_daap_structure_destroy (structure);
+		structure = NULL;
+	}
+	return structure;
+}
+
+static void
+stream_got_headers_cb (SoupMessage      *message,
+		       RBDAAPConnection *connection)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+	const char *encoding_header;
+
+#ifdef HAVE_LIBZ
+	if (priv->inflating) {
+		inflateEnd (&priv->stream);
+		priv->inflating = FALSE;
+	}
+#endif
+
+	encoding_header = soup_message_headers_get (message->response_headers, "Content-Encoding");
+	if (encoding_header == NULL || strcmp (encoding_header, "gzip") != 0) {
+		return;
+	}
+
+#ifdef HAVE_LIBZ
+	memset (&priv->stream, 0, sizeof (z_stream));
+	priv->stream.zalloc = g_zalloc_wrapper;
+	priv->stream.zfree = g_zfree_wrapper;
+	priv->stream.opaque = NULL;
+	if (inflateInit2 (&priv->stream, 32 /* auto-detect */ + 15 /* max */ ) != Z_OK) {
+		rb_debug ("Unable to decompress streamed response");
+		priv->stream_failed = TRUE;
+	} else {
+		priv->inflating = TRUE;
+	}
+#else
+	rb_debug ("Received compressed response but can't handle it");
+	priv->stream_failed = TRUE;
+#endif
+}
+
+static void
+stream_got_chunk_cb (SoupMessage      *message,
+		     SoupBuffer       *chunk,
+		     RBDAAPConnection *connection)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+
+	if (priv->parser == NULL || priv->stream_failed ||
+	    SOUP_STATUS_IS_SUCCESSFUL (message->status_code) == FALSE) {
+		return;
+	}
+
+#ifdef HAVE_LIBZ
+	if (priv->inflating) {
+		char out[DAAP_STREAM_INFLATE_SIZE];
+
+		priv->stream.next_in = (unsigned char *)chunk->data;
+		priv->stream.avail_in = chunk->length;
+		do {
+			int z_res;
+
+			priv->stream.next_out = (unsigned char *)out;
+			priv->stream.avail_out = sizeof (out);
+			z_res = inflate (&priv->stream, Z_NO_FLUSH);
+			if (z_res != Z_OK && z_res != Z_STREAM_END && z_res != Z_BUF_ERROR) {
+				rb_debug ("Error decompressing streamed response: %d", z_res);
+				priv->stream_failed = TRUE;
+				return;
+			}
+
+			rb_daap_structure_parser_feed (priv->parser, out, sizeof (out) - priv->stream.avail_out);
+			if (z_res == Z_STREAM_END)
+				break;
+		} while (priv->stream.avail_out == 0);
+		return;
+	}
+#endif
+
+	rb_daap_structure_parser_feed (priv->parser, chunk->data, chunk->length);
+}
+
 static void
 actual_http_response_handler (DAAPResponseData *data)
 {
@@ -439,9 +550,17 @@ actual_http_response_handler (DAAPResponseData *data)
 	char *message_path;
 	int response_length;
 	gboolean compatible_server = TRUE;
+	gboolean streamed = FALSE;
+	GNode *streamed_structure = NULL;
 
 	priv = data->connection->priv;
 	structure = NULL;
+
+	if (priv->parser != NULL) {
+		/* the response body was parsed as it arrived */
+		streamed = TRUE;
+		streamed_structure = connection_stream_finish (data->connection);
+	}
 	encoding_header = NULL;
 	response = data->message->response_body->data;
 	response_length = data->message->response_body->length;
@@ -465,7 +584,7 @@ actual_http_response_handler (DAAPResponseData *data)
 		}
 	}
 
-	if (SOUP_STATUS_IS_SUCCESSFUL (data->status) && encoding_header && strcmp (encoding_header, "gzip") == 0) {
+	if (streamed == FALSE && SOUP_STATUS_IS_SUCCESSFUL (data->status) && encoding_header && strcmp (encoding_header, "gzip") == 0) {
 #ifdef HAVE_LIBZ
 		z_stream stream;
 		unsigned int factor = 4;
@@ -552,7 +671,12 @@ actual_http_response_handler (DAAPResponseData *data)
 			priv->emit_progress_id = g_idle_add ((GSourceFunc) emit_progress_idle, data->connection);
 		}
 		rb_profile_start ("parsing DAAP response");
-		structure = rb_daap_structure_parse (response, response_length);
+		if (streamed) {
+			structure = streamed_structure;
+			streamed_structure = NULL;
+		} else {
+			structure = rb_daap_structure_parse (response, response_length);
+		}
 		if (structure == NULL) {
 			rb_debug ("No daap structure returned from %s",
 				  message_path);
@@ -597,6 +721,9 @@ actual_http_response_handler (DAAPResponseData *data)
 	if (structure) {
 		rb_daap_structure_destroy (structure);
 	}
+	if (streamed_structure) {
+		rb_daap_structure_destroy (streamed_structure);
+	}
 
 	g_free (new_response);
 	g_free (message_path);
@@ -615,6 +742,9 @@ http_response_handler (SoupSession      *session,
 
 	if (message->status_code == SOUP_STATUS_CANCELLED) {
 		rb_debug ("Message cancelled");
+		if (connection->priv->parser != NULL) {
+			rb_daap_structure_destroy (connection_stream_finish (connection));
+		}
 		return;
 	}
 
@@ -685,6 +815,50 @@ http_get (RBDAAPConnection     *connection,
 	return TRUE;
 }
 
+/* like http_get, but the items in the listing container are passed to
+ * item_func as they arrive instead of keeping the whole response in
+ * memory; the handler gets the rest of the response.
+ */
+static gboolean
+http_get_streamed (RBDAAPConnection       *connection,
+		   const char             *path,
+		   gboolean                need_hash,
+		   gdouble                 version,
+		   gint                    req_id,
+		   RBDAAPContentCode       listing_code,
+		   RBDAAPStructureItemFunc item_func,
+		   RBDAAPResponseHandler   handler)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+	SoupMessage *message;
+
+	message = build_message (connection, path, need_hash, version, req_id, FALSE);
+	if (message == NULL) {
+		rb_debug ("Error building message for http://%s:%d/%s",
+			  priv->base_uri->host,
+			  priv->base_uri->port,
+			  path);
+		return FALSE;
+	}
+
+	soup_message_body_set_accumulate (message->response_body, FALSE);
+	g_signal_connect (message, "got-headers", G_CALLBACK (stream_got_headers_cb), connection);
+	g_signal_connect (message, "got-chunk", G_CALLBACK (stream_got_chunk_cb), connection);
+
+	priv->parser = rb_daap_structure_parser_new (listing_code, item_func, connection);
+	priv->stream_failed = FALSE;
+	priv->use_response_handler_thread = FALSE;
+	priv->response_handler = handler;
+	soup_session_queue_message (priv->session, message,
+				    (SoupSessionCallback) http_response_handler,
+				    connection);
+	rb_debug ("Queued streamed message for http://%s:%d/%s",
+		  priv->base_uri->host,
+		  priv->base_uri->port,
+		  path);
+	return TRUE;
+}
+
 static void
 entry_set_string_prop (RhythmDB        *db,
 		       RhythmDBEntry   *entry,
@@ -853,6 +1027,207 @@ handle_database_info (RBDAAPConnection *connection,
 	rb_daap_connection_state_done (connection, TRUE);
 }
 
+static void
+add_song_listing_item (RBDAAPConnection *connection,
+		       GNode            *item)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+	GNode *n2;
+	RhythmDBEntry *entry = NULL;
+	GValue value = {0,};
+	gchar *uri = NULL;
+	gint item_id = 0;
+	const gchar *title = NULL;
+	const gchar *album = NULL;
+	const gchar *artist = NULL;
+	const gchar *format = NULL;
+	const gchar *genre = NULL;
+	const gchar *streamURI = NULL;
+	gint length = 0;
+	gint track_number = 0;
+	gint disc_number = 0;
+	gint year = 0;
+	gint size = 0;
+	gint bitrate = 0;
+
+	for (n2 = item->children; n2; n2 = n2->next) {
+		RBDAAPItem *meta_item;
+
+		meta_item = n2->data;
+
+		switch (meta_item->content_code) {
+			case RB_DAAP_CC_MIID:
+				item_id = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_MINM:
+				title = g_value_get_string (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASAL:
+				album = g_value_get_string (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASAR:
+				artist = g_value_get_string (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASFM:
+				format = g_value_get_string (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASGN:
+				genre = g_value_get_string (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASTM:
+				length = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASTN:
+				track_number = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASDN:
+				disc_number = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASYR:
+				year = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASSZ:
+				size = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASBR:
+				bitrate = g_value_get_int (&(meta_item->content));
+				break;
+			case RB_DAAP_CC_ASUL:
+				streamURI = g_value_get_string (&(meta_item->content));
+				break;
+			default:
+				break;
+		}
+	}
+
+	/*if (connection->daap_version == 3.0) {*/
+		uri = g_strdup_printf ("%s/databases/%d/items/%d.%s?session-id=%u",
+				       priv->daap_base_uri,
+				       priv->database_id,
+				       item_id, format,
+				       priv->session_id);
+	/*} else {*/
+	/* uri should be
+	 * "/databases/%d/items/%d.%s?session-id=%u&revision-id=%d";
+	 * but its not going to work cause the other parts of the code
+	 * depend on the uri to have the ip address so that the
+	 * RBDAAPSource can be found to ++request_id
+	 * maybe just /dont/ support older itunes.  doesn't seem
+	 * unreasonable to me, honestly
+	 */
+	/*}*/
+	entry = rhythmdb_entry_new (priv->db, priv->db_type, uri);
+	if (entry == NULL) {
+		rb_debug ("cannot create entry for daap track %s", uri);
+		g_free (uri);
+		return;
+	}
+	g_hash_table_insert (priv->item_id_to_uri, GINT_TO_POINTER (item_id), rb_refstring_new (uri));
+	g_free (uri);
+
+	/* year */
+	if (year != 0) {
+		GDate *date;
+		gulong julian;
+
+		/* create dummy date with given year */
+		date = g_date_new_dmy (1, G_DATE_JANUARY, year);
+		julian = g_date_get_julian (date);
+		g_date_free (date);
+
+		g_value_init (&value, G_TYPE_ULONG);
+		g_value_set_ulong (&value,julian);
+		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DATE, &value);
+		g_value_unset (&value);
+	}
+
+	/* track number */
+	g_value_init (&value, G_TYPE_ULONG);
+	g_value_set_ulong (&value,(gulong)track_number);
+	rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_TRACK_NUMBER, &value);
+	g_value_unset (&value);
+
+	/* disc number */
+	g_value_init (&value, G_TYPE_ULONG);
+	g_value_set_ulong (&value,(gulong)disc_number);
+	rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DISC_NUMBER, &value);
+	g_value_unset (&value);
+
+	/* bitrate */
+	g_value_init (&value, G_TYPE_ULONG);
+	g_value_set_ulong (&value,(gulong)bitrate);
+	rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_BITRATE, &value);
+	g_value_unset (&value);
+
+	/* length */
+	g_value_init (&value, G_TYPE_ULONG);
+	g_value_set_ulong (&value,(gulong)length / 1000);
+	rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DURATION, &value);
+	g_value_unset (&value);
+
+	/* file size */
+	g_value_init (&value, G_TYPE_UINT64);
+	g_value_set_uint64(&value,(gint64)size);
+	rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_FILE_SIZE, &value);
+	g_value_unset (&value);
+
+	/* title */
+	entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_TITLE, title);
+
+	/* album */
+	entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_ALBUM, album);
+
+	/* artist */
+	entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_ARTIST, artist);
+
+	/* genre */
+	entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_GENRE, genre);
+
+	/* stream URI property is stored as a mountpoint for get_playback_uri */
+	if (streamURI && *streamURI != '\0') {
+		entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_MOUNTPOINT, streamURI);
+	}
+}
+
+static void
+song_listing_item_cb (GNode            *structure,
+		      GNode            *item,
+		      RBDAAPConnection *connection)
+{
+	RBDAAPConnectionPrivate *priv = connection->priv;
+	gint commit_batch;
+
+	if (priv->items_received == 0) {
+		RBDAAPItem *count;
+
+		/* the response header has been parsed by the time the first item arrives */
+		count = rb_daap_structure_find_item (structure, RB_DAAP_CC_MRCO);
+		if (count != NULL) {
+			priv->returned_count = g_value_get_int (&(count->content));
+		}
+	}
+
+	add_song_listing_item (connection, item);
+	priv->items_received++;
+
+	if (priv->returned_count > 20) {
+		commit_batch = priv->returned_count / 20;
+	} else {
+		commit_batch = 1;
+	}
+
+	if (priv->items_received % commit_batch == 0) {
+		if (priv->returned_count > 0) {
+			priv->progress = ((float)priv->items_received / (float)priv->returned_count);
+		}
+		if (priv->emit_progress_id != 0) {
+			g_source_remove (priv->emit_progress_id);
+		}
+		priv->emit_progress_id = g_idle_add ((GSourceFunc) emit_progress_idle, connection);
+		rhythmdb_commit (priv->db);
+	}
+}
+
 static void
 handle_song_listing (RBDAAPConnection *connection,
 		     guint             status,
@@ -861,14 +1236,12 @@ handle_song_listing (RBDAAPConnection *connection,
 	RBDAAPConnectionPrivate *priv = connection->priv;
 	RBDAAPItem *item = NULL;
 	GNode *listing_node;
-	gint returned_count;
-	gint i;
-	GNode *n;
-	gint specified_total_count;
-	gboolean update_type;
-	gint commit_batch;
 
-	/* get the songs */
+	/* the songs themselves were added by song_listing_item_cb as they
+	 * arrived, so this just checks the rest of the response.
+	 */
+	rhythmdb_commit (priv->db);
+	rb_profile_end ("handling song listing");
 
 	if (structure == NULL || SOUP_STATUS_IS_SUCCESSFUL (status) == FALSE) {
 		rb_daap_connection_state_done (connection, FALSE);
@@ -882,12 +1255,6 @@ handle_song_listing (RBDAAPConnection *connection,
 		rb_daap_connection_state_done (connection, FALSE);
 		return;
 	}
-	returned_count = g_value_get_int (&(item->content));
-	if (returned_count > 20) {
-		commit_batch = returned_count / 20;
-	} else {
-		commit_batch = 1;
-	}
 
 	item = rb_daap_structure_find_item (structure, RB_DAAP_CC_MTCO);
 	if (item == NULL) {
@@ -896,7 +1263,6 @@ handle_song_listing (RBDAAPConnection *connection,
 		rb_daap_connection_state_done (connection, FALSE);
 		return;
 	}
-	specified_total_count = g_value_get_int (&(item->content));
 
 	item = rb_daap_structure_find_item (structure, RB_DAAP_CC_MUTY);
 	if (item == NULL) {
@@ -905,7 +1271,6 @@ handle_song_listing (RBDAAPConnection *connection,
 		rb_daap_connection_state_done (connection, FALSE);
 		return;
 	}
-	update_type = g_value_get_char (&(item->content));
 
 	listing_node = rb_daap_structure_find_node (structure, RB_DAAP_CC_MLCL);
 	if (listing_node == NULL) {
@@ -915,183 +1280,7 @@ handle_song_listing (RBDAAPConnection *connection,
 		return;
 	}
 
-	priv->item_id_to_uri = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)rb_refstring_unref);
-
-	rb_profile_start ("handling song listing");
-	priv->progress = 0.0f;
-	if (priv->emit_progress_id != 0) {
-		g_source_remove (priv->emit_progress_id);
-	}
-	connection->priv->emit_progress_id = g_idle_add ((GSourceFunc) emit_progress_idle, connection);
-
-	for (i = 0, n = listing_node->children; n; i++, n = n->next) {
-		GNode *n2;
-		RhythmDBEntry *entry = NULL;
-		GValue value = {0,};
-		gchar *uri = NULL;
-		gint item_id = 0;
-		const gchar *title = NULL;
-		const gchar *album = NULL;
-		const gchar *artist = NULL;
-		const gchar *format = NULL;
-		const gchar *genre = NULL;
-		const gchar *streamURI = NULL;
-		gint length = 0;
-		gint track_number = 0;
-		gint disc_number = 0;
-		gint year = 0;
-		gint size = 0;
-		gint bitrate = 0;
-
-		for (n2 = n->children; n2; n2 = n2->next) {
-			RBDAAPItem *meta_item;
-
-			meta_item = n2->data;
-
-			switch (meta_item->content_code) {
-				case RB_DAAP_CC_MIID:
-					item_id = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_MINM:
-					title = g_value_get_string (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASAL:
-					album = g_value_get_string (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASAR:
-					artist = g_value_get_string (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASFM:
-					format = g_value_get_string (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASGN:
-					genre = g_value_get_string (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASTM:
-					length = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASTN:
-					track_number = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASDN:
-					disc_number = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASYR:
-					year = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASSZ:
-					size = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASBR:
-					bitrate = g_value_get_int (&(meta_item->content));
-					break;
-				case RB_DAAP_CC_ASUL:
-					streamURI = g_value_get_string (&(meta_item->content));
-					break;
-				default:
-					break;
-			}
-		}
-
-		/*if (connection->daap_version == 3.0) {*/
-			uri = g_strdup_printf ("%s/databases/%d/items/%d.%s?session-id=%u",
-					       priv->daap_base_uri,
-					       priv->database_id,
-					       item_id, format,
-					       priv->session_id);
-		/*} else {*/
-		/* uri should be
-		 * "/databases/%d/items/%d.%s?session-id=%u&revision-id=%d";
-		 * but its not going to work cause the other parts of the code
-		 * depend on the uri to have the ip address so that the
-		 * RBDAAPSource can be found to ++request_id
-		 * maybe just /dont/ support older itunes.  doesn't seem
-		 * unreasonable to me, honestly
-		 */
-		/*}*/
-		entry = rhythmdb_entry_new (priv->db, priv->db_type, uri);
-		if (entry == NULL) {
-			rb_debug ("cannot create entry for daap track %s", uri);
-			continue;
-		}
-		g_hash_table_insert (priv->item_id_to_uri, GINT_TO_POINTER (item_id), rb_refstring_new (uri));
-		g_free (uri);
-
-		/* year */
-		if (year != 0) {
-			GDate *date;
-			gulong julian;
-
-			/* create dummy date with given year */
-			date = g_date_new_dmy (1, G_DATE_JANUARY, year);
-			julian = g_date_get_julian (date);
-			g_date_free (date);
-
-			g_value_init (&value, G_TYPE_ULONG);
-			g_value_set_ulong (&value,julian);
-			rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DATE, &value);
-			g_value_unset (&value);
-		}
-
-		/* track number */
-		g_value_init (&value, G_TYPE_ULONG);
-		g_value_set_ulong (&value,(gulong)track_number);
-		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_TRACK_NUMBER, &value);
-		g_value_unset (&value);
-
-		/* disc number */
-		g_value_init (&value, G_TYPE_ULONG);
-		g_value_set_ulong (&value,(gulong)disc_number);
-		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DISC_NUMBER, &value);
-		g_value_unset (&value);
-
-		/* bitrate */
-		g_value_init (&value, G_TYPE_ULONG);
-		g_value_set_ulong (&value,(gulong)bitrate);
-		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_BITRATE, &value);
-		g_value_unset (&value);
-
-		/* length */
-		g_value_init (&value, G_TYPE_ULONG);
-		g_value_set_ulong (&value,(gulong)length / 1000);
-		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_DURATION, &value);
-		g_value_unset (&value);
-
-		/* file size */
-		g_value_init (&value, G_TYPE_UINT64);
-		g_value_set_uint64(&value,(gint64)size);
-		rhythmdb_entry_set (priv->db, entry, RHYTHMDB_PROP_FILE_SIZE, &value);
-		g_value_unset (&value);
-
-		/* title */
-		entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_TITLE, title);
-
-		/* album */
-		entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_ALBUM, album);
-
-		/* artist */
-		entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_ARTIST, artist);
-
-		/* genre */
-		entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_GENRE, genre);
-
-		/* stream URI property is stored as a mountpoint for get_playback_uri */
-		if (streamURI && *streamURI != '\0') {
-			entry_set_string_prop (priv->db, entry, RHYTHMDB_PROP_MOUNTPOINT, streamURI);
-		}
-
-		if (i % commit_batch == 0) {
-			connection->priv->progress = ((float)i / (float)returned_count);
-			if (priv->emit_progress_id != 0) {
-				g_source_remove (connection->priv->emit_progress_id);
-			}
-			connection->priv->emit_progress_id = g_idle_add ((GSourceFunc) emit_progress_idle, connection);
-			rhythmdb_commit (priv->db);
-		}
-	}
-	rhythmdb_commit (priv->db);
-	rb_profile_end ("handling song listing");
-
+	rb_debug ("added %d songs", priv->items_received);
 	rb_daap_connection_state_done (connection, TRUE);
 }
 
@@ -1590,8 +1779,23 @@ rb_daap_connection_do_something (RBDAAPConnection *connection)
 					priv->database_id,
 					priv->session_id,
 					priv->revision_number);
-		if (! http_get (connection, path, TRUE, priv->daap_version, 0, FALSE,
-			       (RBDAAPResponseHandler) handle_song_listing, TRUE)) {
+
+		if (priv->item_id_to_uri == NULL) {
+			priv->item_id_to_uri = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)rb_refstring_unref);
+		}
+		priv->returned_count = 0;
+		priv->items_received = 0;
+		priv->progress = 0.0f;
+		if (priv->emit_progress_id != 0) {
+			g_source_remove (priv->emit_progress_id);
+		}
+		priv->emit_progress_id = g_idle_add ((GSourceFunc) emit_progress_idle, connection);
+
+		rb_profile_start ("handling song listing");
+		if (! http_get_streamed (connection, path, TRUE, priv->daap_version, 0,
+					 RB_DAAP_CC_MLCL,
+					 (RBDAAPStructureItemFunc) song_listing_item_cb,
+					 (RBDAAPResponseHandler) handle_song_listing)) {
 			rb_debug ("Could not get DAAP song listing");
 			rb_daap_connection_state_done (connection, FALSE);
 		}
@@ -1774,6 +1978,10 @@ rb_daap_connection_dispose (GObject *object)
 		priv->item_id_to_uri = NULL;
 	}
 
+	if (priv->parser != NULL) {
+		rb_daap_structure_destroy (connection_stream_finish (RB_DAAP_CONNECTION (object)));
+	}
+
 	if (priv->session) {
 		rb_debug ("Aborting all pending requests");
 		soup_session_abort (priv->session);
@@ -81,6 +81,15 @@ static void rb_daap_share_forget_playlist (gpointer data,
 /* HTTP chunk size used to send files to clients */
 #define DAAP_SHARE_CHUNK_SIZE	16384
 
+/* number of song listings (one per set of requested fields) to keep */
+#define DAAP_SHARE_MAX_LISTINGS	4
+
+/* number of playlist items written to each chunk of a streamed listing */
+#define DAAP_SHARE_STREAM_ITEMS	1000
+
+/* number of deleted items to remember for delta updates */
+#define DAAP_SHARE_MAX_DELETED_ITEMS	10000
+
 typedef enum {
 	RB_DAAP_SHARE_AUTH_METHOD_NONE              = 0,
 	RB_DAAP_SHARE_AUTH_METHOD_NAME_AND_PASSWORD = 1,
@@ -101,15 +110,22 @@ struct RBDAAPSharePrivate {
 	/* http server things */
 	SoupServer *server;
 	guint revision_number;
+	GList *update_messages;		/* paused /update requests */
 
 	GHashTable *session_ids;
 
+	/* song listing cache */
+	GList *listings;		/* contains RBDAAPListings, most recently used first */
+	GHashTable *item_revisions;	/* entry ID -> revision the item last changed in */
+	GHashTable *deleted_items;	/* entry ID -> revision the item was removed in */
+	guint oldest_delta_revision;
+
 	/* db things */
 	RhythmDB *db;
 	RhythmDBEntryType entry_type;
-	gulong entry_added_id;
-	gulong entry_deleted_id;
-	gulong entry_changed_id;
+	gulong entries_added_id;
+	gulong entries_deleted_id;
+	gulong entries_changed_id;
 
 	/* playlist things */
 	RBPlaylistManager *playlist_manager;
@@ -831,6 +847,32 @@ logout_cb (SoupServer        *server,
 	soup_message_set_status (message, status);
 }
 
+static void
+message_set_update (SoupMessage *message,
+		    RBDAAPShare *share)
+{
+	/* MUPD update response
+	 * 	MSTT status
+	 * 	MUSR server revision
+	 */
+	GNode *mupd;
+
+	mupd = rb_daap_structure_add (NULL, RB_DAAP_CC_MUPD);
+	rb_daap_structure_add (mupd, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
+	rb_daap_structure_add (mupd, RB_DAAP_CC_MUSR, (gint32) share->priv->revision_number);
+
+	message_set_from_rb_daap_structure (message, mupd);
+	rb_daap_structure_destroy (mupd);
+}
+
+static void
+update_message_finished_cb (SoupMessage *message,
+			    RBDAAPShare *share)
+{
+	share->priv->update_messages = g_list_remove (share->priv->update_messages, message);
+	g_object_unref (message);
+}
+
 static void
 update_cb (SoupServer        *server,
 	   SoupMessage       *message,
@@ -845,27 +887,48 @@ update_cb (SoupServer        *server,
 	res = get_revision_number (query, &revision_number);
 
 	if (res && revision_number != share->priv->revision_number) {
-		/* MUPD update response
-		 * 	MSTT status
-		 * 	MUSR server revision
-		 */
-		GNode *mupd;
-
-		mupd = rb_daap_structure_add (NULL, RB_DAAP_CC_MUPD);
-		rb_daap_structure_add (mupd, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
-		rb_daap_structure_add (mupd, RB_DAAP_CC_MUSR, (gint32) share->priv->revision_number);
-
-		message_set_from_rb_daap_structure (message, mupd);
-		rb_daap_structure_destroy (mupd);
+		message_set_update (message, share);
 	} else {
-		/* FIXME: This seems like a bug. It just leaks the
-		 * message (and socket) without ever replying.
+		/* the client already has the current revision, so hold the
+		 * request until the database changes.
 		 */
 		g_object_ref (message);
+		g_signal_connect (message, "finished", G_CALLBACK (update_message_finished_cb), share);
+		share->priv->update_messages = g_list_prepend (share->priv->update_messages, message);
 		soup_server_pause_message (server, message);
 	}
 }
 
+static void
+complete_update_messages (RBDAAPShare *share)
+{
+	GList *messages;
+	GList *l;
+
+	/* the messages are removed from the list when they finish */
+	messages = g_list_copy (share->priv->update_messages);
+	for (l = messages; l != NULL; l = l->next) {
+		SoupMessage *message = l->data;
+
+		message_set_update (message, share);
+		soup_server_unpause_message (share->priv->server, message);
+	}
+	g_list_free (messages);
+}
+
+static void
+forget_update_messages (RBDAAPShare *share)
+{
+	GList *l;
+
+	for (l = share->priv->update_messages; l != NULL; l = l->next) {
+		g_signal_handlers_disconnect_by_func (l->data, G_CALLBACK (update_message_finished_cb), share);
+		g_object_unref (l->data);
+	}
+	g_list_free (share->priv->update_messages);
+	share->priv->update_messages = NULL;
+}
+
 typedef enum {
 	ITEM_ID = 0,
 	ITEM_NAME,
@@ -1099,28 +1162,17 @@ add_playlist_to_mlcl (RBPlaylistID *playlist_id,
 }
 
 static gboolean
-add_playlist_entry_to_mlcl (GtkTreeModel *model,
-			    GtkTreePath *path,
-			    GtkTreeIter *iter,
-			    struct MLCL_Bits *mb)
+collect_playlist_entry_id (GtkTreeModel *model,
+			   GtkTreePath *path,
+			   GtkTreeIter *iter,
+			   GArray *ids)
 {
-	GNode *mlit;
 	RhythmDBEntry *entry;
-	gint id;
-
-	mlit = rb_daap_structure_add (mb->mlcl, RB_DAAP_CC_MLIT);
+	gint32 id;
 
 	gtk_tree_model_get (model, iter, 0, &entry, -1);
-
 	id = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID);
-
-	if (client_requested (mb->bits, ITEM_KIND))
-		rb_daap_structure_add (mlit, RB_DAAP_CC_MIKD, (gchar) DMAP_ITEM_KIND_AUDIO);
-	if (client_requested (mb->bits, ITEM_ID))
-		rb_daap_structure_add (mlit, RB_DAAP_CC_MIID, (gint32) id);
-	if (client_requested (mb->bits, CONTAINER_ITEM_ID))
-		rb_daap_structure_add (mlit, RB_DAAP_CC_MCTI, (gint32) id);
-
+	g_array_append_val (ids, id);
 	rhythmdb_entry_unref (entry);
 
 	return FALSE;
@@ -1162,6 +1214,307 @@ parse_meta (GHashTable *query)
 	return parse_meta_str (attrs);
 }
 
+/* A song listing holds each visible entry serialized as an MLIT item for
+ * one set of requested fields, plus the concatenation of all of them that
+ * full listing responses share.  Entry changes only re-serialize the
+ * affected items; the concatenated body is rebuilt from the items the
+ * next time a client asks for it.
+ */
+typedef struct {
+	bitwise bits;
+	GHashTable *items;	/* entry ID -> SoupBuffer */
+	SoupBuffer *body;	/* NULL when out of date */
+} RBDAAPListing;
+
+static SoupBuffer *
+serialize_entry (RhythmDBEntry *entry,
+		 bitwise bits)
+{
+	struct MLCL_Bits mb = {NULL,0};
+	SoupBuffer *item = NULL;
+
+	mb.bits = bits;
+	mb.mlcl = rb_daap_structure_add (NULL, RB_DAAP_CC_MLCL);
+	add_entry_to_mlcl (entry, &mb);
+
+	if (mb.mlcl->children != NULL) {
+		gchar *data;
+		guint length;
+
+		data = rb_daap_structure_serialize (mb.mlcl->children, &length);
+		item = soup_buffer_new (SOUP_MEMORY_TAKE, data, length);
+	}
+
+	rb_daap_structure_destroy (mb.mlcl);
+	return item;
+}
+
+static void
+listing_invalidate (RBDAAPListing *listing)
+{
+	if (listing->body != NULL) {
+		soup_buffer_free (listing->body);
+		listing->body = NULL;
+	}
+}
+
+static void
+listing_update_entry (RBDAAPListing *listing,
+		      RhythmDBEntry *entry)
+{
+	SoupBuffer *item;
+	gulong id;
+
+	id = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID);
+	item = serialize_entry (entry, listing->bits);
+	if (item != NULL) {
+		g_hash_table_insert (listing->items, GUINT_TO_POINTER (id), item);
+	} else {
+		g_hash_table_remove (listing->items, GUINT_TO_POINTER (id));
+	}
+	listing_invalidate (listing);
+}
+
+static void
+listing_remove_entry (RBDAAPListing *listing,
+		      RhythmDBEntry *entry)
+{
+	gulong id;
+
+	id = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID);
+	if (g_hash_table_remove (listing->items, GUINT_TO_POINTER (id))) {
+		listing_invalidate (listing);
+	}
+}
+
+static void
+listing_add_entry (RhythmDBEntry *entry,
+		   RBDAAPListing *listing)
+{
+	SoupBuffer *item;
+
+	item = serialize_entry (entry, listing->bits);
+	if (item != NULL) {
+		g_hash_table_insert (listing->items,
+				     GUINT_TO_POINTER (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID)),
+				     item);
+	}
+}
+
+static void
+listing_free (RBDAAPListing *listing)
+{
+	listing_invalidate (listing);
+	g_hash_table_destroy (listing->items);
+	g_free (listing);
+}
+
+static SoupBuffer *
+listing_get_body (RBDAAPListing *listing)
+{
+	GHashTableIter iter;
+	SoupBuffer *item;
+	gsize length;
+	char *data;
+	char *p;
+
+	if (listing->body != NULL)
+		return listing->body;
+
+	length = 0;
+	g_hash_table_iter_init (&iter, listing->items);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&item)) {
+		length += item->length;
+	}
+
+	p = data = g_malloc (length);
+	g_hash_table_iter_init (&iter, listing->items);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&item)) {
+		memcpy (p, item->data, item->length);
+		p += item->length;
+	}
+
+	listing->body = soup_buffer_new (SOUP_MEMORY_TAKE, data, length);
+	return listing->body;
+}
+
+static RBDAAPListing *
+get_listing (RBDAAPShare *share,
+	     bitwise bits)
+{
+	RBDAAPListing *listing;
+	GList *l;
+
+	for (l = share->priv->listings; l != NULL; l = l->next) {
+		listing = l->data;
+		if (listing->bits == bits) {
+			share->priv->listings = g_list_remove_link (share->priv->listings, l);
+			share->priv->listings = g_list_concat (l, share->priv->listings);
+			return listing;
+		}
+	}
+
+	rb_debug ("building song listing for fields %" G_GINT64_MODIFIER "x", (guint64) bits);
+	listing = g_new0 (RBDAAPListing, 1);
+	listing->bits = bits;
+	listing->items = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						NULL, (GDestroyNotify) soup_buffer_free);
+	rhythmdb_entry_foreach_by_type (share->priv->db,
+					share->priv->entry_type,
+					(GFunc) listing_add_entry,
+					listing);
+
+	share->priv->listings = g_list_prepend (share->priv->listings, listing);
+	if (g_list_length (share->priv->listings) > DAAP_SHARE_MAX_LISTINGS) {
+		l = g_list_last (share->priv->listings);
+		listing_free (l->data);
+		share->priv->listings = g_list_delete_link (share->priv->listings, l);
+	}
+
+	return listing;
+}
+
+static void
+forget_listings (RBDAAPShare *share)
+{
+	g_list_foreach (share->priv->listings, (GFunc) listing_free, NULL);
+	g_list_free (share->priv->listings);
+	share->priv->listings = NULL;
+}
+
+static guint
+get_delta_revision (GHashTable *query)
+{
+	const char *delta_str;
+
+	delta_str = g_hash_table_lookup (query, "delta");
+	if (delta_str == NULL) {
+		return 0;
+	}
+	return strtoul (delta_str, NULL, 10);
+}
+
+static void
+message_set_from_listing (SoupMessage       *message,
+			  RBDAAPShare       *share,
+			  RBDAAPContentCode  cc,
+			  GHashTable        *query)
+{
+	/* <cc> database songs or base playlist songs
+	 * 	MSTT status
+	 * 	MUTY update type
+	 * 	MTCO specified total count
+	 * 	MRCO returned count
+	 * 	MLCL listing
+	 * 		MLIT
+	 * 			attrs
+	 * 		MLIT
+	 * 		...
+	 * 	MUDL deleted id listing (delta updates only)
+	 * 		MIID item id
+	 * 		...
+	 */
+	RBDAAPListing *listing;
+	SoupBuffer *body = NULL;
+	GList *items = NULL;
+	GList *l;
+	GNode *root;
+	GNode *mlcl;
+	GNode *mudl = NULL;
+	gsize items_length;
+	gint32 returned;
+	guint delta;
+	gchar *data;
+	guint length;
+
+	listing = get_listing (share, parse_meta (query));
+
+	delta = get_delta_revision (query);
+	if (delta != 0 && delta < share->priv->oldest_delta_revision) {
+		rb_debug ("client revision %u is too old for a delta update", delta);
+		delta = 0;
+	}
+
+	if (delta != 0) {
+		GHashTableIter iter;
+		gpointer id;
+		gpointer revision;
+
+		/* only the items that changed since the client's revision */
+		items_length = 0;
+		g_hash_table_iter_init (&iter, share->priv->item_revisions);
+		while (g_hash_table_iter_next (&iter, &id, &revision)) {
+			SoupBuffer *item;
+
+			if (GPOINTER_TO_UINT (revision) <= delta)
+				continue;
+
+			item = g_hash_table_lookup (listing->items, id);
+			if (item != NULL) {
+				items = g_list_prepend (items, item);
+				items_length += item->length;
+			}
+		}
+		returned = g_list_length (items);
+	} else {
+		body = listing_get_body (listing);
+		items_length = body->length;
+		returned = g_hash_table_size (listing->items);
+	}
+
+	root = rb_daap_structure_add (NULL, cc);
+	rb_daap_structure_add (root, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
+	rb_daap_structure_add (root, RB_DAAP_CC_MUTY, 0);
+	rb_daap_structure_add (root, RB_DAAP_CC_MTCO, (gint32) g_hash_table_size (listing->items));
+	rb_daap_structure_add (root, RB_DAAP_CC_MRCO, returned);
+	mlcl = rb_daap_structure_add (root, RB_DAAP_CC_MLCL);
+	rb_daap_structure_add_size (mlcl, items_length);
+
+	if (delta != 0) {
+		GHashTableIter iter;
+		gpointer id;
+		gpointer revision;
+
+		g_hash_table_iter_init (&iter, share->priv->deleted_items);
+		while (g_hash_table_iter_next (&iter, &id, &revision)) {
+			if (GPOINTER_TO_UINT (revision) <= delta)
+				continue;
+
+			if (mudl == NULL)
+				mudl = rb_daap_structure_add (root, RB_DAAP_CC_MUDL);
+			rb_daap_structure_add (mudl, RB_DAAP_CC_MIID, (gint32) GPOINTER_TO_UINT (id));
+		}
+
+		/* the deleted id listing goes after the items, so it's
+		 * serialized separately; its size is already included in
+		 * the root container.
+		 */
+		if (mudl != NULL)
+			g_node_unlink (mudl);
+	}
+
+	data = rb_daap_structure_serialize (root, &length);
+	soup_message_body_append (message->response_body, SOUP_MEMORY_TAKE, data, length);
+	rb_daap_structure_destroy (root);
+
+	if (body != NULL) {
+		soup_message_body_append_buffer (message->response_body, body);
+	}
+	for (l = items; l != NULL; l = l->next) {
+		soup_message_body_append_buffer (message->response_body, l->data);
+	}
+	g_list_free (items);
+
+	if (mudl != NULL) {
+		data = rb_daap_structure_serialize (mudl, &length);
+		soup_message_body_append (message->response_body, SOUP_MEMORY_TAKE, data, length);
+		rb_daap_structure_destroy (mudl);
+	}
+
+	message_add_standard_headers (message);
+	soup_message_set_status (message, SOUP_STATUS_OK);
+}
+
 static void
 write_next_chunk (SoupMessage *message, GInputStream *instream)
 {
@@ -1270,6 +1623,133 @@ send_mapped_file (SoupMessage *message, RhythmDBEntry *entry, guint64 file_size,
 	g_free (path);
 }
 
+/* Playlist song listings are written out in chunks as the client reads
+ * them rather than built as a tree first.  Each item has the same fields,
+ * so the listing size is known before anything is written.
+ */
+typedef struct {
+	GArray *ids;
+	guint next;
+	bitwise bits;
+} RBDAAPPlaylistStream;
+
+static void
+write_playlist_item (GByteArray *array,
+		     gint32 id,
+		     bitwise bits)
+{
+	GByteArray *fields;
+
+	fields = g_byte_array_sized_new (32);
+	if (client_requested (bits, ITEM_KIND))
+		rb_daap_structure_write (fields, RB_DAAP_CC_MIKD, (gchar) DMAP_ITEM_KIND_AUDIO);
+	if (client_requested (bits, ITEM_ID))
+		rb_daap_structure_write (fields, RB_DAAP_CC_MIID, id);
+	if (client_requested (bits, CONTAINER_ITEM_ID))
+		rb_daap_structure_write (fields, RB_DAAP_CC_MCTI, id);
+
+	rb_daap_structure_write_container (array, RB_DAAP_CC_MLIT, fields->len);
+	g_byte_array_append (array, fields->data, fields->len);
+	g_byte_array_free (fields, TRUE);
+}
+
+static void
+write_next_playlist_chunk (SoupMessage *message,
+			   RBDAAPPlaylistStream *ps)
+{
+	GByteArray *array;
+	guint end;
+	guint length;
+
+	if (ps->next >= ps->ids->len) {
+		soup_message_body_complete (message->response_body);
+		return;
+	}
+
+	end = MIN (ps->next + DAAP_SHARE_STREAM_ITEMS, ps->ids->len);
+	array = g_byte_array_new ();
+	for (; ps->next < end; ps->next++) {
+		write_playlist_item (array, g_array_index (ps->ids, gint32, ps->next), ps->bits);
+	}
+
+	length = array->len;
+	soup_message_body_append (message->response_body,
+				  SOUP_MEMORY_TAKE,
+				  g_byte_array_free (array, FALSE),
+				  length);
+}
+
+static void
+playlist_stream_finished (SoupMessage *message,
+			  RBDAAPPlaylistStream *ps)
+{
+	g_array_free (ps->ids, TRUE);
+	g_free (ps);
+}
+
+static void
+send_playlist_listing (SoupMessage *message,
+		       RBPlaylistID *playlist_id,
+		       bitwise bits)
+{
+	/* APSO playlist songs
+	 * 	MSTT status
+	 * 	MUTY update type
+	 * 	MTCO specified total count
+	 * 	MRCO returned count
+	 * 	MLCL listing
+	 * 		MLIT listing item
+	 * 			MIKD item kind
+	 * 			MIID item id
+	 * 			MCTI container item id
+	 * 		MLIT
+	 * 		...
+	 */
+	RBDAAPPlaylistStream *ps;
+	RhythmDBQueryModel *model;
+	GByteArray *sample;
+	GNode *apso;
+	GNode *mlcl;
+	gchar *header;
+	guint header_length;
+	guint item_length;
+
+	/* take a copy of the entry IDs so the size of the listing can't
+	 * change while it's being sent
+	 */
+	ps = g_new0 (RBDAAPPlaylistStream, 1);
+	ps->bits = bits;
+	ps->ids = g_array_new (FALSE, FALSE, sizeof (gint32));
+	g_object_get (playlist_id->source, "base-query-model", &model, NULL);
+	gtk_tree_model_foreach (GTK_TREE_MODEL (model), (GtkTreeModelForeachFunc) collect_playlist_entry_id, ps->ids);
+	g_object_unref (model);
+
+	sample = g_byte_array_new ();
+	write_playlist_item (sample, 0, bits);
+	item_length = sample->len;
+	g_byte_array_free (sample, TRUE);
+
+	apso = rb_daap_structure_add (NULL, RB_DAAP_CC_APSO);
+	rb_daap_structure_add (apso, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
+	rb_daap_structure_add (apso, RB_DAAP_CC_MUTY, 0);
+	rb_daap_structure_add (apso, RB_DAAP_CC_MTCO, (gint32) ps->ids->len);
+	rb_daap_structure_add (apso, RB_DAAP_CC_MRCO, (gint32) ps->ids->len);
+	mlcl = rb_daap_structure_add (apso, RB_DAAP_CC_MLCL);
+	rb_daap_structure_add_size (mlcl, ps->ids->len * item_length);
+
+	header = rb_daap_structure_serialize (apso, &header_length);
+	rb_daap_structure_destroy (apso);
+
+	message_add_standard_headers (message);
+	soup_message_set_status (message, SOUP_STATUS_OK);
+	soup_message_headers_set_encoding (message->response_headers, SOUP_ENCODING_CHUNKED);
+	soup_message_body_set_accumulate (message->response_body, FALSE);
+	soup_message_body_append (message->response_body, SOUP_MEMORY_TAKE, header, header_length);
+
+	g_signal_connect (message, "wrote_chunk", G_CALLBACK (write_next_playlist_chunk), ps);
+	g_signal_connect (message, "finished", G_CALLBACK (playlist_stream_finished), ps);
+}
+
 static void
 databases_cb (SoupServer        *server,
 	      SoupMessage       *message,
@@ -1323,35 +1803,8 @@ databases_cb (SoupServer        *server,
 		message_set_from_rb_daap_structure (message, avdb);
 		rb_daap_structure_destroy (avdb);
 	} else if (g_ascii_strcasecmp ("/1/items", rest_of_path) == 0) {
-	/* ADBS database songs
-	 * 	MSTT status
-	 * 	MUTY update type
-	 * 	MTCO specified total count
-	 * 	MRCO returned count
-	 * 	MLCL listing
-	 * 		MLIT
-	 * 			attrs
-	 * 		MLIT
-	 * 		...
-	 */
-		GNode *adbs;
-		gint32 num_songs = rhythmdb_entry_count_by_type (share->priv->db, share->priv->entry_type);
-		struct MLCL_Bits mb = {NULL,0};
-
-		mb.bits = parse_meta (query);
-
-		adbs = rb_daap_structure_add (NULL, RB_DAAP_CC_ADBS);
-		rb_daap_structure_add (adbs, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
-		rb_daap_structure_add (adbs, RB_DAAP_CC_MUTY, 0);
-		rb_daap_structure_add (adbs, RB_DAAP_CC_MTCO, (gint32) num_songs);
-		rb_daap_structure_add (adbs, RB_DAAP_CC_MRCO, (gint32) num_songs);
-		mb.mlcl = rb_daap_structure_add (adbs, RB_DAAP_CC_MLCL);
-
-		rhythmdb_entry_foreach_by_type (share->priv->db, share->priv->entry_type, (GFunc) add_entry_to_mlcl, &mb);
-
-		message_set_from_rb_daap_structure (message, adbs);
-		rb_daap_structure_destroy (adbs);
-		adbs = NULL;
+		/* ADBS database songs, from the cached listing */
+		message_set_from_listing (message, share, RB_DAAP_CC_ADBS, query);
 	} else if (g_ascii_strcasecmp ("/1/containers", rest_of_path) == 0) {
 	/* APLY database playlists
 	 * 	MSTT status
@@ -1391,68 +1844,25 @@ databases_cb (SoupServer        *server,
 		rb_daap_structure_destroy (aply);
 
 	} else if (g_ascii_strncasecmp ("/1/containers/", rest_of_path, 14) == 0) {
-	/* APSO playlist songs
-	 * 	MSTT status
-	 * 	MUTY update type
-	 * 	MTCO specified total count
-	 * 	MRCO returned count
-	 * 	MLCL listing
-	 * 		MLIT listing item
-	 * 			MIKD item kind
-	 * 			MIID item id
-	 * 			MCTI container item id
-	 * 		MLIT
-	 * 		...
-	 */
-		GNode *apso;
-		struct MLCL_Bits mb = {NULL,0};
+		/* APSO playlist songs */
 		gint pl_id = atoi (rest_of_path + 14);
-
-		mb.bits = parse_meta (query);
-
-		apso = rb_daap_structure_add (NULL, RB_DAAP_CC_APSO);
-		rb_daap_structure_add (apso, RB_DAAP_CC_MSTT, (gint32) DMAP_STATUS_OK);
-		rb_daap_structure_add (apso, RB_DAAP_CC_MUTY, 0);
+		GList *idl;
 
 		if (pl_id == 1) {
-			gint32 num_songs = (gint32) rhythmdb_entry_count_by_type (share->priv->db, share->priv->entry_type);
-			rb_daap_structure_add (apso, RB_DAAP_CC_MTCO, (gint32) num_songs);
-			rb_daap_structure_add (apso, RB_DAAP_CC_MRCO, (gint32) num_songs);
-			mb.mlcl = rb_daap_structure_add (apso, RB_DAAP_CC_MLCL);
-
-			rhythmdb_entry_foreach_by_type (share->priv->db,
-							share->priv->entry_type,
-							(GFunc) add_entry_to_mlcl,
-							&mb);
-		} else {
-			RBPlaylistID *id;
-			GList *idl;
-			guint num_songs;
-			RhythmDBQueryModel *model;
-
-			idl = g_list_find_custom (share->priv->playlist_ids,
-						  GINT_TO_POINTER (pl_id),
-						  _find_by_id);
-			if (idl == NULL) {
-				soup_message_set_status (message, SOUP_STATUS_NOT_FOUND);
-				return;
-			}
-			id = (RBPlaylistID *)idl->data;
-
-			mb.mlcl = rb_daap_structure_add (apso, RB_DAAP_CC_MLCL);
-
-			g_object_get (id->source, "base-query-model", &model, NULL);
-			num_songs = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
-
-			rb_daap_structure_add (apso, RB_DAAP_CC_MTCO, (gint32) num_songs);
-			rb_daap_structure_add (apso, RB_DAAP_CC_MRCO, (gint32) num_songs);
+			/* the base playlist contains every song */
+			message_set_from_listing (message, share, RB_DAAP_CC_APSO, query);
+			return;
+		}
 
-			gtk_tree_model_foreach (GTK_TREE_MODEL (model), (GtkTreeModelForeachFunc) add_playlist_entry_to_mlcl, &mb);
-			g_object_unref (model);
+		idl = g_list_find_custom (share->priv->playlist_ids,
+					  GINT_TO_POINTER (pl_id),
+					  _find_by_id);
+		if (idl == NULL) {
+			soup_message_set_status (message, SOUP_STATUS_NOT_FOUND);
+			return;
 		}
 
-		message_set_from_rb_daap_structure (message, apso);
-		rb_daap_structure_destroy (apso);
+		send_playlist_listing (message, (RBPlaylistID *)idl->data, parse_meta (query));
 	} else if (g_ascii_strncasecmp ("/1/items/", rest_of_path, 9) == 0) {
 	/* just the file :) */
 		const gchar *id_str;
@@ -1505,39 +1915,158 @@ databases_cb (SoupServer        *server,
 }
 
 static void
-db_entry_added_cb (RhythmDB *db,
-		   RhythmDBEntry *entry,
-		   RBDAAPShare *share)
+share_entry_updated (RBDAAPShare *share,
+		     RhythmDBEntry *entry,
+		     guint revision)
 {
-	/* TODO: update our db version number? */
+	gpointer id;
+	GList *l;
+
+	id = GUINT_TO_POINTER (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID));
+	if (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN)) {
+		g_hash_table_remove (share->priv->item_revisions, id);
+		g_hash_table_insert (share->priv->deleted_items, id, GUINT_TO_POINTER (revision));
+	} else {
+		g_hash_table_remove (share->priv->deleted_items, id);
+		g_hash_table_insert (share->priv->item_revisions, id, GUINT_TO_POINTER (revision));
+	}
+
+	for (l = share->priv->listings; l != NULL; l = l->next) {
+		listing_update_entry (l->data, entry);
+	}
 }
 
 static void
-add_db_entry (RhythmDBEntry *entry,
-	      RBDAAPShare *share)
+share_entry_removed (RBDAAPShare *share,
+		     RhythmDBEntry *entry,
+		     guint revision)
 {
-	db_entry_added_cb (share->priv->db, entry, share);
+	gpointer id;
+	GList *l;
+
+	id = GUINT_TO_POINTER (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID));
+	g_hash_table_remove (share->priv->item_revisions, id);
+	g_hash_table_insert (share->priv->deleted_items, id, GUINT_TO_POINTER (revision));
+
+	for (l = share->priv->listings; l != NULL; l = l->next) {
+		listing_remove_entry (l->data, entry);
+	}
 }
 
 static void
-db_entry_deleted_cb (RhythmDB *db,
-		     RhythmDBEntry *entry,
-		     RBDAAPShare *share)
+share_revision_changed (RBDAAPShare *share)
 {
-	/* TODO: update our db version number? */
+	share->priv->revision_number++;
+	rb_debug ("database revision is now %u", share->priv->revision_number);
+
+	if (g_hash_table_size (share->priv->deleted_items) > DAAP_SHARE_MAX_DELETED_ITEMS) {
+		/* clients with older revisions will get a full listing */
+		g_hash_table_remove_all (share->priv->deleted_items);
+		share->priv->oldest_delta_revision = share->priv->revision_number;
+	}
+
+	complete_update_messages (share);
+}
+
+static gboolean
+entry_changes_affect_listing (GSList *changes)
+{
+	GSList *l;
+
+	for (l = changes; l != NULL; l = l->next) {
+		RhythmDBEntryChange *change = l->data;
+
+		/* the properties used in add_entry_to_mlcl */
+		switch (change->prop) {
+		case RHYTHMDB_PROP_HIDDEN:
+		case RHYTHMDB_PROP_TITLE:
+		case RHYTHMDB_PROP_ALBUM:
+		case RHYTHMDB_PROP_ARTIST:
+		case RHYTHMDB_PROP_GENRE:
+		case RHYTHMDB_PROP_BITRATE:
+		case RHYTHMDB_PROP_FIRST_SEEN:
+		case RHYTHMDB_PROP_MTIME:
+		case RHYTHMDB_PROP_DISC_NUMBER:
+		case RHYTHMDB_PROP_LOCATION:
+		case RHYTHMDB_PROP_FILE_SIZE:
+		case RHYTHMDB_PROP_DURATION:
+		case RHYTHMDB_PROP_TRACK_NUMBER:
+		case RHYTHMDB_PROP_YEAR:
+			return TRUE;
+		default:
+			break;
+		}
+	}
+	return FALSE;
 }
 
 static void
-db_entry_changed_cb (RhythmDB *db,
-		     RhythmDBEntry *entry,
-		     GSList *changes,
+db_entries_added_cb (RhythmDB *db,
+		     GPtrArray *entries,
 		     RBDAAPShare *share)
 {
-	if (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN)) {
-		db_entry_deleted_cb (db, entry, share);
-	} else {
-		db_entry_added_cb (db, entry, share);
+	gboolean changed = FALSE;
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (rhythmdb_entry_get_entry_type (entry) != share->priv->entry_type ||
+		    rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN))
+			continue;
+
+		share_entry_updated (share, entry, share->priv->revision_number + 1);
+		changed = TRUE;
 	}
+
+	if (changed)
+		share_revision_changed (share);
+}
+
+static void
+db_entries_deleted_cb (RhythmDB *db,
+		       GPtrArray *entries,
+		       RBDAAPShare *share)
+{
+	gboolean changed = FALSE;
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (rhythmdb_entry_get_entry_type (entry) != share->priv->entry_type ||
+		    rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN))
+			continue;
+
+		share_entry_removed (share, entry, share->priv->revision_number + 1);
+		changed = TRUE;
+	}
+
+	if (changed)
+		share_revision_changed (share);
+}
+
+static void
+db_entries_changed_cb (RhythmDB *db,
+		       GArray *changes,
+		       RBDAAPShare *share)
+{
+	gboolean changed = FALSE;
+	guint i;
+
+	for (i = 0; i < changes->len; i++) {
+		RhythmDBChangedEntry *c = &g_array_index (changes, RhythmDBChangedEntry, i);
+
+		if (rhythmdb_entry_get_entry_type (c->entry) != share->priv->entry_type ||
+		    entry_changes_affect_listing (c->changes) == FALSE)
+			continue;
+
+		share_entry_updated (share, c->entry, share->priv->revision_number + 1);
+		changed = TRUE;
+	}
+
+	if (changed)
+		share_revision_changed (share);
 }
 
 static gboolean
@@ -1643,20 +2172,22 @@ rb_daap_share_server_start (RBDAAPShare *share)
 
 	share->priv->next_playlist_id = 2;		/* 1 already used */
 
-	rhythmdb_entry_foreach (share->priv->db, (GFunc)add_db_entry, share);
+	share->priv->item_revisions = g_hash_table_new (g_direct_hash, g_direct_equal);
+	share->priv->deleted_items = g_hash_table_new (g_direct_hash, g_direct_equal);
+	share->priv->oldest_delta_revision = share->priv->revision_number;
 
-	share->priv->entry_added_id = g_signal_connect (G_OBJECT (share->priv->db),
-							"entry-added",
-							G_CALLBACK (db_entry_added_cb),
-							share);
-	share->priv->entry_deleted_id = g_signal_connect (G_OBJECT (share->priv->db),
-							  "entry-deleted",
-							  G_CALLBACK (db_entry_deleted_cb),
-							  share);
-	share->priv->entry_changed_id = g_signal_connect (G_OBJECT (share->priv->db),
-							  "entry-changed",
-							  G_CALLBACK (db_entry_changed_cb),
+	share->priv->entries_added_id = g_signal_connect (G_OBJECT (share->priv->db),
+							  "entries-added",
+							  G_CALLBACK (db_entries_added_cb),
 							  share);
+	share->priv->entries_deleted_id = g_signal_connect (G_OBJECT (share->priv->db),
+							    "entries-deleted",
+							    G_CALLBACK (db_entries_deleted_cb),
+							    share);
+	share->priv->entries_changed_id = g_signal_connect (G_OBJECT (share->priv->db),
+							    "entries-changed",
+							    G_CALLBACK (db_entries_changed_cb),
+							    share);
 
 	share->priv->server_active = TRUE;
 
@@ -1668,6 +2199,8 @@ rb_daap_share_server_stop (RBDAAPShare *share)
 {
 	rb_debug ("Stopping music sharing server on port %d", share->priv->port);
 
+	forget_update_messages (share);
+
 	if (share->priv->server) {
 		soup_server_quit (share->priv->server);
 		g_object_unref (share->priv->server);
@@ -1679,19 +2212,29 @@ rb_daap_share_server_stop (RBDAAPShare *share)
 		share->priv->session_ids = NULL;
 	}
 
-	if (share->priv->entry_added_id != 0) {
-		g_signal_handler_disconnect (share->priv->db, share->priv->entry_added_id);
-		share->priv->entry_added_id = 0;
+	if (share->priv->entries_added_id != 0) {
+		g_signal_handler_disconnect (share->priv->db, share->priv->entries_added_id);
+		share->priv->entries_added_id = 0;
+	}
+
+	if (share->priv->entries_deleted_id != 0) {
+		g_signal_handler_disconnect (share->priv->db, share->priv->entries_deleted_id);
+		share->priv->entries_deleted_id = 0;
 	}
 
-	if (share->priv->entry_deleted_id != 0) {
-		g_signal_handler_disconnect (share->priv->db, share->priv->entry_deleted_id);
-		share->priv->entry_deleted_id = 0;
+	if (share->priv->entries_changed_id != 0) {
+		g_signal_handler_disconnect (share->priv->db, share->priv->entries_changed_id);
+		share->priv->entries_changed_id = 0;
 	}
 
-	if (share->priv->entry_changed_id != 0) {
-		g_signal_handler_disconnect (share->priv->db, share->priv->entry_changed_id);
-		share->priv->entry_changed_id = 0;
+	forget_listings (share);
+	if (share->priv->item_revisions) {
+		g_hash_table_destroy (share->priv->item_revisions);
+		share->priv->item_revisions = NULL;
+	}
+	if (share->priv->deleted_items) {
+		g_hash_table_destroy (share->priv->deleted_items);
+		share->priv->deleted_items = NULL;
 	}
 
 	share->priv->server_active = FALSE;
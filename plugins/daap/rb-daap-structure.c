@@ -175,20 +175,15 @@ rb_daap_content_code_gtype (RBDAAPContentCode code)
 	}
 }
 
-GNode *
-rb_daap_structure_add (GNode *parent,
-		       RBDAAPContentCode cc,
-		       ...)
+static RBDAAPItem *
+rb_daap_item_new_valist (RBDAAPContentCode cc,
+			 va_list list)
 {
 	RBDAAPType rb_daap_type;
 	GType gtype;
 	RBDAAPItem *item;
-	va_list list;
-	GNode *node;
 	gchar *error = NULL;
 
-	va_start (list, cc);
-
 	rb_daap_type = rb_daap_content_code_rb_daap_type (cc);
 	gtype = rb_daap_content_code_gtype (cc);
 
@@ -238,6 +233,22 @@ rb_daap_structure_add (GNode *parent,
 			break;
 	}
 
+	return item;
+}
+
+GNode *
+rb_daap_structure_add (GNode *parent,
+		       RBDAAPContentCode cc,
+		       ...)
+{
+	RBDAAPItem *item;
+	va_list list;
+	GNode *node;
+
+	va_start (list, cc);
+	item = rb_daap_item_new_valist (cc, list);
+	va_end (list);
+
 	node = g_node_new (item);
 
 	if (parent) {
@@ -255,6 +266,21 @@ rb_daap_structure_add (GNode *parent,
 	return node;
 }
 
+/* accounts for data that will be appended to the serialized form of a
+ * container after it has been built, such as a cached listing.
+ */
+void
+rb_daap_structure_add_size (GNode *structure,
+			    guint size)
+{
+	while (structure) {
+		RBDAAPItem *item = structure->data;
+
+		item->size += size;
+		structure = structure->parent;
+	}
+}
+
 static gboolean
 rb_daap_structure_node_serialize (GNode *node,
 				  GByteArray *array)
@@ -334,6 +360,41 @@ rb_daap_structure_node_serialize (GNode *node,
 	return FALSE;
 }
 
+/* writes a single non-container item straight into a buffer, for
+ * responses that are written out in pieces rather than as a tree.
+ */
+void
+rb_daap_structure_write (GByteArray *array,
+			 RBDAAPContentCode cc,
+			 ...)
+{
+	RBDAAPItem *item;
+	va_list list;
+	GNode *node;
+
+	va_start (list, cc);
+	item = rb_daap_item_new_valist (cc, list);
+	va_end (list);
+
+	node = g_node_new (item);
+	rb_daap_structure_node_serialize (node, array);
+	rb_daap_structure_destroy (node);
+}
+
+/* writes a container header; the caller must write exactly @size bytes
+ * of content after it.
+ */
+void
+rb_daap_structure_write_container (GByteArray *array,
+				   RBDAAPContentCode cc,
+				   guint size)
+{
+	guint32 s = GUINT32_TO_BE (size);
+
+	g_byte_array_append (array, (const guint8 *)rb_daap_content_code_string (cc), 4);
+	g_byte_array_append (array, (const guint8 *)&s, 4);
+}
+
 gchar *
 rb_daap_structure_serialize (GNode *structure,
 			     guint *length)
@@ -605,6 +666,189 @@ rb_daap_structure_parse (const gchar *buf,
 	return child;
 }
 
+/* Incremental parser for responses that arrive in pieces.  The items
+ * inside the listing container are parsed one at a time and passed to
+ * the item function as soon as all of their data has arrived, then
+ * freed; everything else in the response is kept in a structure that
+ * looks like what rb_daap_structure_parse would return for the whole
+ * response, minus the listing items.  Only the item currently being
+ * received is ever buffered.
+ */
+
+typedef struct {
+	GNode *node;
+	guint64 end;
+} RBDAAPOpenContainer;
+
+struct _RBDAAPStructureParser {
+	RBDAAPContentCode listing_code;
+	RBDAAPStructureItemFunc func;
+	gpointer data;
+
+	GByteArray *buffer;
+	guint64 offset;		/* stream offset of the start of the buffer */
+	GNode *structure;
+	GSList *containers;	/* open containers, innermost first */
+	gboolean error;
+};
+
+RBDAAPStructureParser *
+rb_daap_structure_parser_new (RBDAAPContentCode listing_code,
+			      RBDAAPStructureItemFunc func,
+			      gpointer data)
+{
+	RBDAAPStructureParser *parser;
+
+	parser = g_new0 (RBDAAPStructureParser, 1);
+	parser->listing_code = listing_code;
+	parser->func = func;
+	parser->data = data;
+	parser->buffer = g_byte_array_new ();
+	return parser;
+}
+
+static void
+rb_daap_structure_parser_close_containers (RBDAAPStructureParser *parser,
+					   guint64 offset)
+{
+	while (parser->containers != NULL) {
+		RBDAAPOpenContainer *container = parser->containers->data;
+
+		if (offset < container->end)
+			break;
+		if (offset > container->end) {
+			rb_debug ("item overruns the end of its container");
+			parser->error = TRUE;
+		}
+
+		parser->containers = g_slist_delete_link (parser->containers, parser->containers);
+		g_free (container);
+	}
+}
+
+gboolean
+rb_daap_structure_parser_feed (RBDAAPStructureParser *parser,
+			       const gchar *buf,
+			       gsize length)
+{
+	guint pos = 0;
+
+	if (parser->error)
+		return FALSE;
+
+	g_byte_array_append (parser->buffer, (const guint8 *)buf, length);
+
+	while (parser->error == FALSE) {
+		const guchar *p;
+		RBDAAPContentCode cc;
+		RBDAAPOpenContainer *container;
+		GNode *parent;
+		gint32 codesize;
+
+		rb_daap_structure_parser_close_containers (parser, parser->offset + pos);
+
+		if (parser->buffer->len - pos < 8)
+			break;
+
+		if (parser->structure != NULL && parser->containers == NULL) {
+			rb_debug ("ignoring data after the end of the response");
+			pos = parser->buffer->len;
+			break;
+		}
+
+		p = parser->buffer->data + pos;
+		cc = rb_daap_buffer_read_content_code ((const gchar *)p);
+		codesize = rb_daap_buffer_read_int32 (p + 4);
+		if (codesize < 0) {
+			rb_debug ("invalid codesize %d", codesize);
+			parser->error = TRUE;
+			break;
+		}
+
+		container = parser->containers ? parser->containers->data : NULL;
+		parent = container ? container->node : NULL;
+
+		/* descend into the response itself and the listing container */
+		if (cc != RB_DAAP_CC_INVALID &&
+		    rb_daap_content_code_rb_daap_type (cc) == RB_DAAP_TYPE_CONTAINER &&
+		    (parser->structure == NULL || cc == parser->listing_code)) {
+			GNode *node;
+
+			node = rb_daap_structure_add (parent, cc);
+			if (parser->structure == NULL)
+				parser->structure = node;
+
+			container = g_new0 (RBDAAPOpenContainer, 1);
+			container->node = node;
+			container->end = parser->offset + pos + 8 + codesize;
+			parser->containers = g_slist_prepend (parser->containers, container);
+
+			pos += 8;
+			continue;
+		}
+
+		if (parser->buffer->len - pos < 8 + (guint) codesize)
+			break;
+
+		if (cc == RB_DAAP_CC_INVALID) {
+			/* skip unknown items */
+		} else if (parent == NULL) {
+			/* the whole response is a single non-container item */
+			parser->structure = g_node_new (NULL);
+			rb_daap_structure_parse_container_buffer (parser->structure, p, 8 + codesize);
+			parent = parser->structure;
+			parser->structure = parent->children;
+			if (parser->structure != NULL)
+				g_node_unlink (parser->structure);
+			g_node_destroy (parent);
+		} else if (((RBDAAPItem *)parent->data)->content_code == parser->listing_code) {
+			GNode *root;
+			GNode *item;
+
+			root = g_node_new (NULL);
+			rb_daap_structure_parse_container_buffer (root, p, 8 + codesize);
+			item = root->children;
+			if (item != NULL) {
+				g_node_unlink (item);
+				(*parser->func) (parser->structure, item, parser->data);
+				rb_daap_structure_destroy (item);
+			}
+			g_node_destroy (root);
+		} else {
+			rb_daap_structure_parse_container_buffer (parent, p, 8 + codesize);
+		}
+
+		pos += 8 + codesize;
+	}
+
+	g_byte_array_remove_range (parser->buffer, 0, pos);
+	parser->offset += pos;
+
+	return (parser->error == FALSE);
+}
+
+GNode *
+rb_daap_structure_parser_finish (RBDAAPStructureParser *parser)
+{
+	GNode *structure;
+
+	rb_daap_structure_parser_close_containers (parser, parser->offset);
+
+	structure = parser->structure;
+	if (parser->error || parser->buffer->len != 0 || parser->containers != NULL) {
+		rb_debug ("incomplete or malformed response (%u bytes left over)", parser->buffer->len);
+		rb_daap_structure_destroy (structure);
+		structure = NULL;
+	}
+
+	g_slist_foreach (parser->containers, (GFunc) g_free, NULL);
+	g_slist_free (parser->containers);
+	g_byte_array_free (parser->buffer, TRUE);
+	g_free (parser);
+
+	return structure;
+}
+
 struct NodeFinder {
 	RBDAAPContentCode code;
 	GNode *node;
@@ -138,6 +138,10 @@ rb_daap_structure_add (GNode *parent,
 		       RBDAAPContentCode cc,
 		       ...);
 
+void
+rb_daap_structure_add_size (GNode *structure,
+			    guint size);
+
 gchar *
 rb_daap_structure_serialize (GNode *structure,
 			     guint *length);
@@ -146,6 +150,35 @@ GNode *
 rb_daap_structure_parse (const gchar *buf,
 			 gint buf_length);
 
+void
+rb_daap_structure_write (GByteArray *array,
+			 RBDAAPContentCode cc,
+			 ...);
+
+void
+rb_daap_structure_write_container (GByteArray *array,
+				   RBDAAPContentCode cc,
+				   guint size);
+
+typedef struct _RBDAAPStructureParser RBDAAPStructureParser;
+
+typedef void (*RBDAAPStructureItemFunc) (GNode *structure,
+					 GNode *item,
+					 gpointer data);
+
+RBDAAPStructureParser *
+rb_daap_structure_parser_new (RBDAAPContentCode listing_code,
+			      RBDAAPStructureItemFunc func,
+			      gpointer data);
+
+gboolean
+rb_daap_structure_parser_feed (RBDAAPStructureParser *parser,
+			       const gchar *buf,
+			       gsize length);
+
+GNode *
+rb_daap_structure_parser_finish (RBDAAPStructureParser *parser);
+
 RBDAAPItem *
 rb_daap_structure_find_item (GNode *structure,
 			     RBDAAPContentCode code);
@@ -69,8 +69,10 @@ static char *impl_get_browser_key (RBSource *source);
 static char *impl_get_paned_key (RBBrowserSource *source);
 
 static gboolean impl_show_popup (RBSource *source);
+static void impl_get_status (RBSource *source, char **text, char **progress_text, float *progress);
 static void impl_move_to_trash (RBSource *asource);
 static void rb_ipod_load_songs (RBiPodSource *source);
+static void rb_ipod_load_cancel (RBiPodSource *source);
 static void impl_delete_thyself (RBSource *source);
 static GList* impl_get_ui_actions (RBSource *source);
 
@@ -140,6 +142,29 @@ struct _PlayedEntry {
 
 typedef struct _PlayedEntry PlayedEntry;
 
+/* the loading thread hands tracks over to the main thread in batches,
+ * each committed to the database in one go.
+ */
+#define LOAD_BATCH_SIZE		250
+#define LOAD_BATCH_INTERVAL	100
+
+typedef struct
+{
+	GPtrArray *entries;
+	GPtrArray *tracks;
+} RBiPodLoadBatch;
+
+typedef struct
+{
+	RhythmDB *db;
+	RhythmDBEntryType entry_type;
+	char *mount_path;
+	GList *tracks;
+	guint total;
+	GAsyncQueue *batches;
+	volatile gint cancel;
+} RBiPodLoadData;
+
 typedef struct
 {
 	RbIpodDb *ipod_db;
@@ -151,6 +176,9 @@ typedef struct
 	RBIpodStaticPlaylistSource *podcast_pl;
 
 	guint load_idle_id;
+	GThread *load_thread;
+	RBiPodLoadData *load_data;
+	guint load_count;
 
 	GHashTable *artwork_request_map;
 	guint artwork_notify_id;
@@ -198,6 +226,7 @@ rb_ipod_source_class_init (RBiPodSourceClass *klass)
 	source_class->impl_can_browse = (RBSourceFeatureFunc) rb_true_function;
 	source_class->impl_get_browser_key  = impl_get_browser_key;
 	source_class->impl_show_popup = impl_show_popup;
+	source_class->impl_get_status = impl_get_status;
 	source_class->impl_delete_thyself = impl_delete_thyself;
 	source_class->impl_can_move_to_trash = (RBSourceFeatureFunc) rb_true_function;
 	source_class->impl_move_to_trash = impl_move_to_trash;
@@ -363,6 +392,9 @@ static void
 rb_ipod_source_dispose (GObject *object)
 {
 	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (object);
+
+	/* the loading thread uses the tracks in the iPod database */
+	rb_ipod_load_cancel (RB_IPOD_SOURCE (object));
 	
 	if (priv->ipod_db) {
 		g_object_unref (G_OBJECT (priv->ipod_db));
@@ -374,11 +406,6 @@ rb_ipod_source_dispose (GObject *object)
 		priv->entry_map = NULL;
  	}
 
-	if (priv->load_idle_id != 0) {
-		g_source_remove (priv->load_idle_id);
-		priv->load_idle_id = 0;
-	}
-
 	if (priv->artwork_request_map) {
 		g_hash_table_destroy (priv->artwork_request_map);
 		priv->artwork_request_map = NULL;
@@ -676,28 +703,27 @@ static void add_offline_played_entry (RBiPodSource *source,
 	g_queue_push_tail (priv->offline_plays, played_entry);
 }
 
-static void
-add_ipod_song_to_db (RBiPodSource *source, RhythmDB *db, Itdb_Track *song)
+/* Creates the database entry for an iPod track without committing it.  This
+ * only touches the database, so it can be called from the loading thread.
+ */
+static RhythmDBEntry *
+create_entry_for_ipod_song (RhythmDB *db,
+			    RhythmDBEntryType entry_type,
+			    const char *mount_path,
+			    Itdb_Track *song)
 {
 	RhythmDBEntry *entry;
-	RhythmDBEntryType entry_type;
-	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
 	char *pc_path;
-	const char *mount_path;
 
 	/* Set URI */
-	g_object_get (source, "entry-type", &entry_type,
-		      NULL);
-	mount_path = rb_ipod_db_get_mount_path (priv->ipod_db);
 	pc_path = ipod_path_to_uri (mount_path, song->ipod_path);
 	entry = rhythmdb_entry_new (RHYTHMDB (db), entry_type,
 				    pc_path);
-	g_boxed_free (RHYTHMDB_TYPE_ENTRY_TYPE, entry_type);
 
 	if (entry == NULL) {
 		rb_debug ("cannot create entry %s", pc_path);
 		g_free (pc_path);
-		return;
+		return NULL;
 	}
 
 	rb_debug ("Adding %s from iPod", pc_path);
@@ -850,13 +876,40 @@ add_ipod_song_to_db (RBiPodSource *source, RhythmDB *db, Itdb_Track *song)
 	entry_set_string_prop (RHYTHMDB (db), entry,
 			       RHYTHMDB_PROP_GENRE, song->genre);
 
+	return entry;
+}
+
+static void
+add_ipod_song_entry (RBiPodSource *source, RhythmDBEntry *entry, Itdb_Track *song)
+{
+	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+
 	g_hash_table_insert (priv->entry_map, entry, song);
 
 	if (song->recent_playcount != 0) {
 		add_offline_played_entry (source, entry,
 					  song->recent_playcount);
 	}
+}
+
+static void
+add_ipod_song_to_db (RBiPodSource *source, RhythmDB *db, Itdb_Track *song)
+{
+	RhythmDBEntry *entry;
+	RhythmDBEntryType entry_type;
+	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+
+	g_object_get (source, "entry-type", &entry_type,
+		      NULL);
+	entry = create_entry_for_ipod_song (db, entry_type,
+					    rb_ipod_db_get_mount_path (priv->ipod_db),
+					    song);
+	g_boxed_free (RHYTHMDB_TYPE_ENTRY_TYPE, entry_type);
 
+	if (entry == NULL)
+		return;
+
+	add_ipod_song_entry (source, entry, song);
 	rhythmdb_commit (RHYTHMDB (db));
 }
 
@@ -1054,24 +1107,126 @@ rb_ipod_source_entry_changed_cb (RhythmDB *db,
 	}
 }
 
+static void
+rb_ipod_load_batch_free (RBiPodLoadBatch *batch)
+{
+	if (batch->entries != NULL)
+		g_ptr_array_free (batch->entries, TRUE);
+	if (batch->tracks != NULL)
+		g_ptr_array_free (batch->tracks, TRUE);
+	g_free (batch);
+}
+
+static void
+rb_ipod_load_data_free (RBiPodLoadData *data)
+{
+	RBiPodLoadBatch *batch;
+
+	while ((batch = g_async_queue_try_pop (data->batches)) != NULL)
+		rb_ipod_load_batch_free (batch);
+	g_async_queue_unref (data->batches);
+
+	g_list_free (data->tracks);
+	g_free (data->mount_path);
+	g_boxed_free (RHYTHMDB_TYPE_ENTRY_TYPE, data->entry_type);
+	g_object_unref (data->db);
+	g_free (data);
+}
+
+static gpointer
+load_ipod_db_thread (RBiPodLoadData *data)
+{
+	RBiPodLoadBatch *batch = NULL;
+	GList *it;
+
+	for (it = data->tracks; it != NULL; it = it->next) {
+		Itdb_Track *song = (Itdb_Track *)it->data;
+		RhythmDBEntry *entry;
+
+		if (g_atomic_int_get (&data->cancel))
+			break;
+
+		entry = create_entry_for_ipod_song (data->db,
+						    data->entry_type,
+						    data->mount_path,
+						    song);
+		if (entry == NULL)
+			continue;
+
+		if (batch == NULL) {
+			batch = g_new0 (RBiPodLoadBatch, 1);
+			batch->entries = g_ptr_array_sized_new (LOAD_BATCH_SIZE);
+			batch->tracks = g_ptr_array_sized_new (LOAD_BATCH_SIZE);
+		}
+		g_ptr_array_add (batch->entries, entry);
+		g_ptr_array_add (batch->tracks, song);
+
+		if (batch->entries->len == LOAD_BATCH_SIZE) {
+			rhythmdb_commit (data->db);
+			g_async_queue_push (data->batches, batch);
+			batch = NULL;
+		}
+	}
+
+	if (batch != NULL) {
+		rhythmdb_commit (data->db);
+		g_async_queue_push (data->batches, batch);
+	}
+
+	/* an empty batch tells the main thread we're done */
+	batch = g_new0 (RBiPodLoadBatch, 1);
+	g_async_queue_push (data->batches, batch);
+
+	return NULL;
+}
+
 static gboolean
-load_ipod_db_idle_cb (RBiPodSource *source)
+load_ipod_db_batches_cb (RBiPodSource *source)
 {
-	RhythmDB *db;
- 	GList *it;
 	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+	RBiPodLoadBatch *batch;
+	gboolean finished = FALSE;
+	gboolean progress = FALSE;
+	RhythmDB *db;
+	guint i;
 
 	GDK_THREADS_ENTER ();
 
-	db = get_db_for_source (source);
+	while ((batch = g_async_queue_try_pop (priv->load_data->batches)) != NULL) {
+		if (batch->entries == NULL) {
+			rb_ipod_load_batch_free (batch);
+			finished = TRUE;
+			break;
+		}
 
-	g_assert (db != NULL);
- 	for (it = rb_ipod_db_get_tracks (priv->ipod_db);
-	     it != NULL;
-	     it = it->next) {
-		add_ipod_song_to_db (source, db, (Itdb_Track *)it->data);
+		for (i = 0; i < batch->entries->len; i++) {
+			add_ipod_song_entry (source,
+					     g_ptr_array_index (batch->entries, i),
+					     g_ptr_array_index (batch->tracks, i));
+		}
+		priv->load_count += batch->entries->len;
+		rb_ipod_load_batch_free (batch);
+		progress = TRUE;
 	}
 
+	if (finished == FALSE) {
+		if (progress)
+			rb_source_notify_status_changed (RB_SOURCE (source));
+		GDK_THREADS_LEAVE ();
+		return TRUE;
+	}
+
+	rb_debug ("finished loading %u tracks from iPod", priv->load_count);
+	g_thread_join (priv->load_thread);
+	priv->load_thread = NULL;
+	db = g_object_ref (priv->load_data->db);
+	rb_ipod_load_data_free (priv->load_data);
+	priv->load_data = NULL;
+	priv->load_idle_id = 0;
+
+	/* playlists refer to tracks through the entry map, so they can
+	 * only be created once all tracks are in the database.
+	 */
 	load_ipod_playlists (source);
 	send_offline_plays_notification (source);
 
@@ -1081,11 +1236,70 @@ load_ipod_db_idle_cb (RBiPodSource *source)
 
 	g_object_unref (db);
 
+	rb_source_notify_status_changed (RB_SOURCE (source));
+
 	GDK_THREADS_LEAVE ();
-	priv->load_idle_id = 0;
 	return FALSE;
 }
 
+static void
+rb_ipod_load_cancel (RBiPodSource *source)
+{
+	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+
+	if (priv->load_idle_id != 0) {
+		g_source_remove (priv->load_idle_id);
+		priv->load_idle_id = 0;
+	}
+
+	if (priv->load_thread != NULL) {
+		g_atomic_int_set (&priv->load_data->cancel, TRUE);
+		g_thread_join (priv->load_thread);
+		priv->load_thread = NULL;
+	}
+
+	if (priv->load_data != NULL) {
+		rb_ipod_load_data_free (priv->load_data);
+		priv->load_data = NULL;
+	}
+}
+
+static void
+rb_ipod_load_start (RBiPodSource *source)
+{
+	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+	RBiPodLoadData *data;
+	GError *error = NULL;
+
+	data = g_new0 (RBiPodLoadData, 1);
+	data->db = get_db_for_source (source);
+	g_object_get (source, "entry-type", &data->entry_type, NULL);
+	data->mount_path = g_strdup (rb_ipod_db_get_mount_path (priv->ipod_db));
+	/* take a copy of the track list so tracks added while we're loading
+	 * don't affect the loading thread.
+	 */
+	data->tracks = g_list_copy (rb_ipod_db_get_tracks (priv->ipod_db));
+	data->total = g_list_length (data->tracks);
+	data->batches = g_async_queue_new ();
+
+	priv->load_data = data;
+	priv->load_count = 0;
+	priv->load_thread = g_thread_create ((GThreadFunc) load_ipod_db_thread,
+					     data, TRUE, &error);
+	if (priv->load_thread == NULL) {
+		g_warning ("Unable to create iPod loading thread: %s", error->message);
+		g_error_free (error);
+		rb_ipod_load_data_free (data);
+		priv->load_data = NULL;
+		return;
+	}
+
+	priv->load_idle_id = g_timeout_add (LOAD_BATCH_INTERVAL,
+					    (GSourceFunc) load_ipod_db_batches_cb,
+					    source);
+	rb_source_notify_status_changed (RB_SOURCE (source));
+}
+
 static void
 rb_ipod_load_songs (RBiPodSource *source)
 {
@@ -1107,7 +1321,7 @@ rb_ipod_load_songs (RBiPodSource *source)
                 g_signal_connect (G_OBJECT (source), "notify::name",
 		  	          (GCallback)rb_ipod_source_name_changed_cb,
                                   NULL);
-		priv->load_idle_id = g_idle_add ((GSourceFunc)load_ipod_db_idle_cb, source);
+		rb_ipod_load_start (source);
 	}
 	g_object_unref (mount);
 }
@@ -1135,6 +1349,22 @@ impl_get_paned_key (RBBrowserSource *source)
 	return g_strdup (CONF_STATE_PANED_POSITION);
 }
 
+static void
+impl_get_status (RBSource *source, char **text, char **progress_text, float *progress)
+{
+	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
+
+	RB_SOURCE_CLASS (rb_ipod_source_parent_class)->impl_get_status (source, text, progress_text, progress);
+
+	if (priv->load_data != NULL && priv->load_data->total > 0) {
+		g_free (*progress_text);
+		*progress_text = g_strdup_printf (_("Loading tracks (%u/%u)"),
+						  priv->load_count,
+						  priv->load_data->total);
+		*progress = ((float)priv->load_count / (float)priv->load_data->total);
+	}
+}
+
 static gboolean
 impl_show_popup (RBSource *source)
 {
@@ -2446,14 +2676,14 @@ static GHashTable *
 impl_get_podcasts	(RBMediaPlayerSource *source)
 {
 	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
-	GHashTable *result = g_hash_table_new (g_str_hash, g_str_equal);
+	GHashTable *result = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	GHashTableIter iter;
 	gpointer key, value;
 	
 	g_hash_table_iter_init (&iter, priv->entry_map);
 	while (g_hash_table_iter_next (&iter, &key, &value)) {
 		if (((Itdb_Track *)value)->mediatype == MEDIATYPE_PODCAST)
-			g_hash_table_insert (result, rb_media_player_source_track_uuid (key), key);
+			g_hash_table_insert (result, rb_media_player_source_get_track_uuid (source, key), key);
 	}
 	
 	return result;
@@ -2467,14 +2697,14 @@ static GHashTable *
 impl_get_entries	(RBMediaPlayerSource *source)
 {
 	RBiPodSourcePrivate *priv = IPOD_SOURCE_GET_PRIVATE (source);
-	GHashTable *result = g_hash_table_new (g_str_hash, g_str_equal);
+	GHashTable *result = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	GHashTableIter iter;
 	gpointer key, value;
 	
 	g_hash_table_iter_init (&iter, priv->entry_map);
 	while (g_hash_table_iter_next (&iter, &key, &value)) {
 		if (((Itdb_Track *)value)->mediatype == MEDIATYPE_AUDIO)
-			g_hash_table_insert (result, rb_media_player_source_track_uuid (key), key);
+			g_hash_table_insert (result, rb_media_player_source_get_track_uuid (source, key), key);
 	}
 	
 	return result;
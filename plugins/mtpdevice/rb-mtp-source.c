@@ -1164,7 +1164,7 @@ static GHashTable *
 impl_get_entries	(RBMediaPlayerSource *source)
 {
 	RBMtpSourcePrivate *priv = MTP_SOURCE_GET_PRIVATE (source);
-	GHashTable *result = g_hash_table_new (g_str_hash, g_str_equal);
+	GHashTable *result = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	GHashTableIter iter;
 	gpointer key, value;
 	
@@ -1175,7 +1175,7 @@ impl_get_entries	(RBMediaPlayerSource *source)
 		 * Podcasts it is the best we can do for now
 		 */
 		if (strcmp (((LIBMTP_track_t *)value)->genre, "Podcast") != 0)
-			g_hash_table_insert (result, rb_media_player_source_track_uuid (key), key);
+			g_hash_table_insert (result, rb_media_player_source_get_track_uuid (source, key), key);
 	}
 	
 	return result;
@@ -1185,7 +1185,7 @@ static GHashTable *
 impl_get_podcasts	(RBMediaPlayerSource *source)
 {
 	RBMtpSourcePrivate *priv = MTP_SOURCE_GET_PRIVATE (source);
-	GHashTable *result = g_hash_table_new (g_str_hash, g_str_equal);
+	GHashTable *result = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 	GHashTableIter iter;
 	gpointer key, value;
 	
@@ -1196,7 +1196,7 @@ impl_get_podcasts	(RBMediaPlayerSource *source)
 		 * Podcasts it is the best we can do for now
 		 */
 		if (strcmp (((LIBMTP_track_t *)value)->genre, "Podcast") == 0)
-			g_hash_table_insert (result, rb_media_player_source_track_uuid (key), key);
+			g_hash_table_insert (result, rb_media_player_source_get_track_uuid (source, key), key);
 	}
 	
 	return result;
@@ -30,13 +30,34 @@
 #include <config.h>
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <string.h>
 #include "rb-util.h"
 #include "rb-cut-and-paste-code.h"
 #include "rb-refstring.h"
+#include "rb-debug.h"
 
-GHashTable *rb_refstrings;
-GMutex *rb_refstrings_mutex;
+/*
+ * The intern table is split into shards, each with its own lock, selected
+ * by the hash of the string.  This keeps the metadata, stat and query
+ * threads from serialising on a single mutex while a library is being
+ * imported.  Each shard counts how often its lock was taken and how often
+ * it had to wait for it; see rb_refstring_get_lock_stats.
+ */
+#define RB_REFSTRING_SHARD_BITS	4
+#define RB_REFSTRING_SHARDS	(1 << RB_REFSTRING_SHARD_BITS)
+
+typedef struct
+{
+	GMutex *mutex;
+	GHashTable *table;
+	guint locks;
+	guint contended;
+} RBRefStringShard;
+
+static RBRefStringShard rb_refstring_shards[RB_REFSTRING_SHARDS];
+
+#define PRECOMPUTE_CANCEL_CHECK_INTERVAL	1000
 
 struct RBRefString
 {
@@ -57,27 +78,75 @@ rb_refstring_free (RBRefString *refstr)
 	g_free (refstr);
 }
 
+static RBRefStringShard *
+rb_refstring_lock_shard (const char *str)
+{
+	RBRefStringShard *shard;
+	guint hash;
+
+	/* the low bits are used by the shard's hash table, so use the high ones */
+	hash = g_str_hash (str);
+	shard = &rb_refstring_shards[hash >> (32 - RB_REFSTRING_SHARD_BITS)];
+
+	if (g_mutex_trylock (shard->mutex) == FALSE) {
+		g_mutex_lock (shard->mutex);
+		shard->contended++;
+	}
+	shard->locks++;
+	return shard;
+}
+
 void
 rb_refstring_system_init ()
 {
-	rb_refstrings_mutex = g_mutex_new ();
+	int i;
+
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		rb_refstring_shards[i].mutex = g_mutex_new ();
+		rb_refstring_shards[i].table = g_hash_table_new_full (g_str_hash, g_str_equal,
+								      NULL, (GDestroyNotify) rb_refstring_free);
+		rb_refstring_shards[i].locks = 0;
+		rb_refstring_shards[i].contended = 0;
+	}
+}
 
-	rb_refstrings = g_hash_table_new_full (g_str_hash, g_str_equal,
-					       NULL, (GDestroyNotify) rb_refstring_free);
+/*
+ * Takes a reference to a string found in the intern table, unless its
+ * refcount has already dropped to 0.  In that case another thread is
+ * about to free it, so it must be treated as if it wasn't there.
+ */
+static gboolean
+rb_refstring_try_ref (RBRefString *val)
+{
+	gint refcount;
+
+	do {
+		refcount = g_atomic_int_get (&val->refcount);
+		if (refcount == 0)
+			return FALSE;
+	} while (!g_atomic_int_compare_and_exchange (&val->refcount, refcount, refcount + 1));
+
+	return TRUE;
 }
 
 RBRefString *
 rb_refstring_new (const char *init)
 {
+	RBRefStringShard *shard;
 	RBRefString *ret;
 
-	g_mutex_lock (rb_refstrings_mutex);
-	ret = g_hash_table_lookup (rb_refstrings, init);
+	shard = rb_refstring_lock_shard (init);
+	ret = g_hash_table_lookup (shard->table, init);
 
 	if (ret) {
-		rb_refstring_ref (ret);
-		g_mutex_unlock (rb_refstrings_mutex);
-		return ret;
+		if (rb_refstring_try_ref (ret)) {
+			g_mutex_unlock (shard->mutex);
+			return ret;
+		}
+
+		/* the dying string is freed by the thread that dropped
+		 * the last reference, once it finds it's been replaced */
+		g_hash_table_steal (shard->table, init);
 	}
 
 	ret = g_malloc (sizeof (RBRefString) + strlen (init));
@@ -87,23 +156,24 @@ rb_refstring_new (const char *init)
 	ret->folded = NULL;
 	ret->sortkey = NULL;
 
-	g_hash_table_insert (rb_refstrings, ret->value, ret);
-	g_mutex_unlock (rb_refstrings_mutex);
+	g_hash_table_insert (shard->table, ret->value, ret);
+	g_mutex_unlock (shard->mutex);
 	return ret;
 }
 
 RBRefString *
 rb_refstring_find (const char *init)
 {
+	RBRefStringShard *shard;
 	RBRefString *ret;
 
-	g_mutex_lock (rb_refstrings_mutex);
-	ret = g_hash_table_lookup (rb_refstrings, init);
+	shard = rb_refstring_lock_shard (init);
+	ret = g_hash_table_lookup (shard->table, init);
 
-	if (ret)
-		rb_refstring_ref (ret);
+	if (ret != NULL && rb_refstring_try_ref (ret) == FALSE)
+		ret = NULL;
 
-	g_mutex_unlock (rb_refstrings_mutex);
+	g_mutex_unlock (shard->mutex);
 	return ret;
 }
 
@@ -116,20 +186,65 @@ rb_refstring_unref (RBRefString *val)
 	g_return_if_fail (val->refcount > 0);
 
 	if (g_atomic_int_dec_and_test (&val->refcount)) {
-		g_mutex_lock (rb_refstrings_mutex);
-		/* ensure it's still not referenced, as something may have called
-		 * rb_refstring_new since we decremented the count */
-		if (g_atomic_int_get (&val->refcount) == 0)
-			g_hash_table_remove (rb_refstrings, val->value);
-		g_mutex_unlock (rb_refstrings_mutex);
+		RBRefStringShard *shard;
+
+		/* nothing can take a new reference once the count is 0, but
+		 * rb_refstring_new may have replaced it in the table already */
+		shard = rb_refstring_lock_shard (val->value);
+		if (g_hash_table_lookup (shard->table, val->value) == val)
+			g_hash_table_steal (shard->table, val->value);
+		g_mutex_unlock (shard->mutex);
+
+		rb_refstring_free (val);
 	}
 }
 
+/**
+ * rb_refstring_get_lock_stats:
+ * @locks: returns the number of times an intern table lock was taken
+ * @contended: returns the number of times a thread had to wait for one
+ *
+ * Returns lock usage counters for the refstring intern table, summed
+ * across all shards.  Either argument may be NULL.
+ */
+void
+rb_refstring_get_lock_stats (guint *locks, guint *contended)
+{
+	guint total_locks = 0;
+	guint total_contended = 0;
+	int i;
+
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		RBRefStringShard *shard = &rb_refstring_shards[i];
+
+		g_mutex_lock (shard->mutex);
+		total_locks += shard->locks;
+		total_contended += shard->contended;
+		g_mutex_unlock (shard->mutex);
+	}
+
+	if (locks)
+		*locks = total_locks;
+	if (contended)
+		*contended = total_contended;
+}
+
 void
 rb_refstring_system_shutdown (void)
 {
-	g_hash_table_destroy (rb_refstrings);
-	g_mutex_free (rb_refstrings_mutex);
+	guint locks;
+	guint contended;
+	int i;
+
+	rb_refstring_get_lock_stats (&locks, &contended);
+	rb_debug ("refstring table locked %u times, %u contended", locks, contended);
+
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		g_hash_table_destroy (rb_refstring_shards[i].table);
+		g_mutex_free (rb_refstring_shards[i].mutex);
+		rb_refstring_shards[i].table = NULL;
+		rb_refstring_shards[i].mutex = NULL;
+	}
 }
 
 RBRefString *
@@ -240,3 +355,85 @@ rb_refstring_get_type (void)
 
 	return type;
 }
+
+static gboolean
+precompute_value (gpointer *ptr, char *value)
+{
+	/* it may have been computed on another thread in the meantime */
+	if (g_atomic_pointer_compare_and_exchange (ptr, NULL, value))
+		return TRUE;
+
+	g_free (value);
+	return FALSE;
+}
+
+static void
+collect_missing_keys (gpointer key, RBRefString *val, GPtrArray *pending)
+{
+	if (g_atomic_pointer_get (&val->folded) == NULL ||
+	    g_atomic_pointer_get (&val->sortkey) == NULL) {
+		if (rb_refstring_try_ref (val))
+			g_ptr_array_add (pending, val);
+	}
+}
+
+/**
+ * rb_refstring_precompute_keys:
+ * @cancel: a #GCancellable to stop the work early, or NULL
+ *
+ * Computes the folded string and sort key for every interned string that
+ * doesn't have them yet.  This is meant to be called from a worker thread
+ * after a database load, so the first search or sort doesn't have to
+ * compute them all on the main thread.  The keys are freed along with
+ * their strings.
+ * Strings interned while this is running are not covered.
+ */
+void
+rb_refstring_precompute_keys (GCancellable *cancel)
+{
+	GPtrArray *pending;
+	guint computed = 0;
+	guint i;
+
+	rb_profile_start ("precomputing refstring keys");
+
+	pending = g_ptr_array_new ();
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		RBRefStringShard *shard = &rb_refstring_shards[i];
+
+		g_mutex_lock (shard->mutex);
+		g_hash_table_foreach (shard->table, (GHFunc) collect_missing_keys, pending);
+		g_mutex_unlock (shard->mutex);
+	}
+
+	for (i = 0; i < pending->len; i++) {
+		RBRefString *val = g_ptr_array_index (pending, i);
+		const char *folded;
+
+		if ((i % PRECOMPUTE_CANCEL_CHECK_INTERVAL) == 0 &&
+		    g_cancellable_is_cancelled (cancel)) {
+			rb_debug ("precomputing refstring keys cancelled");
+			break;
+		}
+
+		if (g_atomic_pointer_get (&val->folded) == NULL) {
+			if (precompute_value (&val->folded, rb_search_fold (val->value)))
+				computed++;
+		}
+
+		if (g_atomic_pointer_get (&val->sortkey) == NULL) {
+			folded = rb_refstring_get_folded (val);
+			if (precompute_value (&val->sortkey,
+					      g_utf8_collate_key_for_filename (folded, -1)))
+				computed++;
+		}
+	}
+
+	for (i = 0; i < pending->len; i++) {
+		rb_refstring_unref (g_ptr_array_index (pending, i));
+	}
+	rb_debug ("precomputed %u keys for %u refstrings", computed, pending->len);
+	g_ptr_array_free (pending, TRUE);
+
+	rb_profile_end ("precomputing refstring keys");
+}
@@ -28,6 +28,7 @@
  */
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #ifndef __RB_REFSTRING_H
 #define __RB_REFSTRING_H
@@ -38,6 +39,7 @@ typedef struct RBRefString RBRefString;
 
 void		rb_refstring_system_init (void);
 void		rb_refstring_system_shutdown (void);
+void		rb_refstring_get_lock_stats (guint *locks, guint *contended);
 
 RBRefString *	rb_refstring_new (const char *init);
 RBRefString *	rb_refstring_find (const char *init);
@@ -49,6 +51,8 @@ const char *	rb_refstring_get (const RBRefString *val);
 const char *	rb_refstring_get_folded (RBRefString *val);
 const char *	rb_refstring_get_sort_key (RBRefString *val);
 
+void		rb_refstring_precompute_keys (GCancellable *cancel);
+
 guint rb_refstring_hash (gconstpointer p);
 gboolean rb_refstring_equal (gconstpointer ap, gconstpointer bp);
 
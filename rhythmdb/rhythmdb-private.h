@@ -143,6 +143,14 @@ struct _RhythmDBPrivate
 	gboolean action_thread_running;
 	gint outstanding_threads;
 	GAsyncQueue *action_queue;
+	GThreadPool *action_pools[RHYTHMDB_NUM_ACTION_LANES];
+	GMutex *action_lock;
+	GHashTable *active_uris;
+	GQueue *pending_loads;
+	RhythmDBActionStats action_stats[RHYTHMDB_NUM_ACTION_LANES];
+	gint64 action_total_latency[RHYTHMDB_NUM_ACTION_LANES];
+	gint64 action_max_latency[RHYTHMDB_NUM_ACTION_LANES];
+	gint outstanding_actions;
 	GAsyncQueue *event_queue;
 	GAsyncQueue *restored_queue;
 	GAsyncQueue *delayed_write_queue;
@@ -164,6 +172,7 @@ struct _RhythmDBPrivate
 
 	gboolean dry_run;
 	gboolean no_update;
+	gboolean precompute_keys;
 
 	GMutex *change_mutex;
 	GHashTable *added_entries;
@@ -178,6 +187,7 @@ struct _RhythmDBPrivate
 	GCond *saving_condition;
 	GMutex *saving_mutex;
 	guint save_count;
+	guint save_done_count;
 
 	guint event_queue_watch_id;
 	guint commit_timeout_id;
@@ -191,6 +201,8 @@ struct _RhythmDBPrivate
 	gboolean can_save;
 	gboolean saving;
 	gboolean dirty;
+	gboolean save_full;	/* the next save should rewrite the whole database */
+	gboolean saving_full;	/* the save in progress rewrites the whole database */
 
 	GHashTable *entry_type_map;
 	GMutex *entry_type_map_mutex;
@@ -203,6 +215,7 @@ typedef struct
 {
 	enum {
 		RHYTHMDB_EVENT_STAT,
+		RHYTHMDB_EVENT_STAT_UNCHANGED,
 		RHYTHMDB_EVENT_METADATA_LOAD,
 		RHYTHMDB_EVENT_DB_LOAD,
 		RHYTHMDB_EVENT_THREAD_EXITED,
@@ -223,6 +236,8 @@ typedef struct
 
 	/* STAT */
 	GFileInfo *file_info;
+	/* STAT_UNCHANGED */
+	GPtrArray *entries;
 	/* LOAD */
 	RBMetaData *metadata;
 	/* QUERY_COMPLETE */
@@ -67,6 +67,7 @@ static void rhythmdb_property_model_get_property (GObject *object,
 					       GValue *value,
 					       GParamSpec *pspec);
 static void rhythmdb_property_model_sync (RhythmDBPropertyModel *model);
+static void rhythmdb_property_model_populate (RhythmDBPropertyModel *model);
 static void rhythmdb_property_model_row_inserted_cb (GtkTreeModel *model,
 						     GtkTreePath *path,
 						     GtkTreeIter *iter,
@@ -169,6 +170,9 @@ struct RhythmDBPropertyModelPrivate
 
 	RhythmDBPropertyModelEntry *all;
 
+	/* rows whose counts changed since the last sync */
+	GHashTable *changed_rows;
+
 	guint syncing_id;
 };
 
@@ -315,31 +319,6 @@ rhythmdb_property_model_drag_source_init (RbTreeDragSourceIface *iface)
 	iface->rb_drag_data_get = rhythmdb_property_model_drag_data_get;
 }
 
-static gboolean
-_remove_entry_cb (GtkTreeModel *model,
-		  GtkTreePath *path,
-		  GtkTreeIter *iter,
-		  RhythmDBPropertyModel *propmodel)
-{
-	RhythmDBEntry *entry;
-
-	entry = rhythmdb_query_model_iter_to_entry (RHYTHMDB_QUERY_MODEL (model), iter);
-	rhythmdb_property_model_entry_removed_cb (RHYTHMDB_QUERY_MODEL (model),
-						  entry,
-						  propmodel);
-	return FALSE;
-}
-
-static gboolean
-_add_entry_cb (GtkTreeModel *model,
-	       GtkTreePath *path,
-	       GtkTreeIter *iter,
-	       RhythmDBPropertyModel *propmodel)
-{
-	rhythmdb_property_model_row_inserted_cb (model, path, iter, propmodel);
-	return FALSE;
-}
-
 static void
 rhythmdb_property_model_set_query_model_internal (RhythmDBPropertyModel *model,
 						  RhythmDBQueryModel    *query_model)
@@ -355,15 +334,10 @@ rhythmdb_property_model_set_query_model_internal (RhythmDBPropertyModel *model,
 						      G_CALLBACK (rhythmdb_property_model_prop_changed_cb),
 						      model);
 
-		gtk_tree_model_foreach (GTK_TREE_MODEL (model->priv->query_model),
-					(GtkTreeModelForeachFunc)_remove_entry_cb,
-					model);
-
 		g_object_unref (model->priv->query_model);
 	}
 
 	model->priv->query_model = query_model;
-	g_assert (rhythmdb_property_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == 1);
 
 	if (model->priv->query_model != NULL) {
 		g_object_ref (model->priv->query_model);
@@ -383,10 +357,12 @@ rhythmdb_property_model_set_query_model_internal (RhythmDBPropertyModel *model,
 					 G_CALLBACK (rhythmdb_property_model_prop_changed_cb),
 					 model,
 					 0);
-		gtk_tree_model_foreach (GTK_TREE_MODEL (model->priv->query_model),
-					(GtkTreeModelForeachFunc)_add_entry_cb,
-					model);
 	}
+
+	/* rather than removing and adding each entry, count the entries
+	 * in the new query model and update the rows in one pass.
+	 */
+	rhythmdb_property_model_populate (model);
 }
 
 static void
@@ -471,6 +447,8 @@ rhythmdb_property_model_init (RhythmDBPropertyModel *model)
 
 	model->priv->all = g_new0 (RhythmDBPropertyModelEntry, 1);
 	model->priv->all->string = rb_refstring_new (_("All"));
+
+	model->priv->changed_rows = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 
 static void
@@ -528,6 +506,7 @@ rhythmdb_property_model_finalize (GObject *object)
 	g_sequence_free (model->priv->properties);
 
 	g_hash_table_destroy (model->priv->entries);
+	g_hash_table_destroy (model->priv->changed_rows);
 
 	g_free (model->priv->all);
 
@@ -618,6 +597,41 @@ rhythmdb_property_model_entry_removed_cb (RhythmDBQueryModel *model,
 	rhythmdb_property_model_sync (propmodel);
 }
 
+static void
+rhythmdb_property_model_row_changed (RhythmDBPropertyModel *model,
+				     GSequenceIter *ptr)
+{
+	/* count changes are only signalled on the next sync, so adding or
+	 * removing lots of entries for a value only updates its row once.
+	 */
+	g_hash_table_insert (model->priv->changed_rows, g_sequence_get (ptr), ptr);
+	rhythmdb_property_model_sync (model);
+}
+
+static void
+rhythmdb_property_model_remove_row (RhythmDBPropertyModel *model,
+				    GSequenceIter *ptr)
+{
+	RhythmDBPropertyModelEntry *prop;
+	GtkTreePath *path;
+	GtkTreeIter iter;
+
+	iter.stamp = model->priv->stamp;
+	iter.user_data = ptr;
+
+	prop = g_sequence_get (ptr);
+	g_hash_table_remove (model->priv->changed_rows, prop);
+
+	path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
+	g_signal_emit (G_OBJECT (model), rhythmdb_property_model_signals[PRE_ROW_DELETION], 0);
+	gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+	gtk_tree_path_free (path);
+
+	g_sequence_remove (ptr);
+	g_hash_table_remove (model->priv->reverse_map, rb_refstring_get (prop->string));
+	_prop_model_entry_cleanup (prop, NULL);
+}
+
 static gint
 rhythmdb_property_model_compare (RhythmDBPropertyModelEntry *a,
 				 RhythmDBPropertyModelEntry *b,
@@ -651,11 +665,7 @@ rhythmdb_property_model_insert (RhythmDBPropertyModel *model,
 		prop->refcount++;
 		rb_debug ("adding \"%s\": refcount %d", propstr, prop->refcount);
 
-		iter.user_data = ptr;
-		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
-		gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
-		gtk_tree_path_free (path);
-
+		rhythmdb_property_model_row_changed (model, ptr);
 		return prop;
 	}
 	rb_debug ("adding new property \"%s\"", propstr);
@@ -699,37 +709,137 @@ rhythmdb_property_model_delete_prop (RhythmDBPropertyModel *model,
 {
 	GSequenceIter *ptr;
 	RhythmDBPropertyModelEntry *prop;
-	GtkTreePath *path;
-	GtkTreeIter iter;
 
 	g_assert ((ptr = g_hash_table_lookup (model->priv->reverse_map, propstr)));
 
-	iter.stamp = model->priv->stamp;
-	iter.user_data = ptr;
-
 	model->priv->all->refcount--;
 
 	prop = g_sequence_get (ptr);
 	rb_debug ("deleting \"%s\": refcount: %d", propstr, prop->refcount);
 	prop->refcount--;
 	if (prop->refcount > 0) {
-		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
-		gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
-		gtk_tree_path_free (path);
+		rhythmdb_property_model_row_changed (model, ptr);
 		return;
 	}
 
-	path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
-	g_signal_emit (G_OBJECT (model), rhythmdb_property_model_signals[PRE_ROW_DELETION], 0);
-	gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
-	gtk_tree_path_free (path);
+	rhythmdb_property_model_remove_row (model, ptr);
+}
 
-	g_sequence_remove (ptr);
-	g_hash_table_remove (model->priv->reverse_map, propstr);
-	rb_refstring_unref (prop->string);
-	rb_refstring_unref (prop->sort_string);
+static gint
+_prop_model_entry_ptr_compare (RhythmDBPropertyModelEntry **a,
+			       RhythmDBPropertyModelEntry **b,
+			       RhythmDBPropertyModel *model)
+{
+	return rhythmdb_property_model_compare (*a, *b, model);
+}
 
-	g_free (prop);
+static void
+_collect_new_props_cb (const char *propstr,
+		       RhythmDBPropertyModelEntry *prop,
+		       GPtrArray *added)
+{
+	g_ptr_array_add (added, prop);
+}
+
+static void
+rhythmdb_property_model_populate (RhythmDBPropertyModel *model)
+{
+	GHashTable *counts;
+	GPtrArray *added;
+	RhythmDBPropertyModelEntry *prop;
+	GSequenceIter *ptr;
+	GtkTreeIter iter;
+	GtkTreePath *path;
+	guint total = 0;
+	guint i;
+
+	/* count the entries for each property value in the query model */
+	counts = g_hash_table_new (g_str_hash, g_str_equal);
+	if (model->priv->query_model != NULL &&
+	    gtk_tree_model_get_iter_first (GTK_TREE_MODEL (model->priv->query_model), &iter)) {
+		do {
+			RhythmDBEntry *entry;
+			const char *propstr;
+
+			entry = rhythmdb_query_model_iter_to_entry (model->priv->query_model, &iter);
+			propstr = rhythmdb_entry_get_string (entry, model->priv->propid);
+
+			prop = g_hash_table_lookup (counts, propstr);
+			if (prop == NULL) {
+				prop = g_new0 (RhythmDBPropertyModelEntry, 1);
+				prop->string = rb_refstring_new (propstr);
+				prop->sort_string = rb_refstring_new (rhythmdb_entry_get_string (entry, model->priv->sort_propid));
+				g_hash_table_insert (counts, (gpointer)rb_refstring_get (prop->string), prop);
+			}
+			prop->refcount++;
+			total++;
+
+			rhythmdb_entry_unref (entry);
+		} while (gtk_tree_model_iter_next (GTK_TREE_MODEL (model->priv->query_model), &iter));
+	}
+
+	/* hidden entries are counted again when the query model has them */
+	g_hash_table_remove_all (model->priv->entries);
+
+	/* update the counts for values we already have, and remove the
+	 * values that are no longer present.
+	 */
+	ptr = g_sequence_get_begin_iter (model->priv->properties);
+	while (!g_sequence_iter_is_end (ptr)) {
+		RhythmDBPropertyModelEntry *old;
+		GSequenceIter *next;
+
+		old = g_sequence_get (ptr);
+		next = g_sequence_iter_next (ptr);
+
+		prop = g_hash_table_lookup (counts, rb_refstring_get (old->string));
+		if (prop == NULL) {
+			rhythmdb_property_model_remove_row (model, ptr);
+		} else {
+			if (old->refcount != prop->refcount) {
+				old->refcount = prop->refcount;
+				rhythmdb_property_model_row_changed (model, ptr);
+			}
+
+			g_hash_table_remove (counts, rb_refstring_get (prop->string));
+			_prop_model_entry_cleanup (prop, NULL);
+		}
+
+		ptr = next;
+	}
+
+	/* sort the new values once and merge them in */
+	added = g_ptr_array_sized_new (g_hash_table_size (counts));
+	g_hash_table_foreach (counts, (GHFunc)_collect_new_props_cb, added);
+	g_hash_table_destroy (counts);
+
+	g_ptr_array_sort_with_data (added, (GCompareDataFunc)_prop_model_entry_ptr_compare, model);
+
+	rb_debug ("adding %d new properties for %d entries", added->len, total);
+
+	iter.stamp = model->priv->stamp;
+	ptr = g_sequence_get_begin_iter (model->priv->properties);
+	for (i = 0; i < added->len; i++) {
+		prop = g_ptr_array_index (added, i);
+
+		while (!g_sequence_iter_is_end (ptr) &&
+		       rhythmdb_property_model_compare (g_sequence_get (ptr), prop, model) <= 0) {
+			ptr = g_sequence_iter_next (ptr);
+		}
+
+		iter.user_data = g_sequence_insert_before (ptr, prop);
+		g_hash_table_insert (model->priv->reverse_map,
+				     (gpointer)rb_refstring_get (prop->string),
+				     iter.user_data);
+
+		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
+		gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+		gtk_tree_path_free (path);
+	}
+	g_ptr_array_free (added, TRUE);
+
+	model->priv->all->refcount = total;
+	rhythmdb_property_model_sync (model);
 }
 
 /**
@@ -1241,6 +1351,21 @@ rhythmdb_property_model_enable_drag (RhythmDBPropertyModel *model,
 					     GDK_ACTION_COPY);
 }
 
+static void
+_emit_row_changed_cb (RhythmDBPropertyModelEntry *prop,
+		      GSequenceIter *ptr,
+		      RhythmDBPropertyModel *model)
+{
+	GtkTreeIter iter;
+	GtkTreePath *path;
+
+	iter.stamp = model->priv->stamp;
+	iter.user_data = ptr;
+	path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
+	gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+	gtk_tree_path_free (path);
+}
+
 static gboolean
 rhythmdb_property_model_perform_sync (RhythmDBPropertyModel *model)
 {
@@ -1255,6 +1380,9 @@ rhythmdb_property_model_perform_sync (RhythmDBPropertyModel *model)
 	gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
 	gtk_tree_path_free (path);
 
+	g_hash_table_foreach (model->priv->changed_rows, (GHFunc)_emit_row_changed_cb, model);
+	g_hash_table_remove_all (model->priv->changed_rows);
+
 	model->priv->syncing_id = 0;
 	GDK_THREADS_LEAVE ();
 	return FALSE;
@@ -40,6 +40,8 @@
 #include <gtk/gtk.h>
 
 #include "rhythmdb-query-model.h"
+#include "rhythmdb-query-plan.h"
+#include "rhythmdb-sort.h"
 #include "rb-debug.h"
 #include "rb-tree-dnd.h"
 #include "rb-marshal.h"
@@ -88,6 +90,12 @@ static void rhythmdb_query_model_entry_changed_cb (RhythmDB *db, RhythmDBEntry *
 						   GSList *changes, RhythmDBQueryModel *model);
 static void rhythmdb_query_model_entry_deleted_cb (RhythmDB *db, RhythmDBEntry *entry,
 						   RhythmDBQueryModel *model);
+static void rhythmdb_query_model_entries_added_cb (RhythmDB *db, GPtrArray *entries,
+						   RhythmDBQueryModel *model);
+static void rhythmdb_query_model_entries_changed_cb (RhythmDB *db, GArray *changes,
+						     RhythmDBQueryModel *model);
+static void rhythmdb_query_model_entries_deleted_cb (RhythmDB *db, GPtrArray *entries,
+						     RhythmDBQueryModel *model);
 
 static void rhythmdb_query_model_filter_out_entry (RhythmDBQueryModel *model,
 						   RhythmDBEntry *entry);
@@ -223,6 +231,7 @@ struct RhythmDBQueryModelPrivate
 
 	GPtrArray *query;
 	GPtrArray *original_query;
+	RhythmDBQueryPlan *query_plan;
 
 	guint stamp;
 
@@ -477,11 +486,19 @@ rhythmdb_query_model_set_query_internal (RhythmDBQueryModel *model,
 
 	rhythmdb_query_free (model->priv->query);
 	rhythmdb_query_free (model->priv->original_query);
+	rhythmdb_query_plan_free (model->priv->query_plan);
+	model->priv->query_plan = NULL;
 
 	model->priv->query = rhythmdb_query_copy (query);
 	model->priv->original_query = rhythmdb_query_copy (model->priv->query);
 	rhythmdb_query_preprocess (model->priv->db, model->priv->query);
 
+	/* entries are checked against the query every time they change,
+	 * so compile it once here.
+	 */
+	if (model->priv->query != NULL)
+		model->priv->query_plan = rhythmdb_query_plan_new (model->priv->db, model->priv->query);
+
 	/* if the query contains time-relative criteria, re-run it periodically.
 	 * currently it's just every minute, but perhaps it could be smarter.
 	 */
@@ -629,16 +646,16 @@ rhythmdb_query_model_constructor (GType type,
 			constructor (type, n_construct_properties, construct_properties));
 
 	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_added",
-				 G_CALLBACK (rhythmdb_query_model_entry_added_cb),
+				 "entries_added",
+				 G_CALLBACK (rhythmdb_query_model_entries_added_cb),
 				 model, 0);
 	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_changed",
-				 G_CALLBACK (rhythmdb_query_model_entry_changed_cb),
+				 "entries_changed",
+				 G_CALLBACK (rhythmdb_query_model_entries_changed_cb),
 				 model, 0);
 	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_deleted",
-				 G_CALLBACK (rhythmdb_query_model_entry_deleted_cb),
+				 "entries_deleted",
+				 G_CALLBACK (rhythmdb_query_model_entries_deleted_cb),
 				 model, 0);
 
 	return G_OBJECT (model);
@@ -718,6 +735,7 @@ rhythmdb_query_model_finalize (GObject *object)
 		rhythmdb_query_free (model->priv->query);
 	if (model->priv->original_query)
 		rhythmdb_query_free (model->priv->original_query);
+	rhythmdb_query_plan_free (model->priv->query_plan);
 
 	if (model->priv->sort_data_destroy && model->priv->sort_data)
 		model->priv->sort_data_destroy (model->priv->sort_data);
@@ -760,7 +778,7 @@ static void
 _copy_contents_foreach_cb (RhythmDBEntry *entry, RhythmDBQueryModel *dest)
 {
 	if (dest->priv->query == NULL ||
-	    rhythmdb_evaluate_query (dest->priv->db, dest->priv->query, entry)) {
+	    rhythmdb_query_plan_evaluate (dest->priv->query_plan, entry)) {
 		if (dest->priv->show_hidden || (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN) == FALSE))
 			rhythmdb_query_model_do_insert (dest, entry, -1);
 	}
@@ -880,7 +898,7 @@ rhythmdb_query_model_entry_added_cb (RhythmDB *db,
 	}
 
 	if (model->priv->query != NULL) {
-		insert = rhythmdb_evaluate_query (db, model->priv->query, entry);
+		insert = rhythmdb_query_plan_evaluate (model->priv->query_plan, entry);
 	} else {
 		index = GPOINTER_TO_INT (g_hash_table_lookup (model->priv->hidden_entry_map, entry));
 		insert = g_hash_table_remove (model->priv->hidden_entry_map, entry);
@@ -987,7 +1005,7 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 	}
 
 	if (model->priv->query &&
-	    !rhythmdb_evaluate_query (db, model->priv->query, entry)) {
+	    !rhythmdb_query_plan_evaluate (model->priv->query_plan, entry)) {
 		rhythmdb_query_model_filter_out_entry (model, entry);
 		return;
 	}
@@ -1035,6 +1053,43 @@ rhythmdb_query_model_entry_deleted_cb (RhythmDB *db,
 		rhythmdb_query_model_remove_entry (model, entry);
 }
 
+static void
+rhythmdb_query_model_entries_added_cb (RhythmDB *db,
+				       GPtrArray *entries,
+				       RhythmDBQueryModel *model)
+{
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		rhythmdb_query_model_entry_added_cb (db, g_ptr_array_index (entries, i), model);
+	}
+}
+
+static void
+rhythmdb_query_model_entries_changed_cb (RhythmDB *db,
+					 GArray *changes,
+					 RhythmDBQueryModel *model)
+{
+	guint i;
+
+	for (i = 0; i < changes->len; i++) {
+		RhythmDBChangedEntry *changed = &g_array_index (changes, RhythmDBChangedEntry, i);
+		rhythmdb_query_model_entry_changed_cb (db, changed->entry, changed->changes, model);
+	}
+}
+
+static void
+rhythmdb_query_model_entries_deleted_cb (RhythmDB *db,
+					 GPtrArray *entries,
+					 RhythmDBQueryModel *model)
+{
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		rhythmdb_query_model_entry_deleted_cb (db, g_ptr_array_index (entries, i), model);
+	}
+}
+
 static gboolean
 idle_process_update_idle (struct RhythmDBQueryModelUpdate *update)
 {
@@ -2293,8 +2348,8 @@ rhythmdb_query_model_set_sort_order (RhythmDBQueryModel *model,
 {
 	GSequence *new_entries;
 	GSequenceIter *ptr;
+	RhythmDBEntry **entries;
 	int length, i;
-	struct ReverseSortData reverse_data;
 
 	if ((model->priv->sort_func == sort_func) &&
 	    (model->priv->sort_data == sort_data) &&
@@ -2315,27 +2370,24 @@ rhythmdb_query_model_set_sort_order (RhythmDBQueryModel *model,
 	model->priv->sort_data_destroy = sort_data_destroy;
 	model->priv->sort_reverse = sort_reverse;
 
-	if (model->priv->sort_reverse) {
-		reverse_data.func = sort_func;
-		reverse_data.data = sort_data;
-		sort_func = (GCompareDataFunc) _reverse_sorting_func;
-		sort_data = &reverse_data;
-	}
-
-	/* create the new sorted entry sequence */
+	/* sort all the entries at once, then build the new sequence in order */
 	length = g_sequence_get_length (model->priv->entries);
 	if (length > 0) {
-		new_entries = g_sequence_new (NULL);
+		entries = g_new (RhythmDBEntry *, length);
 		ptr = g_sequence_get_begin_iter (model->priv->entries);
 		for (i = 0; i < length; i++) {
-			gpointer entry = g_sequence_get (ptr);
-
-			g_sequence_insert_sorted (new_entries, entry,
-						  sort_func,
-						  sort_data);
+			entries[i] = g_sequence_get (ptr);
 			ptr = g_sequence_iter_next (ptr);
 		}
 
+		rhythmdb_sort_entries (entries, length, sort_func, sort_data, sort_reverse);
+
+		new_entries = g_sequence_new (NULL);
+		for (i = 0; i < length; i++) {
+			g_sequence_append (new_entries, entries[i]);
+		}
+		g_free (entries);
+
 		apply_updated_entry_sequence (model, new_entries);
 	}
 }
@@ -2413,7 +2465,7 @@ rhythmdb_query_model_base_row_inserted (GtkTreeModel *tree_model,
 	if (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN))
 		goto out;
 
-	if (rhythmdb_evaluate_query (model->priv->db, model->priv->query, entry)) {
+	if (rhythmdb_query_plan_evaluate (model->priv->query_plan, entry)) {
 		/* find the closest previous entry that is in the filter model, and it it after that */
 		prev_entry = rhythmdb_query_model_get_previous_from_entry (base_model, entry);
 		while (prev_entry && g_hash_table_lookup (model->priv->reverse_map, prev_entry) == NULL) {
@@ -2522,9 +2574,7 @@ typedef struct {
 static void
 _reapply_query_foreach_cb (RhythmDBEntry *entry, _ReapplyQueryForeachData *data)
 {
-	if (!rhythmdb_evaluate_query (data->model->priv->db,
-				      data->model->priv->query,
-				      entry)) {
+	if (!rhythmdb_query_plan_evaluate (data->model->priv->query_plan, entry)) {
 		data->remove = g_list_prepend (data->remove, entry);
 	}
 }
@@ -2575,6 +2625,69 @@ rhythmdb_query_model_reapply_query (RhythmDBQueryModel *model,
 		rhythmdb_query_model_update_limited_entries (model);
 }
 
+/*
+ * Replaces the query of a chained query model and updates its contents
+ * in place from the entries of the base model, rather than running a new
+ * database query and building a new model.  The base model's entries are
+ * walked once in order; entries that stop matching are filtered out and
+ * entries that start matching are inserted at their position relative to
+ * the base model, so anything attached to this model only sees the rows
+ * that actually changed.
+ */
+void
+rhythmdb_query_model_refilter (RhythmDBQueryModel *model,
+			       GPtrArray *query)
+{
+	_ReapplyQueryForeachData data;
+	GSequenceIter *ptr;
+	GList *t;
+	gint index;
+
+	g_return_if_fail (model->priv->base_model != NULL);
+
+	rhythmdb_query_model_set_query_internal (model, query);
+
+	/* drop limited entries that no longer match first, so they can't
+	 * be moved back in to the main list below.
+	 */
+	data.model = model;
+	data.remove = NULL;
+	if (model->priv->query_plan != NULL)
+		g_sequence_foreach (model->priv->limited_entries, (GFunc)_reapply_query_foreach_cb, &data);
+	for (t = data.remove; t; t = t->next)
+		rhythmdb_query_model_remove_from_limited_list (model, (RhythmDBEntry*)t->data);
+	g_list_free (data.remove);
+
+	index = 0;
+	ptr = g_sequence_get_begin_iter (model->priv->base_model->priv->entries);
+	while (!g_sequence_iter_is_end (ptr)) {
+		RhythmDBEntry *entry = g_sequence_get (ptr);
+		gboolean visible;
+
+		/* step over the entry first; removing rows from this model
+		 * doesn't touch the base model's sequence.
+		 */
+		ptr = g_sequence_iter_next (ptr);
+
+		visible = (model->priv->show_hidden || !rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN)) &&
+			  (model->priv->query_plan == NULL || rhythmdb_query_plan_evaluate (model->priv->query_plan, entry));
+
+		if (g_hash_table_lookup (model->priv->reverse_map, entry) != NULL) {
+			if (!visible) {
+				rhythmdb_query_model_remove_from_main_list (model, entry);
+				continue;
+			}
+		} else if (visible) {
+			rhythmdb_query_model_do_insert (model, entry, model->priv->sort_func ? -1 : index);
+		}
+
+		if (g_hash_table_lookup (model->priv->reverse_map, entry) != NULL)
+			index++;
+	}
+
+	rhythmdb_query_model_update_limited_entries (model);
+}
+
 static gint
 _reverse_sorting_func (gpointer a,
 		       gpointer b,
@@ -153,6 +153,9 @@ void			rhythmdb_query_model_set_sort_order	(RhythmDBQueryModel *model,
 void			rhythmdb_query_model_reapply_query	(RhythmDBQueryModel *model,
 								 gboolean filter);
 
+void			rhythmdb_query_model_refilter		(RhythmDBQueryModel *model,
+								 GPtrArray *query);
+
 gint 			rhythmdb_query_model_location_sort_func (RhythmDBEntry *a,
                                                                  RhythmDBEntry *b,
 								 gpointer data);
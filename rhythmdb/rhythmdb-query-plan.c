@@ -0,0 +1,721 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * A query plan is a query compiled into a flat array of predicates.
+ * Each predicate is a function specialised for the property type and
+ * comparison, and reads the entry field it tests directly where the field
+ * is stored in the entry structure, so evaluating a plan doesn't have to
+ * look up property types or unpack GValues for every entry.
+ *
+ * Conjunctions are laid out one after the other, each one followed by a
+ * terminator (a predicate with no function).  Every predicate records
+ * where the next conjunction starts; when a predicate fails, evaluation
+ * skips there.  Reaching a terminator means the whole conjunction
+ * matched, and running off the end of the array means none did.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "rhythmdb-query-plan.h"
+#include "rhythmdb-private.h"
+#include "rb-util.h"
+
+typedef struct _RhythmDBQueryPredicate RhythmDBQueryPredicate;
+typedef gboolean (*RhythmDBQueryPredicateFunc) (const RhythmDBQueryPredicate *pred,
+						RhythmDBEntry *entry);
+typedef const char *(*RhythmDBQueryStringFunc) (const RhythmDBQueryPredicate *pred,
+						RhythmDBEntry *entry);
+
+struct _RhythmDBQueryPredicate
+{
+	RhythmDBQueryPredicateFunc func;
+	guint next;
+
+	RhythmDBPropType propid;
+	gsize offset;
+	RhythmDBQueryStringFunc get_string;
+
+	union {
+		RBRefString *refstring;
+		char *string;
+		char **words;
+		gulong ulong_value;
+		guint64 uint64_value;
+		double double_value;
+		gboolean boolean_value;
+		gpointer pointer_value;
+		RhythmDBQueryPlan *subplan;
+	} value;
+	GDestroyNotify value_destroy;
+	RhythmDB *db;
+};
+
+struct _RhythmDBQueryPlan
+{
+	RhythmDBQueryPredicate *predicates;
+	guint n_predicates;
+};
+
+#define ENTRY_FIELD(type, entry, pred)	G_STRUCT_MEMBER (type, entry, (pred)->offset)
+#define ENTRY_OFFSET(field)		G_STRUCT_OFFSET (struct RhythmDBEntry_, field)
+
+/* where the value of a property lives in the entry */
+typedef enum {
+	FIELD_NONE,		/* use the rhythmdb_entry_get_* accessor */
+	FIELD_REFSTRING,
+	FIELD_FOLDED,
+	FIELD_ULONG,
+	FIELD_UINT64,
+	FIELD_DOUBLE,
+	FIELD_POINTER
+} FieldKind;
+
+static FieldKind
+property_field (RhythmDBPropType propid, gsize *offset)
+{
+	switch (propid) {
+	case RHYTHMDB_PROP_TYPE:
+		*offset = ENTRY_OFFSET (type);
+		return FIELD_POINTER;
+
+	case RHYTHMDB_PROP_TITLE:
+		*offset = ENTRY_OFFSET (title);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_ARTIST:
+		*offset = ENTRY_OFFSET (artist);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_ALBUM:
+		*offset = ENTRY_OFFSET (album);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_GENRE:
+		*offset = ENTRY_OFFSET (genre);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MUSICBRAINZ_TRACKID:
+		*offset = ENTRY_OFFSET (musicbrainz_trackid);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MUSICBRAINZ_ARTISTID:
+		*offset = ENTRY_OFFSET (musicbrainz_artistid);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMID:
+		*offset = ENTRY_OFFSET (musicbrainz_albumid);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMARTISTID:
+		*offset = ENTRY_OFFSET (musicbrainz_albumartistid);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_ARTIST_SORTNAME:
+		*offset = ENTRY_OFFSET (artist_sortname);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_ALBUM_SORTNAME:
+		*offset = ENTRY_OFFSET (album_sortname);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_LOCATION:
+		*offset = ENTRY_OFFSET (location);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MOUNTPOINT:
+		*offset = ENTRY_OFFSET (mountpoint);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_MIMETYPE:
+		*offset = ENTRY_OFFSET (mimetype);
+		return FIELD_REFSTRING;
+	case RHYTHMDB_PROP_PLAYBACK_ERROR:
+		*offset = ENTRY_OFFSET (playback_error);
+		return FIELD_REFSTRING;
+
+	case RHYTHMDB_PROP_TITLE_FOLDED:
+		*offset = ENTRY_OFFSET (title);
+		return FIELD_FOLDED;
+	case RHYTHMDB_PROP_ARTIST_FOLDED:
+		*offset = ENTRY_OFFSET (artist);
+		return FIELD_FOLDED;
+	case RHYTHMDB_PROP_ALBUM_FOLDED:
+		*offset = ENTRY_OFFSET (album);
+		return FIELD_FOLDED;
+	case RHYTHMDB_PROP_GENRE_FOLDED:
+		*offset = ENTRY_OFFSET (genre);
+		return FIELD_FOLDED;
+
+	case RHYTHMDB_PROP_TRACK_NUMBER:
+		*offset = ENTRY_OFFSET (tracknum);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_DISC_NUMBER:
+		*offset = ENTRY_OFFSET (discnum);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_DURATION:
+		*offset = ENTRY_OFFSET (duration);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_BITRATE:
+		*offset = ENTRY_OFFSET (bitrate);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_MTIME:
+		*offset = ENTRY_OFFSET (mtime);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_FIRST_SEEN:
+		*offset = ENTRY_OFFSET (first_seen);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_LAST_SEEN:
+		*offset = ENTRY_OFFSET (last_seen);
+		return FIELD_ULONG;
+	case RHYTHMDB_PROP_LAST_PLAYED:
+		*offset = ENTRY_OFFSET (last_played);
+		return FIELD_ULONG;
+
+	case RHYTHMDB_PROP_FILE_SIZE:
+		*offset = ENTRY_OFFSET (file_size);
+		return FIELD_UINT64;
+
+	case RHYTHMDB_PROP_RATING:
+		*offset = ENTRY_OFFSET (rating);
+		return FIELD_DOUBLE;
+	case RHYTHMDB_PROP_TRACK_GAIN:
+		*offset = ENTRY_OFFSET (track_gain);
+		return FIELD_DOUBLE;
+	case RHYTHMDB_PROP_TRACK_PEAK:
+		*offset = ENTRY_OFFSET (track_peak);
+		return FIELD_DOUBLE;
+	case RHYTHMDB_PROP_ALBUM_GAIN:
+		*offset = ENTRY_OFFSET (album_gain);
+		return FIELD_DOUBLE;
+	case RHYTHMDB_PROP_ALBUM_PEAK:
+		*offset = ENTRY_OFFSET (album_peak);
+		return FIELD_DOUBLE;
+
+	default:
+		*offset = 0;
+		return FIELD_NONE;
+	}
+}
+
+/* string readers */
+
+static const char *
+read_refstring_field (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rb_refstring_get (ENTRY_FIELD (RBRefString *, entry, pred));
+}
+
+static const char *
+read_folded_field (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rb_refstring_get_folded (ENTRY_FIELD (RBRefString *, entry, pred));
+}
+
+static const char *
+read_string_property (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_entry_get_string (entry, pred->propid);
+}
+
+/* string predicates */
+
+static gboolean
+refstring_equals (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	/* both strings are interned, so equal strings are the same object */
+	return ENTRY_FIELD (RBRefString *, entry, pred) == pred->value.refstring;
+}
+
+static gboolean
+string_equals (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return strcmp (pred->get_string (pred, entry), pred->value.string) == 0;
+}
+
+static gboolean
+string_greater (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return strcmp (pred->get_string (pred, entry), pred->value.string) >= 0;
+}
+
+static gboolean
+string_less (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return strcmp (pred->get_string (pred, entry), pred->value.string) <= 0;
+}
+
+static gboolean
+string_like (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *s = pred->get_string (pred, entry);
+
+	/* the property may be NULL, the value never is */
+	return (s != NULL && strstr (s, pred->value.string) != NULL);
+}
+
+static gboolean
+string_not_like (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *s = pred->get_string (pred, entry);
+
+	return (s != NULL && strstr (s, pred->value.string) == NULL);
+}
+
+static gboolean
+string_prefix (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return g_str_has_prefix (pred->get_string (pred, entry), pred->value.string);
+}
+
+static gboolean
+string_suffix (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return g_str_has_suffix (pred->get_string (pred, entry), pred->value.string);
+}
+
+static gboolean
+search_match (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *fields[4];
+	char **word;
+	int i;
+
+	fields[0] = rb_refstring_get_folded (entry->title);
+	fields[1] = rb_refstring_get_folded (entry->album);
+	fields[2] = rb_refstring_get_folded (entry->artist);
+	fields[3] = rb_refstring_get_folded (entry->genre);
+
+	for (word = pred->value.words; *word != NULL; word++) {
+		for (i = 0; i < G_N_ELEMENTS (fields); i++) {
+			if (fields[i] != NULL && strstr (fields[i], *word) != NULL)
+				break;
+		}
+		if (i == G_N_ELEMENTS (fields))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+search_not_match (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return !search_match (pred, entry);
+}
+
+static gboolean
+keyword_has (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_entry_keyword_has (pred->db, entry, pred->value.refstring);
+}
+
+static gboolean
+keyword_not_has (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return !rhythmdb_entry_keyword_has (pred->db, entry, pred->value.refstring);
+}
+
+/* numeric predicates.  as in the interpreted evaluator, GREATER and LESS
+ * include the value itself.
+ */
+
+#define NUMERIC_PREDICATES(name, READ, member)					\
+static gboolean									\
+name##_equals (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)	\
+{										\
+	return READ == pred->value.member;					\
+}										\
+static gboolean									\
+name##_greater (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)	\
+{										\
+	return READ >= pred->value.member;					\
+}										\
+static gboolean									\
+name##_less (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)		\
+{										\
+	return READ <= pred->value.member;					\
+}
+
+NUMERIC_PREDICATES (ulong_field, ENTRY_FIELD (gulong, entry, pred), ulong_value)
+NUMERIC_PREDICATES (ulong_prop, rhythmdb_entry_get_ulong (entry, pred->propid), ulong_value)
+NUMERIC_PREDICATES (uint64_field, ENTRY_FIELD (guint64, entry, pred), uint64_value)
+NUMERIC_PREDICATES (uint64_prop, rhythmdb_entry_get_uint64 (entry, pred->propid), uint64_value)
+NUMERIC_PREDICATES (double_field, ENTRY_FIELD (double, entry, pred), double_value)
+NUMERIC_PREDICATES (double_prop, rhythmdb_entry_get_double (entry, pred->propid), double_value)
+NUMERIC_PREDICATES (boolean_prop, rhythmdb_entry_get_boolean (entry, pred->propid), boolean_value)
+NUMERIC_PREDICATES (pointer_field, ENTRY_FIELD (gpointer, entry, pred), pointer_value)
+NUMERIC_PREDICATES (pointer_prop, rhythmdb_entry_get_pointer (entry, pred->propid), pointer_value)
+
+static gulong
+time_limit (const RhythmDBQueryPredicate *pred)
+{
+	GTimeVal current_time;
+
+	g_get_current_time (&current_time);
+	return current_time.tv_sec - pred->value.ulong_value;
+}
+
+static gboolean
+ulong_field_within (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return ENTRY_FIELD (gulong, entry, pred) >= time_limit (pred);
+}
+
+static gboolean
+ulong_field_not_within (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return ENTRY_FIELD (gulong, entry, pred) < time_limit (pred);
+}
+
+static gboolean
+ulong_prop_within (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_entry_get_ulong (entry, pred->propid) >= time_limit (pred);
+}
+
+static gboolean
+ulong_prop_not_within (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_entry_get_ulong (entry, pred->propid) < time_limit (pred);
+}
+
+static gboolean
+subquery_matches (const RhythmDBQueryPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_query_plan_evaluate (pred->value.subplan, entry);
+}
+
+/* compilation */
+
+static void
+compile_string (RhythmDB *db,
+		RhythmDBQueryData *data,
+		RhythmDBQueryPredicate *pred)
+{
+	FieldKind kind;
+	const char *value;
+
+	kind = property_field (data->propid, &pred->offset);
+
+	if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+		if (G_VALUE_HOLDS (data->val, G_TYPE_STRV)) {
+			pred->value.words = g_strdupv (g_value_get_boxed (data->val));
+		} else {
+			char *folded;
+
+			/* not preprocessed; do it now rather than per entry */
+			folded = rb_search_fold (g_value_get_string (data->val));
+			pred->value.words = rb_string_split_words (folded);
+			g_free (folded);
+		}
+		pred->value_destroy = (GDestroyNotify) g_strfreev;
+		pred->func = (data->type == RHYTHMDB_QUERY_PROP_LIKE) ? search_match : search_not_match;
+		return;
+	}
+
+	value = g_value_get_string (data->val);
+
+	if (data->type == RHYTHMDB_QUERY_PROP_EQUALS && kind == FIELD_REFSTRING && value != NULL) {
+		/* holding a reference keeps the interned string alive, so any
+		 * entry with this value will point to the same one.
+		 */
+		pred->value.refstring = rb_refstring_new (value);
+		pred->value_destroy = (GDestroyNotify) rb_refstring_unref;
+		pred->func = refstring_equals;
+		return;
+	}
+
+	switch (kind) {
+	case FIELD_REFSTRING:
+		pred->get_string = read_refstring_field;
+		break;
+	case FIELD_FOLDED:
+		pred->get_string = read_folded_field;
+		break;
+	default:
+		pred->get_string = read_string_property;
+		break;
+	}
+
+	pred->value.string = g_strdup (value);
+	pred->value_destroy = g_free;
+
+	switch (data->type) {
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+		pred->func = string_equals;
+		break;
+	case RHYTHMDB_QUERY_PROP_GREATER:
+		pred->func = string_greater;
+		break;
+	case RHYTHMDB_QUERY_PROP_LESS:
+		pred->func = string_less;
+		break;
+	case RHYTHMDB_QUERY_PROP_LIKE:
+		pred->func = string_like;
+		break;
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		pred->func = string_not_like;
+		break;
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+		pred->func = string_prefix;
+		break;
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+		pred->func = string_suffix;
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+#define SELECT_COMPARISON(pred, type, name)				\
+	switch (type) {							\
+	case RHYTHMDB_QUERY_PROP_EQUALS:				\
+	case RHYTHMDB_QUERY_PROP_LIKE:					\
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:				\
+		(pred)->func = name##_equals;				\
+		break;							\
+	case RHYTHMDB_QUERY_PROP_GREATER:				\
+		(pred)->func = name##_greater;				\
+		break;							\
+	case RHYTHMDB_QUERY_PROP_LESS:					\
+		(pred)->func = name##_less;				\
+		break;							\
+	default:							\
+		g_assert_not_reached ();				\
+	}
+
+static void
+compile_criterion (RhythmDB *db,
+		   RhythmDBQueryData *data,
+		   RhythmDBQueryPredicate *pred)
+{
+	FieldKind kind;
+
+	pred->propid = data->propid;
+	pred->db = db;
+
+	switch (data->type) {
+	case RHYTHMDB_QUERY_SUBQUERY:
+		pred->value.subplan = rhythmdb_query_plan_new (db, data->subquery);
+		pred->value_destroy = (GDestroyNotify) rhythmdb_query_plan_free;
+		pred->func = subquery_matches;
+		return;
+
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		g_assert (rhythmdb_get_property_type (db, data->propid) == G_TYPE_ULONG);
+
+		pred->value.ulong_value = g_value_get_ulong (data->val);
+		if (property_field (data->propid, &pred->offset) == FIELD_ULONG) {
+			if (data->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN)
+				pred->func = ulong_field_within;
+			else
+				pred->func = ulong_field_not_within;
+		} else {
+			if (data->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN)
+				pred->func = ulong_prop_within;
+			else
+				pred->func = ulong_prop_not_within;
+		}
+		return;
+
+	case RHYTHMDB_QUERY_PROP_LIKE:
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		if (data->propid == RHYTHMDB_PROP_KEYWORD) {
+			pred->value.refstring = rb_refstring_new (g_value_get_string (data->val));
+			pred->value_destroy = (GDestroyNotify) rb_refstring_unref;
+			if (data->type == RHYTHMDB_QUERY_PROP_LIKE)
+				pred->func = keyword_has;
+			else
+				pred->func = keyword_not_has;
+			return;
+		}
+		/* LIKE on anything other than a string is EQUALS */
+		break;
+
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+	case RHYTHMDB_QUERY_PROP_GREATER:
+	case RHYTHMDB_QUERY_PROP_LESS:
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+		break;
+
+	case RHYTHMDB_QUERY_END:
+	case RHYTHMDB_QUERY_DISJUNCTION:
+	case RHYTHMDB_QUERY_PROP_YEAR_EQUALS:
+	case RHYTHMDB_QUERY_PROP_YEAR_LESS:
+	case RHYTHMDB_QUERY_PROP_YEAR_GREATER:
+		g_assert_not_reached ();
+		break;
+	}
+
+	kind = property_field (data->propid, &pred->offset);
+
+	switch (rhythmdb_get_property_type (db, data->propid)) {
+	case G_TYPE_STRING:
+		compile_string (db, data, pred);
+		break;
+	case G_TYPE_ULONG:
+		pred->value.ulong_value = g_value_get_ulong (data->val);
+		if (kind == FIELD_ULONG) {
+			SELECT_COMPARISON (pred, data->type, ulong_field)
+		} else {
+			SELECT_COMPARISON (pred, data->type, ulong_prop)
+		}
+		break;
+	case G_TYPE_UINT64:
+		pred->value.uint64_value = g_value_get_uint64 (data->val);
+		if (kind == FIELD_UINT64) {
+			SELECT_COMPARISON (pred, data->type, uint64_field)
+		} else {
+			SELECT_COMPARISON (pred, data->type, uint64_prop)
+		}
+		break;
+	case G_TYPE_DOUBLE:
+		pred->value.double_value = g_value_get_double (data->val);
+		if (kind == FIELD_DOUBLE) {
+			SELECT_COMPARISON (pred, data->type, double_field)
+		} else {
+			SELECT_COMPARISON (pred, data->type, double_prop)
+		}
+		break;
+	case G_TYPE_BOOLEAN:
+		pred->value.boolean_value = g_value_get_boolean (data->val);
+		SELECT_COMPARISON (pred, data->type, boolean_prop)
+		break;
+	case G_TYPE_POINTER:
+		pred->value.pointer_value = g_value_get_pointer (data->val);
+		if (kind == FIELD_POINTER) {
+			SELECT_COMPARISON (pred, data->type, pointer_field)
+		} else {
+			SELECT_COMPARISON (pred, data->type, pointer_prop)
+		}
+		break;
+	default:
+		g_warning ("Unexpected type: %s",
+			   g_type_name (rhythmdb_get_property_type (db, data->propid)));
+		g_assert_not_reached ();
+	}
+}
+
+static void
+end_conjunction (GArray *predicates, guint start)
+{
+	RhythmDBQueryPredicate terminator = {0,};
+	guint i;
+
+	g_array_append_val (predicates, terminator);
+	for (i = start; i < predicates->len; i++) {
+		g_array_index (predicates, RhythmDBQueryPredicate, i).next = predicates->len;
+	}
+}
+
+/**
+ * rhythmdb_query_plan_new:
+ * @db: a #RhythmDB
+ * @query: a preprocessed query
+ *
+ * Compiles @query into a plan that can be evaluated against entries
+ * repeatedly.  The plan does not refer to @query after this returns.
+ *
+ * Return value: the compiled plan, to be freed with rhythmdb_query_plan_free
+ */
+RhythmDBQueryPlan *
+rhythmdb_query_plan_new (RhythmDB *db, GPtrArray *query)
+{
+	RhythmDBQueryPlan *plan;
+	GArray *predicates;
+	guint start;
+	guint i;
+
+	predicates = g_array_new (FALSE, TRUE, sizeof (RhythmDBQueryPredicate));
+	start = 0;
+
+	for (i = 0; query != NULL && i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+		RhythmDBQueryPredicate pred = {0,};
+
+		if (data->type == RHYTHMDB_QUERY_DISJUNCTION) {
+			end_conjunction (predicates, start);
+			start = predicates->len;
+			continue;
+		}
+
+		compile_criterion (db, data, &pred);
+		g_array_append_val (predicates, pred);
+	}
+	end_conjunction (predicates, start);
+
+	plan = g_new0 (RhythmDBQueryPlan, 1);
+	plan->n_predicates = predicates->len;
+	plan->predicates = (RhythmDBQueryPredicate *) g_array_free (predicates, FALSE);
+	return plan;
+}
+
+/**
+ * rhythmdb_query_plan_free:
+ * @plan: a #RhythmDBQueryPlan
+ *
+ * Frees the plan and any values it holds.
+ */
+void
+rhythmdb_query_plan_free (RhythmDBQueryPlan *plan)
+{
+	guint i;
+
+	if (plan == NULL)
+		return;
+
+	for (i = 0; i < plan->n_predicates; i++) {
+		RhythmDBQueryPredicate *pred = &plan->predicates[i];
+		if (pred->value_destroy != NULL)
+			pred->value_destroy (pred->value.subplan);
+	}
+	g_free (plan->predicates);
+	g_free (plan);
+}
+
+/**
+ * rhythmdb_query_plan_evaluate:
+ * @plan: a #RhythmDBQueryPlan
+ * @entry: a #RhythmDBEntry
+ *
+ * Evaluates the compiled query against @entry.  This matches exactly the
+ * same entries as rhythmdb_evaluate_query with the query the plan was
+ * compiled from.
+ *
+ * Return value: TRUE if @entry matches the query
+ */
+gboolean
+rhythmdb_query_plan_evaluate (RhythmDBQueryPlan *plan, RhythmDBEntry *entry)
+{
+	const RhythmDBQueryPredicate *predicates = plan->predicates;
+	guint i = 0;
+
+	while (i < plan->n_predicates) {
+		const RhythmDBQueryPredicate *pred = &predicates[i];
+
+		if (pred->func == NULL)
+			return TRUE;
+
+		if (pred->func (pred, entry))
+			i++;
+		else
+			i = pred->next;
+	}
+	return FALSE;
+}
@@ -0,0 +1,576 @@
+/*
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Sorts a whole array of entries at once, for when a query model's sort
+ * order changes.
+ *
+ * For the sort functions defined in rhythmdb-query-model.c, the values
+ * each one compares are fetched from the entries once, into an array of
+ * sort keys, and the keys are compared directly.  The comparisons give
+ * the same results as the sort functions themselves.  As the keys don't
+ * refer back to the database, large arrays are split into runs that are
+ * sorted in separate threads and then merged.
+ *
+ * Any other sort function is used as is, in a single thread, as it may
+ * not be safe to call from other threads.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+#include "rhythmdb-sort.h"
+#include "rhythmdb-query-model.h"
+#include "rb-debug.h"
+
+/* below this, the whole array is sorted in the calling thread */
+#define RHYTHMDB_SORT_PARALLEL_MIN		32768
+#define RHYTHMDB_SORT_MAX_THREADS		8
+
+/* runs shorter than this are insertion sorted */
+#define RHYTHMDB_SORT_INSERTION_MAX		16
+
+typedef struct {
+	RhythmDBEntry *entry;
+	const char *location;
+	const char *title;		/* title sort key */
+	const char *album;		/* album sort key */
+	const char *artist;		/* artist sort key */
+	const char *str;		/* genre sort key, or any other string */
+	gulong disc;
+	gulong track;
+	gulong num;
+	double dbl;
+	gboolean lossless;
+} RhythmDBSortKey;
+
+/* values to fetch into the sort keys */
+enum {
+	SORT_KEY_TITLE		= 1 << 0,
+	SORT_KEY_ALBUM		= 1 << 1,	/* album, disc, track and title */
+	SORT_KEY_ARTIST		= 1 << 2,
+	SORT_KEY_GENRE		= 1 << 3,
+	SORT_KEY_STRING		= 1 << 4,	/* string property from the sort data */
+	SORT_KEY_ULONG		= 1 << 5,	/* ulong property from the sort data */
+	SORT_KEY_DOUBLE_CEILING	= 1 << 6,	/* double property from the sort data */
+	SORT_KEY_BITRATE	= 1 << 7,
+	SORT_KEY_DATE		= 1 << 8
+};
+
+static int
+compare_strings (const char *a, const char *b)
+{
+	if (a == NULL) {
+		if (b == NULL)
+			return 0;
+		else
+			return -1;
+	} else if (b == NULL)
+		return 1;
+	else
+		return strcmp (a, b);
+}
+
+static int
+compare_location (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	return compare_strings (a->location, b->location);
+}
+
+static int
+compare_title (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	int ret;
+
+	ret = compare_strings (a->title, b->title);
+	if (ret != 0)
+		return ret;
+	return compare_location (a, b, data);
+}
+
+static int
+compare_album (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	int ret;
+
+	ret = compare_strings (a->album, b->album);
+	if (ret != 0)
+		return ret;
+
+	if (a->disc != b->disc)
+		return (a->disc < b->disc ? -1 : 1);
+
+	if (a->track != b->track)
+		return (a->track < b->track ? -1 : 1);
+
+	/* rhythmdb_query_model_album_sort_func only checks whether the
+	 * titles are set before going on to the location.
+	 */
+	if (a->title == NULL) {
+		if (b->title == NULL)
+			return 0;
+		else
+			return -1;
+	} else if (b->title == NULL)
+		return 1;
+
+	return compare_location (a, b, data);
+}
+
+static int
+compare_artist (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	int ret;
+
+	ret = compare_strings (a->artist, b->artist);
+	if (ret != 0)
+		return ret;
+	return compare_album (a, b, data);
+}
+
+static int
+compare_genre (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	int ret;
+
+	ret = compare_strings (a->str, b->str);
+	if (ret != 0)
+		return ret;
+	return compare_artist (a, b, data);
+}
+
+static int
+compare_string (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	int ret;
+
+	ret = compare_strings (a->str, b->str);
+	if (ret != 0)
+		return ret;
+	return compare_location (a, b, data);
+}
+
+static int
+compare_ulong (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	if (a->num != b->num)
+		return (a->num > b->num ? 1 : -1);
+	return compare_location (a, b, data);
+}
+
+static int
+compare_double (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	if (a->dbl != b->dbl)
+		return (a->dbl > b->dbl ? 1 : -1);
+	return compare_location (a, b, data);
+}
+
+static int
+compare_bitrate (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	if (a->lossless) {
+		if (b->lossless)
+			return compare_location (a, b, data);
+		else
+			return 1;
+	} else if (b->lossless) {
+		return -1;
+	}
+
+	return compare_ulong (a, b, data);
+}
+
+static int
+compare_date (const RhythmDBSortKey *a, const RhythmDBSortKey *b, gpointer data)
+{
+	if (a->num != b->num)
+		return (a->num > b->num ? 1 : -1);
+	return compare_album (a, b, data);
+}
+
+static const struct {
+	GCompareDataFunc sort_func;
+	guint fields;
+	GCompareDataFunc compare;
+} sort_key_types[] = {
+	{ (GCompareDataFunc) rhythmdb_query_model_location_sort_func,
+	  0,
+	  (GCompareDataFunc) compare_location },
+	{ (GCompareDataFunc) rhythmdb_query_model_title_sort_func,
+	  SORT_KEY_TITLE,
+	  (GCompareDataFunc) compare_title },
+	{ (GCompareDataFunc) rhythmdb_query_model_album_sort_func,
+	  SORT_KEY_ALBUM,
+	  (GCompareDataFunc) compare_album },
+	{ (GCompareDataFunc) rhythmdb_query_model_track_sort_func,
+	  SORT_KEY_ALBUM,
+	  (GCompareDataFunc) compare_album },
+	{ (GCompareDataFunc) rhythmdb_query_model_artist_sort_func,
+	  SORT_KEY_ARTIST | SORT_KEY_ALBUM,
+	  (GCompareDataFunc) compare_artist },
+	{ (GCompareDataFunc) rhythmdb_query_model_genre_sort_func,
+	  SORT_KEY_GENRE | SORT_KEY_ARTIST | SORT_KEY_ALBUM,
+	  (GCompareDataFunc) compare_genre },
+	{ (GCompareDataFunc) rhythmdb_query_model_string_sort_func,
+	  SORT_KEY_STRING,
+	  (GCompareDataFunc) compare_string },
+	{ (GCompareDataFunc) rhythmdb_query_model_ulong_sort_func,
+	  SORT_KEY_ULONG,
+	  (GCompareDataFunc) compare_ulong },
+	{ (GCompareDataFunc) rhythmdb_query_model_double_ceiling_sort_func,
+	  SORT_KEY_DOUBLE_CEILING,
+	  (GCompareDataFunc) compare_double },
+	{ (GCompareDataFunc) rhythmdb_query_model_bitrate_sort_func,
+	  SORT_KEY_BITRATE,
+	  (GCompareDataFunc) compare_bitrate },
+	{ (GCompareDataFunc) rhythmdb_query_model_date_sort_func,
+	  SORT_KEY_DATE | SORT_KEY_ALBUM,
+	  (GCompareDataFunc) compare_date },
+};
+
+static void
+fetch_sort_key (RhythmDBSortKey *key, RhythmDBEntry *entry, guint fields, gpointer sort_data)
+{
+	RhythmDBPropType propid = (RhythmDBPropType) GPOINTER_TO_INT (sort_data);
+
+	memset (key, 0, sizeof (RhythmDBSortKey));
+	key->entry = entry;
+	key->location = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
+
+	if (fields & (SORT_KEY_TITLE | SORT_KEY_ALBUM))
+		key->title = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE_SORT_KEY);
+
+	if (fields & SORT_KEY_ALBUM) {
+		key->album = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ALBUM_SORT_KEY);
+		/* assume disc 1 if not set */
+		key->disc = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DISC_NUMBER);
+		if (key->disc == 0)
+			key->disc = 1;
+		key->track = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_TRACK_NUMBER);
+	}
+
+	if (fields & SORT_KEY_ARTIST)
+		key->artist = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ARTIST_SORT_KEY);
+
+	if (fields & SORT_KEY_GENRE)
+		key->str = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_GENRE_SORT_KEY);
+	else if (fields & SORT_KEY_STRING)
+		key->str = rhythmdb_entry_get_string (entry, propid);
+
+	if (fields & SORT_KEY_ULONG)
+		key->num = rhythmdb_entry_get_ulong (entry, propid);
+	else if (fields & SORT_KEY_DATE)
+		key->num = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DATE);
+	else if (fields & SORT_KEY_BITRATE) {
+		key->lossless = rhythmdb_entry_is_lossless (entry);
+		key->num = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_BITRATE);
+	}
+
+	if (fields & SORT_KEY_DOUBLE_CEILING)
+		key->dbl = ceil (rhythmdb_entry_get_double (entry, propid));
+}
+
+/* merge sort */
+
+typedef struct {
+	GCompareDataFunc compare;
+	gpointer data;
+	int sign;
+} SortCompare;
+
+static inline int
+sort_compare (const SortCompare *cmp, gpointer a, gpointer b)
+{
+	return cmp->sign * (cmp->compare) (a, b, cmp->data);
+}
+
+static void
+insertion_sort (gpointer *items, guint n, const SortCompare *cmp)
+{
+	guint i, j;
+
+	for (i = 1; i < n; i++) {
+		gpointer item = items[i];
+
+		for (j = i; j > 0 && sort_compare (cmp, items[j - 1], item) > 0; j--)
+			items[j] = items[j - 1];
+		items[j] = item;
+	}
+}
+
+/* merges src[0..mid) and src[mid..n) into dest, keeping equal items in order */
+static void
+merge_runs (gpointer *src, guint mid, guint n, gpointer *dest, const SortCompare *cmp)
+{
+	guint i = 0, j = mid, k = 0;
+
+	while (i < mid && j < n) {
+		if (sort_compare (cmp, src[j], src[i]) < 0)
+			dest[k++] = src[j++];
+		else
+			dest[k++] = src[i++];
+	}
+
+	if (i < mid)
+		memcpy (dest + k, src + i, (mid - i) * sizeof (gpointer));
+	else if (j < n)
+		memcpy (dest + k, src + j, (n - j) * sizeof (gpointer));
+}
+
+/* sorts items in place, using tmp (the same size) as scratch space */
+static void
+merge_sort (gpointer *items, gpointer *tmp, guint n, const SortCompare *cmp)
+{
+	guint mid;
+
+	if (n <= RHYTHMDB_SORT_INSERTION_MAX) {
+		insertion_sort (items, n, cmp);
+		return;
+	}
+
+	mid = n / 2;
+	merge_sort (items, tmp, mid, cmp);
+	merge_sort (items + mid, tmp + mid, n - mid, cmp);
+
+	/* already in order */
+	if (sort_compare (cmp, items[mid - 1], items[mid]) <= 0)
+		return;
+
+	merge_runs (items, mid, n, tmp, cmp);
+	memcpy (items, tmp, n * sizeof (gpointer));
+}
+
+/* parallel sorting */
+
+typedef struct {
+	gpointer *src;
+	gpointer *dest;
+	guint mid;
+	guint n;
+	const SortCompare *cmp;
+} SortJob;
+
+static gpointer
+sort_job_thread (SortJob *job)
+{
+	merge_sort (job->src, job->dest, job->n, job->cmp);
+	return NULL;
+}
+
+static gpointer
+merge_job_thread (SortJob *job)
+{
+	if (job->mid < job->n)
+		merge_runs (job->src, job->mid, job->n, job->dest, job->cmp);
+	else
+		memcpy (job->dest, job->src, job->n * sizeof (gpointer));
+	return NULL;
+}
+
+static void
+run_jobs (SortJob *jobs, guint n_jobs, GThreadFunc func)
+{
+	GThread **threads;
+	guint i;
+
+	/* the first job runs in this thread while the others run */
+	threads = g_new0 (GThread *, n_jobs);
+	for (i = 1; i < n_jobs; i++) {
+		threads[i] = g_thread_create (func, &jobs[i], TRUE, NULL);
+		if (threads[i] == NULL)
+			func (&jobs[i]);
+	}
+
+	func (&jobs[0]);
+
+	for (i = 1; i < n_jobs; i++) {
+		if (threads[i] != NULL)
+			g_thread_join (threads[i]);
+	}
+	g_free (threads);
+}
+
+static guint
+sort_thread_count (guint n_items)
+{
+	long n = 1;
+
+	if (n_items < RHYTHMDB_SORT_PARALLEL_MIN || g_thread_supported () == FALSE)
+		return 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	n = CLAMP (n, 1, RHYTHMDB_SORT_MAX_THREADS);
+	return MIN ((guint) n, n_items / (RHYTHMDB_SORT_PARALLEL_MIN / 2));
+}
+
+static void
+parallel_sort (gpointer *items, guint n, guint n_threads, const SortCompare *cmp)
+{
+	gpointer *tmp;
+	gpointer *src;
+	gpointer *dest;
+	guint *bounds;
+	SortJob *jobs;
+	guint n_runs;
+	guint i;
+
+	tmp = g_new (gpointer, n);
+	jobs = g_new0 (SortJob, n_threads);
+	bounds = g_new (guint, n_threads + 1);
+
+	/* sort a run in each thread */
+	for (i = 0; i <= n_threads; i++) {
+		bounds[i] = (guint) (((guint64) n * i) / n_threads);
+	}
+	for (i = 0; i < n_threads; i++) {
+		jobs[i].src = items + bounds[i];
+		jobs[i].dest = tmp + bounds[i];
+		jobs[i].n = bounds[i + 1] - bounds[i];
+		jobs[i].cmp = cmp;
+	}
+	run_jobs (jobs, n_threads, (GThreadFunc) sort_job_thread);
+
+	/* then merge pairs of runs until there's only one left */
+	src = items;
+	dest = tmp;
+	n_runs = n_threads;
+	while (n_runs > 1) {
+		guint n_jobs = (n_runs + 1) / 2;
+		gpointer *swap;
+
+		for (i = 0; i < n_jobs; i++) {
+			guint start = bounds[i * 2];
+			guint end = bounds[MIN (i * 2 + 2, n_runs)];
+
+			jobs[i].src = src + start;
+			jobs[i].dest = dest + start;
+			jobs[i].mid = bounds[MIN (i * 2 + 1, n_runs)] - start;
+			jobs[i].n = end - start;
+			jobs[i].cmp = cmp;
+		}
+		run_jobs (jobs, n_jobs, (GThreadFunc) merge_job_thread);
+
+		for (i = 0; i <= n_jobs; i++) {
+			bounds[i] = bounds[MIN (i * 2, n_runs)];
+		}
+		n_runs = n_jobs;
+
+		swap = src;
+		src = dest;
+		dest = swap;
+	}
+
+	if (src != items)
+		memcpy (items, src, n * sizeof (gpointer));
+
+	g_free (bounds);
+	g_free (jobs);
+	g_free (tmp);
+}
+
+/**
+ * rhythmdb_sort_entries:
+ * @entries: array of entries to sort
+ * @n_entries: number of entries in the array
+ * @sort_func: sort function
+ * @sort_data: data to pass to the sort function
+ * @sort_reverse: if %TRUE, sort in descending order
+ *
+ * Sorts an array of entries in place, in the same order that
+ * inserting them one at a time using @sort_func would produce.
+ * The database must not be modified while this runs.
+ */
+void
+rhythmdb_sort_entries (RhythmDBEntry **entries,
+		       guint n_entries,
+		       GCompareDataFunc sort_func,
+		       gpointer sort_data,
+		       gboolean sort_reverse)
+{
+	SortCompare cmp;
+	RhythmDBSortKey *keys;
+	gpointer *items;
+	gpointer *tmp;
+	guint n_threads;
+	guint type;
+	guint i;
+
+	if (sort_func == NULL || n_entries < 2)
+		return;
+
+	cmp.sign = sort_reverse ? -1 : 1;
+
+	for (type = 0; type < G_N_ELEMENTS (sort_key_types); type++) {
+		if (sort_key_types[type].sort_func == sort_func)
+			break;
+	}
+
+	if (type == G_N_ELEMENTS (sort_key_types)) {
+		/* not one of ours; use it directly */
+		cmp.compare = sort_func;
+		cmp.data = sort_data;
+
+		tmp = g_new (gpointer, n_entries);
+		merge_sort ((gpointer *) entries, tmp, n_entries, &cmp);
+		g_free (tmp);
+		return;
+	}
+
+	keys = g_new (RhythmDBSortKey, n_entries);
+	items = g_new (gpointer, n_entries);
+	for (i = 0; i < n_entries; i++) {
+		fetch_sort_key (&keys[i], entries[i], sort_key_types[type].fields, sort_data);
+		items[i] = &keys[i];
+	}
+
+	cmp.compare = sort_key_types[type].compare;
+	cmp.data = NULL;
+
+	n_threads = sort_thread_count (n_entries);
+	rb_debug ("sorting %u entries using %u threads", n_entries, n_threads);
+	if (n_threads > 1) {
+		parallel_sort (items, n_entries, n_threads, &cmp);
+	} else {
+		tmp = g_new (gpointer, n_entries);
+		merge_sort (items, tmp, n_entries, &cmp);
+		g_free (tmp);
+	}
+
+	for (i = 0; i < n_entries; i++) {
+		entries[i] = ((RhythmDBSortKey *) items[i])->entry;
+	}
+
+	g_free (items);
+	g_free (keys);
+}
@@ -44,6 +44,7 @@
 #include <math.h>
 #include <glib/gprintf.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <glib/gi18n.h>
 #include <gtk/gtk.h>
 #include <libxml/entities.h>
@@ -52,6 +53,7 @@
 
 #include "rhythmdb-private.h"
 #include "rhythmdb-tree.h"
+#include "rhythmdb-query-plan.h"
 #include "rhythmdb-property-model.h"
 #include "rb-debug.h"
 #include "rb-util.h"
@@ -71,6 +73,14 @@ typedef struct RhythmDBTreeProperty
 G_DEFINE_TYPE(RhythmDBTree, rhythmdb_tree, RHYTHMDB_TYPE)
 
 static void rhythmdb_tree_finalize (GObject *object);
+static void rhythmdb_tree_set_property (GObject *object,
+					guint prop_id,
+					const GValue *value,
+					GParamSpec *pspec);
+static void rhythmdb_tree_get_property (GObject *object,
+					guint prop_id,
+					GValue *value,
+					GParamSpec *pspec);
 
 static gboolean rhythmdb_tree_load (RhythmDB *rdb, GCancellable *cancel, GError **error);
 static void rhythmdb_tree_save (RhythmDB *rdb);
@@ -131,10 +141,56 @@ static RhythmDBTreeProperty *get_or_create_genre (RhythmDBTree *db, RhythmDBEntr
 static void remove_entry_from_album (RhythmDBTree *db, RhythmDBEntry *entry);
 static void remove_entry_from_keywords (RhythmDBTree *db, RhythmDBEntry *entry);
 
+static void free_search_posting (GPtrArray *posting);
+static void search_index_entry_added (RhythmDBTree *db, RhythmDBEntry *entry);
+static void search_index_entry_removed (RhythmDBTree *db, RhythmDBEntry *entry);
+static void search_index_entry_changed (RhythmDBTree *db, RhythmDBEntry *entry,
+					RhythmDBPropType propid, const char *value);
+static void search_index_invalidate (RhythmDBTree *db);
+
+static void range_index_entry_added (RhythmDBTree *db, RhythmDBEntry *entry);
+static void range_index_entry_removed (RhythmDBTree *db, RhythmDBEntry *entry);
+static void range_index_entry_changed (RhythmDBTree *db, RhythmDBEntry *entry,
+				       RhythmDBPropType propid, const GValue *value);
+static void range_index_invalidate (RhythmDBTree *db);
+
+static gboolean rhythmdb_tree_load_snapshot (RhythmDBTree *db, const char *name,
+					     GCancellable *cancel);
+static void rhythmdb_tree_save_snapshot (RhythmDBTree *db, const char *name);
+
+static void journal_entry_added (RhythmDBTree *db, RhythmDBEntry *entry);
+static void journal_entry_deleted (RhythmDBTree *db, RhythmDBEntry *entry);
+static void journal_entry_set (RhythmDBTree *db, RhythmDBEntry *entry,
+			       RhythmDBPropType propid, const GValue *value);
+static void journal_entry_keyword (RhythmDBTree *db, RhythmDBEntry *entry,
+				   RBRefString *keyword, gboolean added);
+static void journal_entries_deleted_by_type (RhythmDBTree *db, RhythmDBEntryType type);
+static void rhythmdb_tree_journal_replay (RhythmDBTree *db, const char *name);
+static gboolean rhythmdb_tree_journal_flush (RhythmDBTree *db, const char *name, gboolean force);
+static void rhythmdb_tree_journal_reset (RhythmDBTree *db, const char *name, GString *pending);
+
 static GList *split_query_by_disjunctions (RhythmDBTree *db, GPtrArray *query);
 static gboolean evaluate_conjunctive_subquery (RhythmDBTree *db, GPtrArray *query,
 					       guint base, guint max, RhythmDBEntry *entry);
 
+#define RHYTHMDB_TREE_NUM_RANGE_INDEXES 7
+
+static const RhythmDBPropType range_index_props[RHYTHMDB_TREE_NUM_RANGE_INDEXES] = {
+	RHYTHMDB_PROP_RATING,
+	RHYTHMDB_PROP_PLAY_COUNT,
+	RHYTHMDB_PROP_LAST_PLAYED,
+	RHYTHMDB_PROP_FIRST_SEEN,
+	RHYTHMDB_PROP_DURATION,
+	RHYTHMDB_PROP_FILE_SIZE,
+	RHYTHMDB_PROP_DATE
+};
+
+typedef struct
+{
+	GSequence *nodes;		/* RhythmDBTreeRangeNode, sorted by key */
+	GHashTable *entry_nodes;	/* GHashTable<RhythmDBEntry, GSequenceIter> */
+} RhythmDBTreeRangeIndex;
+
 struct RhythmDBTreePrivate
 {
 	GHashTable *entries;
@@ -147,9 +203,28 @@ struct RhythmDBTreePrivate
 	GHashTable *genres;
 	GMutex *genres_lock; /* must be held while using the tree */
 
+	GHashTable *search_index; /* GHashTable<trigram, GPtrArray<RhythmDBEntry>> */
+	GMutex *search_index_lock;
+	gboolean search_index_valid;
+
+	RhythmDBTreeRangeIndex range_index[RHYTHMDB_TREE_NUM_RANGE_INDEXES];
+	GMutex *range_index_lock;
+	gboolean range_index_valid;
+
 	GHashTable *unknown_entry_types;
 	gboolean finalizing;
 
+	gboolean use_snapshot;
+
+	gboolean use_journal;
+	GMutex *journal_lock;
+	GString *journal;		/* records not yet written to the journal file */
+	guint journal_records;		/* records since the XML file was written */
+	gboolean journal_active;	/* whether changes are being journalled */
+	guint64 journal_size;		/* size of the journal file */
+	guint64 journal_xml_size;	/* size and mtime (in ns) of the XML file the journal applies to */
+	guint64 journal_xml_mtime;
+
 	guint idle_load_id;
 };
 
@@ -170,6 +245,8 @@ typedef struct
 enum
 {
 	PROP_0,
+	PROP_USE_SNAPSHOT,
+	PROP_USE_JOURNAL
 };
 
 const int RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE = 512;
@@ -191,6 +268,8 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	RhythmDBClass *rhythmdb_class = RHYTHMDB_CLASS (klass);
 
 	object_class->finalize = rhythmdb_tree_finalize;
+	object_class->set_property = rhythmdb_tree_set_property;
+	object_class->get_property = rhythmdb_tree_get_property;
 
 	rhythmdb_class->impl_load = rhythmdb_tree_load;
 	rhythmdb_class->impl_save = rhythmdb_tree_save;
@@ -212,12 +291,45 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	rhythmdb_class->impl_do_full_query = rhythmdb_tree_do_full_query;
 	rhythmdb_class->impl_entry_type_registered = rhythmdb_tree_entry_type_registered;
 
+	/**
+	 * RhythmDBTree:use-snapshot:
+	 *
+	 * If TRUE, a binary snapshot of the database is written alongside the
+	 * XML file when saving, and is loaded instead of the XML file when it
+	 * is up to date.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_USE_SNAPSHOT,
+					 g_param_spec_boolean ("use-snapshot",
+							       "use-snapshot",
+							       "Whether to save and load binary snapshots",
+							       TRUE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+
+	/**
+	 * RhythmDBTree:use-journal:
+	 *
+	 * If TRUE, regular saves append the changes made since the last save
+	 * to a journal file instead of rewriting the whole XML file.  The
+	 * journal is folded into the XML file when it gets too large and on
+	 * explicit saves.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_USE_JOURNAL,
+					 g_param_spec_boolean ("use-journal",
+							       "use-journal",
+							       "Whether to journal changes between full saves",
+							       TRUE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+
 	g_type_class_add_private (klass, sizeof (RhythmDBTreePrivate));
 }
 
 static void
 rhythmdb_tree_init (RhythmDBTree *db)
 {
+	guint i;
+
 	db->priv = RHYTHMDB_TREE_GET_PRIVATE (db);
 
 	db->priv->entries = g_hash_table_new (rb_refstring_hash, rb_refstring_equal);
@@ -232,6 +344,21 @@ rhythmdb_tree_init (RhythmDBTree *db)
 	db->priv->genres = g_hash_table_new_full (g_direct_hash, g_direct_equal,
 						  NULL, (GDestroyNotify)g_hash_table_destroy);
 
+	db->priv->search_index_lock = g_mutex_new();
+	db->priv->search_index = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							NULL, (GDestroyNotify)free_search_posting);
+	db->priv->search_index_valid = FALSE;
+
+	db->priv->range_index_lock = g_mutex_new();
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		db->priv->range_index[i].nodes = g_sequence_new (g_free);
+		db->priv->range_index[i].entry_nodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+	db->priv->range_index_valid = FALSE;
+
+	db->priv->journal_lock = g_mutex_new ();
+	db->priv->journal = g_string_new (NULL);
+
 	db->priv->unknown_entry_types = g_hash_table_new (rb_refstring_hash, rb_refstring_equal);
 }
 
@@ -276,6 +403,7 @@ static void
 rhythmdb_tree_finalize (GObject *object)
 {
 	RhythmDBTree *db;
+	guint i;
 
 	g_return_if_fail (object != NULL);
 	g_return_if_fail (RHYTHMDB_IS_TREE (object));
@@ -300,6 +428,18 @@ rhythmdb_tree_finalize (GObject *object)
 	g_hash_table_destroy (db->priv->genres);
 	g_mutex_free (db->priv->genres_lock);
 
+	g_hash_table_destroy (db->priv->search_index);
+	g_mutex_free (db->priv->search_index_lock);
+
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		g_sequence_free (db->priv->range_index[i].nodes);
+		g_hash_table_destroy (db->priv->range_index[i].entry_nodes);
+	}
+	g_mutex_free (db->priv->range_index_lock);
+
+	g_string_free (db->priv->journal, TRUE);
+	g_mutex_free (db->priv->journal_lock);
+
 	g_hash_table_foreach (db->priv->unknown_entry_types,
 			      (GHFunc) free_unknown_entries,
 			      NULL);
@@ -308,6 +448,48 @@ rhythmdb_tree_finalize (GObject *object)
 	G_OBJECT_CLASS (rhythmdb_tree_parent_class)->finalize (object);
 }
 
+static void
+rhythmdb_tree_set_property (GObject *object,
+			    guint prop_id,
+			    const GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_USE_SNAPSHOT:
+		db->priv->use_snapshot = g_value_get_boolean (value);
+		break;
+	case PROP_USE_JOURNAL:
+		db->priv->use_journal = g_value_get_boolean (value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+rhythmdb_tree_get_property (GObject *object,
+			    guint prop_id,
+			    GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_USE_SNAPSHOT:
+		g_value_set_boolean (value, db->priv->use_snapshot);
+		break;
+	case PROP_USE_JOURNAL:
+		g_value_set_boolean (value, db->priv->use_journal);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
 struct RhythmDBTreeLoadContext
 {
 	RhythmDBTree *db;
@@ -329,6 +511,7 @@ struct RhythmDBTreeLoadContext
 	GString *buf;
 	RhythmDBPropType propid;
 	gint batch_count;
+	GPtrArray *batch;	/* entries read, if parsing part of the file */
 	GError **error;
 
 	/* updating */
@@ -485,6 +668,79 @@ rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
 	}
 }
 
+/* adds the entry that has just been read to the database, merging it with
+ * any existing entry with the same location.
+ */
+static void
+rhythmdb_tree_load_add_entry (struct RhythmDBTreeLoadContext *ctx)
+{
+	if (ctx->entry->location != NULL && rb_refstring_get (ctx->entry->location)[0] != '\0') {
+		RhythmDBEntry *entry;
+
+		g_mutex_lock (ctx->db->priv->entries_lock);
+		entry = g_hash_table_lookup (ctx->db->priv->entries, ctx->entry->location);
+		if (entry == NULL) {
+			rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
+			rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
+			if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+				rhythmdb_commit (RHYTHMDB (ctx->db));
+				ctx->batch_count = 0;
+			}
+		} else if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
+			   entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
+			rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
+				  rb_refstring_get (ctx->entry->location));
+
+			ctx->entry->play_count += entry->play_count;
+			if (ctx->entry->last_played < entry->last_played)
+				ctx->entry->last_played = entry->last_played;
+
+			/* Remove the song entry,
+			 * deleting requires relinquishing the locks */
+			g_mutex_unlock (ctx->db->priv->entries_lock);
+			rhythmdb_entry_delete (RHYTHMDB(ctx->db), entry);
+			g_mutex_lock (ctx->db->priv->entries_lock);
+			rhythmdb_commit (RHYTHMDB (ctx->db));
+
+			/* And add the Podcast entry to the database */
+			rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
+			rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
+			if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+				rhythmdb_commit (RHYTHMDB (ctx->db));
+				ctx->batch_count = 0;
+			}
+		} else {
+			rb_debug ("found entry with duplicate location %s. merging metadata",
+				  rb_refstring_get (ctx->entry->location));
+
+			range_index_entry_removed (ctx->db, entry);
+
+			entry->play_count += ctx->entry->play_count;
+
+			if (entry->rating < 0.01)
+				entry->rating = ctx->entry->rating;
+			else if (ctx->entry->rating > 0.01)
+				entry->rating = (entry->rating + ctx->entry->rating) / 2;
+
+			if (ctx->entry->last_played > entry->last_played)
+				entry->last_played = ctx->entry->last_played;
+
+			if (ctx->entry->first_seen < entry->first_seen)
+				entry->first_seen = ctx->entry->first_seen;
+
+			if (ctx->entry->last_seen > entry->last_seen)
+				entry->last_seen = ctx->entry->last_seen;
+
+			range_index_entry_added (ctx->db, entry);
+			rhythmdb_entry_unref (ctx->entry);
+		}
+		g_mutex_unlock (ctx->db->priv->entries_lock);
+	} else {
+		rb_debug ("found entry without location");
+		rhythmdb_entry_unref (ctx->entry);
+	}
+}
+
 static void
 rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 				  const char *name)
@@ -538,67 +794,11 @@ rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 			}
 		}
 
-		if (ctx->entry->location != NULL && rb_refstring_get (ctx->entry->location)[0] != '\0') {
-			RhythmDBEntry *entry;
-
-			g_mutex_lock (ctx->db->priv->entries_lock);
-			entry = g_hash_table_lookup (ctx->db->priv->entries, ctx->entry->location);
-			if (entry == NULL) {
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
-				   entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
-				rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
-
-				ctx->entry->play_count += entry->play_count;
-				if (ctx->entry->last_played < entry->last_played)
-					ctx->entry->last_played = entry->last_played;
-
-				/* Remove the song entry,
-				 * deleting requires relinquishing the locks */
-				g_mutex_unlock (ctx->db->priv->entries_lock);
-				rhythmdb_entry_delete (RHYTHMDB(ctx->db), entry);
-				g_mutex_lock (ctx->db->priv->entries_lock);
-				rhythmdb_commit (RHYTHMDB (ctx->db));
-
-				/* And add the Podcast entry to the database */
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else {
-				rb_debug ("found entry with duplicate location %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
-
-				entry->play_count += ctx->entry->play_count;
-
-				if (entry->rating < 0.01)
-					entry->rating = ctx->entry->rating;
-				else if (ctx->entry->rating > 0.01)
-					entry->rating = (entry->rating + ctx->entry->rating) / 2;
-
-				if (ctx->entry->last_played > entry->last_played)
-					entry->last_played = ctx->entry->last_played;
-
-				if (ctx->entry->first_seen < entry->first_seen)
-					entry->first_seen = ctx->entry->first_seen;
-
-				if (ctx->entry->last_seen > entry->last_seen)
-					entry->last_seen = ctx->entry->last_seen;
-
-				rhythmdb_entry_unref (ctx->entry);
-			}
-			g_mutex_unlock (ctx->db->priv->entries_lock);
+		if (ctx->batch != NULL) {
+			/* parsing part of the file on a worker thread */
+			g_ptr_array_add (ctx->batch, ctx->entry);
 		} else {
-			rb_debug ("found entry without location");
-			rhythmdb_entry_unref (ctx->entry);
+			rhythmdb_tree_load_add_entry (ctx);
 		}
 		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
 		ctx->entry = NULL;
@@ -713,6 +913,235 @@ rhythmdb_tree_parser_characters (struct RhythmDBTreeLoadContext *ctx,
 	}
 }
 
+/*
+ * Large databases are parsed in parallel.  The file is split into chunks
+ * at <entry> element boundaries, and each chunk is parsed on its own
+ * thread as a document of its own, with the original <rhythmdb> start
+ * tag in front of it.  Parsing an entry (including interning its strings,
+ * which is most of the work) doesn't touch the database structure, so the
+ * parsed entries are just collected for each chunk, then added to the
+ * database in file order on the load thread.
+ */
+
+#define RHYTHMDB_TREE_PARALLEL_LOAD_MIN_SIZE	(256 * 1024)
+#define RHYTHMDB_TREE_MAX_LOAD_THREADS		8
+
+static const char rhythmdb_tree_load_chunk_end[] = "</rhythmdb>\n";
+
+struct RhythmDBTreeLoadChunk
+{
+	struct RhythmDBTreeLoadContext ctx;
+	xmlSAXHandlerPtr sax_handler;
+	const char *name;
+	const char *header;
+	gsize header_len;
+	const char *data;
+	gsize len;
+	GError *error;
+};
+
+static int
+rhythmdb_tree_load_thread_count (void)
+{
+	const char *env;
+	long n;
+
+	env = g_getenv ("RB_DB_LOAD_THREADS");
+	if (env != NULL) {
+		n = strtol (env, NULL, 10);
+		if (n > 0)
+			return MIN (n, RHYTHMDB_TREE_MAX_LOAD_THREADS);
+	}
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n > 1)
+		return MIN (n, RHYTHMDB_TREE_MAX_LOAD_THREADS);
+#endif
+	return 1;
+}
+
+static const char *
+find_string (const char *data, gsize len, const char *str)
+{
+	gsize str_len = strlen (str);
+	const char *p;
+	const char *end;
+
+	if (len < str_len)
+		return NULL;
+
+	end = data + len - str_len;
+	for (p = data; p <= end; p++) {
+		p = memchr (p, str[0], end - p + 1);
+		if (p == NULL)
+			return NULL;
+		if (memcmp (p, str, str_len) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+static gpointer
+rhythmdb_tree_load_chunk (struct RhythmDBTreeLoadChunk *chunk)
+{
+	xmlParserCtxtPtr ctxt;
+
+	ctxt = xmlCreatePushParserCtxt (chunk->sax_handler, &chunk->ctx, NULL, 0, chunk->name);
+	if (ctxt == NULL)
+		return NULL;
+
+	chunk->ctx.xmlctx = ctxt;
+	xmlParseChunk (ctxt, chunk->header, chunk->header_len, 0);
+	xmlParseChunk (ctxt, chunk->data, chunk->len, 0);
+	xmlParseChunk (ctxt, rhythmdb_tree_load_chunk_end, strlen (rhythmdb_tree_load_chunk_end), 1);
+	xmlFreeParserCtxt (ctxt);
+	return NULL;
+}
+
+/*
+ * Loads the XML file @name using several threads.  Returns FALSE without
+ * loading anything if the file should be loaded the normal way.
+ */
+static gboolean
+rhythmdb_tree_load_parallel (RhythmDBTree *db,
+			     const char *name,
+			     xmlSAXHandlerPtr sax_handler,
+			     GCancellable *cancel,
+			     GError **error)
+{
+	struct RhythmDBTreeLoadContext ctx;
+	struct RhythmDBTreeLoadChunk *chunks;
+	GThread **threads;
+	GMappedFile *mapped;
+	const char *data;
+	const char *body;
+	const char *body_end;
+	const char *p;
+	gsize len;
+	int n_threads;
+	int n_chunks;
+	int i;
+	guint j;
+
+	n_threads = rhythmdb_tree_load_thread_count ();
+	if (n_threads < 2)
+		return FALSE;
+
+	mapped = g_mapped_file_new (name, FALSE, NULL);
+	if (mapped == NULL)
+		return FALSE;
+
+	data = g_mapped_file_get_contents (mapped);
+	len = g_mapped_file_get_length (mapped);
+	if (len < RHYTHMDB_TREE_PARALLEL_LOAD_MIN_SIZE) {
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+
+	/* everything up to the end of the <rhythmdb> start tag goes in front
+	 * of each chunk, so the chunks are parsed for the right version.
+	 */
+	body = find_string (data, len, "<rhythmdb");
+	if (body != NULL)
+		body = memchr (body, '>', len - (body - data));
+	body_end = NULL;
+	for (p = data + len - strlen ("</rhythmdb>"); body != NULL && p > body; p--) {
+		if (memcmp (p, "</rhythmdb>", strlen ("</rhythmdb>")) == 0) {
+			body_end = p;
+			break;
+		}
+	}
+	if (body == NULL || body_end == NULL) {
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+	body++;
+
+	rb_profile_start ("parallel database load");
+	xmlInitParser ();
+
+	/* split the body at the first <entry> after each equal division */
+	chunks = g_new0 (struct RhythmDBTreeLoadChunk, n_threads);
+	n_chunks = 0;
+	p = body;
+	for (i = 0; i < n_threads && p < body_end; i++) {
+		const char *next = NULL;
+
+		if (i < n_threads - 1) {
+			const char *target = body + (body_end - body) * (i + 1) / n_threads;
+
+			if (target > p)
+				next = find_string (target, body_end - target, "<entry ");
+		}
+		if (next == NULL)
+			next = body_end;
+
+		chunks[n_chunks].sax_handler = sax_handler;
+		chunks[n_chunks].name = name;
+		chunks[n_chunks].header = data;
+		chunks[n_chunks].header_len = body - data;
+		chunks[n_chunks].data = p;
+		chunks[n_chunks].len = next - p;
+		chunks[n_chunks].ctx.state = RHYTHMDB_TREE_PARSER_STATE_START;
+		chunks[n_chunks].ctx.db = db;
+		chunks[n_chunks].ctx.cancel = cancel;
+		chunks[n_chunks].ctx.buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+		chunks[n_chunks].ctx.batch = g_ptr_array_new ();
+		chunks[n_chunks].ctx.error = &chunks[n_chunks].error;
+		n_chunks++;
+		p = next;
+	}
+
+	rb_debug ("parsing %s in %d chunks", name, n_chunks);
+	threads = g_new0 (GThread *, n_chunks);
+	for (i = 1; i < n_chunks; i++) {
+		threads[i] = g_thread_create ((GThreadFunc) rhythmdb_tree_load_chunk, &chunks[i], TRUE, NULL);
+		if (threads[i] == NULL)
+			rhythmdb_tree_load_chunk (&chunks[i]);
+	}
+	rhythmdb_tree_load_chunk (&chunks[0]);
+	for (i = 1; i < n_chunks; i++) {
+		if (threads[i] != NULL)
+			g_thread_join (threads[i]);
+	}
+	g_free (threads);
+
+	/* now add the entries in the order they appear in the file, so
+	 * duplicates are merged the same way as when loading sequentially.
+	 */
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.db = db;
+	ctx.cancel = cancel;
+	for (i = 0; i < n_chunks; i++) {
+		if (chunks[i].error != NULL) {
+			if (error != NULL && *error == NULL)
+				g_propagate_error (error, chunks[i].error);
+			else
+				g_error_free (chunks[i].error);
+		}
+
+		for (j = 0; j < chunks[i].ctx.batch->len; j++) {
+			ctx.entry = g_ptr_array_index (chunks[i].ctx.batch, j);
+			if ((error != NULL && *error != NULL) || g_cancellable_is_cancelled (cancel))
+				rhythmdb_entry_unref (ctx.entry);
+			else
+				rhythmdb_tree_load_add_entry (&ctx);
+		}
+
+		g_ptr_array_free (chunks[i].ctx.batch, TRUE);
+		g_string_free (chunks[i].ctx.buf, TRUE);
+	}
+	if (ctx.batch_count)
+		rhythmdb_commit (RHYTHMDB (db));
+
+	g_free (chunks);
+	g_mapped_file_free (mapped);
+
+	rb_profile_end ("parallel database load");
+	return TRUE;
+}
+
 static gboolean
 rhythmdb_tree_load (RhythmDB *rdb,
 		    GCancellable *cancel,
@@ -743,7 +1172,11 @@ rhythmdb_tree_load (RhythmDB *rdb,
 
 	g_object_get (G_OBJECT (db), "name", &name, NULL);
 
-	if (g_file_test (name, G_FILE_TEST_EXISTS)) {
+	if (rhythmdb_tree_load_snapshot (db, name, cancel)) {
+		rb_debug ("loaded database from snapshot");
+	} else if (rhythmdb_tree_load_parallel (db, name, sax_handler, cancel, &local_error)) {
+		rb_debug ("loaded database using multiple threads");
+	} else if (g_file_test (name, G_FILE_TEST_EXISTS)) {
 		ctxt = xmlCreateFileParserCtxt (name);
 		ctx->xmlctx = ctxt;
 		xmlFree (ctxt->sax);
@@ -761,6 +1194,8 @@ rhythmdb_tree_load (RhythmDB *rdb,
 	if (local_error != NULL) {
 		g_propagate_error (error, local_error);
 		ret = FALSE;
+	} else if (g_cancellable_is_cancelled (cancel) == FALSE) {
+		rhythmdb_tree_journal_replay (db, name);
 	}
 
 	g_string_free (ctx->buf, TRUE);
@@ -1173,11 +1608,27 @@ rhythmdb_tree_save (RhythmDB *rdb)
 	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
 	char *name;
 	GString *savepath;
+	GString *pending;
 	FILE *f;
 	struct RhythmDBTreeSaveContext ctx;
 
 	g_object_get (G_OBJECT (db), "name", &name, NULL);
 
+	/* regular saves just write out the journal, unless it's getting too big */
+	if (rhythmdb_tree_journal_flush (db, name, rdb->priv->saving_full)) {
+		g_free (name);
+		return;
+	}
+
+	/* changes made from here on will be journalled against the new XML
+	 * file.  the ones we've already got will be in it, unless it can't
+	 * be written, in which case they're put back in the journal.
+	 */
+	g_mutex_lock (db->priv->journal_lock);
+	pending = db->priv->journal;
+	db->priv->journal = g_string_new (NULL);
+	g_mutex_unlock (db->priv->journal_lock);
+
 	savepath = g_string_new (name);
 	g_string_append (savepath, ".tmp");
 
@@ -1185,6 +1636,7 @@ rhythmdb_tree_save (RhythmDB *rdb)
 
 	if (!f) {
 		g_warning ("Can't save XML: %s", g_strerror (errno));
+		rhythmdb_tree_journal_reset (db, NULL, pending);
 		goto out;
 	}
 
@@ -1209,6 +1661,7 @@ rhythmdb_tree_save (RhythmDB *rdb)
 			   savepath->str,
 			   g_strerror (errno));
 		unlink (savepath->str);
+		rhythmdb_tree_journal_reset (db, NULL, pending);
 		goto out;
 	}
 
@@ -1216,12 +1669,18 @@ rhythmdb_tree_save (RhythmDB *rdb)
 		g_warning ("Writing to the database failed: %s", ctx.error);
 		g_free (ctx.error);
 		unlink (savepath->str);
+		rhythmdb_tree_journal_reset (db, NULL, pending);
 	} else {
 		if (rename (savepath->str, name) < 0) {
 			g_warning ("Couldn't rename %s to %s: %s",
 				   name, savepath->str,
 				   g_strerror (errno));
 			unlink (savepath->str);
+			rhythmdb_tree_journal_reset (db, NULL, pending);
+		} else {
+			if (db->priv->use_snapshot)
+				rhythmdb_tree_save_snapshot (db, name);
+			rhythmdb_tree_journal_reset (db, name, pending);
 		}
 	}
 
@@ -1236,462 +1695,2526 @@ out:
 #undef RHYTHMDB_FPUTC
 #undef RHYTHMDB_FWRITE
 
-RhythmDB *
-rhythmdb_tree_new (const char *name)
-{
-	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
+/*
+ * Binary snapshots.
+ *
+ * Parsing the XML file and interning every string in it dominates startup
+ * time for large libraries, so each time the XML file is saved we also
+ * write a snapshot of the database next to it.  The snapshot has a table
+ * of distinct strings and a fixed-size record for each entry.  Loading it
+ * maps the file into memory, interns each string once, and fills in the
+ * entries directly.
+ *
+ * The XML file is still the real database; it's what older versions read
+ * and what users edit.  The snapshot records the size and modification
+ * time of the XML file it was written with, and is ignored unless they
+ * still match.  The modification time includes nanoseconds where the
+ * platform has them, so rewriting the XML file within the same second
+ * still invalidates the snapshot.  It's written in the machine's native byte order and
+ * structure layout, and is also ignored if those don't match.
+ *
+ * Layout: header, string offsets, entry records, keyword string ids,
+ * unknown entry records, unknown entry property (name, value) string ids,
+ * and the NUL-terminated string data.  Each section starts on an 8 byte
+ * boundary.
+ */
 
-	g_return_val_if_fail (db->priv != NULL, NULL);
+#define RHYTHMDB_TREE_SNAPSHOT_SUFFIX	".snapshot"
+#define RHYTHMDB_TREE_SNAPSHOT_MAGIC	"RBDBSNAP"
+#define RHYTHMDB_TREE_SNAPSHOT_VERSION	2
+#define RHYTHMDB_TREE_SNAPSHOT_NO_STRING	G_MAXUINT32
+#define RHYTHMDB_TREE_SNAPSHOT_HIDDEN	1
+#define SNAPSHOT_ALIGN(x)		(((x) + 7) & ~((guint64) 7))
 
-	return RHYTHMDB (db);
+/* modification time of the XML file in nanoseconds, for telling
+ * versions of it apart
+ */
+static guint64
+rhythmdb_tree_stat_mtime (const struct stat *st)
+{
+	guint64 mtime;
+
+	mtime = (guint64) st->st_mtime * G_GUINT64_CONSTANT (1000000000);
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	mtime += st->st_mtim.tv_nsec;
+#endif
+	return mtime;
 }
 
-/* must be called with the genres_lock held */
-static void
-set_entry_album (RhythmDBTree *db,
-		 RhythmDBEntry *entry,
-		 RhythmDBTreeProperty *artist,
-		 RBRefString *name)
+enum {
+	SNAPSHOT_TITLE,
+	SNAPSHOT_ARTIST,
+	SNAPSHOT_ALBUM,
+	SNAPSHOT_GENRE,
+	SNAPSHOT_MUSICBRAINZ_TRACKID,
+	SNAPSHOT_MUSICBRAINZ_ARTISTID,
+	SNAPSHOT_MUSICBRAINZ_ALBUMID,
+	SNAPSHOT_MUSICBRAINZ_ALBUMARTISTID,
+	SNAPSHOT_ARTIST_SORTNAME,
+	SNAPSHOT_ALBUM_SORTNAME,
+	SNAPSHOT_LOCATION,
+	SNAPSHOT_MOUNTPOINT,
+	SNAPSHOT_MIMETYPE,
+	SNAPSHOT_DESCRIPTION,
+	SNAPSHOT_SUBTITLE,
+	SNAPSHOT_SUMMARY,
+	SNAPSHOT_LANG,
+	SNAPSHOT_COPYRIGHT,
+	SNAPSHOT_IMAGE,
+	SNAPSHOT_NUM_STRINGS
+};
+
+typedef struct
 {
-	struct RhythmDBTreeProperty *prop;
+	char magic[8];
+	guint32 version;
+	guint32 header_size;
+	guint32 entry_size;
+	guint32 xml_version;
+	guint64 xml_size;
+	guint64 xml_mtime;
+	guint32 n_strings;
+	guint32 n_entries;
+	guint32 n_keywords;
+	guint32 n_unknown_entries;
+	guint32 n_unknown_props;
+	guint32 unused;
+	guint64 string_data_size;
+} RhythmDBTreeSnapshotHeader;
 
-	prop = get_or_create_album (db, artist, name);
-	g_hash_table_insert (prop->children, entry, NULL);
-	entry->data = prop;
-}
+typedef struct
+{
+	guint64 file_size;
+	guint64 tracknum;
+	guint64 discnum;
+	guint64 duration;
+	guint64 bitrate;
+	guint64 date;
+	guint64 mtime;
+	guint64 first_seen;
+	guint64 last_seen;
+	guint64 play_count;
+	guint64 last_played;
+	guint64 status;
+	guint64 post_time;
+	double track_gain;
+	double track_peak;
+	double album_gain;
+	double album_peak;
+	double rating;
+	guint32 type;
+	guint32 flags;
+	guint32 strings[SNAPSHOT_NUM_STRINGS];
+	guint32 keywords_start;
+	guint32 n_keywords;
+} RhythmDBTreeSnapshotEntry;
 
-static void
-rhythmdb_tree_entry_new (RhythmDB *rdb,
-			 RhythmDBEntry *entry)
+typedef struct
 {
-	g_mutex_lock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
-	rhythmdb_tree_entry_new_internal (rdb, entry);
-	g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
-}
+	guint32 type;
+	guint32 props_start;
+	guint32 n_props;
+} RhythmDBTreeSnapshotUnknownEntry;
 
-/* must be called with the entry lock held */
-static void
-rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
+struct RhythmDBTreeSnapshotSaveContext
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
-	RhythmDBTreeProperty *artist;
-	RhythmDBTreeProperty *genre;
+	RhythmDBTree *db;
+	GHashTable *string_ids;		/* RBRefString -> id + 1 */
+	GPtrArray *strings;		/* referenced RBRefStrings, by id */
+	GArray *string_offsets;
+	GString *string_data;
+	GArray *entries;
+	GArray *keywords;
+	GArray *unknown_entries;
+	GArray *unknown_props;
+};
 
-	rb_assert_locked (db->priv->entries_lock);
-	g_assert (entry != NULL);
+static guint32
+snapshot_string_id (struct RhythmDBTreeSnapshotSaveContext *ctx, RBRefString *str)
+{
+	gpointer id;
+	guint32 offset;
 
-	g_return_if_fail (entry->location != NULL);
+	if (str == NULL)
+		return RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
 
-	if (entry->title == NULL) {
-		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
-		entry->title = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->artist == NULL) {
-		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
-		entry->artist = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->album == NULL) {
-		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
-		entry->album = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->genre == NULL) {
-		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
-		entry->genre = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->mimetype == NULL) {
-		g_warning ("Entry %s has missing mimetype", rb_refstring_get (entry->location));
-		entry->mimetype = rb_refstring_new ("unknown/unknown");
-	}
+	id = g_hash_table_lookup (ctx->string_ids, str);
+	if (id != NULL)
+		return GPOINTER_TO_UINT (id) - 1;
 
-	/* Initialize the tree structure. */
-	g_mutex_lock (db->priv->genres_lock);
-	genre = get_or_create_genre (db, entry->type, entry->genre);
-	artist = get_or_create_artist (db, genre, entry->artist);
-	set_entry_album (db, entry, artist, entry->album);
-	g_mutex_unlock (db->priv->genres_lock);
+	rb_refstring_ref (str);
+	g_ptr_array_add (ctx->strings, str);
+	g_hash_table_insert (ctx->string_ids, str, GUINT_TO_POINTER (ctx->strings->len));
 
-	/* this accounts for the initial reference on the entry */
-	g_hash_table_insert (db->priv->entries, entry->location, entry);
-	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+	offset = ctx->string_data->len;
+	g_array_append_val (ctx->string_offsets, offset);
+	g_string_append_len (ctx->string_data, rb_refstring_get (str), strlen (rb_refstring_get (str)) + 1);
 
-	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+	return ctx->strings->len - 1;
 }
 
-static RhythmDBTreeProperty *
-rhythmdb_tree_property_new (RhythmDBTree *db)
+static guint32
+snapshot_static_string_id (struct RhythmDBTreeSnapshotSaveContext *ctx, const char *str)
 {
-	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
-#ifndef G_DISABLE_ASSERT
-	ret->magic = 0xf00dbeef;
-#endif
-	return ret;
+	RBRefString *ref;
+	guint32 id;
+
+	ref = rb_refstring_new (str);
+	id = snapshot_string_id (ctx, ref);
+	rb_refstring_unref (ref);
+	return id;
+}
+
+static void
+snapshot_save_entry (RhythmDBTree *db,
+		     RhythmDBEntry *entry,
+		     struct RhythmDBTreeSnapshotSaveContext *ctx)
+{
+	RhythmDBTreeSnapshotEntry record;
+	RhythmDBPodcastFields *podcast = NULL;
+	GList *keywords, *l;
+
+	memset (&record, 0, sizeof (record));
+
+	record.type = snapshot_static_string_id (ctx, entry->type->name);
+	if (entry->flags & RHYTHMDB_ENTRY_HIDDEN)
+		record.flags |= RHYTHMDB_TREE_SNAPSHOT_HIDDEN;
+
+	record.strings[SNAPSHOT_TITLE] = snapshot_string_id (ctx, entry->title);
+	record.strings[SNAPSHOT_ARTIST] = snapshot_string_id (ctx, entry->artist);
+	record.strings[SNAPSHOT_ALBUM] = snapshot_string_id (ctx, entry->album);
+	record.strings[SNAPSHOT_GENRE] = snapshot_string_id (ctx, entry->genre);
+	record.strings[SNAPSHOT_MUSICBRAINZ_TRACKID] = snapshot_string_id (ctx, entry->musicbrainz_trackid);
+	record.strings[SNAPSHOT_MUSICBRAINZ_ARTISTID] = snapshot_string_id (ctx, entry->musicbrainz_artistid);
+	record.strings[SNAPSHOT_MUSICBRAINZ_ALBUMID] = snapshot_string_id (ctx, entry->musicbrainz_albumid);
+	record.strings[SNAPSHOT_MUSICBRAINZ_ALBUMARTISTID] = snapshot_string_id (ctx, entry->musicbrainz_albumartistid);
+	record.strings[SNAPSHOT_ARTIST_SORTNAME] = snapshot_string_id (ctx, entry->artist_sortname);
+	record.strings[SNAPSHOT_ALBUM_SORTNAME] = snapshot_string_id (ctx, entry->album_sortname);
+	record.strings[SNAPSHOT_LOCATION] = snapshot_string_id (ctx, entry->location);
+	record.strings[SNAPSHOT_MOUNTPOINT] = snapshot_string_id (ctx, entry->mountpoint);
+	record.strings[SNAPSHOT_MIMETYPE] = snapshot_string_id (ctx, entry->mimetype);
+
+	record.file_size = entry->file_size;
+	record.tracknum = entry->tracknum;
+	record.discnum = entry->discnum;
+	record.duration = entry->duration;
+	record.bitrate = entry->bitrate;
+	record.date = g_date_valid (&entry->date) ? g_date_get_julian (&entry->date) : 0;
+	record.mtime = entry->mtime;
+	record.first_seen = entry->first_seen;
+	record.last_seen = entry->last_seen;
+	record.play_count = entry->play_count;
+	record.last_played = entry->last_played;
+	record.track_gain = entry->track_gain;
+	record.track_peak = entry->track_peak;
+	record.album_gain = entry->album_gain;
+	record.album_peak = entry->album_peak;
+	record.rating = entry->rating;
+
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+
+	if (podcast) {
+		record.strings[SNAPSHOT_DESCRIPTION] = snapshot_string_id (ctx, podcast->description);
+		record.strings[SNAPSHOT_SUBTITLE] = snapshot_string_id (ctx, podcast->subtitle);
+		record.strings[SNAPSHOT_SUMMARY] = snapshot_string_id (ctx, podcast->summary);
+		record.strings[SNAPSHOT_LANG] = snapshot_string_id (ctx, podcast->lang);
+		record.strings[SNAPSHOT_COPYRIGHT] = snapshot_string_id (ctx, podcast->copyright);
+		record.strings[SNAPSHOT_IMAGE] = snapshot_string_id (ctx, podcast->image);
+		record.status = podcast->status;
+		record.post_time = podcast->post_time;
+	} else {
+		record.strings[SNAPSHOT_DESCRIPTION] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+		record.strings[SNAPSHOT_SUBTITLE] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+		record.strings[SNAPSHOT_SUMMARY] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+		record.strings[SNAPSHOT_LANG] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+		record.strings[SNAPSHOT_COPYRIGHT] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+		record.strings[SNAPSHOT_IMAGE] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+	}
+
+	record.keywords_start = ctx->keywords->len;
+	keywords = rhythmdb_entry_keywords_get (RHYTHMDB (db), entry);
+	for (l = keywords; l != NULL; l = g_list_next (l)) {
+		guint32 id = snapshot_string_id (ctx, (RBRefString *) l->data);
+
+		g_array_append_val (ctx->keywords, id);
+		rb_refstring_unref ((RBRefString *) l->data);
+	}
+	g_list_free (keywords);
+	record.n_keywords = ctx->keywords->len - record.keywords_start;
+
+	g_array_append_val (ctx->entries, record);
+}
+
+static void
+snapshot_save_entry_type (const char *name,
+			  RhythmDBEntryType entry_type,
+			  struct RhythmDBTreeSnapshotSaveContext *ctx)
+{
+	if (entry_type->save_to_disk == FALSE)
+		return;
+
+	rhythmdb_hash_tree_foreach (RHYTHMDB (ctx->db), entry_type,
+				    (RBTreeEntryItFunc) snapshot_save_entry,
+				    NULL, NULL, NULL, ctx);
+}
+
+static void
+snapshot_save_unknown_entry_type (RBRefString *typename,
+				  GList *entries,
+				  struct RhythmDBTreeSnapshotSaveContext *ctx)
+{
+	GList *t;
+
+	for (t = entries; t != NULL; t = t->next) {
+		RhythmDBUnknownEntry *entry = t->data;
+		RhythmDBTreeSnapshotUnknownEntry record;
+		GList *p;
+
+		record.type = snapshot_string_id (ctx, entry->typename);
+		record.props_start = ctx->unknown_props->len / 2;
+		for (p = entry->properties; p != NULL; p = p->next) {
+			RhythmDBUnknownEntryProperty *prop = p->data;
+			guint32 ids[2];
+
+			ids[0] = snapshot_string_id (ctx, prop->name);
+			ids[1] = snapshot_string_id (ctx, prop->value);
+			g_array_append_vals (ctx->unknown_props, ids, 2);
+		}
+		record.n_props = ctx->unknown_props->len / 2 - record.props_start;
+
+		g_array_append_val (ctx->unknown_entries, record);
+	}
+}
+
+static gboolean
+snapshot_write_section (FILE *f, gconstpointer data, gsize len, guint64 *offset)
+{
+	static const char padding[8] = {0,};
+	guint64 aligned;
+
+	if (len > 0 && fwrite (data, 1, len, f) != len)
+		return FALSE;
+
+	*offset += len;
+	aligned = SNAPSHOT_ALIGN (*offset);
+	if (aligned != *offset) {
+		if (fwrite (padding, 1, aligned - *offset, f) != aligned - *offset)
+			return FALSE;
+		*offset = aligned;
+	}
+	return TRUE;
+}
+
+static void
+rhythmdb_tree_save_snapshot (RhythmDBTree *db, const char *name)
+{
+	struct RhythmDBTreeSnapshotSaveContext ctx;
+	RhythmDBTreeSnapshotHeader header;
+	struct stat xml_stat;
+	char *snapname;
+	char *tmpname;
+	guint64 offset;
+	gboolean ok;
+	FILE *f;
+	guint i;
+
+	if (g_stat (name, &xml_stat) != 0)
+		return;
+
+	rb_profile_start ("saving database snapshot");
+
+	ctx.db = db;
+	ctx.string_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ctx.strings = g_ptr_array_new ();
+	ctx.string_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+	ctx.string_data = g_string_new (NULL);
+	ctx.entries = g_array_new (FALSE, FALSE, sizeof (RhythmDBTreeSnapshotEntry));
+	ctx.keywords = g_array_new (FALSE, FALSE, sizeof (guint32));
+	ctx.unknown_entries = g_array_new (FALSE, FALSE, sizeof (RhythmDBTreeSnapshotUnknownEntry));
+	ctx.unknown_props = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	rhythmdb_entry_type_foreach (RHYTHMDB (db), (GHFunc) snapshot_save_entry_type, &ctx);
+	g_mutex_lock (db->priv->entries_lock);
+	g_hash_table_foreach (db->priv->unknown_entry_types,
+			      (GHFunc) snapshot_save_unknown_entry_type,
+			      &ctx);
+	g_mutex_unlock (db->priv->entries_lock);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.version = RHYTHMDB_TREE_SNAPSHOT_VERSION;
+	header.header_size = sizeof (RhythmDBTreeSnapshotHeader);
+	header.entry_size = sizeof (RhythmDBTreeSnapshotEntry);
+	header.xml_version = RHYTHMDB_TREE_XML_VERSION_INT;
+	header.xml_size = xml_stat.st_size;
+	header.xml_mtime = rhythmdb_tree_stat_mtime (&xml_stat);
+	header.n_strings = ctx.strings->len;
+	header.n_entries = ctx.entries->len;
+	header.n_keywords = ctx.keywords->len;
+	header.n_unknown_entries = ctx.unknown_entries->len;
+	header.n_unknown_props = ctx.unknown_props->len / 2;
+	header.string_data_size = ctx.string_data->len;
+
+	snapname = g_strconcat (name, RHYTHMDB_TREE_SNAPSHOT_SUFFIX, NULL);
+	tmpname = g_strconcat (snapname, ".tmp", NULL);
+
+	ok = FALSE;
+	f = fopen (tmpname, "w");
+	if (f != NULL) {
+		offset = 0;
+		ok = snapshot_write_section (f, &header, sizeof (header), &offset) &&
+		     snapshot_write_section (f, ctx.string_offsets->data,
+					     ctx.string_offsets->len * sizeof (guint32), &offset) &&
+		     snapshot_write_section (f, ctx.entries->data,
+					     ctx.entries->len * sizeof (RhythmDBTreeSnapshotEntry), &offset) &&
+		     snapshot_write_section (f, ctx.keywords->data,
+					     ctx.keywords->len * sizeof (guint32), &offset) &&
+		     snapshot_write_section (f, ctx.unknown_entries->data,
+					     ctx.unknown_entries->len * sizeof (RhythmDBTreeSnapshotUnknownEntry), &offset) &&
+		     snapshot_write_section (f, ctx.unknown_props->data,
+					     ctx.unknown_props->len * sizeof (guint32), &offset) &&
+		     snapshot_write_section (f, ctx.string_data->str, ctx.string_data->len, &offset);
+		if (fclose (f) != 0)
+			ok = FALSE;
+	}
+
+	if (ok && rename (tmpname, snapname) == 0) {
+		rb_debug ("saved snapshot with %u entries and %u strings",
+			  header.n_entries, header.n_strings);
+	} else {
+		g_warning ("Couldn't save database snapshot %s: %s", snapname, g_strerror (errno));
+		unlink (tmpname);
+	}
+
+	for (i = 0; i < ctx.strings->len; i++) {
+		rb_refstring_unref (g_ptr_array_index (ctx.strings, i));
+	}
+	g_ptr_array_free (ctx.strings, TRUE);
+	g_hash_table_destroy (ctx.string_ids);
+	g_array_free (ctx.string_offsets, TRUE);
+	g_string_free (ctx.string_data, TRUE);
+	g_array_free (ctx.entries, TRUE);
+	g_array_free (ctx.keywords, TRUE);
+	g_array_free (ctx.unknown_entries, TRUE);
+	g_array_free (ctx.unknown_props, TRUE);
+	g_free (snapname);
+	g_free (tmpname);
+
+	rb_profile_end ("saving database snapshot");
+}
+
+struct RhythmDBTreeSnapshot
+{
+	const RhythmDBTreeSnapshotHeader *header;
+	const guint32 *string_offsets;
+	const RhythmDBTreeSnapshotEntry *entries;
+	const guint32 *keywords;
+	const RhythmDBTreeSnapshotUnknownEntry *unknown_entries;
+	const guint32 *unknown_props;
+	const char *string_data;
+
+	RBRefString **refstrings;
+};
+
+static RBRefString *
+snapshot_get_string (struct RhythmDBTreeSnapshot *snap, guint32 id)
+{
+	if (id == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+		return NULL;
+
+	/* each distinct string only gets interned once */
+	if (snap->refstrings[id] == NULL)
+		snap->refstrings[id] = rb_refstring_new (snap->string_data + snap->string_offsets[id]);
+
+	return rb_refstring_ref (snap->refstrings[id]);
+}
+
+static void
+snapshot_set_string (struct RhythmDBTreeSnapshot *snap, RBRefString **field, guint32 id)
+{
+	if (*field != NULL)
+		rb_refstring_unref (*field);
+	*field = snapshot_get_string (snap, id);
+}
+
+static gboolean
+snapshot_string_valid (struct RhythmDBTreeSnapshot *snap, guint32 id, gboolean allow_none)
+{
+	if (id == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+		return allow_none;
+	return id < snap->header->n_strings;
+}
+
+/* checks everything that could make loading the snapshot go wrong part way */
+static gboolean
+snapshot_validate (RhythmDBTree *db, struct RhythmDBTreeSnapshot *snap, GHashTable *types)
+{
+	const RhythmDBTreeSnapshotHeader *header = snap->header;
+	guint i, j;
+
+	if (header->string_data_size > 0 &&
+	    snap->string_data[header->string_data_size - 1] != '\0')
+		return FALSE;
+
+	for (i = 0; i < header->n_strings; i++) {
+		if (snap->string_offsets[i] >= header->string_data_size)
+			return FALSE;
+	}
+
+	for (i = 0; i < header->n_entries; i++) {
+		const RhythmDBTreeSnapshotEntry *record = &snap->entries[i];
+		RhythmDBEntryType type;
+
+		if (!snapshot_string_valid (snap, record->type, FALSE))
+			return FALSE;
+		for (j = 0; j < SNAPSHOT_NUM_STRINGS; j++) {
+			if (!snapshot_string_valid (snap, record->strings[j], TRUE))
+				return FALSE;
+		}
+		if (record->strings[SNAPSHOT_LOCATION] == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+			return FALSE;
+		if ((guint64) record->keywords_start + record->n_keywords > header->n_keywords)
+			return FALSE;
+
+		/* entries of types that aren't registered now are kept by the
+		 * XML loader as unknown entries; leave that to it.
+		 */
+		if (g_hash_table_lookup (types, GUINT_TO_POINTER (record->type)) == NULL) {
+			const char *typename = snap->string_data + snap->string_offsets[record->type];
+
+			type = rhythmdb_entry_type_get_by_name (RHYTHMDB (db), typename);
+			if (type == RHYTHMDB_ENTRY_TYPE_INVALID) {
+				rb_debug ("snapshot contains entries of unknown type %s", typename);
+				return FALSE;
+			}
+			g_hash_table_insert (types, GUINT_TO_POINTER (record->type), type);
+		}
+	}
+
+	for (i = 0; i < header->n_keywords; i++) {
+		if (!snapshot_string_valid (snap, snap->keywords[i], FALSE))
+			return FALSE;
+	}
+
+	for (i = 0; i < header->n_unknown_entries; i++) {
+		const RhythmDBTreeSnapshotUnknownEntry *record = &snap->unknown_entries[i];
+
+		if (!snapshot_string_valid (snap, record->type, FALSE))
+			return FALSE;
+		if ((guint64) record->props_start + record->n_props > header->n_unknown_props)
+			return FALSE;
+	}
+	for (i = 0; i < header->n_unknown_props * 2; i++) {
+		if (!snapshot_string_valid (snap, snap->unknown_props[i], FALSE))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+snapshot_load_entry (RhythmDBTree *db,
+		     struct RhythmDBTreeSnapshot *snap,
+		     const RhythmDBTreeSnapshotEntry *record,
+		     RhythmDBEntryType type,
+		     gint *batch_count)
+{
+	RhythmDBEntry *entry;
+	RhythmDBPodcastFields *podcast = NULL;
+	guint i;
+
+	entry = rhythmdb_entry_allocate (RHYTHMDB (db), type);
+	entry->flags |= RHYTHMDB_ENTRY_TREE_LOADING;
+	if (record->flags & RHYTHMDB_TREE_SNAPSHOT_HIDDEN)
+		entry->flags |= RHYTHMDB_ENTRY_HIDDEN;
+
+	snapshot_set_string (snap, &entry->title, record->strings[SNAPSHOT_TITLE]);
+	snapshot_set_string (snap, &entry->artist, record->strings[SNAPSHOT_ARTIST]);
+	snapshot_set_string (snap, &entry->album, record->strings[SNAPSHOT_ALBUM]);
+	snapshot_set_string (snap, &entry->genre, record->strings[SNAPSHOT_GENRE]);
+	snapshot_set_string (snap, &entry->musicbrainz_trackid, record->strings[SNAPSHOT_MUSICBRAINZ_TRACKID]);
+	snapshot_set_string (snap, &entry->musicbrainz_artistid, record->strings[SNAPSHOT_MUSICBRAINZ_ARTISTID]);
+	snapshot_set_string (snap, &entry->musicbrainz_albumid, record->strings[SNAPSHOT_MUSICBRAINZ_ALBUMID]);
+	snapshot_set_string (snap, &entry->musicbrainz_albumartistid, record->strings[SNAPSHOT_MUSICBRAINZ_ALBUMARTISTID]);
+	snapshot_set_string (snap, &entry->artist_sortname, record->strings[SNAPSHOT_ARTIST_SORTNAME]);
+	snapshot_set_string (snap, &entry->album_sortname, record->strings[SNAPSHOT_ALBUM_SORTNAME]);
+	snapshot_set_string (snap, &entry->location, record->strings[SNAPSHOT_LOCATION]);
+	snapshot_set_string (snap, &entry->mountpoint, record->strings[SNAPSHOT_MOUNTPOINT]);
+	snapshot_set_string (snap, &entry->mimetype, record->strings[SNAPSHOT_MIMETYPE]);
+
+	entry->file_size = record->file_size;
+	entry->tracknum = record->tracknum;
+	entry->discnum = record->discnum;
+	entry->duration = record->duration;
+	entry->bitrate = record->bitrate;
+	if (record->date > 0)
+		g_date_set_julian (&entry->date, record->date);
+	entry->mtime = record->mtime;
+	entry->first_seen = record->first_seen;
+	entry->last_seen = record->last_seen;
+	entry->play_count = record->play_count;
+	entry->last_played = record->last_played;
+	entry->track_gain = record->track_gain;
+	entry->track_peak = record->track_peak;
+	entry->album_gain = record->album_gain;
+	entry->album_peak = record->album_peak;
+	entry->rating = record->rating;
+
+	if (type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+
+	if (podcast) {
+		snapshot_set_string (snap, &podcast->description, record->strings[SNAPSHOT_DESCRIPTION]);
+		snapshot_set_string (snap, &podcast->subtitle, record->strings[SNAPSHOT_SUBTITLE]);
+		snapshot_set_string (snap, &podcast->summary, record->strings[SNAPSHOT_SUMMARY]);
+		snapshot_set_string (snap, &podcast->lang, record->strings[SNAPSHOT_LANG]);
+		snapshot_set_string (snap, &podcast->copyright, record->strings[SNAPSHOT_COPYRIGHT]);
+		snapshot_set_string (snap, &podcast->image, record->strings[SNAPSHOT_IMAGE]);
+		podcast->status = record->status;
+		podcast->post_time = record->post_time;
+	}
+
+	for (i = 0; i < record->n_keywords; i++) {
+		RBRefString *keyword;
+
+		keyword = snapshot_get_string (snap, snap->keywords[record->keywords_start + i]);
+		rhythmdb_entry_keyword_add (RHYTHMDB (db), entry, keyword);
+		rb_refstring_unref (keyword);
+	}
+
+	g_mutex_lock (db->priv->entries_lock);
+	if (g_hash_table_lookup (db->priv->entries, entry->location) == NULL) {
+		rhythmdb_tree_entry_new_internal (RHYTHMDB (db), entry);
+		rhythmdb_entry_insert (RHYTHMDB (db), entry);
+		if (++(*batch_count) == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+			rhythmdb_commit (RHYTHMDB (db));
+			*batch_count = 0;
+		}
+	} else {
+		/* can't happen unless something else added entries first */
+		rb_debug ("snapshot entry %s already exists", rb_refstring_get (entry->location));
+		rhythmdb_entry_unref (entry);
+	}
+	g_mutex_unlock (db->priv->entries_lock);
+}
+
+static void
+snapshot_load_unknown_entry (RhythmDBTree *db,
+			     struct RhythmDBTreeSnapshot *snap,
+			     const RhythmDBTreeSnapshotUnknownEntry *record)
+{
+	RhythmDBUnknownEntry *entry;
+	GList *entry_list;
+	guint i;
+
+	entry = g_new0 (RhythmDBUnknownEntry, 1);
+	entry->typename = snapshot_get_string (snap, record->type);
+	for (i = 0; i < record->n_props; i++) {
+		RhythmDBUnknownEntryProperty *prop;
+		const guint32 *ids = &snap->unknown_props[(record->props_start + i) * 2];
+
+		prop = g_new0 (RhythmDBUnknownEntryProperty, 1);
+		prop->name = snapshot_get_string (snap, ids[0]);
+		prop->value = snapshot_get_string (snap, ids[1]);
+		entry->properties = g_list_prepend (entry->properties, prop);
+	}
+	entry->properties = g_list_reverse (entry->properties);
+
+	g_mutex_lock (db->priv->entries_lock);
+	entry_list = g_hash_table_lookup (db->priv->unknown_entry_types, entry->typename);
+	entry_list = g_list_prepend (entry_list, entry);
+	g_hash_table_insert (db->priv->unknown_entry_types, entry->typename, entry_list);
+	g_mutex_unlock (db->priv->entries_lock);
+}
+
+/*
+ * Loads the snapshot for the XML file @name, if there's a usable one.
+ * Returns FALSE without loading anything if the XML file should be read
+ * instead.
+ */
+static gboolean
+rhythmdb_tree_load_snapshot (RhythmDBTree *db, const char *name, GCancellable *cancel)
+{
+	struct RhythmDBTreeSnapshot snap;
+	const RhythmDBTreeSnapshotHeader *header;
+	GMappedFile *mapped;
+	GHashTable *types;
+	struct stat xml_stat;
+	const char *data;
+	char *snapname;
+	guint64 offset;
+	gsize len;
+	gint batch_count;
+	guint i;
+
+	if (db->priv->use_snapshot == FALSE)
+		return FALSE;
+	if (g_stat (name, &xml_stat) != 0)
+		return FALSE;
+
+	snapname = g_strconcat (name, RHYTHMDB_TREE_SNAPSHOT_SUFFIX, NULL);
+	mapped = g_mapped_file_new (snapname, FALSE, NULL);
+	g_free (snapname);
+	if (mapped == NULL)
+		return FALSE;
+
+	data = g_mapped_file_get_contents (mapped);
+	len = g_mapped_file_get_length (mapped);
+	header = (const RhythmDBTreeSnapshotHeader *) data;
+
+	if (len < sizeof (RhythmDBTreeSnapshotHeader) ||
+	    memcmp (header->magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->version != RHYTHMDB_TREE_SNAPSHOT_VERSION ||
+	    header->header_size != sizeof (RhythmDBTreeSnapshotHeader) ||
+	    header->entry_size != sizeof (RhythmDBTreeSnapshotEntry) ||
+	    header->xml_version != RHYTHMDB_TREE_XML_VERSION_INT) {
+		rb_debug ("ignoring snapshot written in a different format");
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+	if (header->xml_size != (guint64) xml_stat.st_size ||
+	    header->xml_mtime != rhythmdb_tree_stat_mtime (&xml_stat)) {
+		rb_debug ("ignoring snapshot of a different version of the database");
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+
+	/* find the sections, making sure they're all inside the file */
+	snap.header = header;
+	offset = SNAPSHOT_ALIGN (sizeof (RhythmDBTreeSnapshotHeader));
+	snap.string_offsets = (const guint32 *) (data + offset);
+	offset = SNAPSHOT_ALIGN (offset + (guint64) header->n_strings * sizeof (guint32));
+	snap.entries = (const RhythmDBTreeSnapshotEntry *) (data + offset);
+	offset = SNAPSHOT_ALIGN (offset + (guint64) header->n_entries * sizeof (RhythmDBTreeSnapshotEntry));
+	snap.keywords = (const guint32 *) (data + offset);
+	offset = SNAPSHOT_ALIGN (offset + (guint64) header->n_keywords * sizeof (guint32));
+	snap.unknown_entries = (const RhythmDBTreeSnapshotUnknownEntry *) (data + offset);
+	offset = SNAPSHOT_ALIGN (offset + (guint64) header->n_unknown_entries * sizeof (RhythmDBTreeSnapshotUnknownEntry));
+	snap.unknown_props = (const guint32 *) (data + offset);
+	offset = SNAPSHOT_ALIGN (offset + (guint64) header->n_unknown_props * 2 * sizeof (guint32));
+	snap.string_data = data + offset;
+	offset = SNAPSHOT_ALIGN (offset + header->string_data_size);
+
+	types = g_hash_table_new (g_direct_hash, g_direct_equal);
+	if (offset != len || snapshot_validate (db, &snap, types) == FALSE) {
+		rb_debug ("ignoring invalid snapshot");
+		g_hash_table_destroy (types);
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+
+	rb_profile_start ("loading database snapshot");
+	snap.refstrings = g_new0 (RBRefString *, header->n_strings);
+
+	batch_count = 0;
+	for (i = 0; i < header->n_entries; i++) {
+		const RhythmDBTreeSnapshotEntry *record = &snap.entries[i];
+
+		if ((i % 1000) == 0 && g_cancellable_is_cancelled (cancel))
+			break;
+
+		snapshot_load_entry (db, &snap, record,
+				     g_hash_table_lookup (types, GUINT_TO_POINTER (record->type)),
+				     &batch_count);
+	}
+	if (batch_count)
+		rhythmdb_commit (RHYTHMDB (db));
+
+	for (i = 0; i < header->n_unknown_entries; i++) {
+		snapshot_load_unknown_entry (db, &snap, &snap.unknown_entries[i]);
+	}
+
+	rb_debug ("loaded %u entries and %u strings from snapshot",
+		  header->n_entries, header->n_strings);
+
+	for (i = 0; i < header->n_strings; i++) {
+		if (snap.refstrings[i] != NULL)
+			rb_refstring_unref (snap.refstrings[i]);
+	}
+	g_free (snap.refstrings);
+	g_hash_table_destroy (types);
+	g_mapped_file_free (mapped);
+
+	rb_profile_end ("loading database snapshot");
+	return TRUE;
+}
+
+/*
+ * Journal.
+ *
+ * Rewriting the whole XML file every time something changes is expensive
+ * for large libraries, when usually all that's changed is a play count or
+ * two.  Instead, changes to entries are recorded as they're made, and
+ * regular saves just append them to a journal file next to the XML file.
+ * The journal is folded into the XML file when it gets too big compared
+ * to the XML file, and on explicit saves (rhythmdb_save), which is what
+ * happens at shutdown.  When the database is loaded, the journal is
+ * replayed on top of the XML file (or snapshot).
+ *
+ * The journal is a text file with one record per line.  Fields are
+ * separated by tabs, with tabs, newlines and backslashes in the fields
+ * escaped as for g_strcompress.  The first line identifies the XML file
+ * the journal applies to, by size and mtime, so a journal left behind
+ * after the XML file has been rewritten is ignored:
+ *
+ *   rhythmdb-journal	2	<size>	<mtime in ns>
+ *
+ * followed by records:
+ *
+ *   A	<type>	<location>			entry added
+ *   S	<location>	<property>	<value>		property set
+ *   K	<location>	<keyword>		keyword added
+ *   k	<location>	<keyword>		keyword removed
+ *   D	<location>				entry deleted
+ *   T	<type>					all entries of a type deleted
+ *
+ * Every record sets absolute values, so replaying records that are
+ * already reflected in the database is harmless.  An incomplete last line
+ * (from a crash while appending) is ignored.
+ */
+
+#define RHYTHMDB_TREE_JOURNAL_SUFFIX		".journal"
+#define RHYTHMDB_TREE_JOURNAL_MAGIC		"rhythmdb-journal"
+#define RHYTHMDB_TREE_JOURNAL_VERSION		2
+#define RHYTHMDB_TREE_JOURNAL_MIN_COMPACT_SIZE	(1024 * 1024)
+
+static void
+journal_append_field (GString *record, const char *str)
+{
+	const char *p;
+
+	g_string_append_c (record, '\t');
+	if (str == NULL)
+		return;
+
+	for (p = str; *p != '\0'; p++) {
+		switch (*p) {
+		case '\\':
+			g_string_append (record, "\\\\");
+			break;
+		case '\t':
+			g_string_append (record, "\\t");
+			break;
+		case '\n':
+			g_string_append (record, "\\n");
+			break;
+		case '\r':
+			g_string_append (record, "\\r");
+			break;
+		default:
+			g_string_append_c (record, *p);
+			break;
+		}
+	}
+}
+
+static void
+journal_append (RhythmDBTree *db, GString *record)
+{
+	g_string_append_c (record, '\n');
+
+	g_mutex_lock (db->priv->journal_lock);
+	if (db->priv->journal_active) {
+		g_string_append_len (db->priv->journal, record->str, record->len);
+		db->priv->journal_records++;
+	}
+	g_mutex_unlock (db->priv->journal_lock);
+
+	g_string_free (record, TRUE);
+}
+
+static void
+journal_entry_added (RhythmDBTree *db, RhythmDBEntry *entry)
+{
+	GString *record;
+
+	if (entry->type->save_to_disk == FALSE)
+		return;
+
+	record = g_string_new ("A");
+	journal_append_field (record, entry->type->name);
+	journal_append_field (record, rb_refstring_get (entry->location));
+	journal_append (db, record);
+}
+
+static void
+journal_entry_deleted (RhythmDBTree *db, RhythmDBEntry *entry)
+{
+	GString *record;
+
+	if (entry->type->save_to_disk == FALSE)
+		return;
+
+	record = g_string_new ("D");
+	journal_append_field (record, rb_refstring_get (entry->location));
+	journal_append (db, record);
+}
+
+static void
+journal_entries_deleted_by_type (RhythmDBTree *db, RhythmDBEntryType type)
+{
+	GString *record;
+
+	if (type->save_to_disk == FALSE)
+		return;
+
+	record = g_string_new ("T");
+	journal_append_field (record, type->name);
+	journal_append (db, record);
+}
+
+static void
+journal_entry_set (RhythmDBTree *db,
+		   RhythmDBEntry *entry,
+		   RhythmDBPropType propid,
+		   const GValue *value)
+{
+	GString *record;
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+	char *str = NULL;
+
+	if (entry->type->save_to_disk == FALSE)
+		return;
+
+	/* not saved */
+	if (propid == RHYTHMDB_PROP_PLAYBACK_ERROR)
+		return;
+
+	switch (G_VALUE_TYPE (value)) {
+	case G_TYPE_STRING:
+		break;
+	case G_TYPE_BOOLEAN:
+		str = g_strdup (g_value_get_boolean (value) ? "1" : "0");
+		break;
+	case G_TYPE_ULONG:
+		str = g_strdup_printf ("%lu", g_value_get_ulong (value));
+		break;
+	case G_TYPE_UINT64:
+		str = g_strdup_printf ("%" G_GUINT64_FORMAT, g_value_get_uint64 (value));
+		break;
+	case G_TYPE_DOUBLE:
+		str = g_strdup (g_ascii_dtostr (buf, sizeof (buf), g_value_get_double (value)));
+		break;
+	default:
+		return;
+	}
+
+	record = g_string_new ("S");
+	journal_append_field (record, rb_refstring_get (entry->location));
+	journal_append_field (record, (const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), propid));
+	journal_append_field (record, str != NULL ? str : g_value_get_string (value));
+	journal_append (db, record);
+
+	g_free (str);
+}
+
+static void
+journal_entry_keyword (RhythmDBTree *db,
+		       RhythmDBEntry *entry,
+		       RBRefString *keyword,
+		       gboolean added)
+{
+	GString *record;
+
+	if (entry->type->save_to_disk == FALSE)
+		return;
+
+	record = g_string_new (added ? "K" : "k");
+	journal_append_field (record, rb_refstring_get (entry->location));
+	journal_append_field (record, rb_refstring_get (keyword));
+	journal_append (db, record);
+}
+
+static char *
+journal_header (RhythmDBTree *db)
+{
+	return g_strdup_printf (RHYTHMDB_TREE_JOURNAL_MAGIC "\t%d\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+				RHYTHMDB_TREE_JOURNAL_VERSION,
+				db->priv->journal_xml_size,
+				db->priv->journal_xml_mtime);
+}
+
+static guint
+journal_count_records (const char *data, gsize len)
+{
+	guint count = 0;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] == '\n')
+			count++;
+	}
+	return count;
+}
+
+static void
+journal_replay_record (RhythmDBTree *db, char **fields)
+{
+	RhythmDB *rdb = RHYTHMDB (db);
+	RhythmDBEntry *entry = NULL;
+	RhythmDBEntryType type;
+	guint n_fields;
+	guint i;
+
+	n_fields = g_strv_length (fields);
+	for (i = 1; i < n_fields; i++) {
+		char *unescaped = g_strcompress (fields[i]);
+		g_free (fields[i]);
+		fields[i] = unescaped;
+	}
+
+	switch (fields[0][0]) {
+	case 'A':
+		if (n_fields != 3)
+			break;
+		type = rhythmdb_entry_type_get_by_name (rdb, fields[1]);
+		if (type == RHYTHMDB_ENTRY_TYPE_INVALID)
+			break;
+		if (rhythmdb_entry_lookup_by_location (rdb, fields[2]) == NULL)
+			rhythmdb_entry_new (rdb, type, fields[2]);
+		break;
+
+	case 'S':
+	{
+		GValue value = {0,};
+		int propid;
+
+		if (n_fields != 4)
+			break;
+		entry = rhythmdb_entry_lookup_by_location (rdb, fields[1]);
+		propid = rhythmdb_propid_from_nice_elt_name (rdb, BAD_CAST fields[2]);
+		if (entry == NULL || propid < 0 ||
+		    propid == RHYTHMDB_PROP_TYPE || propid == RHYTHMDB_PROP_ENTRY_ID)
+			break;
+
+		rhythmdb_read_encoded_property (rdb, fields[3], propid, &value);
+		rhythmdb_entry_set_internal (rdb, entry, FALSE, propid, &value);
+		g_value_unset (&value);
+		break;
+	}
+
+	case 'K':
+	case 'k':
+	{
+		RBRefString *keyword;
+
+		if (n_fields != 3)
+			break;
+		entry = rhythmdb_entry_lookup_by_location (rdb, fields[1]);
+		if (entry == NULL)
+			break;
+
+		keyword = rb_refstring_new (fields[2]);
+		if (fields[0][0] == 'K')
+			rhythmdb_entry_keyword_add (rdb, entry, keyword);
+		else
+			rhythmdb_entry_keyword_remove (rdb, entry, keyword);
+		rb_refstring_unref (keyword);
+		break;
+	}
+
+	case 'D':
+		if (n_fields != 2)
+			break;
+		entry = rhythmdb_entry_lookup_by_location (rdb, fields[1]);
+		if (entry != NULL)
+			rhythmdb_entry_delete (rdb, entry);
+		break;
+
+	case 'T':
+		if (n_fields != 2)
+			break;
+		type = rhythmdb_entry_type_get_by_name (rdb, fields[1]);
+		if (type != RHYTHMDB_ENTRY_TYPE_INVALID)
+			rhythmdb_entry_delete_by_type (rdb, type);
+		break;
+
+	default:
+		rb_debug ("ignoring unknown journal record type %c", fields[0][0]);
+		break;
+	}
+}
+
+/*
+ * Applies the journal for the XML file @name to the database, and starts
+ * journalling changes against that XML file.
+ */
+static void
+rhythmdb_tree_journal_replay (RhythmDBTree *db, const char *name)
+{
+	struct stat xml_stat;
+	char *journal_name;
+	char *contents;
+	char *header;
+	gsize length;
+	gsize valid;
+	guint records;
+
+	g_mutex_lock (db->priv->journal_lock);
+	db->priv->journal_active = FALSE;
+	g_mutex_unlock (db->priv->journal_lock);
+
+	/* without an XML file, the first save has to write one anyway */
+	if (db->priv->use_journal == FALSE || g_stat (name, &xml_stat) != 0)
+		return;
+
+	db->priv->journal_xml_size = xml_stat.st_size;
+	db->priv->journal_xml_mtime = rhythmdb_tree_stat_mtime (&xml_stat);
+	db->priv->journal_size = 0;
+	records = 0;
+
+	journal_name = g_strconcat (name, RHYTHMDB_TREE_JOURNAL_SUFFIX, NULL);
+	header = journal_header (db);
+	if (g_file_get_contents (journal_name, &contents, &length, NULL)) {
+		if (g_str_has_prefix (contents, header)) {
+			char *line;
+			char *end;
+
+			rb_profile_start ("replaying database journal");
+
+			valid = strlen (header);
+			for (line = contents + valid;
+			     (end = memchr (line, '\n', length - (line - contents))) != NULL;
+			     line = end + 1) {
+				char **fields;
+
+				*end = '\0';
+				fields = g_strsplit (line, "\t", 0);
+				if (fields[0] != NULL && fields[0][0] != '\0')
+					journal_replay_record (db, fields);
+				g_strfreev (fields);
+
+				records++;
+				valid = (end + 1) - contents;
+			}
+			rhythmdb_commit (RHYTHMDB (db));
+
+			rb_debug ("replayed %u journal records", records);
+			rb_profile_end ("replaying database journal");
+
+			if (valid < length) {
+				/* drop the partial record, so new ones can be appended */
+				rb_debug ("discarding incomplete journal record");
+				if (g_file_set_contents (journal_name, contents, valid, NULL) == FALSE)
+					valid = 0;
+			}
+			db->priv->journal_size = valid;
+		} else {
+			rb_debug ("ignoring journal for a different version of the database");
+		}
+		g_free (contents);
+	}
+	g_free (header);
+	g_free (journal_name);
+
+	g_mutex_lock (db->priv->journal_lock);
+	db->priv->journal_records = records;
+	db->priv->journal_active = TRUE;
+	g_mutex_unlock (db->priv->journal_lock);
+}
+
+/*
+ * Writes the changes made since the last save to the journal.  Returns
+ * FALSE if the whole database needs to be written out instead, either
+ * because @full is set, the journal has grown too large, or it can't be
+ * written.
+ */
+static gboolean
+rhythmdb_tree_journal_flush (RhythmDBTree *db, const char *name, gboolean full)
+{
+	GString *pending;
+	char *journal_name;
+	char *header = NULL;
+	gboolean ok;
+	FILE *f;
+
+	g_mutex_lock (db->priv->journal_lock);
+	if (db->priv->journal_active == FALSE) {
+		g_mutex_unlock (db->priv->journal_lock);
+		return FALSE;
+	}
+	if (full || db->priv->journal_size + db->priv->journal->len >
+		    MAX (RHYTHMDB_TREE_JOURNAL_MIN_COMPACT_SIZE, db->priv->journal_xml_size / 4)) {
+		/* nothing to fold into the XML file */
+		ok = (db->priv->journal_records == 0);
+		g_mutex_unlock (db->priv->journal_lock);
+		return ok;
+	}
+
+	pending = db->priv->journal;
+	db->priv->journal = g_string_new (NULL);
+	g_mutex_unlock (db->priv->journal_lock);
+
+	if (pending->len == 0) {
+		g_string_free (pending, TRUE);
+		return TRUE;
+	}
+
+	journal_name = g_strconcat (name, RHYTHMDB_TREE_JOURNAL_SUFFIX, NULL);
+	if (db->priv->journal_size == 0) {
+		header = journal_header (db);
+		f = fopen (journal_name, "w");
+	} else {
+		f = fopen (journal_name, "a");
+	}
+
+	ok = FALSE;
+	if (f != NULL) {
+		ok = TRUE;
+		if (header != NULL && fwrite (header, 1, strlen (header), f) != strlen (header))
+			ok = FALSE;
+		if (ok && fwrite (pending->str, 1, pending->len, f) != pending->len)
+			ok = FALSE;
+		if (fflush (f) != 0 || fsync (fileno (f)) != 0)
+			ok = FALSE;
+		if (fclose (f) != 0)
+			ok = FALSE;
+	}
+
+	if (ok) {
+		db->priv->journal_size += pending->len + (header ? strlen (header) : 0);
+		rb_debug ("wrote %" G_GSIZE_FORMAT " bytes to the journal", pending->len);
+		g_string_free (pending, TRUE);
+	} else {
+		g_warning ("Couldn't write database journal %s: %s", journal_name, g_strerror (errno));
+		rhythmdb_tree_journal_reset (db, NULL, pending);
+	}
+
+	g_free (header);
+	g_free (journal_name);
+	return ok;
+}
+
+/*
+ * Called after trying to write the whole database to the XML file @name,
+ * with the journal records that were pending when the save started.  If
+ * the save failed (@name is NULL), the records are put back so they're
+ * written out next time.  Otherwise a new, empty, journal is started
+ * against the new XML file.
+ */
+static void
+rhythmdb_tree_journal_reset (RhythmDBTree *db, const char *name, GString *pending)
+{
+	struct stat xml_stat;
+	char *journal_name;
+	char *header;
+
+	if (name == NULL) {
+		g_mutex_lock (db->priv->journal_lock);
+		g_string_prepend_len (db->priv->journal, pending->str, pending->len);
+		g_mutex_unlock (db->priv->journal_lock);
+		g_string_free (pending, TRUE);
+		return;
+	}
+	g_string_free (pending, TRUE);
+
+	journal_name = g_strconcat (name, RHYTHMDB_TREE_JOURNAL_SUFFIX, NULL);
+	if (db->priv->use_journal == FALSE || g_stat (name, &xml_stat) != 0) {
+		g_mutex_lock (db->priv->journal_lock);
+		db->priv->journal_active = FALSE;
+		g_string_truncate (db->priv->journal, 0);
+		db->priv->journal_records = 0;
+		g_mutex_unlock (db->priv->journal_lock);
+
+		unlink (journal_name);
+		g_free (journal_name);
+		return;
+	}
+
+	db->priv->journal_xml_size = xml_stat.st_size;
+	db->priv->journal_xml_mtime = rhythmdb_tree_stat_mtime (&xml_stat);
+
+	header = journal_header (db);
+	if (g_file_set_contents (journal_name, header, -1, NULL)) {
+		db->priv->journal_size = strlen (header);
+	} else {
+		/* the old journal doesn't match the XML file, so it'll be
+		 * ignored; the next flush will try replacing it again.
+		 */
+		db->priv->journal_size = 0;
+	}
+
+	g_mutex_lock (db->priv->journal_lock);
+	db->priv->journal_records = journal_count_records (db->priv->journal->str, db->priv->journal->len);
+	db->priv->journal_active = TRUE;
+	g_mutex_unlock (db->priv->journal_lock);
+
+	g_free (header);
+	g_free (journal_name);
+}
+
+RhythmDB *
+rhythmdb_tree_new (const char *name)
+{
+	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
+
+	g_return_val_if_fail (db->priv != NULL, NULL);
+
+	return RHYTHMDB (db);
+}
+
+/* must be called with the genres_lock held */
+static void
+set_entry_album (RhythmDBTree *db,
+		 RhythmDBEntry *entry,
+		 RhythmDBTreeProperty *artist,
+		 RBRefString *name)
+{
+	struct RhythmDBTreeProperty *prop;
+
+	prop = get_or_create_album (db, artist, name);
+	g_hash_table_insert (prop->children, entry, NULL);
+	entry->data = prop;
+}
+
+static void
+rhythmdb_tree_entry_new (RhythmDB *rdb,
+			 RhythmDBEntry *entry)
+{
+	g_mutex_lock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	rhythmdb_tree_entry_new_internal (rdb, entry);
+	g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+
+	journal_entry_added (RHYTHMDB_TREE (rdb), entry);
+}
+
+/* must be called with the entry lock held */
+static void
+rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	RhythmDBTreeProperty *artist;
+	RhythmDBTreeProperty *genre;
+
+	rb_assert_locked (db->priv->entries_lock);
+	g_assert (entry != NULL);
+
+	g_return_if_fail (entry->location != NULL);
+
+	if (entry->title == NULL) {
+		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
+		entry->title = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->artist == NULL) {
+		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
+		entry->artist = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->album == NULL) {
+		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
+		entry->album = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->genre == NULL) {
+		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
+		entry->genre = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->mimetype == NULL) {
+		g_warning ("Entry %s has missing mimetype", rb_refstring_get (entry->location));
+		entry->mimetype = rb_refstring_new ("unknown/unknown");
+	}
+
+	/* Initialize the tree structure. */
+	g_mutex_lock (db->priv->genres_lock);
+	genre = get_or_create_genre (db, entry->type, entry->genre);
+	artist = get_or_create_artist (db, genre, entry->artist);
+	set_entry_album (db, entry, artist, entry->album);
+	g_mutex_unlock (db->priv->genres_lock);
+
+	/* this accounts for the initial reference on the entry */
+	g_hash_table_insert (db->priv->entries, entry->location, entry);
+	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+
+	search_index_entry_added (db, entry);
+	range_index_entry_added (db, entry);
+
+	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+}
+
+static RhythmDBTreeProperty *
+rhythmdb_tree_property_new (RhythmDBTree *db)
+{
+	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
+#ifndef G_DISABLE_ASSERT
+	ret->magic = 0xf00dbeef;
+#endif
+	return ret;
 }
 
 static GHashTable *
 get_genres_hash_for_type (RhythmDBTree *db,
 			  RhythmDBEntryType type)
 {
-	GHashTable *table;
+	GHashTable *table;
+
+	table = g_hash_table_lookup (db->priv->genres, type);
+	if (table == NULL) {
+		table = g_hash_table_new_full (rb_refstring_hash,
+					       rb_refstring_equal,
+					       (GDestroyNotify) rb_refstring_unref,
+					       NULL);
+		if (table == NULL) {
+			g_warning ("Out of memory\n");
+			return NULL;
+		}
+		g_hash_table_insert (db->priv->genres,
+				     type,
+				     table);
+	}
+	return table;
+}
+
+typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+
+typedef struct {
+	RhythmDBTree *db;
+	RBHFunc func;
+	gpointer data;
+} GenresIterCtxt;
+
+static void
+genres_process_one (gpointer key,
+		    gpointer value,
+		    gpointer user_data)
+{
+	GenresIterCtxt *ctxt = (GenresIterCtxt *)user_data;
+	ctxt->func (ctxt->db, (GHashTable *)value, ctxt->data);
+}
+
+static void
+genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+{
+	GenresIterCtxt ctxt;
+
+	ctxt.db = db;
+	ctxt.func = func;
+	ctxt.data = data;
+	g_hash_table_foreach (db->priv->genres, genres_process_one, &ctxt);
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_genre (RhythmDBTree *db,
+		     RhythmDBEntryType type,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *genre;
+	GHashTable *table;
+
+	rb_assert_locked (db->priv->genres_lock);
+
+	table = get_genres_hash_for_type (db, type);
+	genre = g_hash_table_lookup (table, name);
+
+	if (G_UNLIKELY (genre == NULL)) {
+		genre = rhythmdb_tree_property_new (db);
+		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							 (GDestroyNotify) rb_refstring_unref,
+							 NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (table, name, genre);
+		genre->parent = NULL;
+	}
+
+	return genre;
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_artist (RhythmDBTree *db,
+		      RhythmDBTreeProperty *genre,
+		      RBRefString *name)
+{
+	RhythmDBTreeProperty *artist;
+
+	rb_assert_locked (db->priv->genres_lock);
+
+	artist = g_hash_table_lookup (genre->children, name);
+
+	if (G_UNLIKELY (artist == NULL)) {
+		artist = rhythmdb_tree_property_new (db);
+		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							  (GDestroyNotify) rb_refstring_unref,
+							  NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (genre->children, name, artist);
+		artist->parent = genre;
+	}
+
+	return artist;
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_album (RhythmDBTree *db,
+		     RhythmDBTreeProperty *artist,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *album;
+
+	rb_assert_locked (db->priv->genres_lock);
+
+	album = g_hash_table_lookup (artist->children, name);
+
+	if (G_UNLIKELY (album == NULL)) {
+		album = rhythmdb_tree_property_new (db);
+		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
+		rb_refstring_ref (name);
+		g_hash_table_insert (artist->children, name, album);
+		album->parent = artist;
+	}
+
+	return album;
+}
+
+static gboolean
+remove_child (RhythmDBTreeProperty *parent,
+	      gconstpointer data)
+{
+	g_assert (g_hash_table_remove (parent->children, data));
+	if (g_hash_table_size (parent->children) <= 0) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* must be called with the genres lock held */
+static void
+remove_entry_from_album (RhythmDBTree *db,
+			 RhythmDBEntry *entry)
+{
+	GHashTable *table;
+
+	rb_assert_locked (db->priv->genres_lock);
+
+	rb_refstring_ref (entry->genre);
+	rb_refstring_ref (entry->artist);
+	rb_refstring_ref (entry->album);
+
+	table = get_genres_hash_for_type (db, entry->type);
+	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
+		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
+				  entry->album)) {
+
+			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
+					  entry->artist)) {
+				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
+				g_assert (g_hash_table_remove (table, entry->genre));
+			}
+			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
+		}
+
+		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+	}
+
+	rb_refstring_unref (entry->genre);
+	rb_refstring_unref (entry->artist);
+	rb_refstring_unref (entry->album);
+}
+
+static gboolean
+rhythmdb_tree_entry_set (RhythmDB *adb,
+			 RhythmDBEntry *entry,
+			 guint propid,
+			 const GValue *value)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBEntryType type;
+
+	type = entry->type;
+
+	/* don't process changes to entries we're loading, we'll get them
+	 * when the entry is complete.  don't process changes for entries that
+	 * have been removed either.
+	 */
+	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
+		return FALSE;
+
+	journal_entry_set (db, entry, propid, value);
+
+	/* Handle special properties */
+	switch (propid)
+	{
+	case RHYTHMDB_PROP_TITLE:
+		search_index_entry_changed (db, entry, propid, g_value_get_string (value));
+		break;
+	case RHYTHMDB_PROP_RATING:
+	case RHYTHMDB_PROP_PLAY_COUNT:
+	case RHYTHMDB_PROP_LAST_PLAYED:
+	case RHYTHMDB_PROP_FIRST_SEEN:
+	case RHYTHMDB_PROP_DURATION:
+	case RHYTHMDB_PROP_FILE_SIZE:
+	case RHYTHMDB_PROP_DATE:
+		range_index_entry_changed (db, entry, propid, value);
+		break;
+	case RHYTHMDB_PROP_LOCATION:
+	{
+		RBRefString *s;
+		/* We have to use the string in the entry itself as the hash key,
+		 * otherwise either we leak it, or the string vanishes when the
+		 * GValue is freed; this means we have to do the entry modification
+		 * here, rather than letting rhythmdb_entry_set_internal do it.
+		 */
+		g_mutex_lock (db->priv->entries_lock);
+		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+
+		s = rb_refstring_new (g_value_get_string (value));
+		rb_refstring_unref (entry->location);
+		entry->location = s;
+		g_hash_table_insert (db->priv->entries, entry->location, entry);
+		g_mutex_unlock (db->priv->entries_lock);
+
+		return TRUE;
+	}
+	case RHYTHMDB_PROP_ALBUM:
+	{
+		const char *albumname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->album), albumname)) {
+			RhythmDBTreeProperty *artist;
+			RhythmDBTreeProperty *genre;
+
+			search_index_entry_changed (db, entry, propid, albumname);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			artist = get_or_create_artist (db, genre, entry->artist);
+			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
+			g_mutex_unlock (db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_ARTIST:
+	{
+		const char *artistname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
+			RhythmDBTreeProperty *new_artist;
+			RhythmDBTreeProperty *genre;
+
+			search_index_entry_changed (db, entry, propid, artistname);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			new_artist = get_or_create_artist (db, genre,
+							   rb_refstring_new (artistname));
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_mutex_unlock (db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_GENRE:
+	{
+		const char *genrename = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
+			RhythmDBTreeProperty *new_genre;
+			RhythmDBTreeProperty *new_artist;
+
+			search_index_entry_changed (db, entry, propid, genrename);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			new_genre = get_or_create_genre (db, type,
+							 rb_refstring_new (genrename));
+			new_artist = get_or_create_artist (db, new_genre, entry->artist);
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_mutex_unlock (db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+static void
+rhythmdb_tree_entry_delete (RhythmDB *adb,
+			    RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+
+	journal_entry_deleted (db, entry);
+
+	g_mutex_lock (db->priv->genres_lock);
+	remove_entry_from_album (db, entry);
+	g_mutex_unlock (db->priv->genres_lock);
+
+	/* remove all keywords */
+	g_mutex_lock (db->priv->keywords_lock);
+	remove_entry_from_keywords (db, entry);
+	g_mutex_unlock (db->priv->keywords_lock);
+
+	/* the indexes are built from the entries table with the entries lock
+	 * held, so remove the entry from them in the same critical section,
+	 * otherwise an index being built now could add it back.
+	 */
+	g_mutex_lock (db->priv->entries_lock);
+	search_index_entry_removed (db, entry);
+	range_index_entry_removed (db, entry);
+	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
+
+	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+	rhythmdb_entry_unref (entry);
+	g_mutex_unlock (db->priv->entries_lock);
+}
+
+typedef struct {
+	RhythmDB *db;
+	RhythmDBEntryType type;
+} RbEntryRemovalCtxt;
+
+/* must be called with the entries and genres locks held */
+static gboolean
+remove_one_song (gpointer key,
+		 RhythmDBEntry *entry,
+		 RbEntryRemovalCtxt *ctxt)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE(ctxt->db);
+
+	rb_assert_locked (db->priv->entries_lock);
+	rb_assert_locked (db->priv->genres_lock);
+
+	g_return_val_if_fail (entry != NULL, FALSE);
+
+	if (entry->type == ctxt->type) {
+		rhythmdb_emit_entry_deleted (ctxt->db, entry);
+		g_mutex_lock (db->priv->keywords_lock);
+		remove_entry_from_keywords (db, entry);
+		g_mutex_unlock (db->priv->keywords_lock);
+		remove_entry_from_album (db, entry);
+		g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id));
+		rhythmdb_entry_unref (entry);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
+				    RhythmDBEntryType type)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RbEntryRemovalCtxt ctxt;
 
-	table = g_hash_table_lookup (db->priv->genres, type);
-	if (table == NULL) {
-		table = g_hash_table_new_full (rb_refstring_hash,
-					       rb_refstring_equal,
-					       (GDestroyNotify) rb_refstring_unref,
-					       NULL);
-		if (table == NULL) {
-			g_warning ("Out of memory\n");
-			return NULL;
+	journal_entries_deleted_by_type (db, type);
+
+	ctxt.db = adb;
+	ctxt.type = type;
+	g_mutex_lock (db->priv->entries_lock);
+	g_mutex_lock (db->priv->genres_lock);
+
+	/* removing each entry from the search indexes individually would be
+	 * slow, so throw them away and rebuild them when needed.
+	 */
+	search_index_invalidate (db);
+	range_index_invalidate (db);
+
+	g_hash_table_foreach_remove (db->priv->entries,
+				     (GHRFunc) remove_one_song, &ctxt);
+	g_mutex_unlock (db->priv->genres_lock);
+	g_mutex_unlock (db->priv->entries_lock);
+}
+
+/*
+ * The search index maps each three byte sequence (trigram) that occurs in
+ * the folded title, album, artist or genre of an entry to the list of
+ * entries containing it.  Any entry matching a substring search for a word
+ * of three or more bytes must contain all of the word's trigrams, so the
+ * shortest of their lists is a superset of the matches.  Those candidates
+ * are then checked against the full query as usual, so the results are
+ * exactly the same as a scan of the whole database.
+ *
+ * The index is built the first time it's needed, then kept up to date as
+ * entries are added, changed and removed.  Trigrams containing spaces are
+ * never part of a search word, so they aren't indexed.
+ */
+
+static void
+free_search_posting (GPtrArray *posting)
+{
+	g_ptr_array_free (posting, TRUE);
+}
+
+static const RhythmDBPropType search_index_props[] = {
+	RHYTHMDB_PROP_TITLE_FOLDED,
+	RHYTHMDB_PROP_ALBUM_FOLDED,
+	RHYTHMDB_PROP_ARTIST_FOLDED,
+	RHYTHMDB_PROP_GENRE_FOLDED
+};
+
+#define SEARCH_INDEX_TRIGRAM(s)	GUINT_TO_POINTER ((((guint)(guchar)(s)[0]) << 16) | \
+						      (((guint)(guchar)(s)[1]) << 8) | \
+						      ((guint)(guchar)(s)[2]))
+
+static void
+collect_trigrams (GArray *trigrams, const char *folded)
+{
+	const char *p;
+
+	if (folded == NULL)
+		return;
+
+	for (p = folded; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++) {
+		gpointer trigram;
+
+		if (p[0] == ' ' || p[1] == ' ' || p[2] == ' ')
+			continue;
+
+		trigram = SEARCH_INDEX_TRIGRAM (p);
+		g_array_append_val (trigrams, trigram);
+	}
+}
+
+static int
+compare_trigrams (gconstpointer a, gconstpointer b)
+{
+	guint ta = GPOINTER_TO_UINT (*(gpointer *)a);
+	guint tb = GPOINTER_TO_UINT (*(gpointer *)b);
+
+	return (ta < tb) ? -1 : ((ta > tb) ? 1 : 0);
+}
+
+/* returns the sorted, distinct trigrams for an entry, optionally with the
+ * value of one property replaced by a new (unfolded) value.
+ */
+static GArray *
+get_entry_trigrams (RhythmDBEntry *entry,
+		    RhythmDBPropType replace_prop,
+		    const char *replace_value)
+{
+	GArray *trigrams;
+	guint i, j;
+
+	trigrams = g_array_new (FALSE, FALSE, sizeof (gpointer));
+	for (i = 0; i < G_N_ELEMENTS (search_index_props); i++) {
+		if (search_index_props[i] == replace_prop) {
+			char *folded = rb_search_fold (replace_value);
+			collect_trigrams (trigrams, folded);
+			g_free (folded);
+		} else {
+			collect_trigrams (trigrams, rhythmdb_entry_get_string (entry, search_index_props[i]));
 		}
-		g_hash_table_insert (db->priv->genres,
-				     type,
-				     table);
 	}
-	return table;
+
+	if (trigrams->len < 2)
+		return trigrams;
+
+	g_array_sort (trigrams, compare_trigrams);
+	for (i = 1, j = 0; i < trigrams->len; i++) {
+		if (g_array_index (trigrams, gpointer, i) != g_array_index (trigrams, gpointer, j)) {
+			j++;
+			g_array_index (trigrams, gpointer, j) = g_array_index (trigrams, gpointer, i);
+		}
+	}
+	g_array_set_size (trigrams, j + 1);
+	return trigrams;
 }
 
-typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+/* must be called with the search index lock held */
+static void
+search_index_add (RhythmDBTree *db, RhythmDBEntry *entry, gpointer trigram)
+{
+	GPtrArray *posting;
 
-typedef struct {
-	RhythmDBTree *db;
-	RBHFunc func;
-	gpointer data;
-} GenresIterCtxt;
+	posting = g_hash_table_lookup (db->priv->search_index, trigram);
+	if (posting == NULL) {
+		posting = g_ptr_array_new ();
+		g_hash_table_insert (db->priv->search_index, trigram, posting);
+	}
+	g_ptr_array_add (posting, entry);
+}
 
+/* must be called with the search index lock held */
 static void
-genres_process_one (gpointer key,
-		    gpointer value,
-		    gpointer user_data)
+search_index_remove (RhythmDBTree *db, RhythmDBEntry *entry, gpointer trigram)
 {
-	GenresIterCtxt *ctxt = (GenresIterCtxt *)user_data;
-	ctxt->func (ctxt->db, (GHashTable *)value, ctxt->data);
+	GPtrArray *posting;
+
+	posting = g_hash_table_lookup (db->priv->search_index, trigram);
+	if (posting == NULL)
+		return;
+
+	g_ptr_array_remove_fast (posting, entry);
+	if (posting->len == 0)
+		g_hash_table_remove (db->priv->search_index, trigram);
 }
 
 static void
-genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+search_index_entry_added (RhythmDBTree *db, RhythmDBEntry *entry)
 {
-	GenresIterCtxt ctxt;
+	GArray *trigrams;
+	guint i;
 
-	ctxt.db = db;
-	ctxt.func = func;
-	ctxt.data = data;
-	g_hash_table_foreach (db->priv->genres, genres_process_one, &ctxt);
+	g_mutex_lock (db->priv->search_index_lock);
+	if (db->priv->search_index_valid) {
+		trigrams = get_entry_trigrams (entry, RHYTHMDB_NUM_PROPERTIES, NULL);
+		for (i = 0; i < trigrams->len; i++) {
+			search_index_add (db, entry, g_array_index (trigrams, gpointer, i));
+		}
+		g_array_free (trigrams, TRUE);
+	}
+	g_mutex_unlock (db->priv->search_index_lock);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_genre (RhythmDBTree *db,
-		     RhythmDBEntryType type,
-		     RBRefString *name)
+static void
+search_index_entry_removed (RhythmDBTree *db, RhythmDBEntry *entry)
 {
-	RhythmDBTreeProperty *genre;
-	GHashTable *table;
+	GArray *trigrams;
+	guint i;
 
-	rb_assert_locked (db->priv->genres_lock);
+	g_mutex_lock (db->priv->search_index_lock);
+	if (db->priv->search_index_valid) {
+		trigrams = get_entry_trigrams (entry, RHYTHMDB_NUM_PROPERTIES, NULL);
+		for (i = 0; i < trigrams->len; i++) {
+			search_index_remove (db, entry, g_array_index (trigrams, gpointer, i));
+		}
+		g_array_free (trigrams, TRUE);
+	}
+	g_mutex_unlock (db->priv->search_index_lock);
+}
 
-	table = get_genres_hash_for_type (db, type);
-	genre = g_hash_table_lookup (table, name);
+static void
+search_index_entry_changed (RhythmDBTree *db,
+			    RhythmDBEntry *entry,
+			    RhythmDBPropType propid,
+			    const char *value)
+{
+	GArray *old_trigrams;
+	GArray *new_trigrams;
+	guint i, j;
 
-	if (G_UNLIKELY (genre == NULL)) {
-		genre = rhythmdb_tree_property_new (db);
-		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							 (GDestroyNotify) rb_refstring_unref,
-							 NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (table, name, genre);
-		genre->parent = NULL;
+	switch (propid) {
+	case RHYTHMDB_PROP_TITLE:
+		propid = RHYTHMDB_PROP_TITLE_FOLDED;
+		break;
+	case RHYTHMDB_PROP_ALBUM:
+		propid = RHYTHMDB_PROP_ALBUM_FOLDED;
+		break;
+	case RHYTHMDB_PROP_ARTIST:
+		propid = RHYTHMDB_PROP_ARTIST_FOLDED;
+		break;
+	case RHYTHMDB_PROP_GENRE:
+		propid = RHYTHMDB_PROP_GENRE_FOLDED;
+		break;
+	default:
+		g_assert_not_reached ();
 	}
 
-	return genre;
+	g_mutex_lock (db->priv->search_index_lock);
+	if (db->priv->search_index_valid == FALSE) {
+		g_mutex_unlock (db->priv->search_index_lock);
+		return;
+	}
+
+	old_trigrams = get_entry_trigrams (entry, RHYTHMDB_NUM_PROPERTIES, NULL);
+	new_trigrams = get_entry_trigrams (entry, propid, value);
+
+	/* both are sorted, so walk them together and only touch the
+	 * trigrams that differ.
+	 */
+	i = 0;
+	j = 0;
+	while (i < old_trigrams->len || j < new_trigrams->len) {
+		gpointer old_t = NULL;
+		gpointer new_t = NULL;
+		int cmp;
+
+		if (i < old_trigrams->len)
+			old_t = g_array_index (old_trigrams, gpointer, i);
+		if (j < new_trigrams->len)
+			new_t = g_array_index (new_trigrams, gpointer, j);
+
+		if (i >= old_trigrams->len)
+			cmp = 1;
+		else if (j >= new_trigrams->len)
+			cmp = -1;
+		else
+			cmp = compare_trigrams (&old_t, &new_t);
+
+		if (cmp < 0) {
+			search_index_remove (db, entry, old_t);
+			i++;
+		} else if (cmp > 0) {
+			search_index_add (db, entry, new_t);
+			j++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	g_array_free (old_trigrams, TRUE);
+	g_array_free (new_trigrams, TRUE);
+	g_mutex_unlock (db->priv->search_index_lock);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_artist (RhythmDBTree *db,
-		      RhythmDBTreeProperty *genre,
-		      RBRefString *name)
+/* must be called with the entries lock held */
+static void
+search_index_invalidate (RhythmDBTree *db)
 {
-	RhythmDBTreeProperty *artist;
+	rb_assert_locked (db->priv->entries_lock);
 
-	rb_assert_locked (db->priv->genres_lock);
+	g_mutex_lock (db->priv->search_index_lock);
+	g_hash_table_remove_all (db->priv->search_index);
+	db->priv->search_index_valid = FALSE;
+	g_mutex_unlock (db->priv->search_index_lock);
+}
 
-	artist = g_hash_table_lookup (genre->children, name);
+static void
+search_index_build_entry (RBRefString *location,
+			  RhythmDBEntry *entry,
+			  RhythmDBTree *db)
+{
+	GArray *trigrams;
+	guint i;
 
-	if (G_UNLIKELY (artist == NULL)) {
-		artist = rhythmdb_tree_property_new (db);
-		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							  (GDestroyNotify) rb_refstring_unref,
-							  NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (genre->children, name, artist);
-		artist->parent = genre;
+	trigrams = get_entry_trigrams (entry, RHYTHMDB_NUM_PROPERTIES, NULL);
+	for (i = 0; i < trigrams->len; i++) {
+		search_index_add (db, entry, g_array_index (trigrams, gpointer, i));
 	}
+	g_array_free (trigrams, TRUE);
+}
 
-	return artist;
+static void
+search_index_ensure (RhythmDBTree *db)
+{
+	g_mutex_lock (db->priv->entries_lock);
+	g_mutex_lock (db->priv->search_index_lock);
+	if (db->priv->search_index_valid == FALSE) {
+		rb_profile_start ("building search index");
+		g_hash_table_foreach (db->priv->entries, (GHFunc) search_index_build_entry, db);
+		db->priv->search_index_valid = TRUE;
+		rb_debug ("search index has %u trigrams", g_hash_table_size (db->priv->search_index));
+		rb_profile_end ("building search index");
+	}
+	g_mutex_unlock (db->priv->search_index_lock);
+	g_mutex_unlock (db->priv->entries_lock);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_album (RhythmDBTree *db,
-		     RhythmDBTreeProperty *artist,
-		     RBRefString *name)
+/* must be called with the search index lock held */
+static GPtrArray *
+search_index_shortest_posting (RhythmDBTree *db,
+			       const char *word,
+			       gboolean *found)
 {
-	RhythmDBTreeProperty *album;
+	GPtrArray *best = NULL;
+	const char *p;
 
-	rb_assert_locked (db->priv->genres_lock);
+	for (p = word; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++) {
+		GPtrArray *posting;
 
-	album = g_hash_table_lookup (artist->children, name);
+		if (p[0] == ' ' || p[1] == ' ' || p[2] == ' ')
+			continue;
 
-	if (G_UNLIKELY (album == NULL)) {
-		album = rhythmdb_tree_property_new (db);
-		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
-		rb_refstring_ref (name);
-		g_hash_table_insert (artist->children, name, album);
-		album->parent = artist;
+		posting = g_hash_table_lookup (db->priv->search_index, SEARCH_INDEX_TRIGRAM (p));
+		if (posting == NULL) {
+			/* nothing can match */
+			*found = TRUE;
+			return NULL;
+		}
+
+		if (best == NULL || posting->len < best->len)
+			best = posting;
 	}
 
-	return album;
+	if (best != NULL)
+		*found = TRUE;
+	return best;
 }
 
-static gboolean
-remove_child (RhythmDBTreeProperty *parent,
-	      gconstpointer data)
+/*
+ * Returns a referenced superset of the entries matching the text search
+ * criteria in a conjunctive query, or NULL if the query has no criteria
+ * the index can help with.
+ */
+static GPtrArray *
+search_index_get_candidates (RhythmDBTree *db, GPtrArray *query)
 {
-	g_assert (g_hash_table_remove (parent->children, data));
-	if (g_hash_table_size (parent->children) <= 0) {
-		return TRUE;
+	GPtrArray *best = NULL;
+	GPtrArray *candidates;
+	gboolean usable = FALSE;
+	gboolean found;
+	guint i, j;
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		if (data->type != RHYTHMDB_QUERY_PROP_LIKE)
+			continue;
+
+		for (j = 0; j < G_N_ELEMENTS (search_index_props); j++) {
+			if (data->propid == search_index_props[j])
+				break;
+		}
+		if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH || j < G_N_ELEMENTS (search_index_props)) {
+			usable = TRUE;
+			break;
+		}
 	}
-	return FALSE;
+	if (usable == FALSE)
+		return NULL;
+
+	search_index_ensure (db);
+
+	g_mutex_lock (db->priv->search_index_lock);
+	if (db->priv->search_index_valid == FALSE) {
+		/* entries were removed since we built it */
+		g_mutex_unlock (db->priv->search_index_lock);
+		return NULL;
+	}
+
+	found = FALSE;
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+		GPtrArray *posting;
+		gboolean word_found = FALSE;
+
+		if (data->type != RHYTHMDB_QUERY_PROP_LIKE)
+			continue;
+
+		if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+			char **words = g_value_get_boxed (data->val);
+			char **word;
+
+			for (word = words; word != NULL && *word != NULL; word++) {
+				word_found = FALSE;
+				posting = search_index_shortest_posting (db, *word, &word_found);
+				if (word_found && (posting == NULL || best == NULL || posting->len < best->len)) {
+					best = posting;
+					found = TRUE;
+					if (best == NULL)
+						break;
+				}
+			}
+		} else {
+			for (j = 0; j < G_N_ELEMENTS (search_index_props); j++) {
+				if (data->propid == search_index_props[j])
+					break;
+			}
+			if (j == G_N_ELEMENTS (search_index_props))
+				continue;
+
+			posting = search_index_shortest_posting (db, g_value_get_string (data->val), &word_found);
+			if (word_found && (posting == NULL || best == NULL || posting->len < best->len)) {
+				best = posting;
+				found = TRUE;
+			}
+		}
+
+		if (found && best == NULL)
+			break;
+	}
+
+	if (found == FALSE) {
+		/* all the words were too short */
+		g_mutex_unlock (db->priv->search_index_lock);
+		return NULL;
+	}
+
+	candidates = g_ptr_array_new ();
+	if (best != NULL) {
+		for (i = 0; i < best->len; i++) {
+			g_ptr_array_add (candidates, rhythmdb_entry_ref (g_ptr_array_index (best, i)));
+		}
+	}
+	g_mutex_unlock (db->priv->search_index_lock);
+
+	return candidates;
 }
 
-/* must be called with the genres lock held */
-static void
-remove_entry_from_album (RhythmDBTree *db,
-			 RhythmDBEntry *entry)
+/*
+ * The range indexes keep the entries sorted by each of a few numeric
+ * properties that smart playlists commonly restrict, such as rating, play
+ * count and when the entry was last played.  For a conjunctive query with
+ * range criteria on those properties, the index gives the entries within
+ * the tightest range, which are then checked against the full query.
+ *
+ * Like the search index, the range indexes are built the first time
+ * they're needed and then kept up to date.  The index nodes hold a copy of
+ * the key, as the tree hears about changes before the entry is updated.
+ */
+
+typedef struct
 {
-	GHashTable *table;
+	double key;
+	RhythmDBEntry *entry;
+} RhythmDBTreeRangeNode;
 
-	rb_assert_locked (db->priv->genres_lock);
+static int
+range_index_find (RhythmDBPropType propid)
+{
+	int i;
 
-	rb_refstring_ref (entry->genre);
-	rb_refstring_ref (entry->artist);
-	rb_refstring_ref (entry->album);
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		if (range_index_props[i] == propid)
+			return i;
+	}
+	return -1;
+}
 
-	table = get_genres_hash_for_type (db, entry->type);
-	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
-		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
-				  entry->album)) {
+static gint
+compare_range_nodes (const RhythmDBTreeRangeNode *a,
+		     const RhythmDBTreeRangeNode *b,
+		     gpointer data)
+{
+	if (a->key < b->key)
+		return -1;
+	else if (a->key > b->key)
+		return 1;
+	else if (a->entry < b->entry)
+		return -1;
+	else if (a->entry > b->entry)
+		return 1;
+	return 0;
+}
 
-			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
-					  entry->artist)) {
-				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
-				g_assert (g_hash_table_remove (table, entry->genre));
-			}
-			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
-		}
+static double
+range_key_from_value (const GValue *value)
+{
+	switch (G_VALUE_TYPE (value)) {
+	case G_TYPE_ULONG:
+		return g_value_get_ulong (value);
+	case G_TYPE_UINT64:
+		return g_value_get_uint64 (value);
+	case G_TYPE_DOUBLE:
+		return g_value_get_double (value);
+	default:
+		g_assert_not_reached ();
+		return 0.0;
+	}
+}
 
-		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+static double
+range_key_from_entry (RhythmDBTree *db, RhythmDBEntry *entry, RhythmDBPropType propid)
+{
+	switch (rhythmdb_get_property_type (RHYTHMDB (db), propid)) {
+	case G_TYPE_ULONG:
+		return rhythmdb_entry_get_ulong (entry, propid);
+	case G_TYPE_UINT64:
+		return rhythmdb_entry_get_uint64 (entry, propid);
+	case G_TYPE_DOUBLE:
+		return rhythmdb_entry_get_double (entry, propid);
+	default:
+		g_assert_not_reached ();
+		return 0.0;
 	}
+}
 
-	rb_refstring_unref (entry->genre);
-	rb_refstring_unref (entry->artist);
-	rb_refstring_unref (entry->album);
+/* must be called with the range index lock held */
+static void
+range_index_insert (RhythmDBTree *db, int idx, RhythmDBEntry *entry, double key)
+{
+	RhythmDBTreeRangeIndex *index = &db->priv->range_index[idx];
+	RhythmDBTreeRangeNode *node;
+	GSequenceIter *iter;
+
+	rb_assert_locked (db->priv->range_index_lock);
+
+	node = g_new (RhythmDBTreeRangeNode, 1);
+	node->key = key;
+	node->entry = entry;
+	iter = g_sequence_insert_sorted (index->nodes, node,
+					 (GCompareDataFunc) compare_range_nodes, NULL);
+	g_hash_table_insert (index->entry_nodes, entry, iter);
 }
 
+/* must be called with the range index lock held */
 static gboolean
-rhythmdb_tree_entry_set (RhythmDB *adb,
-			 RhythmDBEntry *entry,
-			 guint propid,
-			 const GValue *value)
+range_index_remove (RhythmDBTree *db, int idx, RhythmDBEntry *entry)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RhythmDBEntryType type;
+	RhythmDBTreeRangeIndex *index = &db->priv->range_index[idx];
+	GSequenceIter *iter;
 
-	type = entry->type;
+	rb_assert_locked (db->priv->range_index_lock);
 
-	/* don't process changes to entries we're loading, we'll get them
-	 * when the entry is complete.  don't process changes for entries that
-	 * have been removed either.
-	 */
-	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
+	iter = g_hash_table_lookup (index->entry_nodes, entry);
+	if (iter == NULL)
 		return FALSE;
 
-	/* Handle special properties */
-	switch (propid)
-	{
-	case RHYTHMDB_PROP_LOCATION:
-	{
-		RBRefString *s;
-		/* We have to use the string in the entry itself as the hash key,
-		 * otherwise either we leak it, or the string vanishes when the
-		 * GValue is freed; this means we have to do the entry modification
-		 * here, rather than letting rhythmdb_entry_set_internal do it.
-		 */
-		g_mutex_lock (db->priv->entries_lock);
-		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+	g_sequence_remove (iter);
+	g_hash_table_remove (index->entry_nodes, entry);
+	return TRUE;
+}
 
-		s = rb_refstring_new (g_value_get_string (value));
-		rb_refstring_unref (entry->location);
-		entry->location = s;
-		g_hash_table_insert (db->priv->entries, entry->location, entry);
-		g_mutex_unlock (db->priv->entries_lock);
+static void
+range_index_entry_added (RhythmDBTree *db, RhythmDBEntry *entry)
+{
+	int i;
 
-		return TRUE;
+	g_mutex_lock (db->priv->range_index_lock);
+	if (db->priv->range_index_valid) {
+		for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+			range_index_insert (db, i, entry, range_key_from_entry (db, entry, range_index_props[i]));
+		}
 	}
-	case RHYTHMDB_PROP_ALBUM:
-	{
-		const char *albumname = g_value_get_string (value);
-
-		if (strcmp (rb_refstring_get (entry->album), albumname)) {
-			RhythmDBTreeProperty *artist;
-			RhythmDBTreeProperty *genre;
-
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+	g_mutex_unlock (db->priv->range_index_lock);
+}
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			artist = get_or_create_artist (db, genre, entry->artist);
-			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
-			g_mutex_unlock (db->priv->genres_lock);
+static void
+range_index_entry_removed (RhythmDBTree *db, RhythmDBEntry *entry)
+{
+	int i;
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
+	g_mutex_lock (db->priv->range_index_lock);
+	if (db->priv->range_index_valid) {
+		for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+			range_index_remove (db, i, entry);
 		}
-		break;
 	}
-	case RHYTHMDB_PROP_ARTIST:
-	{
-		const char *artistname = g_value_get_string (value);
-
-		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
-			RhythmDBTreeProperty *new_artist;
-			RhythmDBTreeProperty *genre;
+	g_mutex_unlock (db->priv->range_index_lock);
+}
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+static void
+range_index_entry_changed (RhythmDBTree *db,
+			   RhythmDBEntry *entry,
+			   RhythmDBPropType propid,
+			   const GValue *value)
+{
+	int idx;
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			new_artist = get_or_create_artist (db, genre,
-							   rb_refstring_new (artistname));
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (db->priv->genres_lock);
+	idx = range_index_find (propid);
+	g_assert (idx >= 0);
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
-		}
-		break;
+	g_mutex_lock (db->priv->range_index_lock);
+	if (db->priv->range_index_valid && range_index_remove (db, idx, entry)) {
+		range_index_insert (db, idx, entry, range_key_from_value (value));
 	}
-	case RHYTHMDB_PROP_GENRE:
-	{
-		const char *genrename = g_value_get_string (value);
+	g_mutex_unlock (db->priv->range_index_lock);
+}
 
-		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
-			RhythmDBTreeProperty *new_genre;
-			RhythmDBTreeProperty *new_artist;
+/* must be called with the entries lock held */
+static void
+range_index_invalidate (RhythmDBTree *db)
+{
+	int i;
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+	rb_assert_locked (db->priv->entries_lock);
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			new_genre = get_or_create_genre (db, type,
-							 rb_refstring_new (genrename));
-			new_artist = get_or_create_artist (db, new_genre, entry->artist);
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (db->priv->genres_lock);
+	g_mutex_lock (db->priv->range_index_lock);
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		RhythmDBTreeRangeIndex *index = &db->priv->range_index[i];
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
-		}
-		break;
-	}
-	default:
-		break;
+		g_sequence_remove_range (g_sequence_get_begin_iter (index->nodes),
+					 g_sequence_get_end_iter (index->nodes));
+		g_hash_table_remove_all (index->entry_nodes);
 	}
-
-	return FALSE;
+	db->priv->range_index_valid = FALSE;
+	g_mutex_unlock (db->priv->range_index_lock);
 }
 
 static void
-rhythmdb_tree_entry_delete (RhythmDB *adb,
-			    RhythmDBEntry *entry)
+range_index_build_entry (RBRefString *location,
+			 RhythmDBEntry *entry,
+			 RhythmDBTree *db)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-
-	g_mutex_lock (db->priv->genres_lock);
-	remove_entry_from_album (db, entry);
-	g_mutex_unlock (db->priv->genres_lock);
+	int i;
 
-	/* remove all keywords */
-	g_mutex_lock (db->priv->keywords_lock);
-	remove_entry_from_keywords (db, entry);
-	g_mutex_unlock (db->priv->keywords_lock);
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		range_index_insert (db, i, entry, range_key_from_entry (db, entry, range_index_props[i]));
+	}
+}
 
+static void
+range_index_ensure (RhythmDBTree *db)
+{
 	g_mutex_lock (db->priv->entries_lock);
-	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
-	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
-
-	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
-	rhythmdb_entry_unref (entry);
+	g_mutex_lock (db->priv->range_index_lock);
+	if (db->priv->range_index_valid == FALSE) {
+		rb_profile_start ("building range indexes");
+		g_hash_table_foreach (db->priv->entries, (GHFunc) range_index_build_entry, db);
+		db->priv->range_index_valid = TRUE;
+		rb_profile_end ("building range indexes");
+	}
+	g_mutex_unlock (db->priv->range_index_lock);
 	g_mutex_unlock (db->priv->entries_lock);
 }
 
-typedef struct {
-	RhythmDB *db;
-	RhythmDBEntryType type;
-} RbEntryRemovalCtxt;
-
-/* must be called with the entries and genres locks held */
+/*
+ * Narrows the bounds for each indexed property using the criteria in a
+ * conjunctive query.  The bounds are inclusive, which can only let extra
+ * entries through, and those fail when they're checked against the query.
+ * Returns TRUE if any criteria could be used.
+ */
 static gboolean
-remove_one_song (gpointer key,
-		 RhythmDBEntry *entry,
-		 RbEntryRemovalCtxt *ctxt)
+range_index_collect_bounds (RhythmDBTree *db,
+			    GPtrArray *query,
+			    double *lower,
+			    double *upper)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE(ctxt->db);
+	gboolean usable = FALSE;
+	GTimeVal now;
+	guint i;
 
-	rb_assert_locked (db->priv->entries_lock);
-	rb_assert_locked (db->priv->genres_lock);
+	g_get_current_time (&now);
 
-	g_return_val_if_fail (entry != NULL, FALSE);
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+		double value;
+		int idx;
 
-	if (entry->type == ctxt->type) {
-		rhythmdb_emit_entry_deleted (ctxt->db, entry);
-		g_mutex_lock (db->priv->keywords_lock);
-		remove_entry_from_keywords (db, entry);
-		g_mutex_unlock (db->priv->keywords_lock);
-		remove_entry_from_album (db, entry);
-		g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id));
-		rhythmdb_entry_unref (entry);
-		return TRUE;
+		if (data->type == RHYTHMDB_QUERY_SUBQUERY) {
+			guint j;
+
+			/* year criteria become subqueries; only conjunctions can narrow things */
+			for (j = 0; j < data->subquery->len; j++) {
+				RhythmDBQueryData *sub = g_ptr_array_index (data->subquery, j);
+				if (sub->type == RHYTHMDB_QUERY_DISJUNCTION)
+					break;
+			}
+			if (j == data->subquery->len &&
+			    range_index_collect_bounds (db, data->subquery, lower, upper))
+				usable = TRUE;
+			continue;
+		}
+
+		idx = range_index_find (data->propid);
+		if (idx < 0)
+			continue;
+
+		switch (data->type) {
+		case RHYTHMDB_QUERY_PROP_EQUALS:
+			value = range_key_from_value (data->val);
+			lower[idx] = MAX (lower[idx], value);
+			upper[idx] = MIN (upper[idx], value);
+			break;
+		case RHYTHMDB_QUERY_PROP_GREATER:
+			lower[idx] = MAX (lower[idx], range_key_from_value (data->val));
+			break;
+		case RHYTHMDB_QUERY_PROP_LESS:
+			upper[idx] = MIN (upper[idx], range_key_from_value (data->val));
+			break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+			value = (double) now.tv_sec - g_value_get_ulong (data->val);
+			lower[idx] = MAX (lower[idx], value);
+			break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+			value = (double) now.tv_sec - g_value_get_ulong (data->val);
+			upper[idx] = MIN (upper[idx], value);
+			break;
+		default:
+			continue;
+		}
+		usable = TRUE;
 	}
-	return FALSE;
+
+	return usable;
 }
 
-static void
-rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
-				    RhythmDBEntryType type)
+/*
+ * Returns a referenced superset of the entries matching the range
+ * criteria in a conjunctive query, or NULL if the query has no criteria
+ * the indexes can help with, or if the best range has @limit or more
+ * entries.
+ */
+static GPtrArray *
+range_index_get_candidates (RhythmDBTree *db, GPtrArray *query, guint limit)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RbEntryRemovalCtxt ctxt;
+	double lower[RHYTHMDB_TREE_NUM_RANGE_INDEXES];
+	double upper[RHYTHMDB_TREE_NUM_RANGE_INDEXES];
+	GSequenceIter *best_begin = NULL;
+	GSequenceIter *best_end = NULL;
+	GSequenceIter *iter;
+	GPtrArray *candidates;
+	guint best_count = G_MAXUINT;
+	guint total;
+	int i;
 
-	ctxt.db = adb;
-	ctxt.type = type;
-	g_mutex_lock (db->priv->entries_lock);
-	g_mutex_lock (db->priv->genres_lock);
-	g_hash_table_foreach_remove (db->priv->entries,
-				     (GHRFunc) remove_one_song, &ctxt);
-	g_mutex_unlock (db->priv->genres_lock);
-	g_mutex_unlock (db->priv->entries_lock);
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		lower[i] = -G_MAXDOUBLE;
+		upper[i] = G_MAXDOUBLE;
+	}
+	if (range_index_collect_bounds (db, query, lower, upper) == FALSE)
+		return NULL;
+
+	range_index_ensure (db);
+
+	g_mutex_lock (db->priv->range_index_lock);
+	if (db->priv->range_index_valid == FALSE) {
+		/* entries were removed since we built it */
+		g_mutex_unlock (db->priv->range_index_lock);
+		return NULL;
+	}
+
+	total = g_hash_table_size (db->priv->range_index[0].entry_nodes);
+	for (i = 0; i < RHYTHMDB_TREE_NUM_RANGE_INDEXES; i++) {
+		RhythmDBTreeRangeIndex *index = &db->priv->range_index[i];
+		RhythmDBTreeRangeNode probe;
+		GSequenceIter *begin, *end;
+		gint count;
+
+		if (lower[i] == -G_MAXDOUBLE && upper[i] == G_MAXDOUBLE)
+			continue;
+
+		/* no entry sorts before the NULL entry or after the highest
+		 * possible address, so these find the ends of the range.
+		 */
+		probe.key = lower[i];
+		probe.entry = NULL;
+		begin = g_sequence_search (index->nodes, &probe,
+					   (GCompareDataFunc) compare_range_nodes, NULL);
+		probe.key = upper[i];
+		probe.entry = GSIZE_TO_POINTER (G_MAXSIZE);
+		end = g_sequence_search (index->nodes, &probe,
+					 (GCompareDataFunc) compare_range_nodes, NULL);
+
+		count = g_sequence_iter_get_position (end) - g_sequence_iter_get_position (begin);
+		if (count < 0)
+			count = 0;
+		if ((guint) count < best_count) {
+			best_count = count;
+			best_begin = begin;
+			best_end = end;
+		}
+	}
+
+	/* walking the tree costs about the same as walking a long range */
+	if (best_begin == NULL || best_count >= limit || best_count > total / 2) {
+		g_mutex_unlock (db->priv->range_index_lock);
+		return NULL;
+	}
+
+	candidates = g_ptr_array_sized_new (best_count);
+	if (best_count > 0) {
+		for (iter = best_begin; iter != best_end; iter = g_sequence_iter_next (iter)) {
+			RhythmDBTreeRangeNode *node = g_sequence_get (iter);
+			g_ptr_array_add (candidates, rhythmdb_entry_ref (node->entry));
+		}
+	}
+	g_mutex_unlock (db->priv->range_index_lock);
+
+	rb_debug ("range index gave %u candidates", candidates->len);
+	return candidates;
 }
 
 static void
@@ -1711,6 +4234,7 @@ struct RhythmDBTreeTraversalData
 {
 	RhythmDBTree *db;
 	GPtrArray *query;
+	RhythmDBQueryPlan *plan;
 	RhythmDBTreeTraversalFunc func;
 	gpointer data;
 	gboolean *cancel;
@@ -1967,8 +4491,7 @@ do_conjunction (RhythmDBEntry *entry,
 	if (G_UNLIKELY (*data->cancel))
 		return;
 	/* Finally, we actually evaluate the query! */
-	if (evaluate_conjunctive_subquery (data->db, data->query, 0, data->query->len,
-					   entry)) {
+	if (rhythmdb_query_plan_evaluate (data->plan, entry)) {
 		data->func (data->db, entry, data->data);
 	}
 }
@@ -2136,6 +4659,8 @@ conjunctive_query (RhythmDBTree *db,
 	int type_query_idx = -1;
 	guint i;
 	struct RhythmDBTreeTraversalData *traversal_data;
+	GPtrArray *candidates;
+	GPtrArray *range_candidates;
 
 	for (i = 0; i < query->len; i++) {
 		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
@@ -2151,10 +4676,48 @@ conjunctive_query (RhythmDBTree *db,
 	traversal_data = g_new (struct RhythmDBTreeTraversalData, 1);
 	traversal_data->db = db;
 	traversal_data->query = query;
+	/* compiled before the tree walk below takes criteria out of the query;
+	 * rechecking those is only a pointer comparison.
+	 */
+	traversal_data->plan = rhythmdb_query_plan_new (RHYTHMDB (db), query);
 	traversal_data->func = func;
 	traversal_data->data = data;
 	traversal_data->cancel = cancel;
 
+	/* if the query includes a text search or a range of values of an
+	 * indexed property, only look at the entries the indexes say could
+	 * match, using whichever index narrows it down most.
+	 */
+	candidates = search_index_get_candidates (db, query);
+	range_candidates = range_index_get_candidates (db, query,
+						       candidates ? candidates->len : G_MAXUINT);
+	if (range_candidates != NULL) {
+		if (candidates != NULL) {
+			g_ptr_array_foreach (candidates, (GFunc) rhythmdb_entry_unref, NULL);
+			g_ptr_array_free (candidates, TRUE);
+		}
+		candidates = range_candidates;
+	}
+
+	if (candidates != NULL) {
+		rb_debug ("index gave %u candidates", candidates->len);
+
+		g_mutex_lock (db->priv->genres_lock);
+		for (i = 0; i < candidates->len; i++) {
+			RhythmDBEntry *entry = g_ptr_array_index (candidates, i);
+
+			if ((entry->flags & RHYTHMDB_ENTRY_TREE_REMOVED) == 0)
+				do_conjunction (entry, NULL, traversal_data);
+		}
+		g_mutex_unlock (db->priv->genres_lock);
+
+		g_ptr_array_foreach (candidates, (GFunc) rhythmdb_entry_unref, NULL);
+		g_ptr_array_free (candidates, TRUE);
+		rhythmdb_query_plan_free (traversal_data->plan);
+		g_free (traversal_data);
+		return;
+	}
+
 	g_mutex_lock (db->priv->genres_lock);
 	if (type_query_idx >= 0) {
 		GHashTable *genres;
@@ -2178,6 +4741,7 @@ conjunctive_query (RhythmDBTree *db,
 	}
 	g_mutex_unlock (db->priv->genres_lock);
 
+	rhythmdb_query_plan_free (traversal_data->plan);
 	g_free (traversal_data);
 }
 
@@ -2435,6 +4999,9 @@ rhythmdb_tree_entry_keyword_add (RhythmDB *rdb,
 	GHashTable *keyword_table;
 	gboolean present;
 
+	if ((entry->flags & RHYTHMDB_ENTRY_TREE_LOADING) == 0)
+		journal_entry_keyword (db, entry, keyword, TRUE);
+
 	g_mutex_lock (db->priv->keywords_lock);
 	keyword_table = g_hash_table_lookup (db->priv->keywords, keyword);
 	if (keyword_table != NULL) {
@@ -2465,6 +5032,9 @@ rhythmdb_tree_entry_keyword_remove (RhythmDB *rdb,
 	GHashTable *keyword_table;
 	gboolean ret;
 
+	if ((entry->flags & RHYTHMDB_ENTRY_TREE_LOADING) == 0)
+		journal_entry_keyword (db, entry, keyword, FALSE);
+
 	g_mutex_lock (db->priv->keywords_lock);
 	keyword_table = g_hash_table_lookup (db->priv->keywords, keyword);
 	if (keyword_table != NULL) {
@@ -50,6 +50,7 @@
 #include "rb-file-helpers.h"
 #include "rb-debug.h"
 #include "rb-util.h"
+#include "rb-slab.h"
 #include "rb-cut-and-paste-code.h"
 #include "rb-preferences.h"
 #include "eel-gconf-extensions.h"
@@ -137,6 +138,7 @@ typedef struct
  	RhythmDBEntryType entry_type;
 	RhythmDBEntryType ignore_type;
 	RhythmDBEntryType error_type;
+	gint64 queued_time;
 } RhythmDBAction;
 
 static void rhythmdb_dispose (GObject *object);
@@ -187,6 +189,22 @@ static void rhythmdb_add_to_stat_list (RhythmDB *db,
 				       RhythmDBEntryType type,
 				       RhythmDBEntryType ignore_type,
 				       RhythmDBEntryType error_type);
+static void rhythmdb_destroy_entry_slab (const char *name,
+					 RhythmDBEntryType type,
+					 gpointer data);
+static void rhythmdb_report_memory_usage (RhythmDB *db);
+
+/* maps entry types to the slabs their entries are allocated from.  entries
+ * don't know which database they belong to, so this can't live in the
+ * database's private data.
+ */
+static GHashTable *entry_slabs = NULL;
+/* entry types whose database has been finalized while some of their
+ * entries were still referenced.  their slabs are destroyed when the
+ * last of those entries is released.
+ */
+static GHashTable *orphaned_entry_slabs = NULL;
+G_LOCK_DEFINE_STATIC (entry_slabs);
 
 enum
 {
@@ -194,6 +212,7 @@ enum
 	PROP_NAME,
 	PROP_DRY_RUN,
 	PROP_NO_UPDATE,
+	PROP_PRECOMPUTE_KEYS,
 };
 
 enum
@@ -201,6 +220,9 @@ enum
 	ENTRY_ADDED,
 	ENTRY_CHANGED,
 	ENTRY_DELETED,
+	ENTRIES_ADDED,
+	ENTRIES_CHANGED,
+	ENTRIES_DELETED,
 	ENTRY_KEYWORD_ADDED,
 	ENTRY_KEYWORD_REMOVED,
 	ENTRY_EXTRA_METADATA_REQUEST,
@@ -250,6 +272,13 @@ rhythmdb_class_init (RhythmDBClass *klass)
 							       "Whether or not to update the database",
 							       FALSE,
 							       G_PARAM_READWRITE));
+	g_object_class_install_property (object_class,
+					 PROP_PRECOMPUTE_KEYS,
+					 g_param_spec_boolean ("precompute-keys",
+							       "precompute keys",
+							       "Whether to compute search and sort keys for all strings after loading",
+							       TRUE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
 	/**
 	 * RhythmDB::entry-added:
 	 * @db: the #RhythmDB
@@ -303,6 +332,63 @@ rhythmdb_class_init (RhythmDBClass *klass)
 			      G_TYPE_NONE, 2,
 			      RHYTHMDB_TYPE_ENTRY, G_TYPE_POINTER);
 
+	/**
+	 * RhythmDB::entries-added:
+	 * @db: the #RhythmDB
+	 * @entries: a #GPtrArray containing the newly added #RhythmDBEntry structures
+	 *
+	 * Emitted once for each batch of entries added to the database,
+	 * before the entry-added signal is emitted for each of them.
+	 * Handling this rather than entry-added avoids the cost of a
+	 * signal emission per entry when many entries are added at once.
+	 */
+	rhythmdb_signals[ENTRIES_ADDED] =
+		g_signal_new ("entries_added",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_added),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__POINTER,
+			      G_TYPE_NONE,
+			      1, G_TYPE_POINTER);
+
+	/**
+	 * RhythmDB::entries-changed:
+	 * @db: the #RhythmDB
+	 * @changes: a #GArray of #RhythmDBChangedEntry structures
+	 *
+	 * Emitted once for each batch of modified entries, before the
+	 * entry-changed signal is emitted for each of them.  Each element
+	 * of @changes holds an entry and the list of changes made to it.
+	 */
+	rhythmdb_signals[ENTRIES_CHANGED] =
+		g_signal_new ("entries_changed",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_changed),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__POINTER,
+			      G_TYPE_NONE,
+			      1, G_TYPE_POINTER);
+
+	/**
+	 * RhythmDB::entries-deleted:
+	 * @db: the #RhythmDB
+	 * @entries: a #GPtrArray containing the deleted #RhythmDBEntry structures
+	 *
+	 * Emitted once for each batch of entries deleted from the database,
+	 * before the entry-deleted signal is emitted for each of them.
+	 */
+	rhythmdb_signals[ENTRIES_DELETED] =
+		g_signal_new ("entries_deleted",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_deleted),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__POINTER,
+			      G_TYPE_NONE,
+			      1, G_TYPE_POINTER);
+
 	/**
 	 * RhythmDB::entry-keyword-added:
 	 * @db: the #RhythmDB
@@ -668,6 +754,10 @@ rhythmdb_init (RhythmDB *db)
 	db->priv->metadata_cond = g_cond_new ();
 	db->priv->metadata_lock = g_mutex_new ();
 
+	db->priv->action_lock = g_mutex_new ();
+	db->priv->active_uris = g_hash_table_new (g_direct_hash, g_direct_equal);
+	db->priv->pending_loads = g_queue_new ();
+
 	prop_class = g_type_class_ref (RHYTHMDB_TYPE_PROP_TYPE);
 
 	g_assert (prop_class->n_values == RHYTHMDB_NUM_PROPERTIES);
@@ -790,111 +880,315 @@ stat_thread_mount_done_cb (GObject *source, GAsyncResult *result, RhythmDBStatTh
 typedef struct {
 	RhythmDB *db;
 	GList *stat_list;
+
+	/* serialises per-file stats, which may need to mount volumes */
+	GMutex *stat_file_lock;
+
+	/* rescan statistics */
+	gint n_files;
+	gint n_unchanged;
+	gint n_dirs;
 } RhythmDBStatThreadData;
 
-static gpointer
-stat_thread_main (RhythmDBStatThreadData *data)
+typedef struct {
+	RhythmDBStatThreadData *data;
+	char *uri;
+	GList *events;
+} RhythmDBStatThreadDir;
+
+/* number of directories enumerated at once when checking the library on startup */
+#define RHYTHMDB_STAT_THREADS 4
+
+/* file attributes requested when enumerating directories on startup */
+#define RHYTHMDB_STAT_ATTRIBUTES			\
+	G_FILE_ATTRIBUTE_STANDARD_NAME ","		\
+	G_FILE_ATTRIBUTE_STANDARD_TYPE ","		\
+	G_FILE_ATTRIBUTE_STANDARD_SIZE ","		\
+	G_FILE_ATTRIBUTE_TIME_MODIFIED
+
+static void
+stat_thread_stat_file (RhythmDBStatThreadData *data, RhythmDBEvent *event)
 {
-	GList *i;
 	GError *error = NULL;
-	RhythmDBEvent *result;
-	int count = 0;
+	GFile *file;
 
-	rb_debug ("entering stat thread: %d to process", g_list_length (data->stat_list));
-	for (i = data->stat_list; i != NULL; i = i->next) {
-		RhythmDBEvent *event = (RhythmDBEvent *)i->data;
-		GFile *file;
+	file = g_file_new_for_uri (rb_refstring_get (event->uri));
+	event->real_uri = rb_refstring_ref (event->uri);		/* what? */
+	event->file_info = g_file_query_info (file,
+					      RHYTHMDB_FILE_INFO_ATTRIBUTES,
+					      G_FILE_QUERY_INFO_NONE,
+					      data->db->priv->exiting,
+					      &error);
+	if (error != NULL) {
+		if (g_error_matches (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_MOUNTED)) {
+			GMountOperation *mount_op = NULL;
 
-		/* if we've been cancelled, just free the event.  this will
-		 * clean up the list and then we'll exit the thread.
-		 */
-		if (g_cancellable_is_cancelled (data->db->priv->exiting)) {
-			rhythmdb_event_free (data->db, event);
-			count = 0;
-			continue;
+			rb_debug ("got not-mounted error for %s", rb_refstring_get (event->uri));
+
+			/* check if we've tried and failed to mount this location before */
+
+			g_signal_emit (event->db, rhythmdb_signals[CREATE_MOUNT_OP], 0, &mount_op);
+			if (mount_op != NULL) {
+				RhythmDBStatThreadMountData mount_data;
+
+				mount_data.event = event;
+				mount_data.cond = g_cond_new ();
+				mount_data.mutex = g_mutex_new ();
+				mount_data.error = &error;
+
+				g_mutex_lock (mount_data.mutex);
+
+				g_file_mount_enclosing_volume (file,
+							       G_MOUNT_MOUNT_NONE,
+							       mount_op,
+							       data->db->priv->exiting,
+							       (GAsyncReadyCallback) stat_thread_mount_done_cb,
+							       &mount_data);
+				g_clear_error (&error);
+
+				/* wait for the mount to complete.  the callback occurs on the main
+				 * thread (not this thread), so we can just block until it is called.
+				 */
+				g_cond_wait (mount_data.cond, mount_data.mutex);
+				g_mutex_unlock (mount_data.mutex);
+
+				g_mutex_free (mount_data.mutex);
+				g_cond_free (mount_data.cond);
+
+				if (error == NULL) {
+					rb_debug ("mount op successful, retrying stat");
+					event->file_info = g_file_query_info (file,
+									      RHYTHMDB_FILE_INFO_ATTRIBUTES,
+									      G_FILE_QUERY_INFO_NONE,
+									      data->db->priv->exiting,
+									      &error);
+				}
+			} else {
+				rb_debug ("but couldn't create a mount op.");
+			}
+		}
+
+		if (error != NULL) {
+			event->error = make_access_failed_error (rb_refstring_get (event->uri), error);
+			g_clear_error (&error);
 		}
+	}
 
-		if (count > 0 && count % 1000 == 0) {
-			rb_debug ("%d file info queries done", count);
+	if (event->error != NULL) {
+		if (event->file_info != NULL) {
+			g_object_unref (event->file_info);
+			event->file_info = NULL;
 		}
+	}
 
-		file = g_file_new_for_uri (rb_refstring_get (event->uri));
-		event->real_uri = rb_refstring_ref (event->uri);		/* what? */
-		event->file_info = g_file_query_info (file,
-						      G_FILE_ATTRIBUTE_TIME_MODIFIED,	/* anything else? */
-						      G_FILE_QUERY_INFO_NONE,
-						      data->db->priv->exiting,
-						      &error);
+	g_async_queue_push (data->db->priv->event_queue, event);
+	g_object_unref (file);
+}
+
+/*
+ * Checks all the files in the database that are in one directory,
+ * using a single directory enumeration rather than querying each file.
+ * Files that haven't changed since they were last read are handed back
+ * to the main thread in a single event, as all that needs to be done for
+ * those is to update their last-seen times.  Anything else (changed
+ * files, missing files, and directories we can't read) gets a normal
+ * stat event.
+ */
+static void
+stat_thread_check_dir (RhythmDBStatThreadDir *dir, RhythmDBStatThreadData *data)
+{
+	RhythmDB *db = data->db;
+	GFile *file;
+	GFileEnumerator *files;
+	GFileInfo *info;
+	GHashTable *infos;
+	GError *error = NULL;
+	GList *fallback = NULL;
+	GList *l;
+	RhythmDBEvent *unchanged = NULL;
+
+	if (g_cancellable_is_cancelled (db->priv->exiting)) {
+		for (l = dir->events; l != NULL; l = l->next) {
+			rhythmdb_event_free (db, l->data);
+		}
+		goto out;
+	}
+
+	file = g_file_new_for_uri (dir->uri);
+	files = g_file_enumerate_children (file,
+					   RHYTHMDB_STAT_ATTRIBUTES,
+					   G_FILE_QUERY_INFO_NONE,
+					   db->priv->exiting,
+					   &error);
+	g_object_unref (file);
+	if (error != NULL) {
+		rb_debug ("unable to enumerate %s, checking files individually: %s", dir->uri, error->message);
+		g_clear_error (&error);
+		fallback = dir->events;
+		dir->events = NULL;
+	}
+
+	infos = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+	while (files != NULL) {
+		info = g_file_enumerator_next_file (files, db->priv->exiting, &error);
 		if (error != NULL) {
-			if (g_error_matches (error,
-					     G_IO_ERROR,
-					     G_IO_ERROR_NOT_MOUNTED)) {
-				GMountOperation *mount_op = NULL;
-
-				rb_debug ("got not-mounted error for %s", rb_refstring_get (event->uri));
-
-				/* check if we've tried and failed to mount this location before */
-
-				g_signal_emit (event->db, rhythmdb_signals[CREATE_MOUNT_OP], 0, &mount_op);
-				if (mount_op != NULL) {
-					RhythmDBStatThreadMountData mount_data;
-
-					mount_data.event = event;
-					mount_data.cond = g_cond_new ();
-					mount_data.mutex = g_mutex_new ();
-					mount_data.error = &error;
-
-					g_mutex_lock (mount_data.mutex);
-
-					g_file_mount_enclosing_volume (file,
-								       G_MOUNT_MOUNT_NONE,
-								       mount_op,
-								       data->db->priv->exiting,
-								       (GAsyncReadyCallback) stat_thread_mount_done_cb,
-								       &mount_data);
-					g_clear_error (&error);
-
-					/* wait for the mount to complete.  the callback occurs on the main
-					 * thread (not this thread), so we can just block until it is called.
-					 */
-					g_cond_wait (mount_data.cond, mount_data.mutex);
-					g_mutex_unlock (mount_data.mutex);
-
-					g_mutex_free (mount_data.mutex);
-					g_cond_free (mount_data.cond);
-
-					if (error == NULL) {
-						rb_debug ("mount op successful, retrying stat");
-						event->file_info = g_file_query_info (file,
-										      G_FILE_ATTRIBUTE_TIME_MODIFIED,
-										      G_FILE_QUERY_INFO_NONE,
-										      data->db->priv->exiting,
-										      &error);
-					}
-				} else {
-					rb_debug ("but couldn't create a mount op.");
-				}
-			}
+			rb_debug ("error enumerating %s: %s", dir->uri, error->message);
+			g_clear_error (&error);
+			break;
+		} else if (info == NULL) {
+			break;
+		}
+		g_hash_table_insert (infos, (gpointer) g_file_info_get_name (info), info);
+	}
+	if (files != NULL)
+		g_object_unref (files);
 
-			if (error != NULL) {
-				event->error = make_access_failed_error (rb_refstring_get (event->uri), error);
-				g_clear_error (&error);
-			}
+	for (l = dir->events; l != NULL; l = l->next) {
+		RhythmDBEvent *event = (RhythmDBEvent *) l->data;
+		RhythmDBEntry *entry = event->entry;
+		char *name;
+		guint64 mtime;
+		guint64 size;
+
+		file = g_file_new_for_uri (rb_refstring_get (event->uri));
+		name = g_file_get_basename (file);
+		info = g_hash_table_lookup (infos, name);
+		g_free (name);
+		g_object_unref (file);
+
+		if (info == NULL) {
+			/* let the file stat report the error */
+			fallback = g_list_prepend (fallback, event);
+			continue;
 		}
 
-		if (event->error != NULL) {
-			if (event->file_info != NULL) {
-				g_object_unref (event->file_info);
-				event->file_info = NULL;
+		mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		size = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+		if (entry != NULL &&
+		    (entry->flags & RHYTHMDB_ENTRY_HIDDEN) == 0 &&
+		    entry->mtime == mtime &&
+		    entry->file_size == size) {
+			if (unchanged == NULL) {
+				unchanged = g_slice_new0 (RhythmDBEvent);
+				unchanged->db = db;
+				unchanged->type = RHYTHMDB_EVENT_STAT_UNCHANGED;
+				unchanged->entries = g_ptr_array_new ();
 			}
+
+			/* the event's entry reference moves to the array */
+			g_ptr_array_add (unchanged->entries, entry);
+			event->entry = NULL;
+			rhythmdb_event_free (db, event);
+			g_atomic_int_inc (&data->n_unchanged);
+		} else {
+			event->real_uri = rb_refstring_ref (event->uri);
+			event->file_info = g_object_ref (info);
+			g_async_queue_push (db->priv->event_queue, event);
 		}
+	}
+	g_hash_table_destroy (infos);
 
-		g_async_queue_push (data->db->priv->event_queue, event);
-		g_object_unref (file);
-		count++;
+	if (unchanged != NULL)
+		g_async_queue_push (db->priv->event_queue, unchanged);
+
+	if (fallback != NULL) {
+		g_mutex_lock (data->stat_file_lock);
+		for (l = fallback; l != NULL; l = l->next) {
+			stat_thread_stat_file (data, l->data);
+		}
+		g_mutex_unlock (data->stat_file_lock);
+		g_list_free (fallback);
 	}
 
+out:
+	g_list_free (dir->events);
+	g_free (dir->uri);
+	g_free (dir);
+}
+
+static gpointer
+stat_thread_main (RhythmDBStatThreadData *data)
+{
+	GHashTable *dirs;
+	GHashTableIter iter;
+	gpointer value;
+	GThreadPool *pool;
+	GList *single = NULL;
+	GList *i;
+	GTimer *timer;
+	RhythmDBEvent *result;
+	double elapsed;
+
+	data->n_files = g_list_length (data->stat_list);
+	rb_debug ("entering stat thread: %d to process", data->n_files);
+	timer = g_timer_new ();
+
+	/* group the files by the directory they're in */
+	dirs = g_hash_table_new (g_str_hash, g_str_equal);
+	for (i = data->stat_list; i != NULL; i = i->next) {
+		RhythmDBEvent *event = (RhythmDBEvent *)i->data;
+		RhythmDBStatThreadDir *dir;
+		const char *uri;
+		const char *slash;
+		char *dir_uri;
+
+		uri = rb_refstring_get (event->uri);
+		slash = strrchr (uri, '/');
+		if (slash == NULL || slash[1] == '\0' || strstr (uri, "://") == NULL) {
+			single = g_list_prepend (single, event);
+			continue;
+		}
+
+		dir_uri = g_strndup (uri, slash - uri);
+		dir = g_hash_table_lookup (dirs, dir_uri);
+		if (dir == NULL) {
+			dir = g_new0 (RhythmDBStatThreadDir, 1);
+			dir->data = data;
+			dir->uri = dir_uri;
+			g_hash_table_insert (dirs, dir->uri, dir);
+		} else {
+			g_free (dir_uri);
+		}
+		dir->events = g_list_prepend (dir->events, event);
+	}
 	g_list_free (data->stat_list);
+	data->stat_list = NULL;
+
+	data->n_dirs = g_hash_table_size (dirs);
+	data->stat_file_lock = g_mutex_new ();
+	pool = g_thread_pool_new ((GFunc) stat_thread_check_dir,
+				  data,
+				  RHYTHMDB_STAT_THREADS,
+				  FALSE,
+				  NULL);
+
+	g_hash_table_iter_init (&iter, dirs);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		g_thread_pool_push (pool, value, NULL);
+	}
+	g_hash_table_destroy (dirs);
+
+	/* wait for all the directories to be checked */
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	for (i = single; i != NULL; i = i->next) {
+		if (g_cancellable_is_cancelled (data->db->priv->exiting)) {
+			rhythmdb_event_free (data->db, i->data);
+		} else {
+			stat_thread_stat_file (data, i->data);
+		}
+	}
+	g_list_free (single);
+	g_mutex_free (data->stat_file_lock);
+
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+	rb_debug ("checked %d files in %d directories in %f seconds (%.0f files/sec), %d unchanged",
+		  data->n_files, data->n_dirs, elapsed,
+		  elapsed > 0.0 ? data->n_files / elapsed : 0.0,
+		  data->n_unchanged);
 
 	data->db->priv->stat_thread_running = FALSE;
 	
@@ -959,6 +1253,10 @@ rhythmdb_event_free (RhythmDB *db,
 	case RHYTHMDB_EVENT_ENTRY_SET:
 		g_value_unset (&result->change.new);
 		break;
+	case RHYTHMDB_EVENT_STAT_UNCHANGED:
+		g_ptr_array_foreach (result->entries, (GFunc) rhythmdb_entry_unref, NULL);
+		g_ptr_array_free (result->entries, TRUE);
+		break;
 	}
 	if (result->error)
 		g_error_free (result->error);
@@ -1115,6 +1413,10 @@ rhythmdb_finalize (GObject *object)
 	g_list_free (db->priv->stat_list);
  	g_mutex_free (db->priv->stat_mutex);
 
+	g_hash_table_destroy (db->priv->active_uris);
+	g_queue_free (db->priv->pending_loads);
+	g_mutex_free (db->priv->action_lock);
+
 	g_mutex_free (db->priv->change_mutex);
 
 	g_hash_table_destroy (db->priv->propname_map);
@@ -1126,6 +1428,17 @@ rhythmdb_finalize (GObject *object)
 	rb_refstring_unref (db->priv->empty_string);
 	rb_refstring_unref (db->priv->octet_stream_str);
 
+	/* release the memory used for entries of the types registered
+	 * with this database, once nothing outside it holds any of them.
+	 */
+	G_LOCK (entry_slabs);
+	if (entry_slabs != NULL) {
+		g_hash_table_foreach (db->priv->entry_type_map,
+				      (GHFunc) rhythmdb_destroy_entry_slab,
+				      NULL);
+	}
+	G_UNLOCK (entry_slabs);
+
 	g_hash_table_destroy (db->priv->entry_type_map);
 	g_mutex_free (db->priv->entry_type_map_mutex);
 	g_mutex_free (db->priv->entry_type_mutex);
@@ -1159,6 +1472,9 @@ rhythmdb_set_property (GObject *object,
 	case PROP_NO_UPDATE:
 		db->priv->no_update = g_value_get_boolean (value);
 		break;
+	case PROP_PRECOMPUTE_KEYS:
+		db->priv->precompute_keys = g_value_get_boolean (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1183,6 +1499,9 @@ rhythmdb_get_property (GObject *object,
 	case PROP_NO_UPDATE:
 		g_value_set_boolean (value, source->priv->no_update);
 		break;
+	case PROP_PRECOMPUTE_KEYS:
+		g_value_set_boolean (value, source->priv->precompute_keys);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1265,16 +1584,31 @@ free_entry_changes (GSList *entry_changes)
 	g_slist_free (entry_changes);
 }
 
+static GPtrArray *
+entry_list_to_array (GList *entries)
+{
+	GPtrArray *array;
+	GList *l;
+
+	array = g_ptr_array_sized_new (g_list_length (entries));
+	for (l = entries; l != NULL; l = g_list_next (l)) {
+		g_ptr_array_add (array, l->data);
+	}
+	return array;
+}
+
 static gboolean
 rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 {
 	GList *added_entries;
 	GList *deleted_entries;
 	GHashTable *changed_entries;
-	GList *l;
 	GHashTableIter iter;
 	RhythmDBEntry *entry;
 	GSList *entry_changes;
+	GPtrArray *entries;
+	gboolean emit;
+	guint i;
 
 	/* get lists of entries to emit, reset source id value */
 	g_mutex_lock (db->priv->change_mutex);
@@ -1294,27 +1628,59 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 
 	GDK_THREADS_ENTER ();
 
-	/* emit changed entries */
+	/* emit changed entries: one signal for the whole batch, then the
+	 * per-entry signals for anything that only handles those.
+	 */
 	if (changed_entries != NULL) {
+		GArray *changes;
+
+		changes = g_array_sized_new (FALSE, FALSE, sizeof (RhythmDBChangedEntry),
+					     g_hash_table_size (changed_entries));
 		g_hash_table_iter_init (&iter, changed_entries);
 		while (g_hash_table_iter_next (&iter, (gpointer *)&entry, (gpointer *)&entry_changes)) {
-			g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, entry, entry_changes);
-			g_hash_table_iter_remove (&iter);
+			RhythmDBChangedEntry changed;
+
+			changed.entry = entry;
+			changed.changes = entry_changes;
+			g_array_append_val (changes, changed);
 		}
+
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_CHANGED], 0, changes);
+		if (g_signal_has_handler_pending (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, TRUE)) {
+			for (i = 0; i < changes->len; i++) {
+				RhythmDBChangedEntry *changed = &g_array_index (changes, RhythmDBChangedEntry, i);
+				g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, changed->entry, changed->changes);
+			}
+		}
+		g_array_free (changes, TRUE);
 	}
 
 	/* emit added entries */
-	for (l = added_entries; l; l = g_list_next (l)) {
-		entry = (RhythmDBEntry *)l->data;
-		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_ADDED], 0, entry);
-		rhythmdb_entry_unref (entry);
+	if (added_entries != NULL) {
+		entries = entry_list_to_array (added_entries);
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_ADDED], 0, entries);
+		emit = g_signal_has_handler_pending (G_OBJECT (db), rhythmdb_signals[ENTRY_ADDED], 0, TRUE);
+		for (i = 0; i < entries->len; i++) {
+			entry = g_ptr_array_index (entries, i);
+			if (emit)
+				g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_ADDED], 0, entry);
+			rhythmdb_entry_unref (entry);
+		}
+		g_ptr_array_free (entries, TRUE);
 	}
 
 	/* emit deleted entries */
-	for (l = deleted_entries; l; l = g_list_next (l)) {
-		entry = (RhythmDBEntry *)l->data;
-		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, entry);
-		rhythmdb_entry_unref (entry);
+	if (deleted_entries != NULL) {
+		entries = entry_list_to_array (deleted_entries);
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_DELETED], 0, entries);
+		emit = g_signal_has_handler_pending (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, TRUE);
+		for (i = 0; i < entries->len; i++) {
+			entry = g_ptr_array_index (entries, i);
+			if (emit)
+				g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, entry);
+			rhythmdb_entry_unref (entry);
+		}
+		g_ptr_array_free (entries, TRUE);
 	}
 
 	GDK_THREADS_LEAVE ();
@@ -1522,6 +1888,52 @@ rhythmdb_error_quark (void)
 #define ALIGN_STRUCT(offset) \
 	((offset + (STRUCT_ALIGNMENT - 1)) & -STRUCT_ALIGNMENT)
 
+#define RHYTHMDB_ENTRIES_PER_SLAB_BLOCK	256
+
+static RBSlab *
+rhythmdb_entry_type_get_slab (RhythmDBEntryType type, gsize size)
+{
+	RBSlab *slab;
+
+	G_LOCK (entry_slabs);
+	if (entry_slabs == NULL)
+		entry_slabs = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	slab = g_hash_table_lookup (entry_slabs, type);
+	if (slab == NULL) {
+		slab = rb_slab_new (size, RHYTHMDB_ENTRIES_PER_SLAB_BLOCK);
+		g_hash_table_insert (entry_slabs, type, slab);
+	}
+	G_UNLOCK (entry_slabs);
+
+	return slab;
+}
+
+static void
+rhythmdb_destroy_entry_slab (const char *name, RhythmDBEntryType type, gpointer data)
+{
+	RBSlab *slab;
+	guint n_entries;
+
+	slab = g_hash_table_lookup (entry_slabs, type);
+	if (slab == NULL)
+		return;
+
+	rb_slab_get_usage (slab, &n_entries, NULL, NULL);
+	if (n_entries > 0) {
+		rb_debug ("keeping slab for %u %s entries still referenced", n_entries, name);
+		if (orphaned_entry_slabs == NULL)
+			orphaned_entry_slabs = g_hash_table_new (g_direct_hash, g_direct_equal);
+		g_hash_table_insert (orphaned_entry_slabs, type, slab);
+		return;
+	}
+
+	g_hash_table_remove (entry_slabs, type);
+	if (orphaned_entry_slabs != NULL)
+		g_hash_table_remove (orphaned_entry_slabs, type);
+	rb_slab_destroy (slab);
+}
+
 /**
  * rhythmdb_entry_allocate:
  * @db: a #RhythmDB.
@@ -1541,12 +1953,20 @@ rhythmdb_entry_allocate (RhythmDB *db,
 			 RhythmDBEntryType type)
 {
 	RhythmDBEntry *ret;
+	RBSlab *slab;
 	gsize size = sizeof (RhythmDBEntry);
 
 	if (type->entry_type_data_size) {
 		size = ALIGN_STRUCT (sizeof (RhythmDBEntry)) + type->entry_type_data_size;
 	}
-	ret = g_malloc0 (size);
+
+	/* entries of each type are packed together in a slab, created
+	 * when the first entry of the type is allocated.
+	 */
+	slab = rhythmdb_entry_type_get_slab (type, size);
+	g_assert (rb_slab_get_object_size (slab) >= size);
+
+	ret = rb_slab_alloc0 (slab);
 	ret->id = (guint) g_atomic_int_exchange_and_add (&db->priv->next_entry_id, 1);
 
 	ret->type = type;
@@ -1738,6 +2158,7 @@ static void
 rhythmdb_entry_finalize (RhythmDBEntry *entry)
 {
 	RhythmDBEntryType type;
+	RBSlab *slab;
 
 	type = rhythmdb_entry_get_entry_type (entry);
 
@@ -1758,7 +2179,17 @@ rhythmdb_entry_finalize (RhythmDBEntry *entry)
 	rb_refstring_unref (entry->album_sortname);
 	rb_refstring_unref (entry->mimetype);
 
-	g_free (entry);
+	/* if the database has already gone, this may be the last entry
+	 * keeping the slab alive.
+	 */
+	G_LOCK (entry_slabs);
+	slab = g_hash_table_lookup (entry_slabs, type);
+	g_assert (slab != NULL);
+	rb_slab_release (slab, entry);
+	if (orphaned_entry_slabs != NULL &&
+	    g_hash_table_lookup (orphaned_entry_slabs, type) != NULL)
+		rhythmdb_destroy_entry_slab (type->name, type, NULL);
+	G_UNLOCK (entry_slabs);
 }
 
 /**
@@ -2061,6 +2492,30 @@ is_ghost_entry (RhythmDBEntry *entry)
 	return (last_seen + grace_period < time.tv_sec);
 }
 
+static void
+rhythmdb_process_stat_unchanged_event (RhythmDB *db,
+				       RhythmDBEvent *event)
+{
+	GTimeVal time;
+	GValue val = {0, };
+	guint i;
+
+	/* these files are all still there and haven't been modified, so
+	 * all we need to do is update the last seen time.  this isn't
+	 * interesting to anything watching for entry changes.
+	 */
+	g_get_current_time (&time);
+	g_value_init (&val, G_TYPE_ULONG);
+	g_value_set_ulong (&val, time.tv_sec);
+	for (i = 0; i < event->entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (event->entries, i);
+
+		rhythmdb_entry_set_internal (db, entry, FALSE, RHYTHMDB_PROP_LAST_SEEN, &val);
+	}
+	g_value_unset (&val);
+	rb_debug ("%d files unchanged", event->entries->len);
+}
+
 static void
 rhythmdb_process_stat_event (RhythmDB *db,
 			     RhythmDBEvent *event)
@@ -2473,7 +2928,7 @@ rhythmdb_missing_plugin_event_cleanup (RhythmDBEvent *event)
 	rb_debug ("cleaning up missing plugin event %p", event);
 
 	event->db->priv->metadata_blocked = FALSE;
-	g_cond_signal (event->db->priv->metadata_cond);
+	g_cond_broadcast (event->db->priv->metadata_cond);
 
 	g_mutex_unlock (event->db->priv->metadata_lock);
 	rhythmdb_event_free (event->db, event);
@@ -2526,7 +2981,7 @@ rhythmdb_process_metadata_load (RhythmDB *db,
 
 		g_mutex_lock (db->priv->metadata_lock);
 		db->priv->metadata_blocked = FALSE;
-		g_cond_signal (db->priv->metadata_cond);
+		g_cond_broadcast (db->priv->metadata_cond);
 		g_mutex_unlock (db->priv->metadata_lock);
 	}
 
@@ -2592,6 +3047,7 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 	 */
 	if (rhythmdb_get_readonly (db) &&
 	    ((event->type == RHYTHMDB_EVENT_STAT)
+	     || (event->type == RHYTHMDB_EVENT_STAT_UNCHANGED)
 	     || (event->type == RHYTHMDB_EVENT_METADATA_LOAD)
 	     || (event->type == RHYTHMDB_EVENT_ENTRY_SET))) {
 		rb_debug ("Database is read-only, delaying event processing");
@@ -2604,6 +3060,10 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 		rb_debug ("processing RHYTHMDB_EVENT_STAT");
 		rhythmdb_process_stat_event (db, event);
 		break;
+	case RHYTHMDB_EVENT_STAT_UNCHANGED:
+		rb_debug ("processing RHYTHMDB_EVENT_STAT_UNCHANGED");
+		rhythmdb_process_stat_unchanged_event (db, event);
+		break;
 	case RHYTHMDB_EVENT_METADATA_LOAD:
 		rb_debug ("processing RHYTHMDB_EVENT_METADATA_LOAD");
 		free = rhythmdb_process_metadata_load (db, event);
@@ -2615,6 +3075,7 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 	case RHYTHMDB_EVENT_DB_LOAD:
 		rb_debug ("processing RHYTHMDB_EVENT_DB_LOAD");
 		g_signal_emit (G_OBJECT (db), rhythmdb_signals[LOAD_COMPLETE], 0);
+		rhythmdb_report_memory_usage (db);
 
 		/* save the db every five minutes */
 		if (db->priv->save_timeout_id > 0) {
@@ -2754,8 +3215,13 @@ rhythmdb_execute_stat (RhythmDB *db,
 	g_object_unref (file);
 }
 
-static void
-rhythmdb_execute_load (RhythmDB *db,
+/*
+ * Resolves the uri for a load event and gets its file info.  Returns
+ * FALSE if the file can't be accessed, in which case the event already
+ * holds the error.
+ */
+static gboolean
+rhythmdb_prepare_load (RhythmDB *db,
 		       const char *uri,
 		       RhythmDBEvent *event)
 {
@@ -2786,30 +3252,159 @@ rhythmdb_execute_load (RhythmDB *db,
 			g_object_unref (event->file_info);
 			event->file_info = NULL;
 		}
-	} else if (event->type == RHYTHMDB_EVENT_METADATA_LOAD) {
-		g_mutex_lock (event->db->priv->metadata_lock);
-		while (event->db->priv->metadata_blocked) {
-			g_cond_wait (event->db->priv->metadata_cond, event->db->priv->metadata_lock);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rhythmdb_wait_for_metadata (RhythmDB *db)
+{
+	g_mutex_lock (db->priv->metadata_lock);
+	while (db->priv->metadata_blocked) {
+		g_cond_wait (db->priv->metadata_cond, db->priv->metadata_lock);
+	}
+	g_mutex_unlock (db->priv->metadata_lock);
+}
+
+/*
+ * Reads metadata for a load event, unless it was already read as part
+ * of a batch.  Several action workers can be loading metadata at once,
+ * but only one missing plugin request can be outstanding.  If another
+ * load has already blocked metadata loading, wait for its plugins to be
+ * dealt with and then try again, as those may be the plugins we need.
+ */
+static void
+rhythmdb_load_metadata (RhythmDB *db, RhythmDBEvent *event)
+{
+	while (TRUE) {
+		if (event->metadata == NULL) {
+			g_clear_error (&event->error);
+			event->metadata = rb_metadata_new ();
+			rb_metadata_load (event->metadata,
+					  rb_refstring_get (event->real_uri),
+					  &event->error);
 		}
 
-		event->metadata = rb_metadata_new ();
-		rb_metadata_load (event->metadata,
-				  rb_refstring_get (event->real_uri),
-				  &event->error);
+		if (rb_metadata_has_missing_plugins (event->metadata) == FALSE)
+			break;
 
-		/* if we're missing some plugins, block further attempts to
-		 * read metadata until we've processed them.
-		 */
-		if (rb_metadata_has_missing_plugins (event->metadata)) {
-			event->db->priv->metadata_blocked = TRUE;
+		g_mutex_lock (db->priv->metadata_lock);
+		if (db->priv->metadata_blocked == FALSE) {
+			/* block further attempts to read metadata
+			 * until we've processed the missing plugins.
+			 */
+			db->priv->metadata_blocked = TRUE;
+			g_mutex_unlock (db->priv->metadata_lock);
+			break;
 		}
+		while (db->priv->metadata_blocked) {
+			g_cond_wait (db->priv->metadata_cond, db->priv->metadata_lock);
+		}
+		g_mutex_unlock (db->priv->metadata_lock);
+
+		if (g_cancellable_is_cancelled (db->priv->exiting))
+			break;
 
-		g_mutex_unlock (event->db->priv->metadata_lock);
+		g_object_unref (event->metadata);
+		event->metadata = NULL;
+	}
+}
+
+static void
+rhythmdb_execute_load (RhythmDB *db,
+		       const char *uri,
+		       RhythmDBEvent *event)
+{
+	if (rhythmdb_prepare_load (db, uri, event) &&
+	    event->type == RHYTHMDB_EVENT_METADATA_LOAD) {
+		rhythmdb_wait_for_metadata (db);
+		rhythmdb_load_metadata (db, event);
 	}
 
 	rhythmdb_push_event (db, event);
 }
 
+typedef struct {
+	GPtrArray *events;
+	guint next;
+} RhythmDBLoadBatch;
+
+static void
+load_batch_result_cb (RBMetaData *md,
+		      const char *uri,
+		      const GError *error,
+		      RhythmDBLoadBatch *batch)
+{
+	RhythmDBEvent *event;
+
+	if (batch->next >= batch->events->len)
+		return;
+
+	event = g_ptr_array_index (batch->events, batch->next++);
+	event->metadata = g_object_ref (md);
+	if (error != NULL)
+		event->error = g_error_copy (error);
+}
+
+/*
+ * Loads metadata for several files with a single request to the metadata
+ * helper.  The events are pushed in order once their results arrive, and
+ * any missing plugins are dealt with one file at a time, the same way as
+ * for single loads.
+ */
+static void
+rhythmdb_execute_load_batch (RhythmDB *db, GList *actions)
+{
+	RhythmDBLoadBatch batch;
+	GPtrArray *uris;
+	GList *l;
+	guint i;
+
+	batch.events = g_ptr_array_new ();
+	batch.next = 0;
+	uris = g_ptr_array_new ();
+
+	for (l = actions; l != NULL; l = l->next) {
+		RhythmDBAction *action = l->data;
+		RhythmDBEvent *event;
+
+		event = g_slice_new0 (RhythmDBEvent);
+		event->db = db;
+		event->type = RHYTHMDB_EVENT_METADATA_LOAD;
+		event->entry_type = action->entry_type;
+		event->error_type = action->error_type;
+		event->ignore_type = action->ignore_type;
+
+		rb_debug ("executing RHYTHMDB_ACTION_LOAD for \"%s\" in a batch", rb_refstring_get (action->uri));
+
+		if (rhythmdb_prepare_load (db, rb_refstring_get (action->uri), event)) {
+			g_ptr_array_add (batch.events, event);
+			g_ptr_array_add (uris, (gpointer) rb_refstring_get (event->real_uri));
+		} else {
+			rhythmdb_push_event (db, event);
+		}
+	}
+	g_ptr_array_add (uris, NULL);
+
+	if (batch.events->len > 0) {
+		rhythmdb_wait_for_metadata (db);
+		rb_metadata_load_batch (NULL, (char **) uris->pdata,
+					(RBMetaDataBatchFunc) load_batch_result_cb, &batch);
+	}
+
+	for (i = 0; i < batch.events->len; i++) {
+		RhythmDBEvent *event = g_ptr_array_index (batch.events, i);
+
+		rhythmdb_load_metadata (db, event);
+		rhythmdb_push_event (db, event);
+	}
+
+	g_ptr_array_free (uris, TRUE);
+	g_ptr_array_free (batch.events, TRUE);
+}
+
 static void
 rhythmdb_execute_enum_dir (RhythmDB *db,
 			   RhythmDBAction *action)
@@ -2973,94 +3568,333 @@ emit_save_error_idle (RhythmDBSaveErrorData *data)
 	return FALSE;
 }
 
-static gpointer
-action_thread_main (RhythmDB *db)
+/* number of worker threads for each action lane */
+#define RHYTHMDB_IMPORT_WORKERS		4
+#define RHYTHMDB_SYNC_WORKERS		1
+#define RHYTHMDB_LOAD_BATCH_SIZE	16
+
+static gint64
+rhythmdb_action_time_now (void)
+{
+	GTimeVal now;
+
+	g_get_current_time (&now);
+	return ((gint64) now.tv_sec * G_USEC_PER_SEC) + now.tv_usec;
+}
+
+static RhythmDBActionLane
+rhythmdb_action_get_lane (RhythmDBAction *action)
+{
+	switch (action->type) {
+	case RHYTHMDB_ACTION_SYNC:
+		return RHYTHMDB_ACTION_LANE_SYNC;
+	default:
+		return RHYTHMDB_ACTION_LANE_IMPORT;
+	}
+}
+
+static void
+rhythmdb_execute_action (RhythmDB *db, RhythmDBAction *action)
 {
 	RhythmDBEvent *result;
 
-	while (!g_cancellable_is_cancelled (db->priv->exiting)) {
+	switch (action->type) {
+	case RHYTHMDB_ACTION_STAT:
+		result = g_slice_new0 (RhythmDBEvent);
+		result->db = db;
+		result->type = RHYTHMDB_EVENT_STAT;
+		result->entry_type = action->entry_type;
+		result->error_type = action->error_type;
+		result->ignore_type = action->ignore_type;
+
+		rb_debug ("executing RHYTHMDB_ACTION_STAT for \"%s\"", rb_refstring_get (action->uri));
+
+		rhythmdb_execute_stat (db, rb_refstring_get (action->uri), result);
+		break;
+
+	case RHYTHMDB_ACTION_LOAD:
+		result = g_slice_new0 (RhythmDBEvent);
+		result->db = db;
+		result->type = RHYTHMDB_EVENT_METADATA_LOAD;
+		result->entry_type = action->entry_type;
+		result->error_type = action->error_type;
+		result->ignore_type = action->ignore_type;
+
+		rb_debug ("executing RHYTHMDB_ACTION_LOAD for \"%s\"", rb_refstring_get (action->uri));
+
+		rhythmdb_execute_load (db, rb_refstring_get (action->uri), result);
+		break;
+
+	case RHYTHMDB_ACTION_ENUM_DIR:
+		rb_debug ("executing RHYTHMDB_ACTION_ENUM_DIR for \"%s\"", rb_refstring_get (action->uri));
+		rhythmdb_execute_enum_dir (db, action);
+		break;
+
+	case RHYTHMDB_ACTION_SYNC:
+	{
+		GError *error = NULL;
+		RhythmDBEntry *entry;
+		RhythmDBEntryType entry_type;
+
+		if (db->priv->dry_run) {
+			rb_debug ("dry run is enabled, not syncing metadata");
+			break;
+		}
+
+		entry = rhythmdb_entry_lookup_by_location_refstring (db, action->uri);
+		if (!entry)
+			break;
+
+		entry_type = rhythmdb_entry_get_entry_type (entry);
+		entry_type->sync_metadata (db, entry, &error, entry_type->sync_metadata_data);
+
+		if (error != NULL) {
+			RhythmDBSaveErrorData *data;
+
+			data = g_new0 (RhythmDBSaveErrorData, 1);
+			g_object_ref (db);
+			data->db = db;
+			data->uri = g_strdup (rb_refstring_get (action->uri));
+			data->error = error;
+			g_idle_add ((GSourceFunc)emit_save_error_idle, data);
+			break;
+		}
+		break;
+	}
+
+	case RHYTHMDB_ACTION_QUIT:
+		/* don't do any real work here, since we may not process it */
+		rb_debug ("received QUIT action");
+		break;
+
+	default:
+		g_assert_not_reached ();
+		break;
+	}
+}
+
+/*
+ * Queues an action that is ready to run on the worker pool for its lane.
+ * Metadata loads go on the pending load list instead, and the pool is
+ * handed the list itself, so whichever worker picks it up can load
+ * several files in one batch.  Called with the action lock held.
+ */
+static void
+rhythmdb_start_action (RhythmDB *db, RhythmDBAction *action)
+{
+	GThreadPool *pool;
+
+	pool = db->priv->action_pools[rhythmdb_action_get_lane (action)];
+	if (action->type == RHYTHMDB_ACTION_LOAD) {
+		g_queue_push_tail (db->priv->pending_loads, action);
+		g_thread_pool_push (pool, db->priv->pending_loads, NULL);
+	} else {
+		g_thread_pool_push (pool, action, NULL);
+	}
+}
+
+/*
+ * Hands an action to the worker pool for its lane.  Actions on a uri that
+ * already has an action queued or running wait until that one finishes,
+ * so actions on the same file are always executed in the order they
+ * were queued.  Called with the action lock held.
+ */
+static void
+rhythmdb_dispatch_action (RhythmDB *db, RhythmDBAction *action)
+{
+	RhythmDBActionLane lane;
+	GQueue *waiting;
+
+	lane = rhythmdb_action_get_lane (action);
+	db->priv->action_stats[lane].queued++;
+
+	if (action->uri != NULL) {
+		waiting = g_hash_table_lookup (db->priv->active_uris, action->uri);
+		if (waiting != NULL) {
+			rb_debug ("deferring action for \"%s\"", rb_refstring_get (action->uri));
+			g_queue_push_tail (waiting, action);
+			return;
+		}
+		g_hash_table_insert (db->priv->active_uris, action->uri, g_queue_new ());
+	}
+
+	rhythmdb_start_action (db, action);
+}
+
+/*
+ * Updates the statistics for a finished action, starts the next action
+ * waiting on its uri and frees it.
+ */
+static void
+rhythmdb_finish_action (RhythmDB *db, RhythmDBAction *action)
+{
+	RhythmDBActionLane lane;
+	RhythmDBActionStats *stats;
+	gint64 latency;
+
+	lane = rhythmdb_action_get_lane (action);
+	stats = &db->priv->action_stats[lane];
+
+	g_mutex_lock (db->priv->action_lock);
+	latency = rhythmdb_action_time_now () - action->queued_time;
+	stats->running--;
+	stats->completed++;
+	db->priv->action_total_latency[lane] += latency;
+	if (latency > db->priv->action_max_latency[lane])
+		db->priv->action_max_latency[lane] = latency;
+
+	/* start the next action for this uri, if there is one */
+	if (action->uri != NULL) {
+		GQueue *waiting;
+		RhythmDBAction *next;
+
+		waiting = g_hash_table_lookup (db->priv->active_uris, action->uri);
+		g_assert (waiting != NULL);
+
+		next = g_queue_pop_head (waiting);
+		if (next != NULL && g_cancellable_is_cancelled (db->priv->exiting)) {
+			/* the pools are being shut down, so just drop the rest */
+			do {
+				db->priv->action_stats[rhythmdb_action_get_lane (next)].queued--;
+				rhythmdb_action_free (db, next);
+				g_atomic_int_add (&db->priv->outstanding_actions, -1);
+			} while ((next = g_queue_pop_head (waiting)) != NULL);
+		}
+
+		if (next != NULL) {
+			rhythmdb_start_action (db, next);
+		} else {
+			g_hash_table_remove (db->priv->active_uris, action->uri);
+			g_queue_free (waiting);
+		}
+	}
+	g_mutex_unlock (db->priv->action_lock);
+
+	rhythmdb_action_free (db, action);
+	g_atomic_int_add (&db->priv->outstanding_actions, -1);
+}
+
+/*
+ * Takes a share of the pending metadata loads and runs them as a batch.
+ * Each load queued hands the pending load list to the pool once, so a
+ * worker may find that other workers have already taken all of them.
+ */
+static void
+action_worker_load_batch (RhythmDB *db)
+{
+	RhythmDBActionStats *stats;
+	GList *actions = NULL;
+	GList *l;
+	guint count;
+	guint i;
+
+	stats = &db->priv->action_stats[RHYTHMDB_ACTION_LANE_IMPORT];
+
+	g_mutex_lock (db->priv->action_lock);
+	count = g_queue_get_length (db->priv->pending_loads) / RHYTHMDB_IMPORT_WORKERS;
+	count = CLAMP (count, 1, RHYTHMDB_LOAD_BATCH_SIZE);
+	for (i = 0; i < count; i++) {
 		RhythmDBAction *action;
 
-		action = g_async_queue_pop (db->priv->action_queue);
+		action = g_queue_pop_head (db->priv->pending_loads);
+		if (action == NULL)
+			break;
 
-		/* hrm, do we need this check at all? */
-		if (!g_cancellable_is_cancelled (db->priv->exiting)) {
-			switch (action->type) {
-			case RHYTHMDB_ACTION_STAT:
-				result = g_slice_new0 (RhythmDBEvent);
-				result->db = db;
-				result->type = RHYTHMDB_EVENT_STAT;
-				result->entry_type = action->entry_type;
-				result->error_type = action->error_type;
-				result->ignore_type = action->ignore_type;
-
-				rb_debug ("executing RHYTHMDB_ACTION_STAT for \"%s\"", rb_refstring_get (action->uri));
-
-				rhythmdb_execute_stat (db, rb_refstring_get (action->uri), result);
-				break;
+		actions = g_list_prepend (actions, action);
+		stats->queued--;
+		stats->running++;
+	}
+	g_mutex_unlock (db->priv->action_lock);
 
-			case RHYTHMDB_ACTION_LOAD:
-				result = g_slice_new0 (RhythmDBEvent);
-				result->db = db;
-				result->type = RHYTHMDB_EVENT_METADATA_LOAD;
-				result->entry_type = action->entry_type;
-				result->error_type = action->error_type;
-				result->ignore_type = action->ignore_type;
+	if (actions == NULL)
+		return;
+	actions = g_list_reverse (actions);
 
-				rb_debug ("executing RHYTHMDB_ACTION_LOAD for \"%s\"", rb_refstring_get (action->uri));
+	if (!g_cancellable_is_cancelled (db->priv->exiting)) {
+		if (actions->next == NULL) {
+			rhythmdb_execute_action (db, actions->data);
+		} else {
+			rhythmdb_execute_load_batch (db, actions);
+		}
+	}
 
-				rhythmdb_execute_load (db, rb_refstring_get (action->uri), result);
-				break;
+	for (l = actions; l != NULL; l = l->next) {
+		rhythmdb_finish_action (db, l->data);
+	}
+	g_list_free (actions);
+}
 
-			case RHYTHMDB_ACTION_ENUM_DIR:
-				rb_debug ("executing RHYTHMDB_ACTION_ENUM_DIR for \"%s\"", rb_refstring_get (action->uri));
-				rhythmdb_execute_enum_dir (db, action);
-				break;
+static void
+action_worker_main (gpointer data, RhythmDB *db)
+{
+	RhythmDBAction *action;
+	RhythmDBActionStats *stats;
 
-			case RHYTHMDB_ACTION_SYNC:
-			{
-				GError *error = NULL;
-				RhythmDBEntry *entry;
-				RhythmDBEntryType entry_type;
+	if (data == db->priv->pending_loads) {
+		action_worker_load_batch (db);
+		return;
+	}
 
-				if (db->priv->dry_run) {
-					rb_debug ("dry run is enabled, not syncing metadata");
-					break;
-				}
+	action = data;
+	stats = &db->priv->action_stats[rhythmdb_action_get_lane (action)];
 
-				entry = rhythmdb_entry_lookup_by_location_refstring (db, action->uri);
-				if (!entry)
-					break;
+	g_mutex_lock (db->priv->action_lock);
+	stats->queued--;
+	stats->running++;
+	g_mutex_unlock (db->priv->action_lock);
 
-				entry_type = rhythmdb_entry_get_entry_type (entry);
-				entry_type->sync_metadata (db, entry, &error, entry_type->sync_metadata_data);
+	if (!g_cancellable_is_cancelled (db->priv->exiting)) {
+		rhythmdb_execute_action (db, action);
+	}
 
-				if (error != NULL) {
-					RhythmDBSaveErrorData *data;
+	rhythmdb_finish_action (db, action);
+}
 
-					data = g_new0 (RhythmDBSaveErrorData, 1);
-					g_object_ref (db);
-					data->db = db;
-					data->uri = g_strdup (rb_refstring_get (action->uri));
-					data->error = error;
-					g_idle_add ((GSourceFunc)emit_save_error_idle, data);
-					break;
-				}
-				break;
-			}
+/*
+ * The action thread takes actions off the action queue and passes them
+ * to worker pools: one for stats, metadata loads and directory
+ * enumerations, and one for metadata writes, so neither kind of action
+ * can hold up the other.
+ */
+static gpointer
+action_thread_main (RhythmDB *db)
+{
+	RhythmDBEvent *result;
+	int lane;
 
-			case RHYTHMDB_ACTION_QUIT:
-				/* don't do any real work here, since we may not process it */
-				rb_debug ("received QUIT action");
-				break;
+	g_mutex_lock (db->priv->action_lock);
+	db->priv->action_pools[RHYTHMDB_ACTION_LANE_IMPORT] =
+		g_thread_pool_new ((GFunc) action_worker_main, db, RHYTHMDB_IMPORT_WORKERS, FALSE, NULL);
+	db->priv->action_pools[RHYTHMDB_ACTION_LANE_SYNC] =
+		g_thread_pool_new ((GFunc) action_worker_main, db, RHYTHMDB_SYNC_WORKERS, FALSE, NULL);
+	g_mutex_unlock (db->priv->action_lock);
 
-			default:
-				g_assert_not_reached ();
-				break;
-			}
+	while (!g_cancellable_is_cancelled (db->priv->exiting)) {
+		RhythmDBAction *action;
+
+		action = g_async_queue_pop (db->priv->action_queue);
+
+		/* hrm, do we need this check at all? */
+		if (g_cancellable_is_cancelled (db->priv->exiting) ||
+		    action->type == RHYTHMDB_ACTION_QUIT) {
+			rhythmdb_action_free (db, action);
+			continue;
 		}
 
-		rhythmdb_action_free (db, action);
+		action->queued_time = rhythmdb_action_time_now ();
+		g_atomic_int_inc (&db->priv->outstanding_actions);
+
+		g_mutex_lock (db->priv->action_lock);
+		rhythmdb_dispatch_action (db, action);
+		g_mutex_unlock (db->priv->action_lock);
+	}
+
+	/* wait for the workers to finish whatever they're doing.  anything still
+	 * queued is freed without being executed.
+	 */
+	for (lane = 0; lane < RHYTHMDB_NUM_ACTION_LANES; lane++) {
+		g_thread_pool_free (db->priv->action_pools[lane], FALSE, TRUE);
+		db->priv->action_pools[lane] = NULL;
 	}
 
 	rb_debug ("exiting action thread");
@@ -3072,6 +3906,39 @@ action_thread_main (RhythmDB *db)
 	return NULL;
 }
 
+/**
+ * rhythmdb_get_action_stats:
+ * @db: a #RhythmDB
+ * @lane: the action lane to get statistics for
+ * @stats: returns the statistics
+ *
+ * Returns the number of actions waiting and running in one of the
+ * action worker lanes, and the time taken to process the actions
+ * it has completed.
+ */
+void
+rhythmdb_get_action_stats (RhythmDB *db,
+			   RhythmDBActionLane lane,
+			   RhythmDBActionStats *stats)
+{
+	g_return_if_fail (lane < RHYTHMDB_NUM_ACTION_LANES);
+
+	g_mutex_lock (db->priv->action_lock);
+	*stats = db->priv->action_stats[lane];
+	if (stats->completed > 0) {
+		stats->mean_latency = ((gdouble) db->priv->action_total_latency[lane] / stats->completed) / G_USEC_PER_SEC;
+	}
+	stats->max_latency = (gdouble) db->priv->action_max_latency[lane] / G_USEC_PER_SEC;
+	g_mutex_unlock (db->priv->action_lock);
+
+	/* include actions not yet taken off the action queue */
+	if (lane == RHYTHMDB_ACTION_LANE_IMPORT) {
+		gint pending = g_async_queue_length (db->priv->action_queue);
+		if (pending > 0)
+			stats->queued += pending;
+	}
+}
+
 /**
  * rhythmdb_add_uri:
  * @db: a #RhythmDB.
@@ -3223,6 +4090,13 @@ rhythmdb_load_thread_main (RhythmDB *db)
 	result->type = RHYTHMDB_EVENT_DB_LOAD;
 	g_async_queue_push (db->priv->event_queue, result);
 
+	/* do the casefolding and collation for all the strings we just
+	 * loaded here, rather than on the main thread the first time the
+	 * user searches or sorts.
+	 */
+	if (db->priv->precompute_keys)
+		rb_refstring_precompute_keys (db->priv->exiting);
+
 	rb_debug ("exiting");
 	result = g_slice_new0 (RhythmDBEvent);
 	result->type = RHYTHMDB_EVENT_THREAD_EXITED;
@@ -3254,27 +4128,35 @@ rhythmdb_save_thread_main (RhythmDB *db)
 
 	g_mutex_lock (db->priv->saving_mutex);
 
+	while (db->priv->saving)
+		g_cond_wait (db->priv->saving_condition, db->priv->saving_mutex);
+
+	/* saves run one at a time, so this one covers every request made
+	 * before it started.  requests made from here on get another save.
+	 */
 	db->priv->save_count++;
-	g_cond_broadcast (db->priv->saving_condition);
 
-	if (!(db->priv->dirty && db->priv->can_save)) {
+	if (!((db->priv->dirty || db->priv->save_full) && db->priv->can_save)) {
 		rb_debug ("no save needed, ignoring");
+		db->priv->save_done_count++;
 		g_mutex_unlock (db->priv->saving_mutex);
+		g_cond_broadcast (db->priv->saving_condition);
 		goto out;
 	}
 
-	while (db->priv->saving)
-		g_cond_wait (db->priv->saving_condition, db->priv->saving_mutex);
-
 	db->priv->saving = TRUE;
+	db->priv->saving_full = db->priv->save_full;
+	db->priv->save_full = FALSE;
+	db->priv->dirty = FALSE;
 
-	rb_debug ("saving rhythmdb");
+	rb_debug ("saving rhythmdb%s", db->priv->saving_full ? " in full" : "");
 
 	klass = RHYTHMDB_GET_CLASS (db);
 	klass->impl_save (db);
 
 	db->priv->saving = FALSE;
-	db->priv->dirty = FALSE;
+	db->priv->saving_full = FALSE;
+	db->priv->save_done_count++;
 
 	g_mutex_unlock (db->priv->saving_mutex);
 
@@ -3323,17 +4205,20 @@ rhythmdb_save (RhythmDB *db)
 	rb_debug("saving the rhythmdb and blocking");
 
 	g_mutex_lock (db->priv->saving_mutex);
+
+	/* the first save to start after this request picks it up.  saves
+	 * finish in the order they start, so wait until that one is done.
+	 */
 	new_save_count = db->priv->save_count + 1;
+
+	/* backends that only save changes on regular saves should write
+	 * everything out now, as this is used at shutdown.
+	 */
+	db->priv->save_full = TRUE;
 	
 	rhythmdb_save_async (db);
 	
-	/* wait until this save request is being processed */
-	while (db->priv->save_count < new_save_count) {
-		g_cond_wait (db->priv->saving_condition, db->priv->saving_mutex);
-	}
-	
-	/* wait until it's done */
-	while (db->priv->saving) {
+	while (db->priv->save_done_count < new_save_count) {
 		g_cond_wait (db->priv->saving_condition, db->priv->saving_mutex);
 	}
 
@@ -4052,6 +4937,11 @@ rhythmdb_entry_count_by_type (RhythmDB *db,
  *
  * Evaluates the given entry against the given query.
  *
+ * This goes through the database implementation each time.  Code that
+ * evaluates the same query against many entries, like the query models,
+ * should compile it once with rhythmdb_query_plan_new and then use
+ * rhythmdb_query_plan_evaluate.
+ *
  * Returns: whether the given entry matches the criteria of the given query.
  **/
 gboolean
@@ -4347,6 +5237,13 @@ void
 rhythmdb_emit_entry_deleted (RhythmDB *db,
 			     RhythmDBEntry *entry)
 {
+	GPtrArray *entries;
+
+	entries = g_ptr_array_sized_new (1);
+	g_ptr_array_add (entries, entry);
+	g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_DELETED], 0, entries);
+	g_ptr_array_free (entries, TRUE);
+
 	g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, entry);
 }
 
@@ -4516,6 +5413,7 @@ rhythmdb_is_busy (RhythmDB *db)
 		db->priv->stat_thread_running ||
 		!queue_is_empty (db->priv->event_queue) ||
 		!queue_is_empty (db->priv->action_queue) ||
+		(g_atomic_int_get (&db->priv->outstanding_actions) > 0) ||
 		(db->priv->outstanding_stats != NULL));
 }
 
@@ -4747,6 +5645,38 @@ rhythmdb_entry_type_foreach (RhythmDB *db,
 	g_mutex_unlock (db->priv->entry_type_mutex);
 }
 
+static void
+report_entry_type_memory_usage (const char *name,
+				RhythmDBEntryType entry_type,
+				gsize *total)
+{
+	RBSlab *slab;
+	guint n_entries;
+	guint n_free;
+	gsize n_bytes;
+
+	G_LOCK (entry_slabs);
+	slab = (entry_slabs != NULL) ? g_hash_table_lookup (entry_slabs, entry_type) : NULL;
+	G_UNLOCK (entry_slabs);
+	if (slab == NULL)
+		return;
+
+	rb_slab_get_usage (slab, &n_entries, &n_free, &n_bytes);
+	rb_debug ("%s: %u entries of %" G_GSIZE_FORMAT " bytes, %u free slots, %" G_GSIZE_FORMAT " bytes allocated",
+		  name, n_entries, rb_slab_get_object_size (slab), n_free, n_bytes);
+	*total += n_bytes;
+}
+
+/* prints the amount of memory used for entries of each entry type as debug output */
+static void
+rhythmdb_report_memory_usage (RhythmDB *db)
+{
+	gsize total = 0;
+
+	rhythmdb_entry_type_foreach (db, (GHFunc) report_entry_type_memory_usage, &total);
+	rb_debug ("%" G_GSIZE_FORMAT " bytes allocated for entries", total);
+}
+
 /**
  * rhythmdb_entry_type_get_by_name:
  * @db: a #RhythmDB
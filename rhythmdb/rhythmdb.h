@@ -252,6 +252,11 @@ typedef struct {
 	GValue new;
 } RhythmDBEntryChange;
 
+typedef struct {
+	RhythmDBEntry *entry;
+	GSList *changes;	/* list of RhythmDBEntryChanges */
+} RhythmDBChangedEntry;
+
 const char *rhythmdb_entry_get_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
 RBRefString *rhythmdb_entry_get_refstring (RhythmDBEntry *entry, RhythmDBPropType propid);
 char *rhythmdb_entry_dup_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
@@ -268,6 +273,21 @@ typedef enum
 	RHYTHMDB_ERROR_ACCESS_FAILED,
 } RhythmDBError;
 
+typedef enum
+{
+	RHYTHMDB_ACTION_LANE_IMPORT,
+	RHYTHMDB_ACTION_LANE_SYNC,
+	RHYTHMDB_NUM_ACTION_LANES
+} RhythmDBActionLane;
+
+typedef struct {
+	guint queued;		/* waiting for a worker, or for an earlier action on the same uri */
+	guint running;
+	guint completed;
+	gdouble mean_latency;	/* seconds from being queued to completion */
+	gdouble max_latency;
+} RhythmDBActionStats;
+
 #define RHYTHMDB_ERROR (rhythmdb_error_quark ())
 
 GQuark rhythmdb_error_quark (void);
@@ -350,6 +370,11 @@ struct _RhythmDBClass
 							 RBRefString *keyword);
 	GList*		(*impl_entry_keywords_get)	(RhythmDB *db,
 							 RhythmDBEntry *entry);
+
+	/* batched signals, added here to keep the layout of the slots above */
+	void	(*entries_added)	(RhythmDB *db, GPtrArray *entries);
+	void	(*entries_changed)	(RhythmDB *db, GArray *changes); /* array of RhythmDBChangedEntry */
+	void	(*entries_deleted)	(RhythmDB *db, GPtrArray *entries);
 };
 
 GType		rhythmdb_get_type	(void);
@@ -364,6 +389,9 @@ void		rhythmdb_save		(RhythmDB *db);
 void		rhythmdb_save_async	(RhythmDB *db);
 
 void		rhythmdb_start_action_thread	(RhythmDB *db);
+void		rhythmdb_get_action_stats	(RhythmDB *db,
+						 RhythmDBActionLane lane,
+						 RhythmDBActionStats *stats);
 
 void		rhythmdb_commit		(RhythmDB *db);
 
@@ -39,6 +39,13 @@
  * next or previous song. So if the user changes the entry-view to contain
  * different songs, but changes it back before the current song finishes, they
  * will not see any changes to their history of played songs.
+ *
+ * The weights of the entries in the query model are kept in an #RBWeightedIndex,
+ * which is built when the first entry is picked from a new query model and
+ * then kept up to date as entries are added to, removed from or changed in
+ * the model.  An entry's weight is only recalculated when the entry changes
+ * or starts or stops playing, so weights that depend on the current time
+ * (as in the random-by-age orders) drift slightly between those points.
  */
 
 #include "config.h"
@@ -50,6 +57,7 @@
 #include "rb-debug.h"
 #include "rhythmdb.h"
 #include "rb-history.h"
+#include "rb-weighted-index.h"
 
 static void rb_random_play_order_class_init (RBRandomPlayOrderClass *klass);
 static void rb_random_play_order_init (RBRandomPlayOrder *rorder);
@@ -66,7 +74,15 @@ static void rb_random_playing_entry_changed (RBPlayOrder *porder,
 					     RhythmDBEntry *old_entry,
 					     RhythmDBEntry *new_entry);
 static void rb_random_query_model_changed (RBPlayOrder *porder);
+static void rb_random_entry_added (RBPlayOrder *porder, RhythmDBEntry *entry);
+static void rb_random_entry_removed (RBPlayOrder *porder, RhythmDBEntry *entry);
 static void rb_random_db_entry_deleted (RBPlayOrder *porder, RhythmDBEntry *entry);
+static void rb_random_entry_prop_changed_cb (RhythmDBQueryModel *model,
+					     RhythmDBEntry *entry,
+					     RhythmDBPropType prop,
+					     const GValue *old,
+					     const GValue *new,
+					     RBRandomPlayOrder *rorder);
 
 static void rb_random_handle_query_model_changed (RBRandomPlayOrder *rorder);
 static void rb_random_filter_history (RBRandomPlayOrder *rorder, RhythmDBQueryModel *model);
@@ -76,6 +92,10 @@ struct RBRandomPlayOrderPrivate
 	RBHistory *history;
 
 	gboolean query_model_changed;
+
+	RBWeightedIndex *weights;
+	RhythmDBQueryModel *weights_model;
+	gboolean weights_valid;
 };
 
 G_DEFINE_TYPE (RBRandomPlayOrder, rb_random_play_order, RB_TYPE_PLAY_ORDER)
@@ -92,8 +112,8 @@ rb_random_play_order_class_init (RBRandomPlayOrderClass *klass)
 	porder = RB_PLAY_ORDER_CLASS (klass);
 	porder->db_changed = rb_random_db_changed;
 	porder->playing_entry_changed = rb_random_playing_entry_changed;
-	porder->entry_added = (void (*)(RBPlayOrder*,RhythmDBEntry*))rb_random_query_model_changed;
-	porder->entry_removed = (void (*)(RBPlayOrder*,RhythmDBEntry*))rb_random_query_model_changed;
+	porder->entry_added = rb_random_entry_added;
+	porder->entry_removed = rb_random_entry_removed;
 	porder->query_model_changed = rb_random_query_model_changed;
 	porder->db_entry_deleted = rb_random_db_entry_deleted;
 
@@ -117,6 +137,9 @@ rb_random_play_order_init (RBRandomPlayOrder *rorder)
 	rb_history_set_maximum_size (rorder->priv->history, 50);
 
 	rorder->priv->query_model_changed = TRUE;
+
+	rorder->priv->weights = rb_weighted_index_new ((GDestroyNotify) rhythmdb_entry_unref);
+	rorder->priv->weights_valid = FALSE;
 }
 
 static void
@@ -131,6 +154,14 @@ rb_random_play_order_finalize (GObject *object)
 
 	g_object_unref (G_OBJECT (rorder->priv->history));
 
+	if (rorder->priv->weights_model != NULL) {
+		g_signal_handlers_disconnect_by_func (rorder->priv->weights_model,
+						      G_CALLBACK (rb_random_entry_prop_changed_cb),
+						      rorder);
+		g_object_unref (rorder->priv->weights_model);
+	}
+	rb_weighted_index_free (rorder->priv->weights);
+
 	G_OBJECT_CLASS (rb_random_play_order_parent_class)->finalize (object);
 }
 
@@ -149,58 +180,76 @@ get_history (RBRandomPlayOrder *rorder)
 	return rorder->priv->history;
 }
 
-typedef struct {
-	RhythmDBEntry *entry;
+static void
+rb_random_update_entry_weight (RBRandomPlayOrder *rorder, RhythmDBEntry *entry)
+{
+	RhythmDB *db;
 	double weight;
-	double cumulative_weight;
-} EntryWeight;
 
-static GArray *
-get_query_model_contents (RBRandomPlayOrder *rorder, RhythmDBQueryModel *model)
+	db = rb_play_order_get_db (RB_PLAY_ORDER (rorder));
+	weight = rb_random_play_order_get_entry_weight (rorder, db, entry);
+	if (rb_weighted_index_contains (rorder->priv->weights, entry)) {
+		rb_weighted_index_set (rorder->priv->weights, entry, weight);
+	} else {
+		rb_weighted_index_set (rorder->priv->weights, rhythmdb_entry_ref (entry), weight);
+	}
+}
+
+static void
+rb_random_set_weights_model (RBRandomPlayOrder *rorder, RhythmDBQueryModel *model)
 {
-	guint num_entries;
-	guint i;
-	RhythmDB *db;
-	double weight = 0.0;
-	double cumulative_weight = 0.0;
-	GtkTreeIter iter;
-	GArray *result;
+	if (rorder->priv->weights_model == model)
+		return;
 
-	if (model == NULL) {
-		return NULL;
+	if (rorder->priv->weights_model != NULL) {
+		g_signal_handlers_disconnect_by_func (rorder->priv->weights_model,
+						      G_CALLBACK (rb_random_entry_prop_changed_cb),
+						      rorder);
+		g_object_unref (rorder->priv->weights_model);
 	}
 
-	num_entries = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
-	if (num_entries == 0) {
-		return NULL;
+	rorder->priv->weights_model = model;
+	if (model != NULL) {
+		g_object_ref (model);
+		g_signal_connect_object (model,
+					 "entry-prop-changed",
+					 G_CALLBACK (rb_random_entry_prop_changed_cb),
+					 rorder, 0);
 	}
+}
+
+static void
+rb_random_rebuild_weights (RBRandomPlayOrder *rorder)
+{
+	RhythmDBQueryModel *model;
+	GtkTreeIter iter;
+
+	if (rorder->priv->weights_valid)
+		return;
+
+	rb_weighted_index_clear (rorder->priv->weights);
+
+	model = rb_play_order_get_query_model (RB_PLAY_ORDER (rorder));
+	rb_random_set_weights_model (rorder, model);
+	rorder->priv->weights_valid = TRUE;
+
+	if (model == NULL)
+		return;
 
 	if (!gtk_tree_model_get_iter_first (GTK_TREE_MODEL (model), &iter))
-		return NULL;
+		return;
 
-	i = 0;
-	result = g_array_new (FALSE, FALSE, sizeof (EntryWeight));
-	g_array_set_size (result, num_entries);
-	db = rb_play_order_get_db (RB_PLAY_ORDER (rorder));
+	rb_profile_start ("building random play order weights");
 	do {
 		RhythmDBEntry *entry = rhythmdb_query_model_iter_to_entry (model, &iter);
 
 		if (entry == NULL)
 			continue;
 
-		weight = rb_random_play_order_get_entry_weight (rorder, db, entry);
-
-		g_array_index (result, EntryWeight, i).entry = entry;
-		g_array_index (result, EntryWeight, i).weight = weight;
-		g_array_index (result, EntryWeight, i).cumulative_weight = cumulative_weight;
-		cumulative_weight += weight;
-		i++;
-
+		rb_random_update_entry_weight (rorder, entry);
 		rhythmdb_entry_unref (entry);
-
 	} while (gtk_tree_model_iter_next (GTK_TREE_MODEL (model), &iter));
-
-	return result;
+	rb_profile_end ("building random play order weights");
 }
 
 static void
@@ -240,74 +289,34 @@ rb_random_filter_history (RBRandomPlayOrder *rorder, RhythmDBQueryModel *model)
 	g_ptr_array_free (history_contents, TRUE);
 }
 
-static inline double
-rb_random_get_total_weight (GArray *weights)
-{
-	EntryWeight *last;
-
-	g_return_val_if_fail (weights, 0.0);
-	if (weights->len == 0)
-		return 0.0;
-
-	last = &g_array_index (weights,
-			       EntryWeight,
-			       weights->len - 1);
-	return last->cumulative_weight + last->weight;
-}
-
 static RhythmDBEntry*
 rb_random_play_order_pick_entry (RBRandomPlayOrder *rorder)
 {
-	/* This is O(N) because we traverse the query model to get the entries
-	 * and weights.
-	 *
-	 * The general idea of this algorithm is that there is a line segment
+	/* The general idea of this algorithm is that there is a line segment
 	 * whose length is the sum of all the entries' weights. Each entry gets
 	 * a sub-segment whose length is equal to that entry's weight. A random
 	 * point is picked in the line segment, and the entry that point
 	 * belongs to is returned.
 	 *
+	 * The weights are kept in a Fenwick tree that is updated as the query
+	 * model changes, so this is O(log N) except when the tree has to be
+	 * rebuilt for a new query model.
+	 *
 	 * The algorithm was contributed by treed.
 	 */
-	double total_weight, rnd;
-	int high, low;
-	GArray *entry_weights;
 	RhythmDBEntry *entry;
-	RhythmDBQueryModel *model;
 
-	model = rb_play_order_get_query_model (RB_PLAY_ORDER (rorder));
-	entry_weights = get_query_model_contents (rorder, model);
-	if (entry_weights == NULL) {
+	rb_random_rebuild_weights (rorder);
+
+	entry = rb_weighted_index_pick (rorder->priv->weights);
+	if (entry == NULL) {
 		rb_debug ("nothing to choose from");
 		return NULL;
 	}
 
-	total_weight = rb_random_get_total_weight (entry_weights);
-	if (total_weight == 0.0) {
-		low = g_random_int_range (0, entry_weights->len);
-		rb_debug ("total weight is 0; picked entry %d of %d randomly", low, entry_weights->len);
-		entry = g_array_index (entry_weights, EntryWeight, low).entry;
-		g_array_free (entry_weights, TRUE);
-		return entry;
-	}
-
-	rnd = g_random_double_range (0, total_weight);
-	/* Binary search for the entry with cumulative weight closest to but
-	 * less than rnd */
-	low = -1; high = entry_weights->len;
-	while (high - low > 1) {
-		int mid = (high + low) / 2;
-		if (g_array_index (entry_weights, EntryWeight, mid).cumulative_weight > rnd)
-			high = mid;
-		else
-			low = mid;
-	}
-	entry = g_array_index (entry_weights, EntryWeight, low).entry;
-	rb_debug ("picked entry %d of %d (total weight %f) for random value %f",
-		  low, entry_weights->len, total_weight, rnd);
-
-	g_array_free (entry_weights, TRUE);
-
+	rb_debug ("picked entry from %u (total weight %f)",
+		  rb_weighted_index_size (rorder->priv->weights),
+		  rb_weighted_index_total_weight (rorder->priv->weights));
 	return entry;
 }
 
@@ -423,9 +432,16 @@ rb_random_play_order_go_previous (RBPlayOrder* porder)
 static void
 rb_random_db_changed (RBPlayOrder *porder, RhythmDB *db)
 {
+	RBRandomPlayOrder *rorder;
+
 	g_return_if_fail (RB_IS_RANDOM_PLAY_ORDER (porder));
+	rorder = RB_RANDOM_PLAY_ORDER (porder);
 
-	rb_history_clear (RB_RANDOM_PLAY_ORDER (porder)->priv->history);
+	rb_history_clear (rorder->priv->history);
+
+	rorder->priv->weights_valid = FALSE;
+	rb_weighted_index_clear (rorder->priv->weights);
+	rb_random_set_weights_model (rorder, NULL);
 }
 
 static void
@@ -438,6 +454,14 @@ rb_random_playing_entry_changed (RBPlayOrder *porder,
 	g_return_if_fail (RB_IS_RANDOM_PLAY_ORDER (porder));
 	rorder = RB_RANDOM_PLAY_ORDER (porder);
 
+	/* weights may depend on which entry is playing */
+	if (rorder->priv->weights_valid) {
+		if (old_entry && rb_weighted_index_contains (rorder->priv->weights, old_entry))
+			rb_random_update_entry_weight (rorder, old_entry);
+		if (new_entry && rb_weighted_index_contains (rorder->priv->weights, new_entry))
+			rb_random_update_entry_weight (rorder, new_entry);
+	}
+
 	if (new_entry) {
 		if (new_entry == rb_history_current (get_history (rorder))) {
 			/* Do nothing */
@@ -451,8 +475,57 @@ rb_random_playing_entry_changed (RBPlayOrder *porder,
 static void
 rb_random_query_model_changed (RBPlayOrder *porder)
 {
+	RBRandomPlayOrder *rorder;
+
+	g_return_if_fail (RB_IS_RANDOM_PLAY_ORDER (porder));
+	rorder = RB_RANDOM_PLAY_ORDER (porder);
+
+	rorder->priv->query_model_changed = TRUE;
+
+	if (rb_play_order_get_query_model (porder) != rorder->priv->weights_model) {
+		rorder->priv->weights_valid = FALSE;
+		rb_weighted_index_clear (rorder->priv->weights);
+		rb_random_set_weights_model (rorder, NULL);
+	}
+}
+
+static void
+rb_random_entry_added (RBPlayOrder *porder, RhythmDBEntry *entry)
+{
+	RBRandomPlayOrder *rorder;
+
 	g_return_if_fail (RB_IS_RANDOM_PLAY_ORDER (porder));
-	RB_RANDOM_PLAY_ORDER (porder)->priv->query_model_changed = TRUE;
+	rorder = RB_RANDOM_PLAY_ORDER (porder);
+
+	rorder->priv->query_model_changed = TRUE;
+	if (rorder->priv->weights_valid)
+		rb_random_update_entry_weight (rorder, entry);
+}
+
+static void
+rb_random_entry_removed (RBPlayOrder *porder, RhythmDBEntry *entry)
+{
+	RBRandomPlayOrder *rorder;
+
+	g_return_if_fail (RB_IS_RANDOM_PLAY_ORDER (porder));
+	rorder = RB_RANDOM_PLAY_ORDER (porder);
+
+	rorder->priv->query_model_changed = TRUE;
+	if (rorder->priv->weights_valid)
+		rb_weighted_index_remove (rorder->priv->weights, entry);
+}
+
+static void
+rb_random_entry_prop_changed_cb (RhythmDBQueryModel *model,
+				 RhythmDBEntry *entry,
+				 RhythmDBPropType prop,
+				 const GValue *old,
+				 const GValue *new,
+				 RBRandomPlayOrder *rorder)
+{
+	if (rorder->priv->weights_valid &&
+	    rb_weighted_index_contains (rorder->priv->weights, entry))
+		rb_random_update_entry_weight (rorder, entry);
 }
 
 static void
@@ -465,5 +538,6 @@ rb_random_db_entry_deleted (RBPlayOrder *porder, RhythmDBEntry *entry)
 
 	rorder = RB_RANDOM_PLAY_ORDER (porder);
 	rb_history_remove_entry (rorder->priv->history, entry);
+	rb_weighted_index_remove (rorder->priv->weights, entry);
 }
 
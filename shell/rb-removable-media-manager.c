@@ -40,6 +40,8 @@
 #include "config.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
 #include <gtk/gtk.h>
 #include <gio/gio.h>
@@ -100,9 +102,16 @@ static void uevent_cb (GUdevClient *client, const char *action, GUdevDevice *dev
 #endif
 
 static void do_transfer (RBRemovableMediaManager *manager);
+static guint transfer_job_count (const char *env_name, guint max);
 static void rb_removable_media_manager_cmd_copy_tracks (GtkAction *action,
 							RBRemovableMediaManager *mgr);
 
+/* maximum number of plain copies running at once */
+#define MAX_COPY_TRANSFERS		2
+
+/* maximum number of plain copies to a single device running at once */
+#define MAX_DEVICE_COPY_TRANSFERS	1
+
 typedef struct
 {
 	RBShell *shell;
@@ -118,11 +127,16 @@ typedef struct
 	GHashTable *device_mapping;
 	gboolean scanned;
 
-	GAsyncQueue *transfer_queue;
-	gboolean transfer_running;
+	GQueue *transfer_queue;
+	GList *running_transfers;
+	guint running_copies;
+	guint running_transcodes;
+	guint max_copies;
+	guint max_transcodes;
+	gboolean scheduling_transfers;
+	gboolean reschedule_transfers;
 	gint transfer_total;
 	gint transfer_done;
-	double transfer_fraction;
 
 	GVolumeMonitor *volume_monitor;
 	guint mount_added_id;
@@ -247,7 +261,8 @@ rb_removable_media_manager_class_init (RBRemovableMediaManagerClass *klass)
 	 * @mgr: the #RBRemovableMediaManager
 	 * @done: number of tracks that have been fully transferred
 	 * @total: total number of tracks to transfer
-	 * @progress: fraction of the current track that has been transferred
+	 * @progress: combined fraction of the tracks currently being transferred,
+	 *   so that (@done + @progress) / @total is the overall progress
 	 *
 	 * Emitted throughout the track transfer process to allow UI elements
 	 * showing transfer progress to be updated.
@@ -334,7 +349,11 @@ rb_removable_media_manager_init (RBRemovableMediaManager *mgr)
 	priv->volume_mapping = g_hash_table_new (NULL, NULL);
 	priv->mount_mapping = g_hash_table_new (NULL, NULL);
 	priv->device_mapping = g_hash_table_new (g_direct_hash, g_direct_equal);
-	priv->transfer_queue = g_async_queue_new ();
+	priv->transfer_queue = g_queue_new ();
+	priv->max_copies = transfer_job_count ("RB_TRANSFER_COPY_JOBS", MAX_COPY_TRANSFERS);
+	priv->max_transcodes = transfer_job_count ("RB_TRANSFER_TRANSCODE_JOBS", 0);
+	rb_debug ("running up to %u copies and %u transcodes at once",
+		  priv->max_copies, priv->max_transcodes);
 
 	/*
 	 * Monitor new (un)mounted file systems to look for new media;
@@ -446,7 +465,7 @@ rb_removable_media_manager_finalize (GObject *object)
 	g_hash_table_destroy (priv->device_mapping);
 	g_hash_table_destroy (priv->volume_mapping);
 	g_hash_table_destroy (priv->mount_mapping);
-	g_async_queue_unref (priv->transfer_queue);
+	g_queue_free (priv->transfer_queue);
 
 	G_OBJECT_CLASS (rb_removable_media_manager_parent_class)->finalize (object);
 }
@@ -1062,7 +1081,13 @@ rb_removable_media_manager_scan (RBRemovableMediaManager *manager)
 #endif
 }
 
-/* Track transfer */
+/* Track transfer
+ *
+ * Several transfers run at once.  Transcoding is CPU bound, so up to one
+ * transcode per processor runs at a time; copying is limited by the
+ * devices being written to, so only a couple of copies run at once, and
+ * only one at a time to any single device.
+ */
 
 typedef struct {
 	RBRemovableMediaManager *manager;
@@ -1073,17 +1098,53 @@ typedef struct {
 	gboolean failed;
 	RBTransferCompleteCallback callback;
 	gpointer userdata;
+
+	gboolean transcode;
+	gpointer device;
+	double fraction;
 } TransferData;
 
+static guint
+transfer_job_count (const char *env_name, guint max)
+{
+	const char *env;
+	long n;
+
+	env = g_getenv (env_name);
+	if (env != NULL) {
+		n = strtol (env, NULL, 10);
+		if (n > 0)
+			return n;
+	}
+
+	if (max != 0)
+		return max;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n > 1)
+		return n;
+#endif
+	return 1;
+}
+
 static void
 emit_progress (RBRemovableMediaManager *mgr)
 {
 	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (mgr);
+	double fraction = 0.0;
+	GList *l;
+
+	for (l = priv->running_transfers; l != NULL; l = l->next) {
+		TransferData *data = l->data;
+		if (data->fraction > 0.0)
+			fraction += data->fraction;
+	}
 
 	g_signal_emit (G_OBJECT (mgr), rb_removable_media_manager_signals[TRANSFER_PROGRESS], 0,
 		       priv->transfer_done,
 		       priv->transfer_total,
-		       priv->transfer_fraction);
+		       fraction);
 }
 
 static void
@@ -1106,10 +1167,8 @@ error_cb (RBEncoder *encoder, GError *error, TransferData *data)
 static void
 progress_cb (RBEncoder *encoder, double fraction, TransferData *data)
 {
-	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (data->manager);
-
-	rb_debug ("transfer progress %f", (float)fraction);
-	priv->transfer_fraction = fraction;
+	rb_debug ("transfer progress for %s: %f", data->dest, (float)fraction);
+	data->fraction = fraction;
 	emit_progress (data->manager);
 }
 
@@ -1122,9 +1181,12 @@ completed_cb (RBEncoder *encoder, guint64 dest_size, TransferData *data)
 	if (!data->failed)
 		(data->callback) (data->entry, data->dest, dest_size, data->userdata);
 
-	priv->transfer_running = FALSE;
+	priv->running_transfers = g_list_remove (priv->running_transfers, data);
+	if (data->transcode)
+		priv->running_transcodes--;
+	else
+		priv->running_copies--;
 	priv->transfer_done++;
-	priv->transfer_fraction = 0.0;
 	do_transfer (data->manager);
 
 	g_object_unref (G_OBJECT (encoder));
@@ -1133,33 +1195,38 @@ completed_cb (RBEncoder *encoder, guint64 dest_size, TransferData *data)
 	g_free (data);
 }
 
-static void
-do_transfer (RBRemovableMediaManager *manager)
+static gboolean
+can_start_transfer (RBRemovableMediaManagerPrivate *priv, TransferData *data)
 {
-	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (manager);
-	TransferData *data;
-	RBEncoder *encoder;
+	guint device_copies;
+	GList *l;
 
-	g_assert (rb_is_main_thread ());
+	if (data->transcode)
+		return (priv->running_transcodes < priv->max_transcodes);
 
-	emit_progress (manager);
+	if (priv->running_copies >= priv->max_copies)
+		return FALSE;
 
-	if (priv->transfer_running) {
-		rb_debug ("already transferring something");
-		return;
+	device_copies = 0;
+	for (l = priv->running_transfers; l != NULL; l = l->next) {
+		TransferData *running = l->data;
+		if (running->transcode == FALSE && running->device == data->device)
+			device_copies++;
 	}
+	return (device_copies < MAX_DEVICE_COPY_TRANSFERS);
+}
 
-	data = g_async_queue_try_pop (priv->transfer_queue);
-	if (data == NULL) {
-		rb_debug ("transfer queue is empty");
-		priv->transfer_total = 0;
-		priv->transfer_done = 0;
-		emit_progress (manager);
-		return;
-	}
+static void
+start_transfer (RBRemovableMediaManager *manager, TransferData *data)
+{
+	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (manager);
+	RBEncoder *encoder;
 
-	priv->transfer_running = TRUE;
-	priv->transfer_fraction = 0.0;
+	priv->running_transfers = g_list_prepend (priv->running_transfers, data);
+	if (data->transcode)
+		priv->running_transcodes++;
+	else
+		priv->running_copies++;
 
 	encoder = rb_encoder_new ();
 	g_signal_connect (G_OBJECT (encoder),
@@ -1171,7 +1238,8 @@ do_transfer (RBRemovableMediaManager *manager)
 	g_signal_connect (G_OBJECT (encoder),
 			  "completed", G_CALLBACK (completed_cb),
 			  data);
-	rb_debug ("starting transfer of %s to %s",
+	rb_debug ("starting %s of %s to %s",
+		  data->transcode ? "transcode" : "copy",
 		  rhythmdb_entry_get_string (data->entry, RHYTHMDB_PROP_LOCATION),
 		  data->dest);
 	if (rb_encoder_encode (encoder, data->entry, data->dest, data->mime_types) == FALSE) {
@@ -1179,6 +1247,81 @@ do_transfer (RBRemovableMediaManager *manager)
 	}
 }
 
+static void
+do_transfer (RBRemovableMediaManager *manager)
+{
+	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (manager);
+	GList *l;
+	GList *next;
+
+	g_assert (rb_is_main_thread ());
+
+	/* transfers that fail to start complete immediately, which calls
+	 * back into here; just make the outer call go round again.
+	 */
+	if (priv->scheduling_transfers) {
+		priv->reschedule_transfers = TRUE;
+		return;
+	}
+
+	emit_progress (manager);
+
+	priv->scheduling_transfers = TRUE;
+	do {
+		priv->reschedule_transfers = FALSE;
+
+		/* start whatever the limits allow, in queue order */
+		for (l = priv->transfer_queue->head; l != NULL; l = next) {
+			TransferData *data = l->data;
+
+			next = l->next;
+			if (can_start_transfer (priv, data) == FALSE)
+				continue;
+
+			g_queue_delete_link (priv->transfer_queue, l);
+			start_transfer (manager, data);
+			if (priv->reschedule_transfers)
+				break;
+		}
+	} while (priv->reschedule_transfers);
+	priv->scheduling_transfers = FALSE;
+
+	if (priv->running_transfers == NULL && g_queue_is_empty (priv->transfer_queue)) {
+		rb_debug ("transfer queue is empty");
+		priv->transfer_total = 0;
+		priv->transfer_done = 0;
+		emit_progress (manager);
+	}
+}
+
+static gpointer
+find_transfer_device (RBRemovableMediaManager *manager, const char *dest)
+{
+	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (manager);
+	GHashTableIter iter;
+	gpointer mount;
+	gpointer device = NULL;
+	GFile *file;
+
+	/* transfers to the same mount share its write bandwidth */
+	file = g_file_new_for_uri (dest);
+	g_hash_table_iter_init (&iter, priv->mount_mapping);
+	while (g_hash_table_iter_next (&iter, &mount, NULL)) {
+		GFile *root;
+
+		root = g_mount_get_root (G_MOUNT (mount));
+		if (g_file_has_prefix (file, root))
+			device = mount;
+		g_object_unref (root);
+
+		if (device != NULL)
+			break;
+	}
+	g_object_unref (file);
+
+	return device;
+}
+
 /**
  * rb_removable_media_manager_queue_transfer:
  * @manager: the #RBRemovableMediaManager
@@ -1212,12 +1355,34 @@ rb_removable_media_manager_queue_transfer (RBRemovableMediaManager *manager,
 	data->mime_types = rb_string_list_copy (mime_types);
 	data->callback = callback;
 	data->userdata = userdata;
+	data->device = find_transfer_device (manager, dest);
 
-	g_async_queue_push (priv->transfer_queue, data);
+	/* same check the encoder uses to decide between copying and transcoding */
+	data->transcode = rb_encoder_needs_transcode (entry, mime_types);
+
+	g_queue_push_tail (priv->transfer_queue, data);
 	priv->transfer_total++;
 	do_transfer (manager);
 }
 
+/**
+ * rb_removable_media_manager_get_active_transfers:
+ * @mgr: the #RBRemovableMediaManager
+ *
+ * Returns the number of track transfers currently running.  Several
+ * transfers can run at once, so this is used to describe which tracks
+ * are being transferred when reporting progress.
+ *
+ * Return value: number of running transfers
+ */
+guint
+rb_removable_media_manager_get_active_transfers (RBRemovableMediaManager *mgr)
+{
+	RBRemovableMediaManagerPrivate *priv = GET_PRIVATE (mgr);
+
+	return g_list_length (priv->running_transfers);
+}
+
 static gboolean
 copy_entry (RhythmDBQueryModel *model,
 	    GtkTreePath *path,
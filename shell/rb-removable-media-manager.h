@@ -92,6 +92,7 @@ void	rb_removable_media_manager_queue_transfer (RBRemovableMediaManager *mgr,
 						   GList *mime_types,
 						   RBTransferCompleteCallback callback,
 						   gpointer userdata);
+guint	rb_removable_media_manager_get_active_transfers (RBRemovableMediaManager *mgr);
 
 G_END_DECLS
 
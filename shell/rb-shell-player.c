@@ -138,10 +138,9 @@ static void rb_shell_player_set_playing_source_internal (RBShellPlayer *player,
 							 gboolean sync_entry_view);
 static void rb_shell_player_sync_with_source (RBShellPlayer *player);
 static void rb_shell_player_sync_with_selected_source (RBShellPlayer *player);
-static void rb_shell_player_entry_changed_cb (RhythmDB *db,
-							RhythmDBEntry *entry,
-				       		GSList *changes,
-				       		RBShellPlayer *player);
+static void rb_shell_player_entries_changed_cb (RhythmDB *db,
+					       GArray *changed,
+					       RBShellPlayer *player);
 
 static void rb_shell_player_entry_activated_cb (RBEntryView *view,
 						RhythmDBEntry *entry,
@@ -1099,7 +1098,7 @@ rb_shell_player_set_db_internal (RBShellPlayer *player,
 {
 	if (player->priv->db != NULL) {
 		g_signal_handlers_disconnect_by_func (player->priv->db,
-						      G_CALLBACK (rb_shell_player_entry_changed_cb),
+						      G_CALLBACK (rb_shell_player_entries_changed_cb),
 						      player);
 		g_signal_handlers_disconnect_by_func (player->priv->db,
 						      G_CALLBACK (rb_shell_player_extra_metadata_cb),
@@ -1111,8 +1110,8 @@ rb_shell_player_set_db_internal (RBShellPlayer *player,
 	if (player->priv->db != NULL) {
 		/* Listen for changed entries to update metadata display */
 		g_signal_connect_object (G_OBJECT (player->priv->db),
-					 "entry_changed",
-					 G_CALLBACK (rb_shell_player_entry_changed_cb),
+					 "entries_changed",
+					 G_CALLBACK (rb_shell_player_entries_changed_cb),
 					 player, 0);
 		g_signal_connect_object (G_OBJECT (player->priv->db),
 					 "entry_extra_metadata_notify",
@@ -2779,27 +2778,35 @@ rb_shell_player_property_row_activated_cb (RBPropertyView *view,
 }
 
 static void
-rb_shell_player_entry_changed_cb (RhythmDB *db,
-				  RhythmDBEntry *entry,
-				  GSList *changes,
-				  RBShellPlayer *player)
+rb_shell_player_entries_changed_cb (RhythmDB *db,
+				    GArray *changed,
+				    RBShellPlayer *player)
 {
 	GSList *t;
 	gboolean synced = FALSE;
 	const char *location;
 	RhythmDBEntry *playing_entry;
+	GSList *changes = NULL;
+	guint i;
 
 	playing_entry = rb_shell_player_get_playing_entry (player);
+	if (playing_entry == NULL)
+		return;
 
-	/* We try to update only if the changed entry is currently playing */
-	if (entry != playing_entry) {
-		if (playing_entry != NULL) {
-			rhythmdb_entry_unref (playing_entry);
+	/* We try to update only if the currently playing entry has changed */
+	for (i = 0; i < changed->len; i++) {
+		RhythmDBChangedEntry *c = &g_array_index (changed, RhythmDBChangedEntry, i);
+		if (c->entry == playing_entry) {
+			changes = c->changes;
+			break;
 		}
+	}
+	if (i == changed->len) {
+		rhythmdb_entry_unref (playing_entry);
 		return;
 	}
 
-	location = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
+	location = rhythmdb_entry_get_string (playing_entry, RHYTHMDB_PROP_LOCATION);
 	for (t = changes; t; t = t->next) {
 		RhythmDBEntryChange *change = t->data;
 
@@ -2836,9 +2843,7 @@ rb_shell_player_entry_changed_cb (RhythmDB *db,
 		}
 	}
 
-	if (playing_entry != NULL) {
-		rhythmdb_entry_unref (playing_entry);
-	}
+	rhythmdb_entry_unref (playing_entry);
 }
 
 static void
@@ -1801,17 +1801,26 @@ rb_shell_transfer_progress_cb (RBRemovableMediaManager *mgr,
 
 	if (total > 0) {
 		char *s;
+		double progress;
+		int active;
 
-		if (fraction >= 0)
+		/* several tracks may be in flight at once, so 'fraction' is
+		 * the sum of their progress; show the overall percentage and
+		 * the range of tracks being transferred.
+		 */
+		progress = ((double)(done) + MAX (fraction, 0.0)) / total;
+		active = rb_removable_media_manager_get_active_transfers (mgr);
+		if (active > 1 && done + active <= total)
+			s = g_strdup_printf (_("Transferring tracks %d-%d out of %d (%.0f%%)"),
+						   done + 1, done + active, total, progress * 100);
+		else if (fraction > 0)
 			s = g_strdup_printf (_("Transferring track %d out of %d (%.0f%%)"),
-						   done + 1, total, fraction * 100);
+						   done + 1, total, progress * 100);
 		else
 			s = g_strdup_printf (_("Transferring track %d out of %d"),
 						   done + 1, total);
 
-		rb_statusbar_set_progress (shell->priv->statusbar,
-					   (((double)(done) + fraction)/total),
-					   s);
+		rb_statusbar_set_progress (shell->priv->statusbar, progress, s);
 		g_free (s);
 	} else {
 		rb_statusbar_set_progress (shell->priv->statusbar, -1, NULL);
@@ -27,6 +27,7 @@
  *
  */
 
+#include <string.h>
 #include <glib.h>
 
 
@@ -38,6 +39,29 @@
 #include "rb-playlist-manager.h"
 #include "rb-podcast-manager.h"
 
+/* a set of library entries to sync: all songs, all podcasts,
+ * a playlist or a podcast feed
+ */
+typedef struct {
+	RBMediaPlayerPrefs *prefs;
+	char *key;
+	RhythmDBQueryModel *model;
+	RBPlaylistSource *playlist;
+	GHashTable *entries;		/* RhythmDBEntry * set */
+} SyncContributor;
+
+/* an entry contained in at least one contributor */
+typedef struct {
+	char *uuid;
+	guint refcount;			/* number of contributors containing it */
+	gboolean included;		/* FALSE for undownloaded podcasts */
+} ItineraryEntry;
+
+/* a track in the itinerary */
+typedef struct {
+	GSList *entries;		/* included entries with this UUID */
+} ItineraryTrack;
+
 typedef struct {
 	GKeyFile *key_file;
 	gchar *group;
@@ -58,9 +82,17 @@ typedef struct {
 	GHashTable * sync_playlists_list;
 	GHashTable * sync_podcasts_list;
 	
+	RhythmDB *db;
+	
+	/* maintained incrementally, see update_contributors */
+	GHashTable * contributors;	/* key -> SyncContributor */
+	GHashTable * itinerary_entries;	/* RhythmDBEntry -> ItineraryEntry */
+	GHashTable * itinerary_hash;	/* track UUID -> ItineraryTrack */
+	GHashTable * device_hash;	/* track UUID -> RhythmDBEntry on the device */
+	GHashTable * sync_add_hash;	/* track UUID -> RhythmDBEntry to add */
+	GHashTable * sync_remove_hash;	/* track UUID -> RhythmDBEntry to remove */
+	
 	/* generated on rb_media_player_prefs_sync_update */
-	GHashTable * itinerary_hash;
-	GHashTable * device_hash;
 	GList *  sync_to_add;
 	GList *  sync_to_remove;
 	gint64	 sync_space_needed; /* The space used after syncing */
@@ -85,10 +117,6 @@ static gchar ** hash_table_to_string_list (GHashTable * hash_table);
 
 static GHashTable * string_list_to_hash_table (const gchar ** string_list);
 
-static void rb_media_player_prefs_hash_table_compare (gpointer key,
-						      gpointer value,
-						      gpointer user_data);
-
 static gboolean entry_is_undownloaded_podcast (RhythmDBEntry *entry);
 
 static guint64 rb_media_player_prefs_calculate_space_needed (RBMediaPlayerPrefs *prefs);
@@ -105,16 +133,14 @@ static void rb_media_player_prefs_get_property (GObject *object,
 static gchar ** rb_media_player_prefs_get_string_list	( RBMediaPlayerPrefs *prefs,
 							  enum SyncPrefKey pref_key );
 
-static void hash_table_duplicate (GHashTable **hash1, GHashTable *hash2);
-static void itinerary_insert_all_of_type (RBMediaPlayerPrefs *prefs,
-					  RhythmDBEntryType entry_type);
-
-static void itinerary_insert_some_playlists (RBMediaPlayerPrefs *prefs);
-static void itinerary_insert_some_podcasts (RBMediaPlayerPrefs *prefs);
-static void build_itinerary_hash_table (RBMediaPlayerPrefs *prefs);
-static void build_device_hash_table (RBMediaPlayerPrefs *prefs);
-static void build_sync_list (RBMediaPlayerPrefs *prefs,
-			     enum SyncPrefKey pref_key);
+static void itinerary_entry_free (ItineraryEntry *ie);
+static void itinerary_track_free (ItineraryTrack *track);
+static void contributor_free (SyncContributor *contributor);
+static void update_contributors (RBMediaPlayerPrefs *prefs);
+static void update_device_hash (RBMediaPlayerPrefs *prefs);
+static void db_entries_changed_cb (RhythmDB *db,
+				   GArray *changes,
+				   RBMediaPlayerPrefs *prefs);
 
 static GKeyFile * rb_media_player_prefs_load_file (RBMediaPlayerPrefs *prefs,
 						   GError **error);
@@ -122,6 +148,21 @@ static GKeyFile * rb_media_player_prefs_load_file (RBMediaPlayerPrefs *prefs,
 static void
 rb_media_player_prefs_init (RBMediaPlayerPrefs *prefs)
 {
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+
+	priv->contributors = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    NULL, (GDestroyNotify) contributor_free);
+	priv->itinerary_entries = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							 (GDestroyNotify) rhythmdb_entry_unref,
+							 (GDestroyNotify) itinerary_entry_free);
+	priv->itinerary_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, (GDestroyNotify) itinerary_track_free);
+	priv->device_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+						   g_free, (GDestroyNotify) rhythmdb_entry_unref);
+	priv->sync_add_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, (GDestroyNotify) rhythmdb_entry_unref);
+	priv->sync_remove_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, (GDestroyNotify) rhythmdb_entry_unref);
 }
 
 static void
@@ -156,6 +197,17 @@ rb_media_player_prefs_dispose (GObject *object)
 		priv->sync_to_remove = NULL;
 	}
 		
+	/* contributors first, as dropping them updates the other tables */
+	if (priv->contributors != NULL) {
+		g_hash_table_destroy (priv->contributors);
+		priv->contributors = NULL;
+	}
+	
+	if (priv->itinerary_entries != NULL) {
+		g_hash_table_destroy (priv->itinerary_entries);
+		priv->itinerary_entries = NULL;
+	}
+	
 	if (priv->itinerary_hash != NULL) {
 		g_hash_table_destroy (priv->itinerary_hash);
 		priv->itinerary_hash = NULL;
@@ -166,6 +218,24 @@ rb_media_player_prefs_dispose (GObject *object)
 		priv->device_hash = NULL;
 	}
 	
+	if (priv->sync_add_hash != NULL) {
+		g_hash_table_destroy (priv->sync_add_hash);
+		priv->sync_add_hash = NULL;
+	}
+	
+	if (priv->sync_remove_hash != NULL) {
+		g_hash_table_destroy (priv->sync_remove_hash);
+		priv->sync_remove_hash = NULL;
+	}
+	
+	if (priv->db != NULL) {
+		g_signal_handlers_disconnect_by_func (priv->db,
+						      G_CALLBACK (db_entries_changed_cb),
+						      object);
+		g_object_unref (priv->db);
+		priv->db = NULL;
+	}
+	
 	if (priv->source != NULL) {
 		g_object_unref (priv->source);
 		priv->source = NULL;
@@ -236,28 +306,14 @@ string_list_to_hash_table (const gchar ** string_list)
 	return hash_table;
 }
 
-typedef struct {
-	GHashTable *other_hash_table;
-	GList *list;
-} HashTableComparisonData;
-
-static void
-rb_media_player_prefs_hash_table_compare (gpointer key,	/* gchar * track_UUID */
-				  gpointer value,	/* RhythmDBEntry * */
-				  gpointer user_data)	/* HashTableComparisonData * */
-{
-	HashTableComparisonData *data = user_data;
-	
-	if ( !g_hash_table_lookup (data->other_hash_table, key) ) {
-		data->list = g_list_prepend ( data->list, value );
-	}
-
-}
-
-typedef struct {
-	RBMediaPlayerPrefs *prefs;
-	GHashTable *hash_table;
-} HashTableInsertionData;
+/* The sync lists are maintained incrementally.  The itinerary (what should
+ * be on the device) is made up of a set of contributors: all songs, all
+ * podcasts, individual playlists and individual podcast feeds.  Each
+ * contributor follows a live query model, so entries coming and going only
+ * touch the tracks involved, and toggling a playlist in the sync dialog
+ * only walks that playlist.  Tracks are matched between the library and
+ * the device by UUID, which is cached per entry.
+ */
 
 static gboolean
 entry_is_undownloaded_podcast (RhythmDBEntry *entry)
@@ -271,300 +327,555 @@ entry_is_undownloaded_podcast (RhythmDBEntry *entry)
 	return FALSE;
 }
 
-/* This function will resolve the iter from
- * a tree view, then check that the entry is not
- * an undownloaded podcast, before inserting it into
- * the given hash table.
- * Called on each item in a tree view.
- */
-static gboolean
-hash_table_insert_from_tree_view_foreach_func (GtkTreeModel *query_model,
-					       GtkTreePath  *path,
-					       GtkTreeIter  *iter,
-					       HashTableInsertionData *data)
+static void
+itinerary_entry_free (ItineraryEntry *ie)
 {
-	RhythmDBEntry *entry;
-	
-	entry = rhythmdb_query_model_iter_to_entry (RHYTHMDB_QUERY_MODEL (query_model), iter);
-	
-	if (!entry_is_undownloaded_podcast (entry))
-		g_hash_table_insert (data->hash_table,
-				     rb_media_player_source_track_uuid (entry),
-				     entry);
-	
-	return FALSE;
+	g_free (ie->uuid);
+	g_free (ie);
 }
 
-static guint64
-rb_media_player_prefs_calculate_space_needed (RBMediaPlayerPrefs *prefs)
+static void
+itinerary_track_free (ItineraryTrack *track)
 {
-	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	GList * list_iter;
-	priv->sync_space_needed = rb_media_player_source_get_capacity( priv->source )
-					 - rb_media_player_source_get_free_space (priv->source);
-	
-	for (list_iter = priv->sync_to_add; list_iter; list_iter = list_iter->next) {		
-		priv->sync_space_needed += rhythmdb_entry_get_uint64 ( list_iter->data,
-								       RHYTHMDB_PROP_FILE_SIZE );
-	}
-	
-	for (list_iter = priv->sync_to_remove; list_iter; list_iter = list_iter->next) {		
-		priv->sync_space_needed -= rhythmdb_entry_get_uint64 ( list_iter->data,
-								       RHYTHMDB_PROP_FILE_SIZE );
-	}
-	
-	return priv->sync_space_needed;
+	g_slist_free (track->entries);
+	g_free (track);
 }
 
 static void
-rb_media_player_prefs_set_property (GObject *object,
-				    guint prop_id,
-				    const GValue *value,
-				    GParamSpec *pspec)
+itinerary_track_add (RBMediaPlayerPrefs *prefs, const char *uuid, RhythmDBEntry *entry)
 {
-	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (object);
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	ItineraryTrack *track;
 
-	switch (prop_id) {
-	case PROP_SOURCE:
-		priv->source = g_value_dup_object (value);
-		break;
-	default:
-		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-		break;
+	track = g_hash_table_lookup (priv->itinerary_hash, uuid);
+	if (track == NULL) {
+		track = g_new0 (ItineraryTrack, 1);
+		g_hash_table_insert (priv->itinerary_hash, g_strdup (uuid), track);
+
+		if (g_hash_table_lookup (priv->device_hash, uuid) != NULL) {
+			g_hash_table_remove (priv->sync_remove_hash, uuid);
+		} else {
+			g_hash_table_insert (priv->sync_add_hash,
+					     g_strdup (uuid),
+					     rhythmdb_entry_ref (entry));
+		}
+		priv->sync_updated = FALSE;
 	}
+
+	track->entries = g_slist_append (track->entries, entry);
 }
 
 static void
-rb_media_player_prefs_get_property (GObject *object,
-				    guint prop_id,
-				    GValue *value,
-				    GParamSpec *pspec)
+itinerary_track_remove (RBMediaPlayerPrefs *prefs, const char *uuid, RhythmDBEntry *entry)
 {
-	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (object);
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	ItineraryTrack *track;
+	RhythmDBEntry *device_entry;
 
-	switch (prop_id) {
-	case PROP_SOURCE:
-		g_value_set_object (value, priv->source);
-		break;
-	default:
-		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-		break;
+	track = g_hash_table_lookup (priv->itinerary_hash, uuid);
+	g_assert (track != NULL);
+
+	track->entries = g_slist_remove (track->entries, entry);
+	device_entry = g_hash_table_lookup (priv->device_hash, uuid);
+
+	if (track->entries == NULL) {
+		if (device_entry != NULL) {
+			g_hash_table_insert (priv->sync_remove_hash,
+					     g_strdup (uuid),
+					     rhythmdb_entry_ref (device_entry));
+		} else {
+			g_hash_table_remove (priv->sync_add_hash, uuid);
+		}
+		g_hash_table_remove (priv->itinerary_hash, uuid);
+		priv->sync_updated = FALSE;
+	} else if (device_entry == NULL &&
+		   g_hash_table_lookup (priv->sync_add_hash, uuid) == entry) {
+		/* another entry for the same track takes its place */
+		g_hash_table_insert (priv->sync_add_hash,
+				     g_strdup (uuid),
+				     rhythmdb_entry_ref (track->entries->data));
+		priv->sync_updated = FALSE;
 	}
 }
 
-/* Duplicate all entries from hash2 to hash1. hash1
- * needs to not be empty, duplicate entries are silently dropped
+/* Brings an itinerary entry up to date with the entry's current UUID
+ * and podcast download state.
  */
 static void
-hash_table_duplicate (GHashTable **hash1, GHashTable *hash2)
+itinerary_entry_refresh (RBMediaPlayerPrefs *prefs, RhythmDBEntry *entry, ItineraryEntry *ie)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-	
-	g_hash_table_iter_init (&iter, hash2);
-	while (g_hash_table_iter_next (&iter, &key, &value)) {		
-		g_hash_table_insert(*hash1, key, value);
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	gboolean included;
+	char *uuid;
+
+	included = !entry_is_undownloaded_podcast (entry);
+	uuid = rb_media_player_source_get_track_uuid (priv->source, entry);
+
+	if (ie->included && (included == FALSE || strcmp (uuid, ie->uuid) != 0)) {
+		itinerary_track_remove (prefs, ie->uuid, entry);
+		ie->included = FALSE;
+	}
+
+	g_free (ie->uuid);
+	ie->uuid = uuid;
+
+	if (included && ie->included == FALSE) {
+		itinerary_track_add (prefs, ie->uuid, entry);
+		ie->included = TRUE;
 	}
 }
 
 static void
-itinerary_insert_all_of_type (RBMediaPlayerPrefs *prefs,
-			      RhythmDBEntryType entry_type)
+itinerary_entry_add (RBMediaPlayerPrefs *prefs, RhythmDBEntry *entry)
 {
 	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	GtkTreeModel *query_model;
-	HashTableInsertionData data = { prefs, priv->itinerary_hash };
-	RBShell *shell;
-	RhythmDB *db;
-	g_object_get (priv->source, "shell", &shell, NULL);
-	g_object_get (shell, "db", &db, NULL);
-	
-	query_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty(db));
-	rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (query_model),
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TYPE, entry_type,
-				RHYTHMDB_QUERY_END);
-	
-	gtk_tree_model_foreach (query_model,
-				(GtkTreeModelForeachFunc) hash_table_insert_from_tree_view_foreach_func,
-				&data);
-	
-	g_object_unref (db);
-	g_object_unref (shell);
+	ItineraryEntry *ie;
+
+	ie = g_hash_table_lookup (priv->itinerary_entries, entry);
+	if (ie == NULL) {
+		ie = g_new0 (ItineraryEntry, 1);
+		g_hash_table_insert (priv->itinerary_entries, rhythmdb_entry_ref (entry), ie);
+		itinerary_entry_refresh (prefs, entry, ie);
+	}
+	ie->refcount++;
 }
 
 static void
-itinerary_insert_some_playlists (RBMediaPlayerPrefs *prefs)
+itinerary_entry_remove (RBMediaPlayerPrefs *prefs, RhythmDBEntry *entry)
 {
 	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	GList *list_iter, *items;
-	GtkTreeModel *query_model;
-	HashTableInsertionData data = { prefs, priv->itinerary_hash };
-	RBShell *shell;
-	
-	g_object_get (priv->source, "shell", &shell, NULL);
-	items = rb_playlist_manager_get_playlists ( (RBPlaylistManager *) rb_shell_get_playlist_manager (shell) );
-	g_object_unref (shell);
-	
-	/* For each playlist in Rhythmbox */
-	for (list_iter = items;
-	     list_iter;
-	     list_iter = list_iter->next )
-	{
-		gchar *name;
-		
-		g_object_get (G_OBJECT (list_iter->data), "name", &name, NULL);
-		
-		/* See if we should sync it */
-		if ( g_hash_table_lookup (priv->sync_playlists_list, name) ) {
-			query_model = GTK_TREE_MODEL (rb_playlist_source_get_query_model (list_iter->data));
-			
-			/* Add the entries to the hash_table */
-			gtk_tree_model_foreach (query_model,
-						(GtkTreeModelForeachFunc) hash_table_insert_from_tree_view_foreach_func,
-						&data);
+	ItineraryEntry *ie;
+
+	ie = g_hash_table_lookup (priv->itinerary_entries, entry);
+	g_assert (ie != NULL);
+
+	if (--ie->refcount > 0)
+		return;
+
+	if (ie->included)
+		itinerary_track_remove (prefs, ie->uuid, entry);
+	g_hash_table_remove (priv->itinerary_entries, entry);
+}
+
+static void
+contributor_add_entry (SyncContributor *contributor, RhythmDBEntry *entry)
+{
+	if (g_hash_table_lookup (contributor->entries, entry) != NULL)
+		return;
+
+	g_hash_table_insert (contributor->entries, entry, entry);
+	itinerary_entry_add (contributor->prefs, entry);
+}
+
+static void
+contributor_remove_entry (SyncContributor *contributor, RhythmDBEntry *entry)
+{
+	if (g_hash_table_remove (contributor->entries, entry))
+		itinerary_entry_remove (contributor->prefs, entry);
+}
+
+static void
+contributor_row_inserted_cb (GtkTreeModel *model,
+			     GtkTreePath *path,
+			     GtkTreeIter *iter,
+			     SyncContributor *contributor)
+{
+	RhythmDBEntry *entry;
+
+	entry = rhythmdb_query_model_iter_to_entry (RHYTHMDB_QUERY_MODEL (model), iter);
+	contributor_add_entry (contributor, entry);
+	rhythmdb_entry_unref (entry);
+}
+
+static void
+contributor_entry_removed_cb (RhythmDBQueryModel *model,
+			      RhythmDBEntry *entry,
+			      SyncContributor *contributor)
+{
+	contributor_remove_entry (contributor, entry);
+}
+
+static gboolean
+contributor_add_row (GtkTreeModel *model,
+		     GtkTreePath *path,
+		     GtkTreeIter *iter,
+		     SyncContributor *contributor)
+{
+	contributor_row_inserted_cb (model, path, iter, contributor);
+	return FALSE;
+}
+
+static void
+contributor_set_model (SyncContributor *contributor, RhythmDBQueryModel *model)
+{
+	if (contributor->model != NULL) {
+		GList *entries, *l;
+
+		g_signal_handlers_disconnect_by_func (contributor->model,
+						      G_CALLBACK (contributor_row_inserted_cb),
+						      contributor);
+		g_signal_handlers_disconnect_by_func (contributor->model,
+						      G_CALLBACK (contributor_entry_removed_cb),
+						      contributor);
+
+		entries = g_hash_table_get_keys (contributor->entries);
+		for (l = entries; l != NULL; l = l->next) {
+			contributor_remove_entry (contributor, l->data);
 		}
-		
-		g_free (name);
+		g_list_free (entries);
+
+		g_object_unref (contributor->model);
+	}
+
+	contributor->model = model;
+
+	if (contributor->model != NULL) {
+		g_object_ref (contributor->model);
+		g_signal_connect (contributor->model,
+				  "row-inserted",
+				  G_CALLBACK (contributor_row_inserted_cb),
+				  contributor);
+		g_signal_connect (contributor->model,
+				  "entry-removed",
+				  G_CALLBACK (contributor_entry_removed_cb),
+				  contributor);
+
+		gtk_tree_model_foreach (GTK_TREE_MODEL (contributor->model),
+					(GtkTreeModelForeachFunc) contributor_add_row,
+					contributor);
 	}
-	
-	g_list_free (items);
 }
 
 static void
-itinerary_insert_some_podcasts (RBMediaPlayerPrefs *prefs)
+contributor_playlist_model_changed_cb (RBPlaylistSource *playlist,
+				       GParamSpec *pspec,
+				       SyncContributor *contributor)
 {
-	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	const gchar **iter;
-	GtkTreeModel *query_model;
-	HashTableInsertionData data = { prefs, priv->itinerary_hash };
-	RBShell *shell;
-	RhythmDB *db;
-	g_object_get (priv->source, "shell", &shell, NULL);
-	g_object_get (shell, "db", &db, NULL);
-	
-	for (iter = (const gchar **) rb_media_player_prefs_get_string_list (prefs, SYNC_PODCASTS_LIST);
-	     *iter != NULL;
-	     iter++)
-	{
+	contributor_set_model (contributor, rb_playlist_source_get_query_model (playlist));
+}
+
+static void
+contributor_free (SyncContributor *contributor)
+{
+	rb_debug ("no longer syncing %s", contributor->key);
+
+	if (contributor->playlist != NULL) {
+		g_signal_handlers_disconnect_by_func (contributor->playlist,
+						      G_CALLBACK (contributor_playlist_model_changed_cb),
+						      contributor);
+		g_object_unref (contributor->playlist);
+	}
+	contributor_set_model (contributor, NULL);
+
+	g_hash_table_destroy (contributor->entries);
+	g_free (contributor->key);
+	g_free (contributor);
+}
 
-		query_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty(db));
+static RhythmDBQueryModel *
+query_entries (RhythmDB *db, RhythmDBEntryType entry_type, const char *album)
+{
+	RhythmDBQueryModel *query_model;
+
+	query_model = rhythmdb_query_model_new_empty (db);
+	if (album == NULL) {
+		rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (query_model),
+					RHYTHMDB_QUERY_PROP_EQUALS,
+					RHYTHMDB_PROP_TYPE, entry_type,
+					RHYTHMDB_QUERY_END);
+	} else {
 		rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (query_model),
 					RHYTHMDB_QUERY_PROP_EQUALS,
-					RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_PODCAST_POST,
+					RHYTHMDB_PROP_TYPE, entry_type,
 					RHYTHMDB_QUERY_PROP_EQUALS,
-					RHYTHMDB_PROP_ALBUM, *iter,
+					RHYTHMDB_PROP_ALBUM, album,
 					RHYTHMDB_QUERY_END);
-		
-		gtk_tree_model_foreach (query_model,
-					(GtkTreeModelForeachFunc) hash_table_insert_from_tree_view_foreach_func,
-					&data);
 	}
-	
-	g_object_unref (db);
-	g_object_unref (shell);
+
+	return query_model;
 }
 
+/* Marks a contributor as wanted, creating it if it doesn't exist yet.
+ * Contributors are either playlists or queries on entry type and album.
+ */
 static void
-build_itinerary_hash_table (RBMediaPlayerPrefs *prefs)
+want_contributor (RBMediaPlayerPrefs *prefs,
+		  GHashTable *wanted,
+		  const char *key,
+		  RBPlaylistSource *playlist,
+		  RhythmDBEntryType entry_type,
+		  const char *album)
 {
 	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	
-	if (priv->itinerary_hash != NULL) {
-		g_hash_table_unref (priv->itinerary_hash);
-		priv->itinerary_hash = NULL;
+	SyncContributor *contributor;
+	RhythmDBQueryModel *model;
+
+	contributor = g_hash_table_lookup (priv->contributors, key);
+	if (contributor != NULL && contributor->playlist != playlist) {
+		/* a different playlist with the same name */
+		g_hash_table_remove (priv->contributors, key);
+		contributor = NULL;
 	}
-	
-	priv->itinerary_hash = g_hash_table_new (g_str_hash, g_str_equal);
-	
+
+	if (contributor == NULL) {
+		rb_debug ("syncing %s", key);
+		contributor = g_new0 (SyncContributor, 1);
+		contributor->prefs = prefs;
+		contributor->key = g_strdup (key);
+		contributor->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+		g_hash_table_insert (priv->contributors, contributor->key, contributor);
+
+		if (playlist != NULL) {
+			contributor->playlist = g_object_ref (playlist);
+			g_signal_connect (playlist,
+					  "notify::query-model",
+					  G_CALLBACK (contributor_playlist_model_changed_cb),
+					  contributor);
+			contributor_set_model (contributor, rb_playlist_source_get_query_model (playlist));
+		} else {
+			model = query_entries (priv->db, entry_type, album);
+			contributor_set_model (contributor, model);
+			g_object_unref (model);
+		}
+	}
+
+	g_hash_table_insert (wanted, contributor->key, contributor);
+}
+
+static gboolean
+contributor_unwanted (const char *key, SyncContributor *contributor, GHashTable *wanted)
+{
+	return (g_hash_table_lookup (wanted, key) == NULL);
+}
+
+/* Works out which contributors the sync settings call for, adding the
+ * missing ones and dropping the ones no longer wanted.
+ */
+static void
+update_contributors (RBMediaPlayerPrefs *prefs)
+{
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	GHashTable *wanted;
+	char *key;
+
+	wanted = g_hash_table_new (g_str_hash, g_str_equal);
+
 	if (priv->sync_music) {
 		if (priv->sync_music_all) {
 			/* Syncing all songs */
-			itinerary_insert_all_of_type (prefs,
-						      RHYTHMDB_ENTRY_TYPE_SONG);
+			want_contributor (prefs, wanted, "songs", NULL, RHYTHMDB_ENTRY_TYPE_SONG, NULL);
 		} else {
 			/* Only syncing some songs */
-			itinerary_insert_some_playlists (prefs);
+			GList *items, *l;
+			RBShell *shell;
+
+			g_object_get (priv->source, "shell", &shell, NULL);
+			items = rb_playlist_manager_get_playlists ( (RBPlaylistManager *) rb_shell_get_playlist_manager (shell) );
+			g_object_unref (shell);
+
+			for (l = items; l != NULL; l = l->next) {
+				gchar *name;
+
+				g_object_get (G_OBJECT (l->data), "name", &name, NULL);
+				if (g_hash_table_lookup (priv->sync_playlists_list, name)) {
+					key = g_strdup_printf ("playlist:%s", name);
+					want_contributor (prefs, wanted, key, l->data, NULL, NULL);
+					g_free (key);
+				}
+				g_free (name);
+			}
+			g_list_free (items);
 		}
 	}
-	
+
 	if (priv->sync_podcasts) {
 		if (priv->sync_podcasts_all) {
 			/* Syncing all podcasts */
-			itinerary_insert_all_of_type (prefs,
-						       RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
+			want_contributor (prefs, wanted, "podcasts", NULL, RHYTHMDB_ENTRY_TYPE_PODCAST_POST, NULL);
 		} else {
 			/* Only syncing some podcasts */
-			itinerary_insert_some_podcasts (prefs);
+			GHashTableIter iter;
+			gpointer feed;
+
+			g_hash_table_iter_init (&iter, priv->sync_podcasts_list);
+			while (g_hash_table_iter_next (&iter, &feed, NULL)) {
+				key = g_strdup_printf ("podcast:%s", (const char *) feed);
+				want_contributor (prefs, wanted, key, NULL, RHYTHMDB_ENTRY_TYPE_PODCAST_POST, feed);
+				g_free (key);
+			}
 		}
 	}
+
+	g_hash_table_foreach_remove (priv->contributors,
+				     (GHRFunc) contributor_unwanted,
+				     wanted);
+	g_hash_table_destroy (wanted);
 }
 
 static void
-build_device_hash_table (RBMediaPlayerPrefs *prefs)
+device_hash_merge (GHashTable *device_hash, GHashTable *tracks)
 {
-	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	
-	if (priv->device_hash != NULL) {
-		g_hash_table_unref (priv->device_hash);
-		priv->device_hash = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, tracks);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		g_hash_table_insert (device_hash,
+				     g_strdup (key),
+				     rhythmdb_entry_ref (value));
 	}
-	
-	priv->device_hash = g_hash_table_new (g_str_hash, g_str_equal);
-	
+	g_hash_table_destroy (tracks);
+}
+
+/* Fetches the set of tracks on the device and applies the differences
+ * from the previous set to the sync lists.
+ */
+static void
+update_device_hash (RBMediaPlayerPrefs *prefs)
+{
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	GHashTable *device_hash;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	device_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, (GDestroyNotify) rhythmdb_entry_unref);
+
 	if (priv->sync_music) {
-		hash_table_duplicate (&priv->device_hash, rb_media_player_source_get_entries (priv->source));
+		device_hash_merge (device_hash, rb_media_player_source_get_entries (priv->source));
 	}
 	
 	if (priv->sync_podcasts) {
-		hash_table_duplicate (&priv->device_hash, rb_media_player_source_get_podcasts (priv->source));
+		device_hash_merge (device_hash, rb_media_player_source_get_podcasts (priv->source));
 	}
+
+	/* tracks no longer on the device */
+	g_hash_table_iter_init (&iter, priv->device_hash);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		ItineraryTrack *track;
+
+		if (g_hash_table_lookup (device_hash, key) != NULL)
+			continue;
+
+		g_hash_table_remove (priv->sync_remove_hash, key);
+		track = g_hash_table_lookup (priv->itinerary_hash, key);
+		if (track != NULL) {
+			g_hash_table_insert (priv->sync_add_hash,
+					     g_strdup (key),
+					     rhythmdb_entry_ref (track->entries->data));
+		}
+	}
+
+	/* tracks now on the device */
+	g_hash_table_iter_init (&iter, device_hash);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (g_hash_table_lookup (priv->itinerary_hash, key) != NULL) {
+			g_hash_table_remove (priv->sync_add_hash, key);
+		} else if (g_hash_table_lookup (priv->sync_remove_hash, key) != value) {
+			g_hash_table_insert (priv->sync_remove_hash,
+					     g_strdup (key),
+					     rhythmdb_entry_ref (value));
+		}
+	}
+
+	g_hash_table_destroy (priv->device_hash);
+	priv->device_hash = device_hash;
 }
 
 static void
-build_sync_list (RBMediaPlayerPrefs *prefs,
-		 enum SyncPrefKey pref_key)
+db_entries_changed_cb (RhythmDB *db, GArray *changes, RBMediaPlayerPrefs *prefs)
+{
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	guint i;
+
+	/* make sure the refreshed entries don't pick up stale UUIDs */
+	rb_media_player_source_track_uuids_changed (priv->source, changes);
+
+	for (i = 0; i < changes->len; i++) {
+		RhythmDBChangedEntry *change = &g_array_index (changes, RhythmDBChangedEntry, i);
+		ItineraryEntry *ie;
+
+		ie = g_hash_table_lookup (priv->itinerary_entries, change->entry);
+		if (ie != NULL)
+			itinerary_entry_refresh (prefs, change->entry, ie);
+	}
+}
+
+static guint64
+rb_media_player_prefs_calculate_space_needed (RBMediaPlayerPrefs *prefs)
 {
 	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
-	HashTableComparisonData comparison_data;
-	GHashTable *this_hash_table;
+	GList * list_iter;
+	priv->sync_space_needed = rb_media_player_source_get_capacity( priv->source )
+					 - rb_media_player_source_get_free_space (priv->source);
 	
-	switch (pref_key) {
-		case SYNC_TO_ADD:
-			this_hash_table = priv->itinerary_hash;
-			comparison_data.other_hash_table = priv->device_hash;
-			break;
-		case SYNC_TO_REMOVE:
-			this_hash_table = priv->device_hash;
-			comparison_data.other_hash_table = priv->itinerary_hash;
-			break;
-		default:
-			g_assert_not_reached();
-			return;
+	for (list_iter = priv->sync_to_add; list_iter; list_iter = list_iter->next) {		
+		priv->sync_space_needed += rhythmdb_entry_get_uint64 ( list_iter->data,
+								       RHYTHMDB_PROP_FILE_SIZE );
 	}
 	
-	comparison_data.list = NULL;
-	g_hash_table_foreach (this_hash_table,
-			      rb_media_player_prefs_hash_table_compare, /* function to add to add list if necessary */
-			      &comparison_data );
-	g_list_free (rb_media_player_prefs_get_list (prefs, pref_key));
-	rb_media_player_prefs_set_list(prefs, pref_key, comparison_data.list);
+	for (list_iter = priv->sync_to_remove; list_iter; list_iter = list_iter->next) {		
+		priv->sync_space_needed -= rhythmdb_entry_get_uint64 ( list_iter->data,
+								       RHYTHMDB_PROP_FILE_SIZE );
+	}
+	
+	return priv->sync_space_needed;
+}
+
+static void
+rb_media_player_prefs_set_property (GObject *object,
+				    guint prop_id,
+				    const GValue *value,
+				    GParamSpec *pspec)
+{
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (object);
+
+	switch (prop_id) {
+	case PROP_SOURCE:
+		priv->source = g_value_dup_object (value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+rb_media_player_prefs_get_property (GObject *object,
+				    guint prop_id,
+				    GValue *value,
+				    GParamSpec *pspec)
+{
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (object);
+
+	switch (prop_id) {
+	case PROP_SOURCE:
+		g_value_set_object (value, priv->source);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
 }
 
 static gboolean
 rb_media_player_prefs_update_sync_helper ( RBMediaPlayerPrefs *prefs )
 {
-	/* Build itinerary_hash */
-	build_itinerary_hash_table (prefs);
+	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+
+	/* Bring the itinerary up to date with the sync settings */
+	update_contributors (prefs);
 	
-	/* Build device_hash */
-	build_device_hash_table (prefs);
+	/* Pick up tracks added to or removed from the device */
+	update_device_hash (prefs);
 	
 	/* Build Addition List */
-	build_sync_list (prefs, SYNC_TO_ADD);
+	g_list_free (priv->sync_to_add);
+	priv->sync_to_add = g_hash_table_get_values (priv->sync_add_hash);
 	
 	/* Build Removal List */
-	build_sync_list (prefs, SYNC_TO_REMOVE);
+	g_list_free (priv->sync_to_remove);
+	priv->sync_to_remove = g_hash_table_get_values (priv->sync_remove_hash);
 	
 	/* Calculate how much space we need */
 	rb_media_player_prefs_calculate_space_needed (prefs);
@@ -662,6 +973,7 @@ rb_media_player_prefs_new (GKeyFile **key_file, GObject *source)
 	g_return_val_if_fail (prefs != NULL, NULL);
 	
 	RBMediaPlayerPrefsPrivate *priv = MEDIA_PLAYER_PREFS_GET_PRIVATE (prefs);
+	RBShell *shell;
 	
 	GError *error = NULL;
 	
@@ -712,6 +1024,14 @@ rb_media_player_prefs_new (GKeyFile **key_file, GObject *source)
 	
 	priv->sync_updated = FALSE;
 	
+	g_object_get (priv->source, "shell", &shell, NULL);
+	g_object_get (shell, "db", &priv->db, NULL);
+	g_object_unref (shell);
+	g_signal_connect (priv->db,
+			  "entries-changed",
+			  G_CALLBACK (db_entries_changed_cb),
+			  prefs);
+	
 	g_assert (priv->updating == NULL);
 	priv->updating = g_mutex_new ();
 	
@@ -36,6 +36,8 @@
 #include "rb-dialog.h"
 #include "rb-debug.h"
 
+typedef struct _RBTrackUUIDCache RBTrackUUIDCache;
+
 typedef struct {
 	RBMediaPlayerPrefs *prefs;
 	
@@ -44,6 +46,8 @@ typedef struct {
 	GMutex *syncing;
 	
 	GtkAction *sync_action;
+
+	RBTrackUUIDCache *track_uuids;
 	
 } RBMediaPlayerSourcePrivate;
 
@@ -80,6 +84,8 @@ static void auto_sync_cb (RhythmDB *db,
 			  RBMediaPlayerSource *source);
 */
 
+static void track_uuid_cache_unref (RBTrackUUIDCache *cache);
+
 enum
 {
 	PROP_0,
@@ -160,6 +166,11 @@ rb_media_player_source_dispose (GObject *object)
 	if (priv->sync_action != NULL) {
 		priv->sync_action = NULL;
 	}
+
+	if (priv->track_uuids != NULL) {
+		track_uuid_cache_unref (priv->track_uuids);
+		priv->track_uuids = NULL;
+	}
 	
 	G_OBJECT_CLASS (rb_media_player_source_parent_class)->dispose (object);
 }
@@ -211,12 +222,137 @@ rb_media_player_source_get_property (GObject *object,
 	}
 }
 
+/* Track UUIDs are needed for every track whenever the sync lists are
+ * updated, and computing one means formatting and hashing a string, so
+ * they are cached until one of the properties they're made from changes.
+ * The cache is attached to the database and shared by all media player
+ * sources using it; it goes away when the last of them is disposed.
+ * It is only used from the main thread.
+ */
+#define TRACK_UUID_CACHE_KEY	"rb-media-player-track-uuid-cache"
+
+struct _RBTrackUUIDCache {
+	RhythmDB *db;
+	GHashTable *uuids;
+	guint refcount;
+};
+
+static gboolean
+track_uuid_prop (RhythmDBPropType prop)
+{
+	switch (prop) {
+	case RHYTHMDB_PROP_TITLE:
+	case RHYTHMDB_PROP_ARTIST:
+	case RHYTHMDB_PROP_GENRE:
+	case RHYTHMDB_PROP_ALBUM:
+	case RHYTHMDB_PROP_FILE_SIZE:
+	case RHYTHMDB_PROP_DURATION:
+	case RHYTHMDB_PROP_TRACK_NUMBER:
+	case RHYTHMDB_PROP_DISC_NUMBER:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+track_uuid_cache_invalidate (RBTrackUUIDCache *cache, GArray *changes)
+{
+	guint i;
+
+	for (i = 0; i < changes->len; i++) {
+		RhythmDBChangedEntry *change = &g_array_index (changes, RhythmDBChangedEntry, i);
+		GSList *l;
+
+		for (l = change->changes; l != NULL; l = l->next) {
+			RhythmDBEntryChange *c = l->data;
+			if (track_uuid_prop (c->prop)) {
+				g_hash_table_remove (cache->uuids, change->entry);
+				break;
+			}
+		}
+	}
+}
+
+static void
+track_uuid_entries_changed_cb (RhythmDB *db, GArray *changes, RBTrackUUIDCache *cache)
+{
+	track_uuid_cache_invalidate (cache, changes);
+}
+
+static void
+track_uuid_entries_deleted_cb (RhythmDB *db, GPtrArray *entries, RBTrackUUIDCache *cache)
+{
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		g_hash_table_remove (cache->uuids, g_ptr_array_index (entries, i));
+	}
+}
+
+static void
+track_uuid_cache_free (RBTrackUUIDCache *cache)
+{
+	g_signal_handlers_disconnect_by_func (cache->db,
+					      G_CALLBACK (track_uuid_entries_changed_cb),
+					      cache);
+	g_signal_handlers_disconnect_by_func (cache->db,
+					      G_CALLBACK (track_uuid_entries_deleted_cb),
+					      cache);
+	g_hash_table_destroy (cache->uuids);
+	g_free (cache);
+}
+
+static RBTrackUUIDCache *
+track_uuid_cache_ref (RBMediaPlayerSource *source)
+{
+	RBTrackUUIDCache *cache;
+	RBShell *shell;
+	RhythmDB *db;
+
+	g_object_get (source, "shell", &shell, NULL);
+	g_object_get (shell, "db", &db, NULL);
+	g_object_unref (shell);
+
+	cache = g_object_get_data (G_OBJECT (db), TRACK_UUID_CACHE_KEY);
+	if (cache == NULL) {
+		cache = g_new0 (RBTrackUUIDCache, 1);
+		cache->db = db;
+		cache->uuids = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						      (GDestroyNotify) rhythmdb_entry_unref,
+						      g_free);
+
+		g_signal_connect (db, "entries-changed",
+				  G_CALLBACK (track_uuid_entries_changed_cb), cache);
+		g_signal_connect (db, "entries-deleted",
+				  G_CALLBACK (track_uuid_entries_deleted_cb), cache);
+
+		g_object_set_data_full (G_OBJECT (db), TRACK_UUID_CACHE_KEY,
+					cache, (GDestroyNotify) track_uuid_cache_free);
+	}
+	cache->refcount++;
+
+	g_object_unref (db);
+	return cache;
+}
+
+static void
+track_uuid_cache_unref (RBTrackUUIDCache *cache)
+{
+	if (--cache->refcount == 0) {
+		/* this frees the cache */
+		g_object_set_data (G_OBJECT (cache->db), TRACK_UUID_CACHE_KEY, NULL);
+	}
+}
+
 /* Must be called in the 'instance_init' method of any children */
 void
 rb_media_player_source_load		(RBMediaPlayerSource *source)
 {
 	RBMediaPlayerSourcePrivate *priv = MEDIA_PLAYER_SOURCE_GET_PRIVATE (source);
 	
+	priv->track_uuids = track_uuid_cache_ref (source);
+	
 	priv->prefs = rb_media_player_prefs_new ( priv->key_file,
 						  G_OBJECT (source) );
 	
@@ -630,3 +766,54 @@ rb_media_player_source_track_uuid  (RhythmDBEntry *entry)
 	return result;
 }
 
+/**
+ * rb_media_player_source_get_track_uuid:
+ * @source: the #RBMediaPlayerSource
+ * @entry: the #RhythmDBEntry
+ *
+ * Returns the same UUID as rb_media_player_source_track_uuid, but
+ * caches it until one of the properties it is made from changes.
+ *
+ * Return value: the UUID of the entry, to be freed by the caller
+ */
+gchar *
+rb_media_player_source_get_track_uuid (RBMediaPlayerSource *source, RhythmDBEntry *entry)
+{
+	RBMediaPlayerSourcePrivate *priv = MEDIA_PLAYER_SOURCE_GET_PRIVATE (source);
+	const char *cached;
+	gchar *result;
+
+	if (priv->track_uuids == NULL)
+		return rb_media_player_source_track_uuid (entry);
+
+	cached = g_hash_table_lookup (priv->track_uuids->uuids, entry);
+	if (cached != NULL)
+		return g_strdup (cached);
+
+	result = rb_media_player_source_track_uuid (entry);
+	g_hash_table_insert (priv->track_uuids->uuids,
+			     rhythmdb_entry_ref (entry),
+			     g_strdup (result));
+	return result;
+}
+
+/**
+ * rb_media_player_source_track_uuids_changed:
+ * @source: the #RBMediaPlayerSource
+ * @changes: a #GArray of #RhythmDBChangedEntry from the database's
+ *   entries-changed signal
+ *
+ * Drops cached UUIDs of entries whose UUID properties have changed.
+ * The cache does this itself when the database emits the changes, but
+ * handlers of the same signal that need up to date UUIDs can't rely on
+ * running after it, so they should call this first.
+ */
+void
+rb_media_player_source_track_uuids_changed (RBMediaPlayerSource *source, GArray *changes)
+{
+	RBMediaPlayerSourcePrivate *priv = MEDIA_PLAYER_SOURCE_GET_PRIVATE (source);
+
+	if (priv->track_uuids != NULL)
+		track_uuid_cache_invalidate (priv->track_uuids, changes);
+}
+
@@ -103,6 +103,10 @@ void	rb_media_player_source_show_properties (RBMediaPlayerSource *source);
 void	rb_media_player_source_sync (RBMediaPlayerSource *source);
 
 gchar *	rb_media_player_source_track_uuid (RhythmDBEntry *entry);
+gchar *	rb_media_player_source_get_track_uuid (RBMediaPlayerSource *source,
+					       RhythmDBEntry *entry);
+void	rb_media_player_source_track_uuids_changed (RBMediaPlayerSource *source,
+						    GArray *changes);
 
 G_END_DECLS
 
@@ -229,6 +229,9 @@ static void rb_podcast_source_entry_changed_cb	(RhythmDB *db,
 						 RhythmDBEntry *entry,
 						 GSList *changes,
 						 RBPodcastSource *source);
+static void rb_podcast_source_entries_changed_cb (RhythmDB *db,
+						 GArray *changed,
+						 RBPodcastSource *source);
 static void rb_podcast_source_pixbuf_clicked_cb	(RBCellRendererPixbuf *renderer,
 						 const char *path,
 						 RBPodcastSource *source);
@@ -714,8 +717,8 @@ rb_podcast_source_constructor (GType type,
 
 	/* redraw error indicator when errors are set or cleared */
 	g_signal_connect_object (source->priv->db,
-				 "entry_changed",
-				 G_CALLBACK (rb_podcast_source_entry_changed_cb),
+				 "entries_changed",
+				 G_CALLBACK (rb_podcast_source_entries_changed_cb),
 				 source, 0);
 
 	/* title column */
@@ -2115,6 +2118,19 @@ rb_podcast_source_entry_changed_cb (RhythmDB *db,
 	}
 }
 
+static void
+rb_podcast_source_entries_changed_cb (RhythmDB *db,
+				      GArray *changed,
+				      RBPodcastSource *source)
+{
+	guint i;
+
+	for (i = 0; i < changed->len; i++) {
+		RhythmDBChangedEntry *c = &g_array_index (changed, RhythmDBChangedEntry, i);
+		rb_podcast_source_entry_changed_cb (db, c->entry, c->changes, source);
+	}
+}
+
 static void
 rb_podcast_source_pixbuf_clicked_cb (RBCellRendererPixbuf *renderer,
 				     const char *path_string,
@@ -363,21 +363,7 @@ impl_paste (RBSource *source, GList *entries)
 			goto impl_paste_end;
 		}
 
-		entry_mime = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_MIMETYPE);
-		/* hackish mapping of gstreamer media types to mime types; this
-		 * should be easier when we do proper (deep) typefinding.
-		 */
-		if (strcmp (entry_mime, "audio/x-wav") == 0) {
-			/* if it has a bitrate, assume it's mp3-in-wav */
-			if (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_BITRATE) != 0)
-				entry_mime = "audio/mpeg";
-		} else if (strcmp (entry_mime, "audio/x-m4a") == 0) {
-			entry_mime = "audio/aac";
-		} else if (strcmp (entry_mime, "application/x-id3") == 0) {
-			entry_mime = "audio/mpeg";
-		} else if (strcmp (entry_mime, "audio/x-flac") == 0) {
-			entry_mime = "audio/flac";
-		}
+		entry_mime = rb_encoder_get_media_type (entry);
 
 		mime_types = rb_removable_media_source_get_mime_types (RB_REMOVABLE_MEDIA_SOURCE (source));
 		if (mime_types != NULL && !rb_string_list_contains (mime_types, entry_mime)) {
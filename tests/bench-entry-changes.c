@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+
+#include "bench-utils.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-model.h"
+
+#define NUM_ENTRIES	50000
+#define NUM_MODELS	4
+#define NUM_LISTENERS	8
+
+static guint changed_entries = 0;
+
+static GPtrArray *
+create_entries (RhythmDB *db)
+{
+	GPtrArray *entries;
+	guint i;
+
+	entries = g_ptr_array_sized_new (NUM_ENTRIES);
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/%u.ogg", i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, g_strdup_printf ("Track %u", i));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, g_strdup_printf ("Artist %u", i % 500));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, g_strdup_printf ("Album %u", i % 4000));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DURATION, 60 + (i * 37) % 540);
+
+		g_ptr_array_add (entries, entry);
+	}
+	rhythmdb_commit (db);
+	bench_drain_main_loop ();
+	return entries;
+}
+
+static void
+entry_changed_cb (RhythmDB *db, RhythmDBEntry *entry, GSList *changes, gpointer data)
+{
+	changed_entries++;
+}
+
+static void
+entries_changed_cb (RhythmDB *db, GArray *changed, gpointer data)
+{
+	changed_entries += changed->len;
+}
+
+static void
+bench_changes (RhythmDB *db, GPtrArray *entries, const char *name, guint round)
+{
+	GTimer *timer;
+	double elapsed;
+	guint i;
+
+	changed_entries = 0;
+	for (i = 0; i < entries->len; i++) {
+		bench_set_entry_ulong (db, g_ptr_array_index (entries, i), RHYTHMDB_PROP_PLAY_COUNT, round * NUM_ENTRIES + i + 1);
+	}
+	rhythmdb_commit (db);
+
+	timer = g_timer_new ();
+	bench_drain_main_loop ();
+	elapsed = g_timer_elapsed (timer, NULL);
+
+	g_print ("%s: %u entries changed, %u deliveries, %.1fms in the main loop\n",
+		 name, entries->len, changed_entries, elapsed * 1000.0);
+	g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	GPtrArray *entries;
+	RhythmDBQueryModel *models[NUM_MODELS];
+	GPtrArray *query;
+	gulong handlers[NUM_LISTENERS];
+	int i;
+
+	bench_init (&argc, &argv);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+
+	rb_profile_start ("creating entries");
+	entries = create_entries (db);
+	rb_profile_end ("creating entries");
+
+	/* a few query models, as the library, a playlist and the play queue would have */
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+				      RHYTHMDB_QUERY_END);
+	for (i = 0; i < NUM_MODELS; i++) {
+		models[i] = rhythmdb_query_model_new_empty (db);
+		rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (models[i]), query);
+	}
+	rhythmdb_query_free (query);
+	bench_drain_main_loop ();
+
+	bench_changes (db, entries, "query models only", 0);
+
+	/* listeners using the batched signal */
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		handlers[i] = g_signal_connect (db, "entries-changed", G_CALLBACK (entries_changed_cb), NULL);
+	}
+	bench_changes (db, entries, "batched listeners", 1);
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		g_signal_handler_disconnect (db, handlers[i]);
+	}
+
+	/* the same listeners using the per-entry signal */
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		handlers[i] = g_signal_connect (db, "entry-changed", G_CALLBACK (entry_changed_cb), NULL);
+	}
+	bench_changes (db, entries, "per-entry listeners", 2);
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		g_signal_handler_disconnect (db, handlers[i]);
+	}
+
+	for (i = 0; i < NUM_MODELS; i++) {
+		g_object_unref (models[i]);
+	}
+	g_ptr_array_free (entries, TRUE);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	bench_shutdown ();
+	return 0;
+}
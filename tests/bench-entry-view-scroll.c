@@ -0,0 +1,205 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-utils.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-model.h"
+#include "rb-entry-view.h"
+
+#define NUM_ENTRIES	100000
+
+/* how many rows to scroll back and forth over for the repeated pass */
+#define REPEAT_ROWS	1000
+#define REPEAT_PASSES	10
+
+static const RBEntryViewColumn columns[] = {
+	RB_ENTRY_VIEW_COL_TRACK_NUMBER,
+	RB_ENTRY_VIEW_COL_TITLE,
+	RB_ENTRY_VIEW_COL_ARTIST,
+	RB_ENTRY_VIEW_COL_ALBUM,
+	RB_ENTRY_VIEW_COL_DURATION,
+	RB_ENTRY_VIEW_COL_YEAR,
+	RB_ENTRY_VIEW_COL_QUALITY,
+	RB_ENTRY_VIEW_COL_PLAY_COUNT,
+	RB_ENTRY_VIEW_COL_LOCATION,
+};
+
+static void
+create_entries (RhythmDB *db, guint n_entries)
+{
+	guint i;
+
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+
+		/* escaped characters in the location, so unescaping does some work */
+		uri = g_strdup_printf ("file:///bench/Artist%%20%u/Album%%20%u/%02u%%20Track%%20%u.ogg",
+				       i % 3000, i % 25000, 1 + i % 14, i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, g_strdup_printf ("Track %u", i));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, g_strdup_printf ("Artist %u", i % 3000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, g_strdup_printf ("Album %u", i % 25000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_MIMETYPE, g_strdup ("audio/x-vorbis"));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, 1 + i % 14);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DURATION, 60 + (i * 37) % 540);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, (i * 13) % 100);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_BITRATE, 128 + 32 * (i % 6));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DATE, 700000 + (i * 31) % 10000);
+	}
+	rhythmdb_commit (db);
+}
+
+/* scrolls from 'from' to 'to' in steps of 'step' (all in rows), redrawing the view each time */
+static guint
+scroll_view (GtkAdjustment *adjustment, GtkWidget *window, double row_height, int from, int to, int step)
+{
+	guint steps = 0;
+	int row;
+
+	for (row = from; (step > 0) ? (row <= to) : (row >= to); row += step) {
+		double value;
+
+		value = MIN (row * row_height, adjustment->upper - adjustment->page_size);
+		gtk_adjustment_set_value (adjustment, value);
+		gdk_window_process_updates (window->window, TRUE);
+		bench_drain_main_loop ();
+		steps++;
+	}
+
+	return steps;
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	RhythmDBQueryModel *model;
+	RBEntryView *view;
+	GtkWidget *window;
+	GtkAdjustment *adjustment;
+	GPtrArray *query;
+	GTimer *timer;
+	double row_height;
+	double elapsed;
+	guint n_entries = NUM_ENTRIES;
+	guint n_rows;
+	guint page_rows;
+	guint steps;
+	guint i;
+
+	bench_init (&argc, &argv);
+
+	if (argc > 1)
+		n_entries = strtoul (argv[1], NULL, 10);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+
+	rb_profile_start ("creating entries");
+	create_entries (db, n_entries);
+	bench_drain_main_loop ();
+	rb_profile_end ("creating entries");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+				      RHYTHMDB_QUERY_END);
+	model = rhythmdb_query_model_new_empty (db);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+	bench_drain_main_loop ();
+
+	view = rb_entry_view_new (db, NULL, NULL, FALSE, FALSE);
+	for (i = 0; i < G_N_ELEMENTS (columns); i++) {
+		rb_entry_view_append_column (view, columns[i], TRUE);
+	}
+	rb_entry_view_set_model (view, model);
+
+	/* realize the view in a window placed off the screen, so it's
+	 * actually drawn without getting in anyone's way.
+	 */
+	window = gtk_window_new (GTK_WINDOW_POPUP);
+	gtk_window_set_default_size (GTK_WINDOW (window), 800, 600);
+	gtk_window_move (GTK_WINDOW (window), -10000, -10000);
+	gtk_container_add (GTK_CONTAINER (window), GTK_WIDGET (view));
+	gtk_widget_show_all (window);
+	gdk_window_process_updates (window->window, TRUE);
+	bench_drain_main_loop ();
+
+	adjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (view));
+	n_rows = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	row_height = adjustment->upper / MAX (n_rows, 1);
+	page_rows = MAX (adjustment->page_size / row_height, 1);
+
+	g_print ("%u rows, %u rows per page\n", n_rows, page_rows);
+	timer = g_timer_new ();
+
+	/* scroll through the whole view a quarter page at a time */
+	g_timer_start (timer);
+	steps = scroll_view (adjustment, window, row_height, 0, n_rows, MAX (page_rows / 4, 1));
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("full scroll: %u steps, %.1fms (%.3fms per step)\n",
+		 steps, elapsed * 1000.0, elapsed * 1000.0 / steps);
+
+	/* scroll back and forth over the same rows, a line at a time */
+	g_timer_start (timer);
+	steps = 0;
+	for (i = 0; i < REPEAT_PASSES; i++) {
+		steps += scroll_view (adjustment, window, row_height, 0, REPEAT_ROWS, 1);
+		steps += scroll_view (adjustment, window, row_height, REPEAT_ROWS, 0, -1);
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("repeated scroll over %d rows: %u steps, %.1fms (%.3fms per step)\n",
+		 REPEAT_ROWS, steps, elapsed * 1000.0, elapsed * 1000.0 / steps);
+
+	g_timer_destroy (timer);
+
+	gtk_widget_destroy (window);
+	g_object_unref (model);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	GDK_THREADS_LEAVE ();
+
+	bench_shutdown ();
+	return 0;
+}
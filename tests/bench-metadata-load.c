@@ -0,0 +1,215 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+#include "config.h"
+
+#include <glib.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rb-debug.h"
+#include "rb-metadata.h"
+
+#define DEFAULT_NUM_FILES	500
+#define BATCH_SIZE		64
+
+/* a short, silent, mono 16 bit 8kHz wav file */
+#define SAMPLE_RATE		8000
+#define NUM_SAMPLES		(SAMPLE_RATE / 10)
+
+static void
+put_le32 (guchar *p, guint32 v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void
+put_le16 (guchar *p, guint16 v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static char **
+create_files (const char *dir, guint n)
+{
+	char **uris;
+	guchar *data;
+	gsize data_size;
+	guint i;
+
+	data_size = 44 + NUM_SAMPLES * 2;
+	data = g_malloc0 (data_size);
+	memcpy (data, "RIFF", 4);
+	put_le32 (data + 4, data_size - 8);
+	memcpy (data + 8, "WAVEfmt ", 8);
+	put_le32 (data + 16, 16);
+	put_le16 (data + 20, 1);		/* PCM */
+	put_le16 (data + 22, 1);		/* channels */
+	put_le32 (data + 24, SAMPLE_RATE);
+	put_le32 (data + 28, SAMPLE_RATE * 2);	/* byte rate */
+	put_le16 (data + 32, 2);		/* block align */
+	put_le16 (data + 34, 16);		/* bits per sample */
+	memcpy (data + 36, "data", 4);
+	put_le32 (data + 40, NUM_SAMPLES * 2);
+
+	uris = g_new0 (char *, n + 1);
+	for (i = 0; i < n; i++) {
+		char *name;
+		char *path;
+
+		name = g_strdup_printf ("%05u.wav", i);
+		path = g_build_filename (dir, name, NULL);
+		if (!g_file_set_contents (path, (char *) data, data_size, NULL))
+			g_error ("couldn't create %s", path);
+
+		uris[i] = g_filename_to_uri (path, NULL, NULL);
+		g_free (name);
+		g_free (path);
+	}
+
+	g_free (data);
+	return uris;
+}
+
+static void
+delete_files (const char *dir, char **uris)
+{
+	int i;
+
+	for (i = 0; uris[i] != NULL; i++) {
+		char *path;
+
+		path = g_filename_from_uri (uris[i], NULL, NULL);
+		g_unlink (path);
+		g_free (path);
+	}
+	g_rmdir (dir);
+}
+
+static void
+count_result (RBMetaData *md, const char *uri, const GError *error, guint *n_errors)
+{
+	if (error != NULL)
+		(*n_errors)++;
+}
+
+static void
+report (const char *name, guint n, guint n_errors, double elapsed)
+{
+	g_print ("%s: %u files in %.2fs, %.1f files/s", name, n, elapsed, n / elapsed);
+	if (n_errors > 0)
+		g_print (" (%u errors)", n_errors);
+	g_print ("\n");
+}
+
+static void
+bench_single (RBMetaData *md, char **uris, guint n)
+{
+	GTimer *timer;
+	guint n_errors = 0;
+	guint i;
+
+	timer = g_timer_new ();
+	for (i = 0; i < n; i++) {
+		GError *error = NULL;
+
+		rb_metadata_load (md, uris[i], &error);
+		if (error != NULL) {
+			n_errors++;
+			g_error_free (error);
+		}
+	}
+	report ("single", n, n_errors, g_timer_elapsed (timer, NULL));
+	g_timer_destroy (timer);
+}
+
+static void
+bench_batched (RBMetaData *md, char **uris, guint n)
+{
+	GTimer *timer;
+	guint n_errors = 0;
+	guint i;
+
+	timer = g_timer_new ();
+	for (i = 0; i < n; i += BATCH_SIZE) {
+		char **batch;
+		guint len;
+
+		len = MIN (BATCH_SIZE, n - i);
+		batch = g_new0 (char *, len + 1);
+		memcpy (batch, uris + i, len * sizeof (char *));
+		rb_metadata_load_batch (md, batch, (RBMetaDataBatchFunc) count_result, &n_errors);
+		g_free (batch);
+	}
+	report ("batched", n, n_errors, g_timer_elapsed (timer, NULL));
+	g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+	RBMetaData *md;
+	char *dir;
+	char **uris;
+	guint n;
+
+	g_thread_init (NULL);
+	g_type_init ();
+	rb_debug_init (FALSE);
+
+	n = DEFAULT_NUM_FILES;
+	if (argc > 1)
+		n = strtoul (argv[1], NULL, 10);
+
+	/* compare the per-file overhead of the two methods on a single helper */
+	g_setenv ("RB_METADATA_HELPERS", "1", TRUE);
+
+	dir = g_build_filename (g_get_tmp_dir (), "bench-metadata-load-XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("couldn't create temporary directory");
+	uris = create_files (dir, n);
+
+	md = rb_metadata_new ();
+
+	/* start the helper before timing anything */
+	rb_metadata_load (md, uris[0], NULL);
+
+	bench_single (md, uris, n);
+	bench_batched (md, uris, n);
+
+	g_object_unref (md);
+	delete_files (dir, uris);
+	g_strfreev (uris);
+	g_free (dir);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-utils.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-model.h"
+
+#define NUM_ENTRIES	300000
+
+static const char *genres[] = {
+	"Rock", "Pop", "Jazz", "Classical", "Electronic", "Folk", "Hip Hop", "Metal"
+};
+
+static const char *mimetypes[] = {
+	"audio/x-vorbis", "audio/mpeg", "audio/x-flac"
+};
+
+static const struct {
+	const char *name;
+	GCompareDataFunc func;
+	RhythmDBPropType propid;
+} sort_funcs[] = {
+	{ "location", (GCompareDataFunc) rhythmdb_query_model_location_sort_func, RHYTHMDB_PROP_LOCATION },
+	{ "title", (GCompareDataFunc) rhythmdb_query_model_title_sort_func, RHYTHMDB_PROP_TITLE_SORT_KEY },
+	{ "string (title)", (GCompareDataFunc) rhythmdb_query_model_string_sort_func, RHYTHMDB_PROP_TITLE_SORT_KEY },
+	{ "album", (GCompareDataFunc) rhythmdb_query_model_album_sort_func, RHYTHMDB_PROP_ALBUM_SORT_KEY },
+	{ "artist", (GCompareDataFunc) rhythmdb_query_model_artist_sort_func, RHYTHMDB_PROP_ARTIST_SORT_KEY },
+	{ "genre", (GCompareDataFunc) rhythmdb_query_model_genre_sort_func, RHYTHMDB_PROP_GENRE_SORT_KEY },
+	{ "track", (GCompareDataFunc) rhythmdb_query_model_track_sort_func, RHYTHMDB_PROP_TRACK_NUMBER },
+	{ "rating", (GCompareDataFunc) rhythmdb_query_model_double_ceiling_sort_func, RHYTHMDB_PROP_RATING },
+	{ "play count", (GCompareDataFunc) rhythmdb_query_model_ulong_sort_func, RHYTHMDB_PROP_PLAY_COUNT },
+	{ "duration", (GCompareDataFunc) rhythmdb_query_model_ulong_sort_func, RHYTHMDB_PROP_DURATION },
+	{ "bitrate", (GCompareDataFunc) rhythmdb_query_model_bitrate_sort_func, RHYTHMDB_PROP_BITRATE },
+	{ "date", (GCompareDataFunc) rhythmdb_query_model_date_sort_func, RHYTHMDB_PROP_DATE },
+};
+
+static void
+create_entries (RhythmDB *db, guint n_entries)
+{
+	guint i;
+
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+
+		/* scramble the locations so the initial order isn't sorted */
+		uri = g_strdup_printf ("file:///bench/%u.ogg", (i * 7919) % n_entries);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, g_strdup_printf ("Track %u", i % 20000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, g_strdup_printf ("Artist %u", i % 3000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, g_strdup_printf ("Album %u", i % 25000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, g_strdup (genres[i % G_N_ELEMENTS (genres)]));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_MIMETYPE, g_strdup (mimetypes[i % G_N_ELEMENTS (mimetypes)]));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, 1 + i % 14);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DISC_NUMBER, i % 3);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DURATION, 60 + (i * 37) % 540);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, (i * 13) % 100);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_BITRATE, 128 + 32 * (i % 6));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DATE, 700000 + (i * 31) % 10000);
+		bench_set_entry_double (db, entry, RHYTHMDB_PROP_RATING, (i % 11) / 2.0);
+	}
+	rhythmdb_commit (db);
+}
+
+static GPtrArray *
+model_entries (RhythmDBQueryModel *model)
+{
+	GPtrArray *entries;
+	GtkTreeIter iter;
+	gboolean valid;
+
+	entries = g_ptr_array_new ();
+	valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (model), &iter);
+	while (valid) {
+		RhythmDBEntry *entry;
+
+		entry = rhythmdb_query_model_iter_to_entry (model, &iter);
+		g_ptr_array_add (entries, entry);
+		rhythmdb_entry_unref (entry);
+
+		valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (model), &iter);
+	}
+	return entries;
+}
+
+static void
+bench_sort (RhythmDBQueryModel *model, guint i)
+{
+	GPtrArray *before, *after;
+	GSequence *sequence;
+	GSequenceIter *ptr;
+	GTimer *timer;
+	gpointer sort_data;
+	double inserted, bulk;
+	guint mismatches;
+	guint j;
+
+	sort_data = GINT_TO_POINTER (sort_funcs[i].propid);
+	before = model_entries (model);
+	timer = g_timer_new ();
+
+	/* the old way: insert each entry into a new sequence */
+	g_timer_start (timer);
+	sequence = g_sequence_new (NULL);
+	for (j = 0; j < before->len; j++) {
+		g_sequence_insert_sorted (sequence, g_ptr_array_index (before, j),
+					  sort_funcs[i].func, sort_data);
+	}
+	inserted = g_timer_elapsed (timer, NULL);
+
+	g_timer_start (timer);
+	rhythmdb_query_model_set_sort_order (model, sort_funcs[i].func, sort_data, NULL, FALSE);
+	bulk = g_timer_elapsed (timer, NULL);
+
+	/* both should produce the same order */
+	after = model_entries (model);
+	mismatches = 0;
+	ptr = g_sequence_get_begin_iter (sequence);
+	for (j = 0; j < after->len; j++) {
+		if (g_sequence_get (ptr) != g_ptr_array_index (after, j))
+			mismatches++;
+		ptr = g_sequence_iter_next (ptr);
+	}
+
+	g_print ("%s: inserted %.1fms, bulk %.1fms (%.2fx)\n",
+		 sort_funcs[i].name, inserted * 1000.0, bulk * 1000.0, inserted / bulk);
+	if (mismatches > 0)
+		g_warning ("%s: %u entries sorted differently", sort_funcs[i].name, mismatches);
+
+	g_sequence_free (sequence);
+	g_ptr_array_free (before, TRUE);
+	g_ptr_array_free (after, TRUE);
+	g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	RhythmDBQueryModel *model;
+	GPtrArray *query;
+	guint n_entries = NUM_ENTRIES;
+	guint i;
+
+	bench_init (&argc, &argv);
+
+	if (argc > 1)
+		n_entries = strtoul (argv[1], NULL, 10);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+
+	rb_profile_start ("creating entries");
+	create_entries (db, n_entries);
+	bench_drain_main_loop ();
+	rb_profile_end ("creating entries");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+				      RHYTHMDB_QUERY_END);
+	model = rhythmdb_query_model_new_empty (db);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+	bench_drain_main_loop ();
+
+	g_print ("sorting %u entries\n", n_entries);
+	for (i = 0; i < G_N_ELEMENTS (sort_funcs); i++) {
+		bench_sort (model, i);
+	}
+
+	g_object_unref (model);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	bench_shutdown ();
+	return 0;
+}
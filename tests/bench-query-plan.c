@@ -0,0 +1,168 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+
+#include "bench-utils.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-plan.h"
+
+#define NUM_ENTRIES	500000
+#define NUM_ROUNDS	5
+
+static const char *genres[] = {
+	"Rock", "Pop", "Jazz", "Classical", "Electronic", "Folk", "Hip Hop", "Metal"
+};
+
+static GPtrArray *
+create_entries (RhythmDB *db)
+{
+	GPtrArray *entries;
+	GTimeVal now;
+	guint i;
+
+	g_get_current_time (&now);
+	entries = g_ptr_array_sized_new (NUM_ENTRIES);
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/%u.ogg", i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_TITLE,
+					g_strdup_printf ("Track %u%s", i, (i % 17) ? "" : " of love"));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, g_strdup_printf ("Artist %u", i % 5000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, g_strdup_printf ("Album %u", i % 40000));
+		bench_set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, g_strdup (genres[i % G_N_ELEMENTS (genres)]));
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_DURATION, 60 + (i * 37) % 540);
+		bench_set_entry_ulong (db, entry, RHYTHMDB_PROP_LAST_PLAYED, now.tv_sec - (i * 7919) % (90 * 24 * 3600));
+		bench_set_entry_double (db, entry, RHYTHMDB_PROP_RATING, i % 6);
+
+		g_ptr_array_add (entries, entry);
+	}
+	rhythmdb_commit (db);
+	return entries;
+}
+
+static void
+bench_query (RhythmDB *db, GPtrArray *entries, const char *name, GPtrArray *query)
+{
+	RhythmDBQueryPlan *plan;
+	GTimer *timer;
+	double interpreted, compiled;
+	guint interpreted_matches, compiled_matches;
+	guint round;
+	guint i;
+
+	rhythmdb_query_preprocess (db, query);
+	timer = g_timer_new ();
+
+	interpreted_matches = 0;
+	g_timer_start (timer);
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		for (i = 0; i < entries->len; i++) {
+			if (RHYTHMDB_GET_CLASS (db)->impl_evaluate_query (db, query, g_ptr_array_index (entries, i)))
+				interpreted_matches++;
+		}
+	}
+	interpreted = g_timer_elapsed (timer, NULL) / NUM_ROUNDS;
+
+	compiled_matches = 0;
+	g_timer_start (timer);
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		plan = rhythmdb_query_plan_new (db, query);
+		for (i = 0; i < entries->len; i++) {
+			if (rhythmdb_query_plan_evaluate (plan, g_ptr_array_index (entries, i)))
+				compiled_matches++;
+		}
+		rhythmdb_query_plan_free (plan);
+	}
+	compiled = g_timer_elapsed (timer, NULL) / NUM_ROUNDS;
+
+	g_print ("%s: %u matches; interpreted %.1fms, compiled %.1fms (%.2fx)\n",
+		 name, compiled_matches / NUM_ROUNDS,
+		 interpreted * 1000.0, compiled * 1000.0, interpreted / compiled);
+	if (interpreted_matches != compiled_matches)
+		g_warning ("%s: interpreted query matched %u entries, compiled query %u",
+			   name, interpreted_matches / NUM_ROUNDS, compiled_matches / NUM_ROUNDS);
+
+	g_timer_destroy (timer);
+	rhythmdb_query_free (query);
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	GPtrArray *entries;
+
+	bench_init (&argc, &argv);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+
+	rb_profile_start ("creating entries");
+	entries = create_entries (db);
+	rb_profile_end ("creating entries");
+
+	bench_query (db, entries, "genre and rating",
+		     rhythmdb_query_parse (db,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Jazz",
+					   RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, 3.0,
+					   RHYTHMDB_QUERY_END));
+
+	bench_query (db, entries, "auto-playlist",
+		     rhythmdb_query_parse (db,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					   RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_ARTIST_FOLDED, "artist 1",
+					   RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_DURATION, (gulong) 300,
+					   RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN, RHYTHMDB_PROP_LAST_PLAYED, (gulong) (30 * 24 * 3600),
+					   RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, 2.0,
+					   RHYTHMDB_QUERY_DISJUNCTION,
+					   RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "love rock",
+					   RHYTHMDB_QUERY_END));
+
+	g_ptr_array_free (entries, TRUE);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	bench_shutdown ();
+	return 0;
+}
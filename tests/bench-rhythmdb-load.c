@@ -30,7 +30,10 @@
 #include "config.h"
 
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "rb-debug.h"
 #include "rb-file-helpers.h"
@@ -38,6 +41,7 @@
 
 #include "rhythmdb.h"
 #include "rhythmdb-tree.h"
+#include "rhythmdb-query-model.h"
 
 /* test utils */
 gboolean waiting, signaled;
@@ -80,12 +84,155 @@ static void wait_for_signal (void)
 	sig_name = NULL;
 }
 
+static void
+delete_entries (RhythmDB *db)
+{
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
+	rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
+}
+
+/* asks the kernel to drop a file from the page cache, so the next load is cold */
+static void
+drop_cached_file (const char *filename)
+{
+#ifdef POSIX_FADV_DONTNEED
+	int fd;
+
+	fd = g_open (filename, O_RDONLY, 0);
+	if (fd < 0)
+		return;
+	fdatasync (fd);
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+	close (fd);
+#endif
+}
+
+static double
+timed_load (RhythmDB *db, const char *filename)
+{
+	GTimer *timer;
+	double elapsed;
+
+	if (filename != NULL)
+		drop_cached_file (filename);
+
+	timer = g_timer_new ();
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	delete_entries (db);
+	return elapsed;
+}
+
+/* compares loading the XML file with loading the binary snapshot */
+static void
+bench_formats (const char *name)
+{
+	RhythmDB *db;
+	char *contents;
+	gsize length;
+	char *copy;
+	char *snapshot;
+	double cold, warm;
+	int fd;
+
+	if (g_file_get_contents (name, &contents, &length, NULL) == FALSE) {
+		g_print ("unable to read %s\n", name);
+		return;
+	}
+
+	/* work on a copy so the real database and its snapshot are left alone */
+	fd = g_file_open_tmp ("bench-rhythmdb-XXXXXX.xml", &copy, NULL);
+	if (fd < 0) {
+		g_free (contents);
+		return;
+	}
+	close (fd);
+	g_file_set_contents (copy, contents, length, NULL);
+	g_free (contents);
+	snapshot = g_strconcat (copy, ".snapshot", NULL);
+
+	db = rhythmdb_tree_new ("test");
+	g_object_set (G_OBJECT (db), "name", copy, "use-snapshot", FALSE, NULL);
+
+	cold = timed_load (db, copy);
+	warm = timed_load (db, NULL);
+	g_print ("xml: cold load %.1fms, warm load %.1fms\n", cold * 1000.0, warm * 1000.0);
+
+	/* load once more and write out the XML file and the snapshot */
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+	g_object_set (G_OBJECT (db), "use-snapshot", TRUE, NULL);
+	RHYTHMDB_GET_CLASS (db)->impl_save (db);
+	delete_entries (db);
+
+	cold = timed_load (db, snapshot);
+	warm = timed_load (db, NULL);
+	g_print ("snapshot: cold load %.1fms, warm load %.1fms\n", cold * 1000.0, warm * 1000.0);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	g_unlink (snapshot);
+	g_unlink (copy);
+	g_free (snapshot);
+	g_free (copy);
+}
+
+/* simulates typing a word into the search box one character at a time */
+static void
+bench_typing (RhythmDB *db, const char *word)
+{
+	GTimer *timer;
+	int len;
+
+	timer = g_timer_new ();
+	for (len = 1; len <= strlen (word); len++) {
+		RhythmDBQueryModel *model;
+		GPtrArray *query;
+		char *text;
+		int round;
+
+		text = g_strndup (word, len);
+		query = rhythmdb_query_parse (db,
+					      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					      RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, text,
+					      RHYTHMDB_QUERY_END);
+
+		/* run each search twice, as the first one may build the index */
+		for (round = 0; round < 2; round++) {
+			model = rhythmdb_query_model_new_empty (db);
+
+			g_timer_start (timer);
+			rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+			g_timer_stop (timer);
+
+			g_print ("search for '%s'%s: %d results in %.2fms\n",
+				 text,
+				 round == 0 ? "" : " (repeated)",
+				 gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL),
+				 g_timer_elapsed (timer, NULL) * 1000.0);
+			g_object_unref (model);
+		}
+
+		rhythmdb_query_free (query);
+		g_free (text);
+	}
+	g_timer_destroy (timer);
+}
 
 int 
 main (int argc, char **argv)
 {
 	RhythmDB *db;
 	char *name;
+	const char *search_word = "love";
 	int i;
 
 	if (argc < 2) {
@@ -94,6 +241,9 @@ main (int argc, char **argv)
 	} else {
 		name = g_strdup (argv[1]);
 	}
+	if (argc > 2) {
+		search_word = argv[2];
+	}
 
 	rb_profile_start ("load test");
 
@@ -107,6 +257,8 @@ main (int argc, char **argv)
 
 	GDK_THREADS_ENTER ();
 
+	bench_formats (name);
+
 	db = rhythmdb_tree_new ("test");
 	g_object_set (G_OBJECT (db), "name", name, NULL);
 	g_free (name);
@@ -119,15 +271,17 @@ main (int argc, char **argv)
 			rhythmdb_load (db);
 			wait_for_signal ();
 
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
-			rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
+			delete_entries (db);
 		}
 		rb_profile_end ("10 rhythmdb loads");
 		g_print ("completed %d loads\n", i * 10);
 	}
 
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+	bench_typing (db, search_word);
+
 	rhythmdb_shutdown (db);
 	g_object_unref (G_OBJECT (db));
 	db = NULL;
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+
+#include "bench-utils.h"
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+void
+bench_init (int *argc, char ***argv)
+{
+	g_thread_init (NULL);
+	rb_threads_init ();
+	gtk_set_locale ();
+	gtk_init (argc, argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+}
+
+void
+bench_shutdown (void)
+{
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+}
+
+void
+bench_drain_main_loop (void)
+{
+	while (gtk_events_pending ())
+		gtk_main_iteration ();
+}
+
+void
+bench_set_entry_string (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, char *value)
+{
+	GValue v = {0,};
+
+	g_value_init (&v, G_TYPE_STRING);
+	g_value_take_string (&v, value);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+void
+bench_set_entry_ulong (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, gulong value)
+{
+	GValue v = {0,};
+
+	g_value_init (&v, G_TYPE_ULONG);
+	g_value_set_ulong (&v, value);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+void
+bench_set_entry_double (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, double value)
+{
+	GValue v = {0,};
+
+	g_value_init (&v, G_TYPE_DOUBLE);
+	g_value_set_double (&v, value);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
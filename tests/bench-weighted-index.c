@@ -0,0 +1,140 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+#include <math.h>
+
+#include "rb-weighted-index.h"
+
+#define PICK_TIME_LIMIT		2.0
+
+/* the weight function used by the random-by-age play order */
+static double
+age_weight (guint i)
+{
+	return log (1 + (i * 7919) % 10000000);
+}
+
+/* what the random play order used to do for every pick: rebuild the
+ * cumulative weights then binary search them.
+ */
+static guint
+linear_pick (double *cumulative, guint n)
+{
+	double total = 0.0;
+	double rnd;
+	int low, high;
+	guint i;
+
+	for (i = 0; i < n; i++) {
+		cumulative[i] = total;
+		total += age_weight (i);
+	}
+
+	rnd = g_random_double_range (0, total);
+	low = -1; high = n;
+	while (high - low > 1) {
+		int mid = (high + low) / 2;
+		if (cumulative[mid] > rnd)
+			high = mid;
+		else
+			low = mid;
+	}
+	return low;
+}
+
+static void
+bench_size (guint n)
+{
+	RBWeightedIndex *index;
+	GTimer *timer;
+	double *cumulative;
+	double elapsed;
+	gpointer played;
+	guint picks;
+	guint i;
+
+	timer = g_timer_new ();
+	index = rb_weighted_index_new (NULL);
+
+	g_timer_start (timer);
+	for (i = 0; i < n; i++) {
+		rb_weighted_index_set (index, GUINT_TO_POINTER (i + 1), age_weight (i));
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("%8u entries: built index in %.3fs\n", n, elapsed);
+
+	/* a pick is followed by the played entry's weight changing.  the
+	 * previously played entry gets its weight back, so every pick is
+	 * made from the same weights as the linear picks below, rather than
+	 * from a shrinking set.
+	 */
+	played = NULL;
+	picks = 0;
+	g_timer_start (timer);
+	do {
+		for (i = 0; i < 1000; i++) {
+			gpointer item;
+
+			item = rb_weighted_index_pick (index);
+			if (played != NULL)
+				rb_weighted_index_set (index, played, age_weight (GPOINTER_TO_UINT (played) - 1));
+			rb_weighted_index_set (index, item, 0.0);
+			played = item;
+		}
+		picks += i;
+		elapsed = g_timer_elapsed (timer, NULL);
+	} while (elapsed < PICK_TIME_LIMIT);
+	g_print ("%8u entries: %.0f indexed picks/s\n", n, picks / elapsed);
+
+	cumulative = g_new (double, n);
+	picks = 0;
+	g_timer_start (timer);
+	do {
+		linear_pick (cumulative, n);
+		picks++;
+		elapsed = g_timer_elapsed (timer, NULL);
+	} while (elapsed < PICK_TIME_LIMIT);
+	g_print ("%8u entries: %.0f linear picks/s\n", n, picks / elapsed);
+
+	g_free (cumulative);
+	rb_weighted_index_free (index);
+	g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+	bench_size (10000);
+	bench_size (100000);
+	bench_size (1000000);
+	return 0;
+}
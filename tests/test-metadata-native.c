@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  Copyright (C) 2009 The Rhythmbox authors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/* Checks that the native metadata readers return the same fields as the
+ * GStreamer pipeline for sample files in each of the formats they handle.
+ * The samples are encoded with GStreamer when the test runs; formats
+ * whose encoders aren't installed are skipped.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include <glib-object.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+#include "rb-metadata.h"
+#include "rb-metadata-native.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+/* fields both paths should agree on */
+static const RBMetaDataField compared_fields[] = {
+	RB_METADATA_FIELD_TITLE,
+	RB_METADATA_FIELD_ARTIST,
+	RB_METADATA_FIELD_ALBUM,
+	RB_METADATA_FIELD_GENRE,
+	RB_METADATA_FIELD_DATE,
+	RB_METADATA_FIELD_TRACK_NUMBER,
+	RB_METADATA_FIELD_DISC_NUMBER,
+	RB_METADATA_FIELD_DURATION,
+};
+
+static void
+set_sample_tags (GstElement *pipeline)
+{
+	GstTagList *tags;
+	GstIterator *it;
+	gpointer item;
+	GDate *date;
+
+	date = g_date_new_dmy (1, G_DATE_JANUARY, 1999);
+	tags = gst_tag_list_new ();
+	gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE,
+			  GST_TAG_TITLE, "Sample Title",
+			  GST_TAG_ARTIST, "Sample Artist",
+			  GST_TAG_ALBUM, "Sample Album",
+			  GST_TAG_GENRE, "Rock",
+			  GST_TAG_DATE, date,
+			  GST_TAG_TRACK_NUMBER, 7,
+			  GST_TAG_ALBUM_VOLUME_NUMBER, 2,
+			  NULL);
+	g_date_free (date);
+
+	it = gst_bin_iterate_all_by_interface (GST_BIN (pipeline), GST_TYPE_TAG_SETTER);
+	while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+		gst_tag_setter_merge_tags (GST_TAG_SETTER (item), tags, GST_TAG_MERGE_REPLACE_ALL);
+		gst_object_unref (item);
+	}
+	gst_iterator_free (it);
+	gst_tag_list_free (tags);
+}
+
+/* encodes a few seconds of audio into a temporary file, returning its
+ * filename, or NULL if the encoder isn't available.
+ */
+static char *
+make_sample (const char *encoder, const char *extension)
+{
+	GstElement *pipeline;
+	GstMessage *message;
+	GstBus *bus;
+	GError *error = NULL;
+	char *filename;
+	char *name;
+	char *desc;
+	gboolean ok = FALSE;
+
+	name = g_strdup_printf ("rb-test-metadata-native-%d.%s", getpid (), extension);
+	filename = g_build_filename (g_get_tmp_dir (), name, NULL);
+	g_free (name);
+
+	desc = g_strdup_printf ("audiotestsrc num-buffers=200 ! audioconvert ! %s ! filesink location=\"%s\"",
+				encoder, filename);
+	pipeline = gst_parse_launch (desc, &error);
+	g_free (desc);
+	if (error != NULL) {
+		rb_debug ("unable to encode %s samples: %s", extension, error->message);
+		g_error_free (error);
+		if (pipeline != NULL)
+			gst_object_unref (pipeline);
+		g_free (filename);
+		return NULL;
+	}
+
+	set_sample_tags (pipeline);
+
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+	bus = gst_element_get_bus (pipeline);
+	message = gst_bus_timed_pop_filtered (bus, 30 * GST_SECOND,
+					      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (message != NULL) {
+		ok = (GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS);
+		gst_message_unref (message);
+	}
+	gst_object_unref (bus);
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (pipeline);
+
+	if (ok == FALSE) {
+		rb_debug ("encoding %s sample failed", extension);
+		g_unlink (filename);
+		g_free (filename);
+		return NULL;
+	}
+
+	return filename;
+}
+
+static gboolean
+values_match (RBMetaDataField field, const GValue *a, const GValue *b)
+{
+	switch (G_VALUE_TYPE (a)) {
+	case G_TYPE_STRING:
+		return (rb_safe_strcmp (g_value_get_string (a), g_value_get_string (b)) == 0);
+	case G_TYPE_ULONG:
+		if (field == RB_METADATA_FIELD_DURATION) {
+			/* estimates from frame counts can be out by a second */
+			gulong da = g_value_get_ulong (a);
+			gulong db = g_value_get_ulong (b);
+			return ((da > db ? da - db : db - da) <= 1);
+		}
+		return (g_value_get_ulong (a) == g_value_get_ulong (b));
+	case G_TYPE_DOUBLE:
+		return (g_value_get_double (a) == g_value_get_double (b));
+	default:
+		return FALSE;
+	}
+}
+
+static void
+compare_loaders (const char *encoder, const char *extension, gboolean expect_native)
+{
+	RBMetaDataNativeResult result;
+	RBMetaData *native_md;
+	RBMetaData *gst_md;
+	GError *error = NULL;
+	char *filename;
+	char *uri;
+	guint i;
+
+	filename = make_sample (encoder, extension);
+	if (filename == NULL)
+		return;
+	uri = g_filename_to_uri (filename, NULL, NULL);
+
+	/* make sure the native reader is actually being compared */
+	if (expect_native) {
+		rb_metadata_native_set_enabled (TRUE);
+		fail_unless (rb_metadata_native_load (uri, &result),
+			     "native readers declined the %s sample", extension);
+		rb_metadata_native_result_clear (&result);
+	}
+
+	native_md = rb_metadata_new ();
+	rb_metadata_native_set_enabled (TRUE);
+	rb_metadata_load (native_md, uri, &error);
+	fail_unless (error == NULL, "native load of %s sample failed", extension);
+
+	gst_md = rb_metadata_new ();
+	rb_metadata_native_set_enabled (FALSE);
+	rb_metadata_load (gst_md, uri, &error);
+	rb_metadata_native_set_enabled (TRUE);
+	fail_unless (error == NULL, "GStreamer load of %s sample failed", extension);
+
+	fail_unless (rb_safe_strcmp (rb_metadata_get_mime (native_md), rb_metadata_get_mime (gst_md)) == 0,
+		     "%s: media type %s doesn't match %s", extension,
+		     rb_metadata_get_mime (native_md), rb_metadata_get_mime (gst_md));
+
+	for (i = 0; i < G_N_ELEMENTS (compared_fields); i++) {
+		RBMetaDataField field = compared_fields[i];
+		GValue native_val = {0,};
+		GValue gst_val = {0,};
+		gboolean has_native;
+		gboolean has_gst;
+
+		has_native = rb_metadata_get (native_md, field, &native_val);
+		has_gst = rb_metadata_get (gst_md, field, &gst_val);
+
+		fail_unless (has_native == has_gst, "%s: field %s is only set by the %s loader",
+			     extension, rb_metadata_get_field_name (field),
+			     has_native ? "native" : "GStreamer");
+		if (has_native && has_gst) {
+			fail_unless (values_match (field, &native_val, &gst_val),
+				     "%s: field %s doesn't match", extension,
+				     rb_metadata_get_field_name (field));
+		}
+
+		if (has_native)
+			g_value_unset (&native_val);
+		if (has_gst)
+			g_value_unset (&gst_val);
+	}
+
+	g_object_unref (native_md);
+	g_object_unref (gst_md);
+	g_unlink (filename);
+	g_free (filename);
+	g_free (uri);
+}
+
+START_TEST (test_metadata_native_ogg_vorbis)
+{
+	compare_loaders ("vorbisenc ! oggmux", "ogg", TRUE);
+}
+END_TEST
+
+START_TEST (test_metadata_native_flac)
+{
+	compare_loaders ("flacenc", "flac", TRUE);
+}
+END_TEST
+
+START_TEST (test_metadata_native_mp3)
+{
+	/* the native reader needs a Xing header for the duration */
+	compare_loaders ("lame ! xingmux ! id3v2mux", "mp3", TRUE);
+}
+END_TEST
+
+START_TEST (test_metadata_native_mp4)
+{
+	/* the brand depends on the muxer, so the native reader may decline it */
+	compare_loaders ("faac ! mp4mux", "m4a", FALSE);
+}
+END_TEST
+
+static Suite *
+rb_metadata_native_suite (void)
+{
+	Suite *s = suite_create ("rb-metadata-native");
+	TCase *tc_chain = tcase_create ("rb-metadata-native-core");
+
+	suite_add_tcase (s, tc_chain);
+
+	/* encoding the samples takes a little while */
+	tcase_set_timeout (tc_chain, 60);
+
+	tcase_add_test (tc_chain, test_metadata_native_ogg_vorbis);
+	tcase_add_test (tc_chain, test_metadata_native_flac);
+	tcase_add_test (tc_chain, test_metadata_native_mp3);
+	tcase_add_test (tc_chain, test_metadata_native_mp4);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	g_thread_init (NULL);
+	g_type_init ();
+	gst_init (&argc, &argv);
+	rb_debug_init (TRUE);
+
+	s = rb_metadata_native_suite ();
+	sr = srunner_create (s);
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	return ret;
+}
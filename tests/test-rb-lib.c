@@ -34,6 +34,7 @@
 #include "test-utils.h"
 #include "rb-util.h"
 #include "rb-string-value-map.h"
+#include "rb-slab.h"
 #include "rb-debug.h"
 
 START_TEST (test_rb_string_value_map)
@@ -82,6 +83,49 @@ START_TEST (test_rb_string_value_map)
 }
 END_TEST
 
+START_TEST (test_rb_slab)
+{
+	RBSlab *slab;
+	gpointer objects[10];
+	gpointer obj;
+	guint n_objects;
+	guint n_free;
+	gsize n_bytes;
+	guint i;
+
+	slab = rb_slab_new (20, 4);
+	fail_unless (rb_slab_get_object_size (slab) >= 20, "object size should not be smaller than requested");
+	fail_unless (rb_slab_get_object_size (slab) % (2 * sizeof (gsize)) == 0, "object size should be aligned");
+
+	for (i = 0; i < G_N_ELEMENTS (objects); i++) {
+		objects[i] = rb_slab_alloc0 (slab);
+		fail_unless (((guchar *) objects[i])[19] == 0, "allocated object should be cleared");
+		memset (objects[i], 0xff, 20);
+	}
+	rb_slab_get_usage (slab, &n_objects, &n_free, &n_bytes);
+	fail_unless (n_objects == 10, "slab should have 10 objects allocated");
+	fail_unless (n_free == 0, "slab should have no free objects");
+	fail_unless (n_bytes == 3 * 4 * rb_slab_get_object_size (slab), "slab should have allocated 3 blocks");
+
+	rb_slab_release (slab, objects[3]);
+	rb_slab_release (slab, objects[7]);
+	rb_slab_get_usage (slab, &n_objects, &n_free, NULL);
+	fail_unless (n_objects == 8 && n_free == 2, "released objects should be counted as free");
+
+	obj = rb_slab_alloc0 (slab);
+	fail_unless (obj == objects[7], "most recently released object should be reused first");
+	fail_unless (((guchar *) obj)[0] == 0, "reused object should be cleared");
+	obj = rb_slab_alloc0 (slab);
+	fail_unless (obj == objects[3], "released object should be reused");
+
+	rb_slab_get_usage (slab, &n_objects, &n_free, &n_bytes);
+	fail_unless (n_objects == 10 && n_free == 0, "all released objects should have been reused");
+	fail_unless (n_bytes == 3 * 4 * rb_slab_get_object_size (slab), "reusing objects should not allocate blocks");
+
+	rb_slab_destroy (slab);
+}
+END_TEST
+
 static Suite *
 rb_file_helpers_suite ()
 {
@@ -91,6 +135,7 @@ rb_file_helpers_suite ()
 	suite_add_tcase (s, tc_chain);
 
 	tcase_add_test (tc_chain, test_rb_string_value_map);
+	tcase_add_test (tc_chain, test_rb_slab);
 
 	return s;
 }
@@ -27,6 +27,7 @@
 
 #include "config.h"
 
+#include <string.h>
 #include <check.h>
 #include <gtk/gtk.h>
 #include "test-utils.h"
@@ -434,23 +435,165 @@ START_TEST (test_rhythmdb_property_model_query_chain)
 END_TEST
 
 
+#define BULK_N_ENTRIES		10000
+#define BULK_N_VALUES		1000
+
+static void
+_count_row_inserted_cb (GtkTreeModel *model,
+			GtkTreePath *path,
+			GtkTreeIter *iter,
+			int *count)
+{
+	(*count)++;
+}
+
+/* compares property models populated entry by entry and from a complete query model */
+START_TEST (test_rhythmdb_property_model_bulk)
+{
+	RhythmDBQueryModel *model;
+	RhythmDBQueryModel *empty_model;
+	RhythmDBPropertyModel *propmodel;
+	RhythmDBPropertyModel *propmodel2;
+	RhythmDBEntry **entries;
+	GtkTreeIter iter, iter2;
+	GTimer *timer;
+	double incremental, bulk;
+	gboolean valid, valid2;
+	int inserted = 0;
+	guint count;
+	int i;
+
+	start_test_case ();
+
+	/* create test entries, BULK_N_ENTRIES / BULK_N_VALUES for each artist */
+	entries = g_new0 (RhythmDBEntry *, BULK_N_ENTRIES);
+	for (i = 0; i < BULK_N_ENTRIES; i++) {
+		char *uri;
+		char *artist;
+
+		uri = g_strdup_printf ("file:///bulk/%d.ogg", i);
+		artist = g_strdup_printf ("artist %04d", (i * 7) % BULK_N_VALUES);
+		entries[i] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		set_entry_string (db, entries[i], RHYTHMDB_PROP_ARTIST, artist);
+		g_free (uri);
+		g_free (artist);
+	}
+	rhythmdb_commit (db);
+
+	end_step ();
+
+	/* populate one property model entry by entry */
+	model = rhythmdb_query_model_new_empty (db);
+	propmodel = rhythmdb_property_model_new (db, RHYTHMDB_PROP_ARTIST);
+	g_object_set (propmodel, "query-model", model, NULL);
+
+	timer = g_timer_new ();
+	for (i = 0; i < BULK_N_ENTRIES; i++) {
+		rhythmdb_query_model_add_entry (model, entries[i], -1);
+	}
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+	incremental = g_timer_elapsed (timer, NULL);
+
+	end_step ();
+
+	/* and another from the complete query model */
+	propmodel2 = rhythmdb_property_model_new (db, RHYTHMDB_PROP_ARTIST);
+	g_signal_connect (G_OBJECT (propmodel2), "row-inserted",
+			  G_CALLBACK (_count_row_inserted_cb), &inserted);
+
+	g_timer_start (timer);
+	g_object_set (propmodel2, "query-model", model, NULL);
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+	bulk = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	rb_debug ("%d entries, %d values: entry by entry %.3fs, bulk %.3fs",
+		  BULK_N_ENTRIES, BULK_N_VALUES, incremental, bulk);
+
+	fail_unless (inserted == BULK_N_VALUES);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (propmodel2), NULL) == BULK_N_VALUES + 1);
+
+	/* both models should have the same rows in the same order */
+	valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (propmodel), &iter);
+	valid2 = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (propmodel2), &iter2);
+	fail_unless (valid && valid2);
+	gtk_tree_model_get (GTK_TREE_MODEL (propmodel2), &iter2,
+			    RHYTHMDB_PROPERTY_MODEL_COLUMN_NUMBER, &count, -1);
+	fail_unless (count == BULK_N_ENTRIES);
+
+	valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (propmodel), &iter);
+	valid2 = gtk_tree_model_iter_next (GTK_TREE_MODEL (propmodel2), &iter2);
+	while (valid && valid2) {
+		char *title;
+		char *title2;
+
+		gtk_tree_model_get (GTK_TREE_MODEL (propmodel), &iter,
+				    RHYTHMDB_PROPERTY_MODEL_COLUMN_TITLE, &title, -1);
+		gtk_tree_model_get (GTK_TREE_MODEL (propmodel2), &iter2,
+				    RHYTHMDB_PROPERTY_MODEL_COLUMN_TITLE, &title2,
+				    RHYTHMDB_PROPERTY_MODEL_COLUMN_NUMBER, &count, -1);
+		fail_unless (strcmp (title, title2) == 0);
+		fail_unless (count == BULK_N_ENTRIES / BULK_N_VALUES);
+		g_free (title);
+		g_free (title2);
+
+		valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (propmodel), &iter);
+		valid2 = gtk_tree_model_iter_next (GTK_TREE_MODEL (propmodel2), &iter2);
+	}
+	fail_unless (valid == FALSE && valid2 == FALSE);
+
+	end_step ();
+
+	/* switching to an empty model removes everything */
+	empty_model = rhythmdb_query_model_new_empty (db);
+	g_object_set (propmodel2, "query-model", empty_model, NULL);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (propmodel2), NULL) == 1);
+	fail_unless (_get_property_count (propmodel2, "artist 0000") == 0);
+
+	end_step ();
+
+	for (i = 0; i < BULK_N_ENTRIES; i++) {
+		rhythmdb_entry_delete (db, entries[i]);
+	}
+	rhythmdb_commit (db);
+	g_free (entries);
+
+	end_test_case ();
+
+	g_object_unref (model);
+	g_object_unref (empty_model);
+	g_object_unref (propmodel);
+	g_object_unref (propmodel2);
+}
+END_TEST
+
+
 static Suite *
 rhythmdb_property_model_suite (void)
 {
 	Suite *s = suite_create ("rhythmdb-property-model");
 	TCase *tc_chain = tcase_create ("rhythmdb-property-model-core");
 	TCase *tc_bugs = tcase_create ("rhythmdb-property-model-bugs");
+	TCase *tc_timing = tcase_create ("rhythmdb-property-model-timing");
 
 	suite_add_tcase (s, tc_chain);
 	tcase_add_checked_fixture (tc_chain, test_rhythmdb_setup, test_rhythmdb_shutdown);
 	suite_add_tcase (s, tc_bugs);
 	tcase_add_checked_fixture (tc_bugs, test_rhythmdb_setup, test_rhythmdb_shutdown);
+	suite_add_tcase (s, tc_timing);
+	tcase_add_checked_fixture (tc_timing, test_rhythmdb_setup, test_rhythmdb_shutdown);
+	tcase_set_timeout (tc_timing, 60);
 
 	/* test core functionality */
 	tcase_add_test (tc_chain, test_rhythmdb_property_model_static);
 	tcase_add_test (tc_chain, test_rhythmdb_property_model_query);
 	tcase_add_test (tc_chain, test_rhythmdb_property_model_query_chain);
 
+	/* compare entry by entry and bulk population */
+	tcase_add_test (tc_timing, test_rhythmdb_property_model_bulk);
+
 	/* tests for breakable bug fixes */
 /*	tcase_add_test (tc_bugs, test_hidden_chain_filter);*/
 
@@ -30,7 +30,9 @@
 #include <check.h>
 #include <gtk/gtk.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 #include "test-utils.h"
 
@@ -471,6 +473,224 @@ START_TEST (test_rhythmdb_modify_after_delete)
 }
 END_TEST
 
+START_TEST (test_rhythmdb_journal)
+{
+	RhythmDB *db2;
+	RhythmDBEntry *entry;
+	RBRefString *keyword;
+	struct stat saved_stat;
+	struct stat journal_stat;
+	char *name;
+	char *journal;
+	char *snapshot;
+	char *contents;
+	int fd;
+
+	fd = g_file_open_tmp ("test-rhythmdb-journal-XXXXXX.xml", &name, NULL);
+	fail_unless (fd >= 0, "failed to create temporary file");
+	close (fd);
+	g_unlink (name);
+	journal = g_strconcat (name, ".journal", NULL);
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///journal/a.ogg");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "First");
+	rhythmdb_commit (db);
+
+	/* explicit saves write the whole database */
+	rhythmdb_save (db);
+	fail_unless (g_stat (name, &saved_stat) == 0, "database file not written");
+
+	/* regular saves only write the changes to the journal */
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 7);
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Tab\tand\nnewline");
+	keyword = rb_refstring_new ("journalled");
+	rhythmdb_entry_keyword_add (db, entry, keyword);
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///journal/b.ogg");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Second");
+	rhythmdb_commit (db);
+
+	RHYTHMDB_GET_CLASS (db)->impl_save (db);
+	fail_unless (g_stat (name, &journal_stat) == 0, "database file missing");
+	fail_unless (journal_stat.st_size == saved_stat.st_size &&
+		     journal_stat.st_mtime == saved_stat.st_mtime, "database file rewritten");
+	fail_unless (g_file_test (journal, G_FILE_TEST_EXISTS), "journal not written");
+
+	/* loading replays the journal */
+	db2 = rhythmdb_tree_new ("test");
+	g_object_set (G_OBJECT (db2), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (db2), "load-complete");
+	rhythmdb_load (db2);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_lookup_by_location (db2, "file:///journal/a.ogg");
+	fail_unless (entry != NULL, "entry missing after replay");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 7, "play count not replayed");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Tab\tand\nnewline") == 0,
+		     "title not replayed");
+	fail_unless (rhythmdb_entry_keyword_has (db2, entry, keyword), "keyword not replayed");
+
+	entry = rhythmdb_entry_lookup_by_location (db2, "file:///journal/b.ogg");
+	fail_unless (entry != NULL, "added entry not replayed");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Second") == 0,
+		     "added entry title not replayed");
+
+	rhythmdb_shutdown (db2);
+	g_object_unref (db2);
+
+	/* explicit saves fold the journal into the database file */
+	rhythmdb_save (db);
+	fail_unless (g_file_get_contents (journal, &contents, NULL, NULL), "journal missing");
+	fail_unless (strchr (contents, '\n') != NULL && strchr (contents, '\n')[1] == '\0',
+		     "journal not emptied");
+	g_free (contents);
+
+	rb_refstring_unref (keyword);
+	g_unlink (name);
+	g_unlink (journal);
+	g_unlink (snapshot);
+	g_free (name);
+	g_free (journal);
+	g_free (snapshot);
+}
+END_TEST
+
+/* enough entries to take the database over the size at which it's
+ * loaded in parallel.
+ */
+#define PARALLEL_LOAD_ENTRIES	3000
+
+static const RhythmDBPropType parallel_load_string_props[] = {
+	RHYTHMDB_PROP_TITLE,
+	RHYTHMDB_PROP_GENRE,
+	RHYTHMDB_PROP_ARTIST,
+	RHYTHMDB_PROP_ALBUM,
+};
+
+static const RhythmDBPropType parallel_load_ulong_props[] = {
+	RHYTHMDB_PROP_TRACK_NUMBER,
+	RHYTHMDB_PROP_DURATION,
+	RHYTHMDB_PROP_PLAY_COUNT,
+	RHYTHMDB_PROP_LAST_PLAYED,
+	RHYTHMDB_PROP_FIRST_SEEN,
+};
+
+static void
+write_parallel_load_entry (GString *xml, guint i, guint play_count, guint last_played)
+{
+	g_string_append_printf (xml,
+				"  <entry type=\"song\">\n"
+				"    <title>Title &amp; %u</title>\n"
+				"    <genre>Genre %u</genre>\n"
+				"    <artist>Artist %u</artist>\n"
+				"    <album>Album %u</album>\n"
+				"    <track-number>%u</track-number>\n"
+				"    <duration>%u</duration>\n"
+				"    <file-size>%u</file-size>\n"
+				"    <location>file:///parallel/%u.ogg</location>\n"
+				"    <mtime>0</mtime>\n"
+				"    <first-seen>%u</first-seen>\n"
+				"    <last-seen>0</last-seen>\n"
+				"    <play-count>%u</play-count>\n"
+				"    <last-played>%u</last-played>\n"
+				"  </entry>\n",
+				i, i % 17, i % 101, i % 331, i % 20, 60 + i % 600, 1000 + i,
+				i, 1000000 + i, play_count, last_played);
+}
+
+static void
+compare_loaded_entry (RhythmDBEntry *entry, RhythmDB *parallel_db)
+{
+	RhythmDBEntry *other;
+	const char *location;
+	guint i;
+
+	location = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
+	other = rhythmdb_entry_lookup_by_location (parallel_db, location);
+	fail_unless (other != NULL, "%s missing after parallel load", location);
+
+	for (i = 0; i < G_N_ELEMENTS (parallel_load_string_props); i++) {
+		RhythmDBPropType prop = parallel_load_string_props[i];
+		fail_unless (strcmp (rhythmdb_entry_get_string (entry, prop),
+				     rhythmdb_entry_get_string (other, prop)) == 0,
+			     "%s: property %d differs after parallel load", location, prop);
+	}
+	for (i = 0; i < G_N_ELEMENTS (parallel_load_ulong_props); i++) {
+		RhythmDBPropType prop = parallel_load_ulong_props[i];
+		fail_unless (rhythmdb_entry_get_ulong (entry, prop) == rhythmdb_entry_get_ulong (other, prop),
+			     "%s: property %d differs after parallel load", location, prop);
+	}
+}
+
+static void
+load_with_threads (RhythmDB *load_db, const char *name, const char *threads)
+{
+	g_setenv ("RB_DB_LOAD_THREADS", threads, TRUE);
+	g_object_set (G_OBJECT (load_db), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (load_db), "load-complete");
+	rhythmdb_load (load_db);
+	wait_for_signal ();
+	g_unsetenv ("RB_DB_LOAD_THREADS");
+}
+
+START_TEST (test_rhythmdb_parallel_load)
+{
+	RhythmDB *parallel_db;
+	RhythmDBEntry *entry;
+	GString *xml;
+	char *name;
+	guint i;
+	int fd;
+
+	xml = g_string_new ("<?xml version=\"1.0\" standalone=\"yes\"?>\n"
+			    "<rhythmdb version=\"1.6\">\n");
+	for (i = 0; i < PARALLEL_LOAD_ENTRIES; i++) {
+		write_parallel_load_entry (xml, i, i % 5, i);
+
+		/* duplicates of earlier entries, which will usually be in
+		 * a different chunk, and have to be merged the same way
+		 */
+		if (i % 500 == 499)
+			write_parallel_load_entry (xml, i - 450, 100, 2000000000);
+	}
+	g_string_append (xml, "</rhythmdb>\n");
+	fail_unless (xml->len > 256 * 1024, "generated database is too small to load in parallel");
+
+	fd = g_file_open_tmp ("test-rhythmdb-parallel-XXXXXX.xml", &name, NULL);
+	fail_unless (fd >= 0, "failed to create temporary file");
+	close (fd);
+	fail_unless (g_file_set_contents (name, xml->str, xml->len, NULL), "failed to write database");
+	g_string_free (xml, TRUE);
+
+	load_with_threads (db, name, "1");
+
+	parallel_db = rhythmdb_tree_new ("test");
+	load_with_threads (parallel_db, name, "4");
+
+	fail_unless (rhythmdb_entry_count (db) == PARALLEL_LOAD_ENTRIES, "sequential load has the wrong number of entries");
+	fail_unless (rhythmdb_entry_count (parallel_db) == rhythmdb_entry_count (db),
+		     "parallel load has the wrong number of entries");
+	rhythmdb_entry_foreach (db, (GFunc) compare_loaded_entry, parallel_db);
+
+	entry = rhythmdb_entry_lookup_by_location (parallel_db, "file:///parallel/49.ogg");
+	fail_unless (entry != NULL, "duplicated entry missing");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_LAST_PLAYED) == 2000000000,
+		     "duplicated entries not merged");
+
+	rhythmdb_shutdown (parallel_db);
+	g_object_unref (parallel_db);
+
+	g_unlink (name);
+	g_free (name);
+}
+END_TEST
+
 static Suite *
 rhythmdb_suite (void)
 {
@@ -496,6 +716,8 @@ rhythmdb_suite (void)
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation2);
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation3);
 	/*tcase_add_test (tc_chain, test_rhythmdb_serialisation);*/
+	tcase_add_test (tc_chain, test_rhythmdb_journal);
+	tcase_add_test (tc_chain, test_rhythmdb_parallel_load);
 
 	/* tests for breakable bug fixes */
 	tcase_add_test (tc_chain, test_rhythmdb_podcast_upgrade);
@@ -171,6 +171,13 @@ static gboolean rb_entry_view_emit_row_changed (RBEntryView *view,
 static void rb_entry_view_playing_song_changed (RBShellPlayer *player,
 						RhythmDBEntry *entry,
 						RBEntryView *view);
+static void rb_entry_view_db_entries_changed_cb (RhythmDB *db,
+						 GArray *changes,
+						 RBEntryView *view);
+static void rb_entry_view_db_entries_deleted_cb (RhythmDB *db,
+						 GPtrArray *entries,
+						 RBEntryView *view);
+static void rb_entry_view_cached_values_free (GSList *values);
 
 struct RBEntryViewPrivate
 {
@@ -208,8 +215,21 @@ struct RBEntryViewPrivate
 	guint gconf_notification_id;
 	GHashTable *propid_column_map;
 	GHashTable *column_sort_data_map;
+
+	/* formatted cell text, RhythmDBEntry -> GSList of RBEntryViewCachedValue */
+	GHashTable *value_cache;
 };
 
+/* the cache is only meant to cover the rows around the visible ones,
+ * so it's simply emptied when it grows past this many entries.
+ */
+#define RB_ENTRY_VIEW_VALUE_CACHE_SIZE	4096
+
+typedef struct {
+	RhythmDBPropType propid;
+	char *str;
+} RBEntryViewCachedValue;
+
 #define RB_ENTRY_VIEW_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), RB_TYPE_ENTRY_VIEW, RBEntryViewPrivate))
 
 enum
@@ -542,6 +562,9 @@ rb_entry_view_init (RBEntryView *view)
 	view->priv->propid_column_map = g_hash_table_new (NULL, NULL);
 	view->priv->column_sort_data_map = g_hash_table_new_full (NULL, NULL, NULL, g_free);
 	view->priv->column_key_map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	view->priv->value_cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							 (GDestroyNotify) rhythmdb_entry_unref,
+							 (GDestroyNotify) rb_entry_view_cached_values_free);
 }
 
 static void
@@ -602,6 +625,8 @@ rb_entry_view_dispose (GObject *object)
 		view->priv->model = NULL;
 	}
 
+	g_hash_table_remove_all (view->priv->value_cache);
+
 	G_OBJECT_CLASS (rb_entry_view_parent_class)->dispose (object);
 }
 
@@ -622,6 +647,7 @@ rb_entry_view_finalize (GObject *object)
 			      rb_entry_view_sort_data_finalize, NULL);
 	g_hash_table_destroy (view->priv->column_sort_data_map);
 	g_hash_table_destroy (view->priv->column_key_map);
+	g_hash_table_destroy (view->priv->value_cache);
 
 	g_free (view->priv->sorting_key);
 	g_free (view->priv->sorting_column_name);
@@ -657,10 +683,12 @@ rb_entry_view_set_shell_player_internal (RBEntryView   *view,
 
 	view->priv->shell_player = player;
 
-	g_signal_connect_object (view->priv->shell_player,
-				 "playing-song-changed",
-				 G_CALLBACK (rb_entry_view_playing_song_changed),
-				 view, 0);
+	if (view->priv->shell_player != NULL) {
+		g_signal_connect_object (view->priv->shell_player,
+					 "playing-song-changed",
+					 G_CALLBACK (rb_entry_view_playing_song_changed),
+					 view, 0);
+	}
 }
 
 static void
@@ -892,6 +920,92 @@ struct RBEntryViewCellDataFuncData {
 	RhythmDBPropType propid;
 };
 
+static void
+rb_entry_view_cached_values_free (GSList *values)
+{
+	GSList *l;
+
+	for (l = values; l != NULL; l = l->next) {
+		RBEntryViewCachedValue *value = l->data;
+		g_free (value->str);
+		g_free (value);
+	}
+	g_slist_free (values);
+}
+
+static const char *
+rb_entry_view_lookup_cached_value (RBEntryView *view,
+				   RhythmDBEntry *entry,
+				   RhythmDBPropType propid)
+{
+	GSList *l;
+
+	for (l = g_hash_table_lookup (view->priv->value_cache, entry); l != NULL; l = l->next) {
+		RBEntryViewCachedValue *value = l->data;
+		if (value->propid == propid)
+			return value->str;
+	}
+
+	return NULL;
+}
+
+/* takes ownership of str */
+static const char *
+rb_entry_view_cache_value (RBEntryView *view,
+			   RhythmDBEntry *entry,
+			   RhythmDBPropType propid,
+			   char *str)
+{
+	RBEntryViewCachedValue *value;
+	GSList *values;
+
+	values = g_hash_table_lookup (view->priv->value_cache, entry);
+	if (values == NULL &&
+	    g_hash_table_size (view->priv->value_cache) >= RB_ENTRY_VIEW_VALUE_CACHE_SIZE) {
+		g_hash_table_remove_all (view->priv->value_cache);
+	}
+
+	value = g_new0 (RBEntryViewCachedValue, 1);
+	value->propid = propid;
+	value->str = str;
+
+	if (values != NULL) {
+		/* add it after the head so the list in the hash stays valid */
+		values->next = g_slist_prepend (values->next, value);
+	} else {
+		g_hash_table_insert (view->priv->value_cache,
+				     rhythmdb_entry_ref (entry),
+				     g_slist_prepend (NULL, value));
+	}
+
+	return str;
+}
+
+static void
+rb_entry_view_db_entries_changed_cb (RhythmDB *db,
+				     GArray *changes,
+				     RBEntryView *view)
+{
+	guint i;
+
+	for (i = 0; i < changes->len; i++) {
+		RhythmDBChangedEntry *change = &g_array_index (changes, RhythmDBChangedEntry, i);
+		g_hash_table_remove (view->priv->value_cache, change->entry);
+	}
+}
+
+static void
+rb_entry_view_db_entries_deleted_cb (RhythmDB *db,
+				     GPtrArray *entries,
+				     RBEntryView *view)
+{
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		g_hash_table_remove (view->priv->value_cache, g_ptr_array_index (entries, i));
+	}
+}
+
 static void
 rb_entry_view_playing_cell_data_func (GtkTreeViewColumn *column,
 				      GtkCellRenderer *renderer,
@@ -957,20 +1071,24 @@ rb_entry_view_long_cell_data_func (GtkTreeViewColumn *column,
 				   struct RBEntryViewCellDataFuncData *data)
 {
 	RhythmDBEntry *entry;
-	char *str;
+	const char *str;
 	gulong val;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
 
-	val = rhythmdb_entry_get_ulong (entry, data->propid);
+	str = rb_entry_view_lookup_cached_value (data->view, entry, data->propid);
+	if (str == NULL) {
+		val = rhythmdb_entry_get_ulong (entry, data->propid);
 
-	if (val > 0)
-		str = g_strdup_printf ("%lu", val);
-	else
-		str = g_strdup ("");
+		if (val > 0)
+			str = rb_entry_view_cache_value (data->view, entry, data->propid,
+							 g_strdup_printf ("%lu", val));
+		else
+			str = rb_entry_view_cache_value (data->view, entry, data->propid,
+							 g_strdup (""));
+	}
 
 	g_object_set (renderer, "text", str, NULL);
-	g_free (str);
 	rhythmdb_entry_unref (entry);
 }
 
@@ -983,20 +1101,22 @@ rb_entry_view_play_count_cell_data_func (GtkTreeViewColumn *column,
 {
 	RhythmDBEntry *entry;
 	gulong i;
-	char *str;
+	const char *str;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
 
-	i = rhythmdb_entry_get_ulong (entry, data->propid);
-	if (i == 0)
-		str = _("Never");
-	else
-		str = g_strdup_printf ("%ld", i);
+	str = rb_entry_view_lookup_cached_value (data->view, entry, data->propid);
+	if (str == NULL) {
+		i = rhythmdb_entry_get_ulong (entry, data->propid);
+		if (i == 0)
+			str = rb_entry_view_cache_value (data->view, entry, data->propid,
+							 g_strdup (_("Never")));
+		else
+			str = rb_entry_view_cache_value (data->view, entry, data->propid,
+							 g_strdup_printf ("%ld", i));
+	}
 
 	g_object_set (renderer, "text", str, NULL);
-	if (i != 0)
-		g_free (str);
-
 	rhythmdb_entry_unref (entry);
 }
 
@@ -1009,14 +1129,18 @@ rb_entry_view_duration_cell_data_func (GtkTreeViewColumn *column,
 {
 	RhythmDBEntry *entry;
 	gulong duration;
-	char *str;
+	const char *str;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
-	duration = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DURATION);
 
-	str = rb_make_duration_string (duration);
+	str = rb_entry_view_lookup_cached_value (data->view, entry, RHYTHMDB_PROP_DURATION);
+	if (str == NULL) {
+		duration = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DURATION);
+		str = rb_entry_view_cache_value (data->view, entry, RHYTHMDB_PROP_DURATION,
+						 rb_make_duration_string (duration));
+	}
+
 	g_object_set (renderer, "text", str, NULL);
-	g_free (str);
 	rhythmdb_entry_unref (entry);
 }
 
@@ -1028,22 +1152,30 @@ rb_entry_view_year_cell_data_func (GtkTreeViewColumn *column,
 				   struct RBEntryViewCellDataFuncData *data)
 {
 	RhythmDBEntry *entry;
-	char str[255];
+	const char *str;
+	char buf[255];
 	int julian;
 	GDate *date;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
-	julian = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DATE);
 
-	if (julian > 0) {
-		date = g_date_new_julian (julian);
-		g_date_strftime (str, sizeof (str), "%Y", date);
-		g_object_set (renderer, "text", str, NULL);
-		g_date_free (date);
-	} else {
-		g_object_set (renderer, "text", _("Unknown"), NULL);
+	str = rb_entry_view_lookup_cached_value (data->view, entry, RHYTHMDB_PROP_DATE);
+	if (str == NULL) {
+		julian = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DATE);
+
+		if (julian > 0) {
+			date = g_date_new_julian (julian);
+			g_date_strftime (buf, sizeof (buf), "%Y", date);
+			g_date_free (date);
+			str = rb_entry_view_cache_value (data->view, entry, RHYTHMDB_PROP_DATE,
+							 g_strdup (buf));
+		} else {
+			str = rb_entry_view_cache_value (data->view, entry, RHYTHMDB_PROP_DATE,
+							 g_strdup (_("Unknown")));
+		}
 	}
 
+	g_object_set (renderer, "text", str, NULL);
 	rhythmdb_entry_unref (entry);
 }
 
@@ -1055,23 +1187,29 @@ rb_entry_view_quality_cell_data_func (GtkTreeViewColumn *column,
 				      struct RBEntryViewCellDataFuncData *data)
 {
 	RhythmDBEntry *entry;
+	const char *str;
 	gulong bitrate;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
-	bitrate = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_BITRATE);
 
-	if (rhythmdb_entry_is_lossless (entry)) {
-		g_object_set (renderer, "text", _("Lossless"), NULL);
-	} else if (bitrate == 0) {
-		g_object_set (renderer, "text", _("Unknown"), NULL);
-	} else {
+	str = rb_entry_view_lookup_cached_value (data->view, entry, RHYTHMDB_PROP_BITRATE);
+	if (str == NULL) {
 		char *s;
-	       
-		s = g_strdup_printf (_("%lu kbps"), bitrate);
-		g_object_set (renderer, "text", s, NULL);
-		g_free (s);
+
+		bitrate = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_BITRATE);
+
+		if (rhythmdb_entry_is_lossless (entry)) {
+			s = g_strdup (_("Lossless"));
+		} else if (bitrate == 0) {
+			s = g_strdup (_("Unknown"));
+		} else {
+			s = g_strdup_printf (_("%lu kbps"), bitrate);
+		}
+
+		str = rb_entry_view_cache_value (data->view, entry, RHYTHMDB_PROP_BITRATE, s);
 	}
 
+	g_object_set (renderer, "text", str, NULL);
 	rhythmdb_entry_unref (entry);
 }
 
@@ -1084,16 +1222,22 @@ rb_entry_view_location_cell_data_func (GtkTreeViewColumn *column,
 {
 	RhythmDBEntry *entry;
 	const char *location;
-	char *str;
+	const char *str;
 
 	entry = rhythmdb_query_model_iter_to_entry (data->view->priv->model, iter);
 
-	location = rhythmdb_entry_get_string (entry, data->propid);
-	str = g_uri_unescape_string (location, NULL);
+	str = rb_entry_view_lookup_cached_value (data->view, entry, data->propid);
+	if (str == NULL) {
+		char *unescaped;
 
-	g_object_set (renderer, "text", str, NULL);
-	g_free (str);
+		location = rhythmdb_entry_get_string (entry, data->propid);
+		unescaped = g_uri_unescape_string (location, NULL);
+		if (unescaped == NULL)
+			unescaped = g_strdup (location);
+		str = rb_entry_view_cache_value (data->view, entry, data->propid, unescaped);
+	}
 
+	g_object_set (renderer, "text", str, NULL);
 	rhythmdb_entry_unref (entry);
 }
 
@@ -1799,6 +1943,18 @@ rb_entry_view_constructor (GType type,
 	view->priv->treeview = GTK_WIDGET (gtk_tree_view_new ());
 	gtk_tree_view_set_fixed_height_mode (GTK_TREE_VIEW (view->priv->treeview), TRUE);
 
+	/* drop formatted cell text for entries when they change */
+	g_signal_connect_object (view->priv->db,
+				 "entries-changed",
+				 G_CALLBACK (rb_entry_view_db_entries_changed_cb),
+				 view,
+				 0);
+	g_signal_connect_object (view->priv->db,
+				 "entries-deleted",
+				 G_CALLBACK (rb_entry_view_db_entries_deleted_cb),
+				 view,
+				 0);
+
 	gtk_tree_view_set_search_equal_func (GTK_TREE_VIEW (view->priv->treeview),
 					     type_ahead_search_func,
 					     NULL, NULL);
@@ -98,7 +98,9 @@ G_DEFINE_TYPE (RBLibraryBrowser, rb_library_browser, GTK_TYPE_HBOX)
  * When the selection in any of the property views changes, or when
  * #rb_library_browser_reset or #rb_library_browser_set_selection are
  * called to manipulate the selection, the query chain is rebuilt
- * asynchronously to update the property views.
+ * asynchronously to update the property views.  Query models in the
+ * chain are refiltered in place from their parent models where possible,
+ * so views attached to them only see the rows that changed.
  */
 
 struct _RBLibraryBrowserRebuildData
@@ -120,6 +122,7 @@ typedef struct
 
 	GHashTable *property_views;
 	GHashTable *selections;
+	GHashTable *filter_models;
 
 	RBLibraryBrowserRebuildData *rebuild_data;
 } RBLibraryBrowserPrivate;
@@ -227,6 +230,7 @@ rb_library_browser_init (RBLibraryBrowser *widget)
 
 	priv->property_views = g_hash_table_new (g_direct_hash, g_direct_equal);
 	priv->selections = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)rb_list_deep_free);
+	priv->filter_models = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_object_unref);
 }
 
 static GObject *
@@ -309,6 +313,8 @@ rb_library_browser_dispose (GObject *object)
 		priv->output_model = NULL;
 	}
 
+	g_hash_table_remove_all (priv->filter_models);
+
 	G_OBJECT_CLASS (rb_library_browser_parent_class)->dispose (object);
 }
 
@@ -319,6 +325,7 @@ rb_library_browser_finalize (GObject *object)
 
 	g_hash_table_destroy (priv->property_views);
 	g_hash_table_destroy (priv->selections);
+	g_hash_table_destroy (priv->filter_models);
 
 	G_OBJECT_CLASS (rb_library_browser_parent_class)->finalize (object);
 }
@@ -648,7 +655,8 @@ rebuild_child_model (RBLibraryBrowser *widget,
 {
 	RBLibraryBrowserPrivate *priv = RB_LIBRARY_BROWSER_GET_PRIVATE (widget);
 	RhythmDBPropertyModel *prop_model;
-	RhythmDBQueryModel *base_model, *child_model;
+	RhythmDBQueryModel *base_model, *child_model, *child_base_model;
+	RhythmDBPropType prop_type;
 	RBPropertyView *view;
 	RhythmDBQuery *query;
 	GList *selections;
@@ -657,17 +665,17 @@ rebuild_child_model (RBLibraryBrowser *widget,
 	g_assert (property_index < num_browser_properties);
 
 	/* get the query model for the previous property view */
-	view = g_hash_table_lookup (priv->property_views, (gpointer)browser_properties[property_index].type);
+	prop_type = browser_properties[property_index].type;
+	view = g_hash_table_lookup (priv->property_views, (gpointer)prop_type);
 	prop_model = rb_property_view_get_model (view);
 	g_object_get (prop_model, "query-model", &base_model, NULL);
 
-	selections = g_hash_table_lookup (priv->selections, (gpointer)browser_properties[property_index].type);
+	selections = g_hash_table_lookup (priv->selections, (gpointer)prop_type);
 	if (selections != NULL) {
 
-		/* create a new query model based on it, filtered by
-		 * the selections of the previous property view.
-		 * we need the entry type query criteria to allow the
-		 * backend to optimise the query.
+		/* filter the previous property view's query model by
+		 * its selections.  we need the entry type query criteria
+		 * to allow the backend to optimise the query.
 		 */
 		query = rhythmdb_query_parse (priv->db,
 				              RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, priv->entry_type,
@@ -677,24 +685,42 @@ rebuild_child_model (RBLibraryBrowser *widget,
 						     browser_properties[property_index].type,
 						     selections);
 
-		child_model = rhythmdb_query_model_new_empty (priv->db);
+		/* if we already have a model filtering the same base model,
+		 * refilter it in place, so the views attached to it only see
+		 * the rows that changed.
+		 */
+		child_model = g_hash_table_lookup (priv->filter_models, (gpointer)prop_type);
+		child_base_model = NULL;
+		if (child_model != NULL)
+			g_object_get (child_model, "base-model", &child_base_model, NULL);
+
 		if (query_pending) {
 			rb_debug ("rebuilding child model for browser %d; query is pending", property_index);
+			child_model = rhythmdb_query_model_new_empty (priv->db);
 			g_object_set (child_model,
 				      "query", query,
 				      "base-model", base_model,
 				      NULL);
+			g_hash_table_insert (priv->filter_models, (gpointer)prop_type, g_object_ref (child_model));
+		} else if (child_model != NULL && child_base_model == base_model) {
+			rb_debug ("refiltering child model for browser %d", property_index);
+			g_object_ref (child_model);
+			rhythmdb_query_model_refilter (child_model, query);
 		} else {
-			rb_debug ("rebuilding child model for browser %d; running new query", property_index);
+			rb_debug ("rebuilding child model for browser %d; filtering parent model", property_index);
+			child_model = rhythmdb_query_model_new_empty (priv->db);
 			rhythmdb_query_model_chain (child_model, base_model, FALSE);
-			rhythmdb_do_full_query_parsed (priv->db,
-						       RHYTHMDB_QUERY_RESULTS (child_model),
-						       query);
+			rhythmdb_query_model_refilter (child_model, query);
+			g_hash_table_insert (priv->filter_models, (gpointer)prop_type, g_object_ref (child_model));
 		}
+
+		if (child_base_model != NULL)
+			g_object_unref (child_base_model);
 		rhythmdb_query_free (query);
 	} else {
 		rb_debug ("no selection for browser %d - reusing parent model", property_index);
 		child_model = g_object_ref (base_model);
+		g_hash_table_remove (priv->filter_models, (gpointer)prop_type);
 	}
 
 	/* If this is the last property, use the child model as the output model
@@ -702,20 +728,31 @@ rebuild_child_model (RBLibraryBrowser *widget,
 	 * view.
 	 */
 	if (property_index == num_browser_properties-1) {
-		if (priv->output_model != NULL) {
-			g_object_unref (priv->output_model);
-		}
+		if (priv->output_model == child_model) {
+			/* refiltered in place */
+			g_object_unref (child_model);
+		} else {
+			if (priv->output_model != NULL) {
+				g_object_unref (priv->output_model);
+			}
 
-		priv->output_model = child_model;
+			priv->output_model = child_model;
 
-		g_object_notify (G_OBJECT (widget), "output-model");
+			g_object_notify (G_OBJECT (widget), "output-model");
+		}
 
 	} else {
+		RhythmDBQueryModel *old_model;
+
 		view = g_hash_table_lookup (priv->property_views, (gpointer)browser_properties[property_index+1].type);
 		ignore_selection_changes (widget, view, TRUE);
 
 		prop_model = rb_property_view_get_model (view);
-		g_object_set (prop_model, "query-model", child_model, NULL);
+		g_object_get (prop_model, "query-model", &old_model, NULL);
+		if (old_model != child_model)
+			g_object_set (prop_model, "query-model", child_model, NULL);
+		if (old_model != NULL)
+			g_object_unref (old_model);
 
 		g_object_unref (child_model);
 